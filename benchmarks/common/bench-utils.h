@@ -0,0 +1,237 @@
+// Helpers shared by the sqlite-vss benchmark tools: timing, JSON lines output,
+// SQLite calls that abort on error, and random vector data.
+
+#ifndef _SQLITE_VSS_BENCH_UTILS_H
+#define _SQLITE_VSS_BENCH_UTILS_H
+
+#include "sqlite3.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+typedef std::chrono::steady_clock bench_clock;
+
+static inline double elapsed_us(bench_clock::time_point since) {
+
+    return std::chrono::duration<double, std::micro>(bench_clock::now() - since).count();
+}
+
+// Returns the p-th percentile (0 < p <= 1) of samples in milliseconds.
+static inline double percentile_ms(std::vector<double> samples_us, double p) {
+
+    if (samples_us.empty())
+        return 0;
+
+    auto rank = std::min(samples_us.size() - 1, (size_t)std::ceil(p * samples_us.size()) - 1);
+    std::nth_element(samples_us.begin(), samples_us.begin() + rank, samples_us.end());
+    return samples_us[rank] / 1000.0;
+}
+
+#pragma region Output
+
+// One JSON object, printed on its own line.
+class ResultLine {
+
+  public:
+    explicit ResultLine(const char *benchmark) { add("benchmark", benchmark); }
+
+    ResultLine &add(const char *key, const std::string &value) {
+
+        separator(key);
+        out << '"';
+        for (auto c : value) {
+            if (c == '"' || c == '\\')
+                out << '\\';
+            out << c;
+        }
+        out << '"';
+        return *this;
+    }
+
+    ResultLine &add(const char *key, const char *value) {
+        return add(key, std::string(value));
+    }
+
+    ResultLine &add(const char *key, long long value) {
+        separator(key);
+        out << value;
+        return *this;
+    }
+
+    ResultLine &add(const char *key, int value) {
+        return add(key, (long long)value);
+    }
+
+    ResultLine &add(const char *key, size_t value) {
+        return add(key, (long long)value);
+    }
+
+    ResultLine &add(const char *key, double value) {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%.4f", value);
+        separator(key);
+        out << buffer;
+        return *this;
+    }
+
+    void print() {
+        printf("{%s}\n", out.str().c_str());
+        fflush(stdout);
+    }
+
+  private:
+    void separator(const char *key) {
+        if (!first)
+            out << ',';
+        first = false;
+        out << '"' << key << "\":";
+    }
+
+    std::ostringstream out;
+    bool first = true;
+};
+
+#pragma endregion
+
+#pragma region SQLite helpers
+
+static inline void check(int rc, sqlite3 *db, const char *what) {
+
+    if (rc == SQLITE_OK || rc == SQLITE_DONE || rc == SQLITE_ROW)
+        return;
+
+    fprintf(stderr, "%s failed: %s\n", what, db != nullptr ? sqlite3_errmsg(db) : sqlite3_errstr(rc));
+    exit(1);
+}
+
+static inline void exec(sqlite3 *db, const std::string &sql) {
+
+    char *errmsg = nullptr;
+    if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &errmsg) != SQLITE_OK) {
+        fprintf(stderr, "%s failed: %s\n", sql.c_str(), errmsg);
+        exit(1);
+    }
+}
+
+static inline sqlite3_stmt *prepare(sqlite3 *db, const std::string &sql) {
+
+    sqlite3_stmt *stmt = nullptr;
+    check(sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr), db, sql.c_str());
+    return stmt;
+}
+
+static inline sqlite3 *open_db(const std::string &path) {
+
+    sqlite3 *db = nullptr;
+    check(sqlite3_open(path.c_str(), &db), db, "sqlite3_open");
+    return db;
+}
+
+static inline void remove_db(const std::string &path) {
+
+    for (auto suffix : {"", "-journal", "-wal", "-shm"})
+        std::filesystem::remove(path + suffix);
+}
+
+#pragma endregion
+
+#pragma region Data
+
+static inline std::vector<float> random_vectors(size_t n, size_t d, std::mt19937 &rng) {
+
+    std::uniform_real_distribution<float> distribution(0, 1);
+    std::vector<float> data(n * d);
+    for (auto &x : data)
+        x = distribution(rng);
+    return data;
+}
+
+// The 'v' blob format read by vector0: header byte, type byte, then floats.
+static inline std::string vector_blob(const float *v, size_t d) {
+
+    std::string blob(2 + d * sizeof(float), '\0');
+    blob[0] = 'v';
+    blob[1] = 1;
+    memcpy(&blob[2], v, d * sizeof(float));
+    return blob;
+}
+
+static inline void bind_vector(sqlite3_stmt *stmt, int i, const float *v, size_t d) {
+
+    auto blob = vector_blob(v, d);
+    sqlite3_bind_blob(stmt, i, blob.data(), blob.size(), SQLITE_TRANSIENT);
+}
+
+// Inserts the vectors into column v of table, with rowids starting at
+// first_rowid, in a single transaction. Returns the microseconds spent in the
+// inserts and in the commit.
+static inline std::pair<double, double> insert_vectors(sqlite3 *db,
+                                                       const std::string &table,
+                                                       const std::vector<float> &data,
+                                                       size_t d,
+                                                       sqlite3_int64 first_rowid = 1) {
+
+    auto n = data.size() / d;
+    auto stmt = prepare(db, "insert into \"" + table + "\"(rowid, v) values (?, ?)");
+
+    exec(db, "begin");
+    auto insert_start = bench_clock::now();
+
+    for (size_t i = 0; i < n; i++) {
+        sqlite3_bind_int64(stmt, 1, first_rowid + i);
+        bind_vector(stmt, 2, &data[i * d], d);
+        check(sqlite3_step(stmt), db, "insert");
+        sqlite3_reset(stmt);
+    }
+
+    auto insert_us = elapsed_us(insert_start);
+    sqlite3_finalize(stmt);
+
+    auto commit_start = bench_clock::now();
+    exec(db, "commit");
+    return {insert_us, elapsed_us(commit_start)};
+}
+
+// Trains column v of table on the given vectors, if its index needs training.
+// Returns the microseconds the training commit took, 0 if it wasn't needed.
+static inline double train_if_needed(sqlite3 *db,
+                                     const std::string &table,
+                                     const std::vector<float> &data,
+                                     size_t d) {
+
+    auto trained = prepare(db, "select is_trained from vss_indexes where table_name = ?");
+    sqlite3_bind_text(trained, 1, table.c_str(), -1, SQLITE_TRANSIENT);
+    check(sqlite3_step(trained), db, "vss_indexes");
+    auto is_trained = sqlite3_column_int(trained, 0);
+    sqlite3_finalize(trained);
+
+    if (is_trained)
+        return 0;
+
+    auto n = data.size() / d;
+    auto train = prepare(db, "insert into \"" + table + "\"(operation, v) values ('training', ?)");
+    exec(db, "begin");
+    for (size_t i = 0; i < n; i += std::max((size_t)1, n / 10000)) {
+        bind_vector(train, 1, &data[i * d], d);
+        check(sqlite3_step(train), db, "training insert");
+        sqlite3_reset(train);
+    }
+    sqlite3_finalize(train);
+
+    auto train_start = bench_clock::now();
+    exec(db, "commit");
+    return elapsed_us(train_start);
+}
+
+#pragma endregion
+
+#endif /* ifndef _SQLITE_VSS_BENCH_UTILS_H */
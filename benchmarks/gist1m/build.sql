@@ -1,5 +1,5 @@
 create table gist as
   select 
     rowid, vector_to_blob(vector) as vector
-  from vector_fvecs_each(readfile('../../examples/sift/data/gist/gist_base.fvecs'));
-  
\ No newline at end of file
+  from vector_vecs_each('../../examples/sift/data/gist/gist_base.fvecs');
+  
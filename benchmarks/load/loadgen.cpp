@@ -0,0 +1,355 @@
+// Multi-connection load generator for vss0.
+//
+// Fills a vss0 table in a WAL database, then runs N reader threads (each with
+// its own connection) issuing a weighted mix of queries, and optionally a
+// writer thread inserting and committing batches at a fixed interval. Reports
+// throughput and p50/p99/p999 latency per query type, split between queries
+// that overlapped a writer commit (where vss0 rewrites the index in xSync)
+// and queries that didn't. Output is one JSON object per line, like
+// sqlite-vss-bench.
+//
+//   sqlite-vss-loadgen --readers 8 --writer --duration 30 --mix knn=9,range=1
+
+#include "sqlite-vector.h"
+#include "sqlite-vss.h"
+#include "../common/bench-utils.h"
+
+#include <atomic>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+enum QueryKind { knn, range, query_kind_count };
+
+static const char *query_kind_names[] = {"knn", "range"};
+
+struct LoadOptions {
+
+    // Scratch database, recreated on every run. Removed afterwards unless it
+    // was given with --db.
+    string path;
+    bool keep = false;
+    string factory = "Flat,IDMap2";
+    size_t d = 128;
+    size_t ntotal = 100000;
+
+    int readers = 4;
+    double duration = 10;
+    double weights[query_kind_count] = {1, 0};
+    sqlite3_int64 k = 10;
+    double radius = -1;
+
+    bool writer = false;
+    int write_interval_ms = 1000;
+    size_t write_batch = 1000;
+};
+
+struct Sample {
+
+    QueryKind kind;
+    double us;
+
+    // Whether a writer commit was running at any point during the query.
+    bool during_sync;
+};
+
+// Bumped by the writer right before and right after each commit, so an odd
+// value means a commit is in progress.
+static atomic<uint64_t> sync_generation(0);
+static atomic<bool> stopping(false);
+
+static bool parse_mix(const char *mix, LoadOptions &options) {
+
+    for (auto &w : options.weights)
+        w = 0;
+
+    string spec(mix);
+    size_t start = 0;
+    while (start < spec.size()) {
+
+        auto end = spec.find(',', start);
+        if (end == string::npos)
+            end = spec.size();
+
+        auto entry = spec.substr(start, end - start);
+        auto eq = entry.find('=');
+        auto name = entry.substr(0, eq);
+        double weight = eq == string::npos ? 1 : atof(entry.c_str() + eq + 1);
+
+        bool found = false;
+        for (int i = 0; i < query_kind_count; i++) {
+            if (name == query_kind_names[i]) {
+                options.weights[i] = weight;
+                found = true;
+            }
+        }
+        if (!found || weight < 0)
+            return false;
+
+        start = end + 1;
+    }
+
+    double total = 0;
+    for (auto w : options.weights)
+        total += w;
+    return total > 0;
+}
+
+static void reader_thread(const LoadOptions &options, int id, vector<Sample> *samples) {
+
+    // Each reader has its own connection, so it reads the index itself.
+    auto db = open_db(options.path);
+    exec(db, "pragma busy_timeout = 5000");
+
+    sqlite3_stmt *stmts[query_kind_count];
+    stmts[knn] = prepare(db, "select rowid, distance from x where vss_search(v, vss_search_params(?1, ?2))");
+    stmts[range] = prepare(db, "select rowid, distance from x where vss_range_search(v, vss_range_search_params(?1, ?2))");
+
+    mt19937 rng(1000 + id);
+    const size_t pool = 1024;
+    auto queries = random_vectors(pool, options.d, rng);
+    discrete_distribution<int> mix(begin(options.weights), end(options.weights));
+
+    // Random uniform vectors in [0, 1]^d are ~d/6 apart (squared L2), keep
+    // the default radius well below that so range searches return few rows.
+    auto radius = options.radius >= 0 ? options.radius : options.d / 12.0;
+
+    for (size_t q = 0; !stopping.load(memory_order_relaxed); q++) {
+
+        auto kind = (QueryKind)mix(rng);
+        auto stmt = stmts[kind];
+
+        bind_vector(stmt, 1, &queries[(q % pool) * options.d], options.d);
+        if (kind == knn)
+            sqlite3_bind_int64(stmt, 2, options.k);
+        else
+            sqlite3_bind_double(stmt, 2, radius);
+
+        auto generation = sync_generation.load();
+        auto start = bench_clock::now();
+
+        int rc;
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+            ;
+        check(rc, db, query_kind_names[kind]);
+        sqlite3_reset(stmt);
+
+        auto us = elapsed_us(start);
+        bool during_sync = (generation & 1) || sync_generation.load() != generation;
+        samples->push_back({kind, us, during_sync});
+    }
+
+    for (auto stmt : stmts)
+        sqlite3_finalize(stmt);
+    sqlite3_close(db);
+}
+
+static void writer_thread(const LoadOptions &options, vector<double> *commit_us, size_t *rows) {
+
+    auto db = open_db(options.path);
+    exec(db, "pragma busy_timeout = 5000");
+
+    mt19937 rng(7);
+    auto rowid = (sqlite3_int64)options.ntotal + 1;
+    auto insert = prepare(db, "insert into x(rowid, v) values (?, ?)");
+
+    while (!stopping.load()) {
+
+        this_thread::sleep_for(chrono::milliseconds(options.write_interval_ms));
+        if (stopping.load())
+            break;
+
+        auto data = random_vectors(options.write_batch, options.d, rng);
+
+        exec(db, "begin");
+        for (size_t i = 0; i < options.write_batch; i++) {
+            sqlite3_bind_int64(insert, 1, rowid++);
+            bind_vector(insert, 2, &data[i * options.d], options.d);
+            check(sqlite3_step(insert), db, "writer insert");
+            sqlite3_reset(insert);
+        }
+
+        sync_generation++;
+        auto start = bench_clock::now();
+        exec(db, "commit");
+        commit_us->push_back(elapsed_us(start));
+        sync_generation++;
+
+        *rows += options.write_batch;
+    }
+
+    sqlite3_finalize(insert);
+    sqlite3_close(db);
+}
+
+static void setup(const LoadOptions &options) {
+
+    remove_db(options.path);
+    auto db = open_db(options.path);
+    exec(db, "pragma journal_mode = wal");
+    exec(db, "create virtual table x using vss0(v(" + to_string(options.d) + ") factory=\"" + options.factory + "\")");
+
+    mt19937 rng(42);
+    auto data = random_vectors(options.ntotal, options.d, rng);
+    train_if_needed(db, "x", data, options.d);
+    insert_vectors(db, "x", data, options.d);
+
+    sqlite3_close(db);
+}
+
+static void report(const char *phase, QueryKind kind, const vector<Sample> &samples, double seconds) {
+
+    vector<double> latencies;
+    for (auto &sample : samples) {
+        if (sample.kind != kind)
+            continue;
+        if (strcmp(phase, "idle") == 0 && sample.during_sync)
+            continue;
+        if (strcmp(phase, "during_sync") == 0 && !sample.during_sync)
+            continue;
+        latencies.push_back(sample.us);
+    }
+
+    if (latencies.empty())
+        return;
+
+    auto line = ResultLine("load");
+    line.add("query", query_kind_names[kind])
+        .add("phase", phase)
+        .add("queries", latencies.size());
+
+    // Throughput is only meaningful over the whole run.
+    if (strcmp(phase, "all") == 0)
+        line.add("qps", latencies.size() / seconds);
+
+    line.add("p50_ms", percentile_ms(latencies, 0.50))
+        .add("p99_ms", percentile_ms(latencies, 0.99))
+        .add("p999_ms", percentile_ms(latencies, 0.999))
+        .print();
+}
+
+static void usage(const char *program) {
+
+    fprintf(stderr,
+            "usage: %s [--db path] [--factory F] [--d N] [--ntotal N]\n"
+            "          [--readers N] [--duration seconds] [--mix knn=W,range=W] [--k N] [--radius R]\n"
+            "          [--writer] [--write-interval-ms N] [--write-batch N]\n",
+            program);
+}
+
+int main(int argc, char *argv[]) {
+
+    LoadOptions options;
+    options.path = (filesystem::temp_directory_path() / "sqlite-vss-loadgen.db").string();
+
+    for (int i = 1; i < argc; i++) {
+
+        auto arg = argv[i];
+        auto value = i + 1 < argc ? argv[i + 1] : nullptr;
+        bool consumed = true;
+
+        if (strcmp(arg, "--writer") == 0) {
+            options.writer = true;
+            consumed = false;
+        } else if (value == nullptr) {
+            usage(argv[0]);
+            return 1;
+        } else if (strcmp(arg, "--db") == 0) {
+            options.path = value;
+            options.keep = true;
+        } else if (strcmp(arg, "--factory") == 0) {
+            options.factory = value;
+        } else if (strcmp(arg, "--d") == 0) {
+            options.d = atol(value);
+        } else if (strcmp(arg, "--ntotal") == 0) {
+            options.ntotal = atol(value);
+        } else if (strcmp(arg, "--readers") == 0) {
+            options.readers = atoi(value);
+        } else if (strcmp(arg, "--duration") == 0) {
+            options.duration = atof(value);
+        } else if (strcmp(arg, "--mix") == 0) {
+            if (!parse_mix(value, options)) {
+                fprintf(stderr, "invalid --mix %s, expected e.g. knn=9,range=1\n", value);
+                return 1;
+            }
+        } else if (strcmp(arg, "--k") == 0) {
+            options.k = atol(value);
+        } else if (strcmp(arg, "--radius") == 0) {
+            options.radius = atof(value);
+        } else if (strcmp(arg, "--write-interval-ms") == 0) {
+            options.write_interval_ms = atoi(value);
+        } else if (strcmp(arg, "--write-batch") == 0) {
+            options.write_batch = atol(value);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+
+        if (consumed)
+            i++;
+    }
+
+    if (options.readers < 1 || options.d < 1 || options.ntotal < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    check(sqlite3_auto_extension((void (*)())sqlite3_vector_init), nullptr, "sqlite3_vector_init");
+    check(sqlite3_auto_extension((void (*)())sqlite3_vss_init), nullptr, "sqlite3_vss_init");
+
+    setup(options);
+
+    ResultLine("load_config")
+        .add("factory", options.factory)
+        .add("d", options.d)
+        .add("ntotal", options.ntotal)
+        .add("readers", options.readers)
+        .add("writer", options.writer ? 1 : 0)
+        .add("duration_s", options.duration)
+        .print();
+
+    vector<vector<Sample>> samples(options.readers);
+    vector<thread> threads;
+    vector<double> commit_us;
+    size_t rows_written = 0;
+
+    auto start = bench_clock::now();
+
+    for (int i = 0; i < options.readers; i++)
+        threads.emplace_back(reader_thread, cref(options), i, &samples[i]);
+    if (options.writer)
+        threads.emplace_back(writer_thread, cref(options), &commit_us, &rows_written);
+
+    this_thread::sleep_for(chrono::duration<double>(options.duration));
+    stopping = true;
+    for (auto &t : threads)
+        t.join();
+
+    auto seconds = elapsed_us(start) / 1e6;
+
+    vector<Sample> all;
+    for (auto &s : samples)
+        all.insert(all.end(), s.begin(), s.end());
+
+    for (int kind = 0; kind < query_kind_count; kind++) {
+        for (auto phase : {"all", "idle", "during_sync"})
+            report(phase, (QueryKind)kind, all, seconds);
+    }
+
+    if (options.writer) {
+        ResultLine("load_writer")
+            .add("commits", commit_us.size())
+            .add("rows", rows_written)
+            .add("commit_p50_ms", percentile_ms(commit_us, 0.50))
+            .add("commit_max_ms", percentile_ms(commit_us, 1.0))
+            .print();
+    }
+
+    if (!options.keep)
+        remove_db(options.path);
+    return 0;
+}
@@ -0,0 +1,351 @@
+// Microbenchmarks for the sqlite-vss hot paths.
+//
+// Links the static sqlite-vector and sqlite-vss libraries, registers both
+// extensions in-process and generates its own random vectors, so it runs
+// without any downloaded dataset. Every measurement is printed to stdout as a
+// single JSON object per line, so runs from two releases can be diffed or
+// loaded into SQLite with json_extract().
+//
+//   sqlite-vss-bench [--quick] [--filter decode|distance|write|knn]
+
+#include "sqlite-vector.h"
+#include "sqlite-vss.h"
+#include "../common/bench-utils.h"
+
+#include <cstring>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+struct BenchOptions {
+
+    bool quick = false;
+    string filter;
+
+    bool enabled(const char *benchmark) const {
+        return filter.empty() || filter == benchmark;
+    }
+};
+
+static vector0_api *vector_api_from_db(sqlite3 *db) {
+
+    vector0_api *api = nullptr;
+    auto stmt = prepare(db, "select vector0(?1)");
+    sqlite3_bind_pointer(stmt, 1, (void *)&api, "vector0_api_ptr", nullptr);
+    check(sqlite3_step(stmt), db, "select vector0(?1)");
+    sqlite3_finalize(stmt);
+
+    if (api == nullptr) {
+        fprintf(stderr, "vector0 API not available\n");
+        exit(1);
+    }
+    return api;
+}
+
+static string vector_json(const float *v, size_t d) {
+
+    ostringstream out;
+    out << '[';
+    for (size_t i = 0; i < d; i++) {
+        if (i > 0)
+            out << ',';
+        out << v[i];
+    }
+    out << ']';
+    return out.str();
+}
+
+#pragma region Benchmarks
+
+// Every benchmark seeds its own generator, so it benchmarks the same data in
+// every run, whether or not --filter skipped the others.
+#define VSS_BENCH_SEED 42
+
+// bench_value_as_vector(value, iterations): decodes value with vector0's
+// xValueAsVector `iterations` times, so only the decode cost is measured.
+static void bench_value_as_vector(sqlite3_context *context, int argc, sqlite3_value **argv) {
+
+    auto api = static_cast<vector0_api *>(sqlite3_user_data(context));
+    auto iterations = sqlite3_value_int64(argv[1]);
+
+    size_t total = 0;
+    for (sqlite3_int64 i = 0; i < iterations; i++) {
+        auto vec = api->xValueAsVector(argv[0]);
+        if (vec == nullptr) {
+            sqlite3_result_error(context, "value is not a vector", -1);
+            return;
+        }
+        total += vec->size();
+    }
+    sqlite3_result_int64(context, total);
+}
+
+static void bench_decode(const BenchOptions &options) {
+
+    mt19937 rng(VSS_BENCH_SEED);
+
+    auto db = open_db(":memory:");
+    auto api = vector_api_from_db(db);
+    check(sqlite3_create_function_v2(db, "bench_value_as_vector", 2, SQLITE_UTF8, api,
+                                     bench_value_as_vector, nullptr, nullptr, nullptr),
+          db, "bench_value_as_vector");
+
+    sqlite3_int64 iterations = options.quick ? 1000 : 20000;
+
+    for (size_t d : {128, 768}) {
+
+        auto v = random_vectors(1, d, rng);
+        auto blob = vector_blob(v.data(), d);
+        auto json = vector_json(v.data(), d);
+
+        struct Encoding {
+            const char *name;
+            const char *argument;
+        };
+
+        // The compact 'v' blob types are encoded once, before the decodes.
+        for (auto encoding : {Encoding{"json", "?1"},
+                              Encoding{"blob", "?2"},
+                              Encoding{"f16", "vector_to_f16(?2)"},
+                              Encoding{"bf16", "vector_to_bf16(?2)"},
+                              Encoding{"int8", "vector_quantize_i8(?2)"},
+                              Encoding{"raw", "?3"},
+                              Encoding{"pointer", "vector_from_json(?1)"}}) {
+
+            auto stmt = prepare(db, string("select bench_value_as_vector(") + encoding.argument + ", ?4)");
+            sqlite3_bind_text(stmt, 1, json.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_blob(stmt, 2, blob.data(), blob.size(), SQLITE_TRANSIENT);
+            sqlite3_bind_blob(stmt, 3, v.data(), d * sizeof(float), SQLITE_TRANSIENT);
+            sqlite3_bind_int64(stmt, 4, iterations);
+
+            auto start = bench_clock::now();
+            check(sqlite3_step(stmt), db, "bench_value_as_vector");
+            auto us = elapsed_us(start);
+            sqlite3_finalize(stmt);
+
+            ResultLine("decode")
+                .add("encoding", encoding.name)
+                .add("d", d)
+                .add("iterations", (long long)iterations)
+                .add("ns_per_op", us * 1000.0 / iterations)
+                .print();
+        }
+    }
+
+    sqlite3_close(db);
+}
+
+static void bench_distance(const BenchOptions &options) {
+
+    mt19937 rng(VSS_BENCH_SEED);
+
+    auto db = open_db(":memory:");
+    size_t rows = options.quick ? 2000 : 50000;
+
+    for (size_t d : {128, 768}) {
+
+        auto data = random_vectors(rows, d, rng);
+        auto query = random_vectors(1, d, rng);
+
+        exec(db, "create table vectors(v blob)");
+        auto insert = prepare(db, "insert into vectors(v) values (?)");
+        exec(db, "begin");
+        for (size_t i = 0; i < rows; i++) {
+            bind_vector(insert, 1, &data[i * d], d);
+            check(sqlite3_step(insert), db, "insert into vectors");
+            sqlite3_reset(insert);
+        }
+        exec(db, "commit");
+        sqlite3_finalize(insert);
+
+        for (auto function : {"vss_distance_l1",
+                              "vss_distance_l2",
+                              "vss_distance_linf",
+                              "vss_inner_product",
+                              "vss_cosine_similarity"}) {
+
+            auto stmt = prepare(db, string("select sum(") + function + "(v, ?1)) from vectors");
+            bind_vector(stmt, 1, query.data(), d);
+
+            auto start = bench_clock::now();
+            check(sqlite3_step(stmt), db, function);
+            auto us = elapsed_us(start);
+            sqlite3_finalize(stmt);
+
+            ResultLine("distance")
+                .add("function", function)
+                .add("d", d)
+                .add("rows", rows)
+                .add("ns_per_row", us * 1000.0 / rows)
+                .print();
+        }
+
+        exec(db, "drop table vectors");
+    }
+
+    sqlite3_close(db);
+}
+
+// Inserts and commits into a vss0 column per factory, then reopens the
+// database to time reading the index back (read_index_select).
+static void bench_write(const BenchOptions &options) {
+
+    mt19937 rng(VSS_BENCH_SEED);
+
+    size_t d = 128;
+    size_t n = options.quick ? 5000 : 100000;
+    auto data = random_vectors(n, d, rng);
+
+    auto path = (filesystem::temp_directory_path() / "sqlite-vss-bench.db").string();
+
+    for (auto factory : {"Flat,IDMap2", "IVF256,Flat,IDMap2", "HNSW32,IDMap2", "IVF256,PQ16,IDMap2"}) {
+
+        remove_db(path);
+        auto db = open_db(path);
+
+        exec(db, "create virtual table x using vss0(v(" + to_string(d) + ") factory=\"" + factory + "\")");
+
+        auto train_us = train_if_needed(db, "x", data, d);
+
+        auto timings = insert_vectors(db, "x", data, d);
+        sqlite3_close(db);
+
+        ResultLine("update")
+            .add("factory", factory)
+            .add("d", d)
+            .add("ntotal", n)
+            .add("rows_per_sec", n / (timings.first / 1e6))
+            .print();
+
+        ResultLine("sync")
+            .add("factory", factory)
+            .add("d", d)
+            .add("ntotal", n)
+            .add("train_ms", train_us / 1000.0)
+            .add("sync_ms", timings.second / 1000.0)
+            .print();
+
+        db = open_db(path);
+        auto stmt = prepare(db, "select load_ms, serialized_size from vss_indexes where table_name = 'x'");
+        check(sqlite3_step(stmt), db, "vss_indexes");
+
+        ResultLine("load")
+            .add("factory", factory)
+            .add("d", d)
+            .add("ntotal", n)
+            .add("load_ms", sqlite3_column_double(stmt, 0))
+            .add("serialized_size", (long long)sqlite3_column_int64(stmt, 1))
+            .print();
+
+        sqlite3_finalize(stmt);
+        sqlite3_close(db);
+    }
+
+    remove_db(path);
+}
+
+static void bench_knn(const BenchOptions &options) {
+
+    mt19937 rng(VSS_BENCH_SEED);
+
+    struct Shape {
+        size_t d;
+        size_t ntotal;
+    };
+
+    size_t scale = options.quick ? 10 : 1;
+    size_t queries = options.quick ? 50 : 500;
+
+    for (auto shape : {Shape{32, 10000}, Shape{128, 10000}, Shape{128, 100000}, Shape{768, 10000}}) {
+
+        auto d = shape.d;
+        auto ntotal = shape.ntotal / scale;
+        auto db = open_db(":memory:");
+
+        exec(db, "create virtual table x using vss0(v(" + to_string(d) + "))");
+        insert_vectors(db, "x", random_vectors(ntotal, d, rng), d);
+
+        auto query_vectors = random_vectors(queries, d, rng);
+        auto stmt = prepare(db, "select rowid, distance from x where vss_search(v, vss_search_params(?1, ?2))");
+
+        for (sqlite3_int64 k : {1, 10, 100}) {
+
+            vector<double> latencies;
+            latencies.reserve(queries);
+            auto start = bench_clock::now();
+
+            for (size_t q = 0; q < queries; q++) {
+
+                auto query_start = bench_clock::now();
+                bind_vector(stmt, 1, &query_vectors[q * d], d);
+                sqlite3_bind_int64(stmt, 2, k);
+
+                int rc;
+                while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+                    ;
+                check(rc, db, "vss_search");
+                sqlite3_reset(stmt);
+                latencies.push_back(elapsed_us(query_start));
+            }
+
+            auto total_us = elapsed_us(start);
+
+            ResultLine("knn")
+                .add("factory", "Flat,IDMap2")
+                .add("d", d)
+                .add("ntotal", ntotal)
+                .add("k", (long long)k)
+                .add("queries", queries)
+                .add("qps", queries / (total_us / 1e6))
+                .add("p50_ms", percentile_ms(latencies, 0.50))
+                .add("p99_ms", percentile_ms(latencies, 0.99))
+                .print();
+        }
+
+        sqlite3_finalize(stmt);
+        sqlite3_close(db);
+    }
+}
+
+#pragma endregion
+
+int main(int argc, char *argv[]) {
+
+    BenchOptions options;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0) {
+            options.quick = true;
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            options.filter = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [--quick] [--filter decode|distance|write|knn]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // Statically linked, so both extensions are registered on every new
+    // connection instead of being loaded.
+    check(sqlite3_auto_extension((void (*)())sqlite3_vector_init), nullptr, "sqlite3_vector_init");
+    check(sqlite3_auto_extension((void (*)())sqlite3_vss_init), nullptr, "sqlite3_vss_init");
+
+    ResultLine("meta")
+        .add("vss_version", SQLITE_VSS_VERSION)
+        .add("sqlite_version", sqlite3_libversion())
+        .add("quick", options.quick ? 1 : 0)
+        .print();
+
+    if (options.enabled("decode"))
+        bench_decode(options);
+    if (options.enabled("distance"))
+        bench_distance(options);
+    if (options.enabled("write"))
+        bench_write(options);
+    if (options.enabled("knn"))
+        bench_knn(options);
+
+    return 0;
+}
@@ -0,0 +1,300 @@
+"""
+Recall and QPS benchmark for vss0 factories, against the ground truth of the
+sift1m and gist1m datasets from http://corpus-texmex.irisa.fr/
+
+For every factory, builds a vss0 table in its own database file, then reports
+training and build time, index size, connect time, recall@1/10/100 and
+single/batched query throughput.
+
+    python3 benchmarks/recall/bench.py sift1m
+    python3 benchmarks/recall/bench.py gist1m --factory "IVF4096,Flat,IDMap2" --k 10 100
+    python3 benchmarks/recall/bench.py sift1m --nprobe 1 16 64 --ef-search 16 64 256
+"""
+
+import argparse
+import array
+import itertools
+import json
+import os
+import sqlite3
+import sys
+import tempfile
+import time
+
+DATASETS = {
+    "sift1m": {"prefix": "sift", "dir": "examples/sift/data/sift"},
+    "gist1m": {"prefix": "gist", "dir": "examples/sift/data/gist"},
+}
+
+DEFAULT_FACTORIES = [
+    "Flat,IDMap2",
+    "IVF4096,Flat,IDMap2",
+    "IVF4096,PQ32,IDMap2",
+    "HNSW32,IDMap2",
+]
+
+RECALL_AT = [1, 10, 100]
+
+
+def read_vecs(path, limit=None):
+    """
+    Yields every vector of a .fvecs or .ivecs file as raw little-endian bytes.
+    Each record is an int32 dimension followed by that many 4-byte values.
+    """
+    with open(path, "rb") as f:
+        count = 0
+        while limit is None or count < limit:
+            header = f.read(4)
+            if len(header) < 4:
+                return
+            d = int.from_bytes(header, "little")
+            yield f.read(d * 4)
+            count += 1
+
+
+def read_ivecs(path, limit=None):
+    rows = []
+    for record in read_vecs(path, limit):
+        values = array.array("i")
+        values.frombytes(record)
+        rows.append(values.tolist())
+    return rows
+
+
+def connect(path, extension_dir):
+    db = sqlite3.connect(path, isolation_level=None)
+    db.enable_load_extension(True)
+    db.load_extension(os.path.join(extension_dir, "vector0"))
+    db.load_extension(os.path.join(extension_dir, "vss0"))
+    db.enable_load_extension(False)
+    return db
+
+
+def insert_batches(db, sql, rows, batch_size=10000):
+    batch = []
+    for row in rows:
+        batch.append(row)
+        if len(batch) == batch_size:
+            db.executemany(sql, batch)
+            batch = []
+    if batch:
+        db.executemany(sql, batch)
+
+
+def build(db, factory, d, files, train_size):
+    """
+    Creates and fills the vss0 table x, returning the seconds spent training
+    and adding the base vectors. Rowids are the 1-based positions in the base
+    file, the ground truth uses 0-based ones.
+    """
+    db.execute(f'create virtual table x using vss0(v({d}) factory="{factory}")')
+
+    train_seconds = 0.0
+    needs_training = db.execute(
+        "select not is_trained from vss_indexes where table_name = 'x'"
+    ).fetchone()[0]
+
+    if needs_training:
+        source = files["learn"] if os.path.exists(files["learn"]) else files["base"]
+        start = time.perf_counter()
+        db.execute("begin")
+        insert_batches(
+            db,
+            "insert into x(operation, v) values ('training', ?)",
+            ((v,) for v in read_vecs(source, train_size)),
+        )
+        db.execute("commit")
+        train_seconds = time.perf_counter() - start
+
+    start = time.perf_counter()
+    db.execute("begin")
+    insert_batches(
+        db,
+        "insert into x(rowid, v) values (?, ?)",
+        ((i + 1, v) for i, v in enumerate(read_vecs(files["base"]))),
+    )
+    db.execute("commit")
+    build_seconds = time.perf_counter() - start
+
+    return train_seconds, build_seconds
+
+
+def recall(results, groundtruth, at):
+    """
+    Mean fraction of the true `at` nearest neighbors found in the first `at`
+    results of each query.
+    """
+    total = 0.0
+    for found, truth in zip(results, groundtruth):
+        total += len(set(found[:at]) & set(truth[:at])) / at
+    return total / len(results)
+
+
+def search_widths(factory, args):
+    """
+    The (nprobe, ef_search) settings to run a factory with: the --nprobe values
+    for IVF factories, the --ef-search values for HNSW and Vamana ones, and
+    the index's own settings otherwise, or when none were given.
+    """
+    if "IVF" in factory and args.nprobe:
+        return [(nprobe, None) for nprobe in args.nprobe]
+    if ("HNSW" in factory or "Vamana" in factory) and args.ef_search:
+        return [(None, ef_search) for ef_search in args.ef_search]
+    return [(None, None)]
+
+
+def search_single(db, queries, k, nprobe, ef_search):
+    results = []
+    start = time.perf_counter()
+    for query in queries:
+        rows = db.execute(
+            "select rowid from x where vss_search(v, vss_search_params(?, ?, ?, ?))",
+            [query, k, nprobe, ef_search],
+        ).fetchall()
+        results.append([rowid - 1 for (rowid,) in rows])
+    return results, len(queries) / (time.perf_counter() - start)
+
+
+def search_batched(db, queries, k, nprobe, ef_search):
+    """
+    Runs every query in a single statement, joining a table of queries against
+    the vss0 table.
+    """
+    db.execute("create temp table if not exists queries(v blob)")
+    db.execute("delete from queries")
+    db.executemany("insert into queries(rowid, v) values (?, ?)", enumerate(queries))
+
+    start = time.perf_counter()
+    rows = db.execute(
+        """
+        select queries.rowid, x.rowid
+        from queries
+        join x
+        where vss_search(x.v, vss_search_params(queries.v, ?, ?, ?))
+        """,
+        [k, nprobe, ef_search],
+    ).fetchall()
+    qps = len(queries) / (time.perf_counter() - start)
+
+    results = [[] for _ in queries]
+    for query, rowid in rows:
+        results[query].append(rowid - 1)
+    return results, qps
+
+
+def bench_factory(args, dataset, files, factory, queries, groundtruth, d):
+    path = os.path.join(args.work_dir, f"{dataset}-{factory.replace(',', '_')}.db")
+    for suffix in ["", "-journal", "-wal"]:
+        if os.path.exists(path + suffix):
+            os.remove(path + suffix)
+
+    db = connect(path, args.extension_dir)
+    train_seconds, build_seconds = build(db, factory, d, files, args.train_size)
+    db.close()
+
+    # Time the first use on a new connection, which reads the index back.
+    start = time.perf_counter()
+    db = connect(path, args.extension_dir)
+    size, load_ms = db.execute(
+        "select serialized_size, load_ms from vss_indexes where table_name = 'x'"
+    ).fetchone()
+    connect_ms = (time.perf_counter() - start) * 1000
+
+    rows = []
+    for (nprobe, ef_search), k in itertools.product(search_widths(factory, args), args.k):
+        single, single_qps = search_single(db, queries, k, nprobe, ef_search)
+        batched, batched_qps = search_batched(db, queries, k, nprobe, ef_search)
+
+        row = {
+            "dataset": dataset,
+            "factory": factory,
+            "nprobe": nprobe,
+            "ef_search": ef_search,
+            "k": k,
+            "train_s": round(train_seconds, 2),
+            "build_s": round(build_seconds, 2),
+            "index_mb": round(size / 1e6, 1),
+            "connect_ms": round(connect_ms, 1),
+            "load_ms": round(load_ms, 1),
+            "single_qps": round(single_qps, 1),
+            "batched_qps": round(batched_qps, 1),
+        }
+        for at in RECALL_AT:
+            # Recall@n needs at least n results per query.
+            row[f"recall@{at}"] = round(recall(single, groundtruth, at), 4) if at <= k else None
+
+        # The batched and single queries must agree, or one of them is broken.
+        if batched != single:
+            print(
+                f"warning: batched results differ from single results for {factory}, nprobe={nprobe}, ef_search={ef_search}",
+                file=sys.stderr,
+            )
+
+        rows.append(row)
+        print(json.dumps(row), file=sys.stderr)
+
+    db.close()
+    if not args.keep:
+        os.remove(path)
+    return rows
+
+
+def print_table(rows):
+    columns = list(rows[0].keys())
+    cells = [[("-" if row[c] is None else str(row[c])) for c in columns] for row in rows]
+    widths = [max(len(c), *(len(r[i]) for r in cells)) for i, c in enumerate(columns)]
+
+    print("| " + " | ".join(c.ljust(w) for c, w in zip(columns, widths)) + " |")
+    print("| " + " | ".join("-" * w for w in widths) + " |")
+    for r in cells:
+        print("| " + " | ".join(v.ljust(w) for v, w in zip(r, widths)) + " |")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="vss0 recall/QPS benchmark")
+    parser.add_argument("dataset", choices=DATASETS.keys())
+    parser.add_argument("--data-dir", help="directory with the dataset's .fvecs/.ivecs files")
+    parser.add_argument("--factory", nargs="+", default=DEFAULT_FACTORIES)
+    parser.add_argument("--k", nargs="+", type=int, default=[1, 10, 100])
+    parser.add_argument("--nprobe", nargs="+", type=int, help="nprobe values to search IVF factories with")
+    parser.add_argument("--ef-search", nargs="+", type=int, help="efSearch values to search HNSW and Vamana factories with")
+    parser.add_argument("--queries", type=int, default=1000, help="number of queries to run")
+    parser.add_argument("--train-size", type=int, default=100000)
+    parser.add_argument("--extension-dir", default="dist/debug")
+    parser.add_argument("--work-dir", default=tempfile.gettempdir())
+    parser.add_argument("--keep", action="store_true", help="keep the built databases")
+    parser.add_argument("--json", help="also write the results as JSON lines to this file")
+    args = parser.parse_args()
+
+    dataset = DATASETS[args.dataset]
+    data_dir = args.data_dir or dataset["dir"]
+    prefix = os.path.join(data_dir, dataset["prefix"])
+    files = {
+        "base": prefix + "_base.fvecs",
+        "learn": prefix + "_learn.fvecs",
+        "query": prefix + "_query.fvecs",
+        "groundtruth": prefix + "_groundtruth.ivecs",
+    }
+
+    for name in ["base", "query", "groundtruth"]:
+        if not os.path.exists(files[name]):
+            sys.exit(f"missing {files[name]}, download the dataset from http://corpus-texmex.irisa.fr/")
+
+    queries = list(read_vecs(files["query"], args.queries))
+    groundtruth = read_ivecs(files["groundtruth"], args.queries)
+    d = len(queries[0]) // 4
+
+    rows = []
+    for factory in args.factory:
+        rows.extend(bench_factory(args, args.dataset, files, factory, queries, groundtruth, d))
+
+    print_table(rows)
+
+    if args.json:
+        with open(args.json, "w") as f:
+            for row in rows:
+                f.write(json.dumps(row) + "\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -2,4 +2,5 @@
 
 hyperfine --cleanup=./cleanup.sh \
   'sqlite3 test.db ".read load-flat.sql"' \
-  'sqlite3 test.db ".read load-ivfflat.sql"'
\ No newline at end of file
+  'sqlite3 test.db ".read load-ivfflat.sql"' \
+  'sqlite3 test.db ".read load-bulk.sql"'
@@ -1,4 +1,5 @@
 #!/bin/bash
 sqlite3 test.db '.load ./vector0' '.load ./vss0' \
   'drop table if exists x_flat;' \
-  'drop table if exists x_ivfflat;' 
\ No newline at end of file
+  'drop table if exists x_ivfflat;' \
+  'drop table if exists x_bulk;' 
\ No newline at end of file
@@ -0,0 +1,12 @@
+.bail on
+
+.load ./vector0
+.load ./vss0
+.timer on
+
+create virtual table x_bulk using vss0(v(128) factory="IVF4096,Flat,IDMap2");
+
+-- faiss wants 39 to 256 training vectors per list, a sample is plenty
+select vss_train('x_bulk', 'v', 160000, 0, 'select rowid, vector from sift');
+
+select vss_bulk_load('x_bulk', 'v', '../../examples/sift/data/sift/sift_base.fvecs');
@@ -17,6 +17,11 @@ struct vector0_api {
     int iVersion;
     std::unique_ptr<std::vector<float>> (*xValueAsVector)(sqlite3_value *value);
     void (*xResultVector)(sqlite3_context *context, std::vector<float> *);
+
+    // Since version 1. Reads a matrix blob made by vector_matrix(), returning
+    // a pointer to its first value (not necessarily aligned), or nullptr with
+    // pzErrMsg set if value isn't a matrix blob.
+    const void *(*xValueAsMatrix)(sqlite3_value *value, int64_t *rows, int64_t *dimensions, const char **pzErrMsg);
 };
 
 #endif /* end of C++ specific APIs*/
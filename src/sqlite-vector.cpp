@@ -3,13 +3,29 @@
 
 #include "sqlite-vector.h"
 #include "sqlite-vss.h"
+#include "vector-encoding.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <memory>
 #include <stdio.h>
 #include <string.h>
+#include <string>
 #include <vector>
 
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include "sqlite3ext.h"
 SQLITE_EXTENSION_INIT1
 
@@ -70,14 +86,29 @@ vec_ptr vectorFromBlobValue(sqlite3_value *value, const char **pzErrMsg) {
         return nullptr;
     }
 
-    if (type != VECTOR_BLOB_HEADER_TYPE) {
+    if (type == VECTOR_BLOB_HEADER_TYPE) {
+
+        int numElements = (size - 2) / sizeof(float);
+        float *vec = (float *)((char *)pBlob + 2);
+        return vec_ptr(new vector<float>(vec, vec + numElements));
+    }
+
+    // Compact encodings, see vector-encoding.h
+    auto elementSize = vectorBlobTypeElementSize(type);
+    if (elementSize == 0) {
         *pzErrMsg = "Blob type not right";
         return nullptr;
     }
 
-    int numElements = (size - 2) / sizeof(float);
-    float *vec = (float *)((char *)pBlob + 2);
-    return vec_ptr(new vector<float>(vec, vec + numElements));
+    sqlite3_int64 bodySize = size - 2 - vectorBlobTypeExtra(type);
+    if (bodySize < 0 || bodySize % elementSize != 0) {
+        *pzErrMsg = "Vector blob size doesn't match its type";
+        return nullptr;
+    }
+
+    vec_ptr pVec(new vector<float>(bodySize / elementSize));
+    vectorDecodeBlob(type, (const uint8_t *)pBlob + 2, pVec->size(), pVec->data());
+    return pVec;
 }
 
 vec_ptr vectorFromRawBlobValue(sqlite3_value *value, const char **pzErrMsg) {
@@ -311,6 +342,132 @@ static void vector_to_blob(sqlite3_context *context,
     sqlite3_result_blob64(context, pBlob, memSize, sqlite3_free);
 }
 
+// Writes vec as a 'v' blob of the given compact type.
+static void resultEncodedBlob(sqlite3_context *context,
+                              const vector<float> &vec,
+                              VectorBlobType type,
+                              float min = 0,
+                              float max = 0) {
+
+    sqlite3_int64 n = vec.size();
+    sqlite3_int64 memSize = 2 + vectorBlobTypeExtra(type) + n * vectorBlobTypeElementSize(type);
+
+    auto pBlob = (uint8_t *)sqlite3_malloc64(memSize);
+    if (pBlob == nullptr) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+
+    pBlob[0] = VECTOR_BLOB_HEADER_BYTE;
+    pBlob[1] = type;
+    auto body = pBlob + 2;
+
+    switch (type) {
+
+        case vector_blob_float16:
+            vectorEncodeF16(vec.data(), body, n);
+            break;
+
+        case vector_blob_bfloat16:
+            vectorEncodeBF16(vec.data(), body, n);
+            break;
+
+        case vector_blob_int8: {
+            float scale, offset;
+            vectorEncodeI8(vec.data(), min, max, body + 2 * sizeof(float), n, &scale, &offset);
+            memcpy(body, &scale, sizeof(float));
+            memcpy(body + sizeof(float), &offset, sizeof(float));
+            break;
+        }
+
+        default:
+            memcpy(body, vec.data(), n * sizeof(float));
+            break;
+    }
+
+    sqlite3_result_blob64(context, pBlob, memSize, sqlite3_free);
+}
+
+static void vector_to_f16(sqlite3_context *context,
+                          int argc,
+                          sqlite3_value **argv) {
+
+    vec_ptr pVec = valueAsVector(argv[0]);
+    if (pVec == nullptr)
+        return;
+
+    resultEncodedBlob(context, *pVec, vector_blob_float16);
+}
+
+static void vector_to_bf16(sqlite3_context *context,
+                           int argc,
+                           sqlite3_value **argv) {
+
+    vec_ptr pVec = valueAsVector(argv[0]);
+    if (pVec == nullptr)
+        return;
+
+    resultEncodedBlob(context, *pVec, vector_blob_bfloat16);
+}
+
+// vector_quantize_i8(vector [, min, max]): without a range, the vector's own
+// minimum and maximum are used. Pass the range of the whole column instead to
+// make the quantized vectors comparable with each other.
+static void vector_quantize_i8(sqlite3_context *context,
+                               int argc,
+                               sqlite3_value **argv) {
+
+    if (argc != 1 && argc != 3) {
+        sqlite3_result_error(context, "vector_quantize_i8() takes a vector, and optionally a min and max", -1);
+        return;
+    }
+
+    vec_ptr pVec = valueAsVector(argv[0]);
+    if (pVec == nullptr)
+        return;
+
+    float min, max;
+    if (argc == 3) {
+        min = sqlite3_value_double(argv[1]);
+        max = sqlite3_value_double(argv[2]);
+    } else if (pVec->empty()) {
+        min = max = 0;
+    } else {
+        auto range = minmax_element(pVec->begin(), pVec->end());
+        min = *range.first;
+        max = *range.second;
+    }
+
+    if (!(min <= max) || !isfinite(min) || !isfinite(max)) {
+        sqlite3_result_error(context, "vector_quantize_i8() range must be finite, with min <= max", -1);
+        return;
+    }
+
+    resultEncodedBlob(context, *pVec, vector_blob_int8, min, max);
+}
+
+// vector_binarize(vector): one bit per dimension, set for elements > 0 (see
+// vectorBinarize()), packed 8 to a byte. The format binary vss0 columns and
+// vss_distance_hamming() take.
+static void vector_binarize(sqlite3_context *context,
+                            int argc,
+                            sqlite3_value **argv) {
+
+    vec_ptr pVec = valueAsVector(argv[0]);
+    if (pVec == nullptr)
+        return;
+
+    auto memSize = vectorBinarySize(pVec->size());
+    auto pBlob = (uint8_t *)sqlite3_malloc64(max(memSize, (int64_t)1));
+    if (pBlob == nullptr) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+
+    vectorBinarize(pVec->data(), pBlob, pVec->size());
+    sqlite3_result_blob64(context, pBlob, memSize, sqlite3_free);
+}
+
 static void vector_from_blob(sqlite3_context *context,
                              int argc,
                              sqlite3_value **argv) {
@@ -355,76 +512,161 @@ static void vector_from_raw(sqlite3_context *context,
 
 #pragma endregion
 
-#pragma region fvecs vtab
+#pragma region Random vectors
 
-struct fvecsEach_vtab : public sqlite3_vtab {
-  
-    fvecsEach_vtab() {
+// Small, seedable generator for synthetic vectors (splitmix64). The standard
+// <random> distributions aren't specified exactly, so the uniform and gaussian
+// transforms are done here to produce the same vectors on every platform.
+struct VectorRandom {
 
-      pModule = nullptr;
-      nRef = 0;
-      zErrMsg = nullptr;
+    explicit VectorRandom(uint64_t seed) : state(seed) {}
+
+    uint64_t next() {
+
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
     }
 
-    ~fvecsEach_vtab() {
+    // Uniform in [0, 1).
+    float uniform() {
+        return (next() >> 40) * (1.0f / 16777216.0f);
+    }
 
-        if (zErrMsg != nullptr) {
-            sqlite3_free(zErrMsg);
+    // Standard normal, with Box-Muller.
+    float gaussian() {
+
+        if (hasSpare) {
+            hasSpare = false;
+            return spare;
         }
+
+        double u1 = ((next() >> 11) + 1) * (1.0 / 9007199254740993.0);
+        double u2 = (next() >> 11) * (1.0 / 9007199254740992.0);
+        double r = sqrt(-2.0 * log(u1));
+        double theta = 2 * 3.14159265358979323846 * u2;
+
+        spare = (float)(r * sin(theta));
+        hasSpare = true;
+        return (float)(r * cos(theta));
     }
+
+    uint64_t state;
+    bool hasSpare = false;
+    float spare = 0;
 };
 
-struct fvecsEach_cursor : public sqlite3_vtab_cursor {
+// Every row of vector_random_each() gets its own generator, so any row can be
+// produced without generating the rows before it.
+static VectorRandom vectorRandomForRow(sqlite3_int64 seed, sqlite3_int64 rowid) {
 
-    fvecsEach_cursor(sqlite3_vtab *pVtab) {
-      
-      this->pVtab = pVtab;
-      iRowid = 0;
-      pBlob = nullptr;
-      iBlobN = 0;
-      p = 0;
-      iCurrentD = 0;
+    VectorRandom mix((uint64_t)seed);
+    return VectorRandom(mix.next() ^ ((uint64_t)rowid * 0xd1b54a32d192ed03ULL));
+}
+
+enum VectorRandomDistribution { uniform, gaussian, clustered };
+
+#define VECTOR_RANDOM_MAX_DIMENSIONS 65536
+#define VECTOR_RANDOM_DEFAULT_CLUSTERS 16
+
+// Spread of the points around their centroid, for clustered distributions.
+#define VECTOR_RANDOM_CLUSTER_SIGMA 0.05f
+
+static VectorFloat *newVectorFloat(sqlite3_int64 dimensions) {
+
+    auto vec = new VectorFloat();
+    vec->size = dimensions;
+    // sqlite3_malloc64(0) returns NULL, so allocate at least one float.
+    vec->data = (float *)sqlite3_malloc64(max(dimensions, (sqlite3_int64)1) * sizeof(float));
+    if (vec->data == nullptr) {
+        delete vec;
+        return nullptr;
     }
+    return vec;
+}
 
-    ~fvecsEach_cursor() {
-        if (pBlob != nullptr)
-            sqlite3_free(pBlob);
+static void vector_random(sqlite3_context *context,
+                          int argc,
+                          sqlite3_value **argv) {
+
+    auto dimensions = sqlite3_value_int64(argv[0]);
+    auto seed = sqlite3_value_int64(argv[1]);
+
+    if (dimensions < 1 || dimensions > VECTOR_RANDOM_MAX_DIMENSIONS) {
+        sqlite3_result_error(context, "dimensions must be between 1 and 65536", -1);
+        return;
     }
 
-    sqlite3_int64 iRowid;
+    auto vec = newVectorFloat(dimensions);
+    if (vec == nullptr) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
 
-    // Copy of fvecs input blob
-    void *pBlob;
+    // Same vector as the 1st row of vector_random_each(n, dimensions, seed).
+    auto rng = vectorRandomForRow(seed, 1);
+    for (sqlite3_int64 i = 0; i < dimensions; i++)
+        vec->data[i] = rng.uniform();
 
-    // Total size of pBlob in bytes
-    sqlite3_int64 iBlobN;
-    sqlite3_int64 p;
+    sqlite3_result_pointer(context, vec, VECTOR_FLOAT_POINTER_NAME, delVectorFloat);
+}
 
-    // Current dimensions
-    int iCurrentD;
+struct randomEach_vtab : public sqlite3_vtab {
 
-    // Pointer to current vector being read in
-    vec_ptr pCurrentVector;
+    randomEach_vtab() {
+
+        pModule = nullptr;
+        nRef = 0;
+        zErrMsg = nullptr;
+    }
+
+    ~randomEach_vtab() {
+
+        if (zErrMsg != nullptr)
+            sqlite3_free(zErrMsg);
+    }
 };
 
-static int fvecsEachConnect(sqlite3 *db,
-                            void *pAux,
-                            int argc,
-                            const char *const *argv,
-                            sqlite3_vtab **ppVtab,
-                            char **pzErr) {
+struct randomEach_cursor : public sqlite3_vtab_cursor {
 
-    int rc;
+    explicit randomEach_cursor(sqlite3_vtab *pVtab) {
 
-    rc = sqlite3_declare_vtab(db, "create table x(dimensions, vector, input hidden)");
+        this->pVtab = pVtab;
+    }
 
-#define FVECS_EACH_DIMENSIONS 0
-#define FVECS_EACH_VECTOR 1
-#define FVECS_EACH_INPUT 2
+    sqlite3_int64 iRowid = 1;
+    sqlite3_int64 n = 0;
+    sqlite3_int64 dimensions = 0;
+    sqlite3_int64 seed = 0;
+    sqlite3_int64 clusters = 0;
+    VectorRandomDistribution distribution = uniform;
+
+    // clusters * dimensions centroid coordinates, for clustered distributions.
+    vector<float> centroids;
+};
+
+#define RANDOM_EACH_VECTOR 0
+#define RANDOM_EACH_CLUSTER 1
+#define RANDOM_EACH_N 2
+#define RANDOM_EACH_DIMENSIONS 3
+#define RANDOM_EACH_SEED 4
+#define RANDOM_EACH_DISTRIBUTION 5
+#define RANDOM_EACH_CLUSTERS 6
+
+static int randomEachConnect(sqlite3 *db,
+                             void *pAux,
+                             int argc,
+                             const char *const *argv,
+                             sqlite3_vtab **ppVtab,
+                             char **pzErr) {
+
+    int rc = sqlite3_declare_vtab(db, "create table x(vector, cluster, n hidden, dimensions hidden, "
+                                      "seed hidden, distribution hidden, clusters hidden)");
 
     if (rc == SQLITE_OK) {
 
-        auto pNew = new fvecsEach_vtab();
+        auto pNew = new randomEach_vtab();
         if (pNew == 0)
             return SQLITE_NOMEM;
 
@@ -433,16 +675,16 @@ static int fvecsEachConnect(sqlite3 *db,
     return rc;
 }
 
-static int fvecsEachDisconnect(sqlite3_vtab *pVtab) {
+static int randomEachDisconnect(sqlite3_vtab *pVtab) {
 
-    auto pTable = static_cast<fvecsEach_vtab *>(pVtab);
+    auto pTable = static_cast<randomEach_vtab *>(pVtab);
     delete pTable;
     return SQLITE_OK;
 }
 
-static int fvecsEachOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
+static int randomEachOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
 
-    auto pCur = new fvecsEach_cursor(p);
+    auto pCur = new randomEach_cursor(p);
     if (pCur == nullptr)
         return SQLITE_NOMEM;
 
@@ -450,132 +692,515 @@ static int fvecsEachOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
     return SQLITE_OK;
 }
 
-static int fvecsEachClose(sqlite3_vtab_cursor *cur) {
+static int randomEachClose(sqlite3_vtab_cursor *cur) {
 
-    auto pCur = static_cast<fvecsEach_cursor *>(cur);
+    auto pCur = static_cast<randomEach_cursor *>(cur);
     delete pCur;
     return SQLITE_OK;
 }
 
-static int fvecsEachBestIndex(sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo) {
+// idxNum is a bitmask of the hidden columns constrained, bit 0 for n. Their
+// values are passed to xFilter in column order.
+static int randomEachBestIndex(sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo) {
+
+    int constraints[RANDOM_EACH_CLUSTERS - RANDOM_EACH_N + 1];
+    for (auto &c : constraints)
+        c = -1;
+
+    int unusable = 0;
 
     for (int i = 0; i < pIdxInfo->nConstraint; i++) {
 
         auto pCons = pIdxInfo->aConstraint[i];
+        if (pCons.iColumn < RANDOM_EACH_N || pCons.op != SQLITE_INDEX_CONSTRAINT_EQ)
+            continue;
 
-        switch (pCons.iColumn) {
+        auto bit = pCons.iColumn - RANDOM_EACH_N;
+        if (!pCons.usable)
+            unusable |= 1 << bit;
+        else
+            constraints[bit] = i;
+    }
 
-            case FVECS_EACH_INPUT:
-                if (pCons.op == SQLITE_INDEX_CONSTRAINT_EQ && pCons.usable) {
+    int idxNum = 0;
+    int argvIndex = 0;
+    for (int bit = 0; bit <= RANDOM_EACH_CLUSTERS - RANDOM_EACH_N; bit++) {
 
-                    pIdxInfo->aConstraintUsage[i].argvIndex = 1;
-                    pIdxInfo->aConstraintUsage[i].omit = 1;
-                }
-            break;
-        }
+        if (constraints[bit] < 0)
+            continue;
+
+        idxNum |= 1 << bit;
+        pIdxInfo->aConstraintUsage[constraints[bit]].argvIndex = ++argvIndex;
+        pIdxInfo->aConstraintUsage[constraints[bit]].omit = 1;
     }
 
+    // n and dimensions are required. If they're only missing because they
+    // aren't usable in this plan, ask for another one.
+    const int required = (1 << (RANDOM_EACH_N - RANDOM_EACH_N)) |
+                         (1 << (RANDOM_EACH_DIMENSIONS - RANDOM_EACH_N));
+
+    if ((idxNum & required) != required) {
+
+        if (unusable & required)
+            return SQLITE_CONSTRAINT;
+
+        sqlite3_free(tab->zErrMsg);
+        tab->zErrMsg = sqlite3_mprintf("vector_random_each() requires n and dimensions arguments");
+        return SQLITE_ERROR;
+    }
+
+    pIdxInfo->idxNum = idxNum;
     pIdxInfo->estimatedCost = (double)10;
     pIdxInfo->estimatedRows = 10;
     return SQLITE_OK;
 }
 
-static int fvecsEachFilter(sqlite3_vtab_cursor *pVtabCursor,
-                           int idxNum,
-                           const char *idxStr,
-                           int argc,
-                           sqlite3_value **argv) {
-
-    auto pCur = static_cast<fvecsEach_cursor *>(pVtabCursor);
-
-    int size = sqlite3_value_bytes(argv[0]);
-    const void *blob = sqlite3_value_blob(argv[0]);
+static int randomEachFilter(sqlite3_vtab_cursor *pVtabCursor,
+                            int idxNum,
+                            const char *idxStr,
+                            int argc,
+                            sqlite3_value **argv) {
 
-    if (pCur->pBlob)
-        sqlite3_free(pCur->pBlob);
+    auto pCur = static_cast<randomEach_cursor *>(pVtabCursor);
+    auto pVtab = pVtabCursor->pVtab;
 
-    pCur->pBlob = sqlite3_malloc(size);
-    pCur->iBlobN = size;
     pCur->iRowid = 1;
-    memcpy(pCur->pBlob, blob, size);
+    pCur->seed = 0;
+    pCur->distribution = uniform;
+    pCur->clusters = VECTOR_RANDOM_DEFAULT_CLUSTERS;
+    pCur->centroids.clear();
+
+    int arg = 0;
+    for (int bit = 0; bit <= RANDOM_EACH_CLUSTERS - RANDOM_EACH_N; bit++) {
+
+        if (!(idxNum & (1 << bit)))
+            continue;
+
+        auto value = argv[arg++];
+
+        switch (bit + RANDOM_EACH_N) {
+
+            case RANDOM_EACH_N:
+                pCur->n = sqlite3_value_int64(value);
+                break;
+
+            case RANDOM_EACH_DIMENSIONS:
+                pCur->dimensions = sqlite3_value_int64(value);
+                break;
+
+            case RANDOM_EACH_SEED:
+                pCur->seed = sqlite3_value_int64(value);
+                break;
+
+            case RANDOM_EACH_DISTRIBUTION: {
+
+                auto name = (const char *)sqlite3_value_text(value);
+                if (name == nullptr || sqlite3_stricmp(name, "uniform") == 0) {
+                    pCur->distribution = uniform;
+                } else if (sqlite3_stricmp(name, "gaussian") == 0) {
+                    pCur->distribution = gaussian;
+                } else if (sqlite3_stricmp(name, "clustered") == 0) {
+                    pCur->distribution = clustered;
+                } else {
+                    sqlite3_free(pVtab->zErrMsg);
+                    pVtab->zErrMsg = sqlite3_mprintf(
+                        "Unknown distribution '%s', expected uniform, gaussian or clustered", name);
+                    return SQLITE_ERROR;
+                }
+                break;
+            }
 
-    memcpy(&pCur->iCurrentD, pCur->pBlob, sizeof(int));
-    float *vecBegin = (float *)((char *)pCur->pBlob + sizeof(int));
+            case RANDOM_EACH_CLUSTERS:
+                pCur->clusters = sqlite3_value_int64(value);
+                break;
+        }
+    }
 
-    // TODO: Shouldn't this multiply by sizeof(float)?
-    pCur->pCurrentVector = vec_ptr(new vector<float>(vecBegin, vecBegin + pCur->iCurrentD));
+    if (pCur->dimensions < 1 || pCur->dimensions > VECTOR_RANDOM_MAX_DIMENSIONS) {
+        sqlite3_free(pVtab->zErrMsg);
+        pVtab->zErrMsg = sqlite3_mprintf("dimensions must be between 1 and 65536");
+        return SQLITE_ERROR;
+    }
 
-    pCur->p = sizeof(int) + (pCur->iCurrentD * sizeof(float));
+    if (pCur->n < 0)
+        pCur->n = 0;
 
-    return SQLITE_OK;
-}
+    if (pCur->distribution == clustered) {
 
-static int fvecsEachNext(sqlite3_vtab_cursor *cur) {
+        if (pCur->clusters < 1 || pCur->clusters * pCur->dimensions > 64 * 1024 * 1024) {
+            sqlite3_free(pVtab->zErrMsg);
+            pVtab->zErrMsg = sqlite3_mprintf("clusters must be at least 1, and clusters * dimensions at most 67108864");
+            return SQLITE_ERROR;
+        }
 
-    auto pCur = static_cast<fvecsEach_cursor *>(cur);
+        // Row 0 never exists, its generator is used for the centroids.
+        auto rng = vectorRandomForRow(pCur->seed, 0);
+        pCur->centroids.resize(pCur->clusters * pCur->dimensions);
+        for (auto &x : pCur->centroids)
+            x = rng.uniform();
+    }
 
-    // TODO: Shouldn't this multiply by sizeof(float)?
-    memcpy(&pCur->iCurrentD, ((char *)pCur->pBlob + pCur->p), sizeof(int));
-    float *vecBegin = (float *)(((char *)pCur->pBlob + pCur->p) + sizeof(int));
+    return SQLITE_OK;
+}
 
-    pCur->pCurrentVector->clear();
-    pCur->pCurrentVector->shrink_to_fit();
-    pCur->pCurrentVector->reserve(pCur->iCurrentD);
-    pCur->pCurrentVector->insert(pCur->pCurrentVector->begin(),
-                                 vecBegin,
-                                 vecBegin + pCur->iCurrentD);
+static int randomEachNext(sqlite3_vtab_cursor *cur) {
 
-    pCur->p += (sizeof(int) + (pCur->iCurrentD * sizeof(float)));
+    auto pCur = static_cast<randomEach_cursor *>(cur);
     pCur->iRowid++;
     return SQLITE_OK;
 }
 
-static int fvecsEachEof(sqlite3_vtab_cursor *cur) {
+static int randomEachEof(sqlite3_vtab_cursor *cur) {
 
-    auto pCur = (fvecsEach_cursor *)cur;
-    return pCur->p > pCur->iBlobN;
+    auto pCur = static_cast<randomEach_cursor *>(cur);
+    return pCur->iRowid > pCur->n;
 }
 
-static int fvecsEachRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+static int randomEachRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
 
-    fvecsEach_cursor *pCur = (fvecsEach_cursor *)cur;
+    auto pCur = static_cast<randomEach_cursor *>(cur);
     *pRowid = pCur->iRowid;
     return SQLITE_OK;
 }
 
-static int fvecsEachColumn(sqlite3_vtab_cursor *cur,
-                           sqlite3_context *context,
-                           int i) {
+static int randomEachColumn(sqlite3_vtab_cursor *cur,
+                            sqlite3_context *context,
+                            int i) {
 
-    auto pCur = static_cast<fvecsEach_cursor *>(cur);
+    auto pCur = static_cast<randomEach_cursor *>(cur);
 
     switch (i) {
 
-        case FVECS_EACH_DIMENSIONS:
-            sqlite3_result_int(context, pCur->iCurrentD);
+        case RANDOM_EACH_VECTOR: {
+
+            auto vec = newVectorFloat(pCur->dimensions);
+            if (vec == nullptr)
+                return SQLITE_NOMEM;
+
+            auto rng = vectorRandomForRow(pCur->seed, pCur->iRowid);
+            auto d = pCur->dimensions;
+
+            switch (pCur->distribution) {
+
+                case uniform:
+                    for (sqlite3_int64 j = 0; j < d; j++)
+                        vec->data[j] = rng.uniform();
+                    break;
+
+                case gaussian:
+                    for (sqlite3_int64 j = 0; j < d; j++)
+                        vec->data[j] = rng.gaussian();
+                    break;
+
+                case clustered: {
+                    auto centroid = &pCur->centroids[(rng.next() % pCur->clusters) * d];
+                    for (sqlite3_int64 j = 0; j < d; j++)
+                        vec->data[j] = centroid[j] + VECTOR_RANDOM_CLUSTER_SIGMA * rng.gaussian();
+                    break;
+                }
+            }
+
+            sqlite3_result_pointer(context, vec, VECTOR_FLOAT_POINTER_NAME, delVectorFloat);
             break;
+        }
 
-        case FVECS_EACH_VECTOR:
-            resultVector(context, pCur->pCurrentVector.get());
+        case RANDOM_EACH_CLUSTER:
+            if (pCur->distribution == clustered) {
+                auto rng = vectorRandomForRow(pCur->seed, pCur->iRowid);
+                sqlite3_result_int64(context, rng.next() % pCur->clusters);
+            }
             break;
 
-        case FVECS_EACH_INPUT:
-            sqlite3_result_null(context);
+        case RANDOM_EACH_N:
+            sqlite3_result_int64(context, pCur->n);
+            break;
+
+        case RANDOM_EACH_DIMENSIONS:
+            sqlite3_result_int64(context, pCur->dimensions);
+            break;
+
+        case RANDOM_EACH_SEED:
+            sqlite3_result_int64(context, pCur->seed);
+            break;
+
+        case RANDOM_EACH_DISTRIBUTION: {
+            static const char *names[] = {"uniform", "gaussian", "clustered"};
+            sqlite3_result_text(context, names[pCur->distribution], -1, SQLITE_STATIC);
+            break;
+        }
+
+        case RANDOM_EACH_CLUSTERS:
+            if (pCur->distribution == clustered)
+                sqlite3_result_int64(context, pCur->clusters);
             break;
     }
     return SQLITE_OK;
 }
 
-/*
- * This following structure defines all the methods for the
- * virtual table.
- */
-static sqlite3_module fvecsEachModule = {
+static sqlite3_module randomEachModule = {
     /* iVersion    */ 0,
-    /* xCreate     */ fvecsEachConnect,
-    /* xConnect    */ fvecsEachConnect,
-    /* xBestIndex  */ fvecsEachBestIndex,
-    /* xDisconnect */ fvecsEachDisconnect,
+    /* xCreate     */ 0,
+    /* xConnect    */ randomEachConnect,
+    /* xBestIndex  */ randomEachBestIndex,
+    /* xDisconnect */ randomEachDisconnect,
+    /* xDestroy    */ 0,
+    /* xOpen       */ randomEachOpen,
+    /* xClose      */ randomEachClose,
+    /* xFilter     */ randomEachFilter,
+    /* xNext       */ randomEachNext,
+    /* xEof        */ randomEachEof,
+    /* xColumn     */ randomEachColumn,
+    /* xRowid      */ randomEachRowid,
+    /* xUpdate     */ 0,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ 0,
+    /* xRename     */ 0,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ 0};
+
+#pragma endregion
+
+#pragma region fvecs vtab
+
+struct fvecsEach_vtab : public sqlite3_vtab {
+  
+    fvecsEach_vtab() {
+
+      pModule = nullptr;
+      nRef = 0;
+      zErrMsg = nullptr;
+    }
+
+    ~fvecsEach_vtab() {
+
+        if (zErrMsg != nullptr) {
+            sqlite3_free(zErrMsg);
+        }
+    }
+};
+
+struct fvecsEach_cursor : public sqlite3_vtab_cursor {
+
+    fvecsEach_cursor(sqlite3_vtab *pVtab) {
+      
+      this->pVtab = pVtab;
+      iRowid = 0;
+      pBlob = nullptr;
+      iBlobN = 0;
+      p = 0;
+      iCurrentD = 0;
+    }
+
+    ~fvecsEach_cursor() {
+        if (pBlob != nullptr)
+            sqlite3_free(pBlob);
+    }
+
+    sqlite3_int64 iRowid;
+
+    // Copy of fvecs input blob
+    void *pBlob;
+
+    // Total size of pBlob in bytes
+    sqlite3_int64 iBlobN;
+    sqlite3_int64 p;
+
+    // Current dimensions
+    int iCurrentD;
+
+    // Pointer to current vector being read in
+    vec_ptr pCurrentVector;
+};
+
+static int fvecsEachConnect(sqlite3 *db,
+                            void *pAux,
+                            int argc,
+                            const char *const *argv,
+                            sqlite3_vtab **ppVtab,
+                            char **pzErr) {
+
+    int rc;
+
+    rc = sqlite3_declare_vtab(db, "create table x(dimensions, vector, input hidden)");
+
+#define FVECS_EACH_DIMENSIONS 0
+#define FVECS_EACH_VECTOR 1
+#define FVECS_EACH_INPUT 2
+
+    if (rc == SQLITE_OK) {
+
+        auto pNew = new fvecsEach_vtab();
+        if (pNew == 0)
+            return SQLITE_NOMEM;
+
+        *ppVtab = pNew;
+    }
+    return rc;
+}
+
+static int fvecsEachDisconnect(sqlite3_vtab *pVtab) {
+
+    auto pTable = static_cast<fvecsEach_vtab *>(pVtab);
+    delete pTable;
+    return SQLITE_OK;
+}
+
+static int fvecsEachOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
+
+    auto pCur = new fvecsEach_cursor(p);
+    if (pCur == nullptr)
+        return SQLITE_NOMEM;
+
+    *ppCursor = pCur;
+    return SQLITE_OK;
+}
+
+static int fvecsEachClose(sqlite3_vtab_cursor *cur) {
+
+    auto pCur = static_cast<fvecsEach_cursor *>(cur);
+    delete pCur;
+    return SQLITE_OK;
+}
+
+static int fvecsEachBestIndex(sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo) {
+
+    for (int i = 0; i < pIdxInfo->nConstraint; i++) {
+
+        auto pCons = pIdxInfo->aConstraint[i];
+
+        switch (pCons.iColumn) {
+
+            case FVECS_EACH_INPUT:
+                if (pCons.op == SQLITE_INDEX_CONSTRAINT_EQ && pCons.usable) {
+
+                    pIdxInfo->aConstraintUsage[i].argvIndex = 1;
+                    pIdxInfo->aConstraintUsage[i].omit = 1;
+                }
+            break;
+        }
+    }
+
+    pIdxInfo->estimatedCost = (double)10;
+    pIdxInfo->estimatedRows = 10;
+    return SQLITE_OK;
+}
+
+// Reads the vector starting at pCur->p into pCurrentVector, and moves p past
+// it. Past the last (or a truncated) record, p is set beyond the end of the
+// blob, which xEof reports.
+static void fvecsEachRead(fvecsEach_cursor *pCur) {
+
+    if (pCur->p + (sqlite3_int64)sizeof(int) > pCur->iBlobN) {
+        pCur->p = pCur->iBlobN + 1;
+        return;
+    }
+
+    memcpy(&pCur->iCurrentD, ((char *)pCur->pBlob + pCur->p), sizeof(int));
+    auto end = pCur->p + (sqlite3_int64)sizeof(int) + (sqlite3_int64)pCur->iCurrentD * sizeof(float);
+
+    if (pCur->iCurrentD < 0 || end > pCur->iBlobN) {
+        pCur->p = pCur->iBlobN + 1;
+        return;
+    }
+
+    float *vecBegin = (float *)(((char *)pCur->pBlob + pCur->p) + sizeof(int));
+
+    // Rows usually all have the same dimensions, so assign() reuses the
+    // vector's storage instead of reallocating it for every row.
+    pCur->pCurrentVector->assign(vecBegin, vecBegin + pCur->iCurrentD);
+    pCur->p = end;
+}
+
+static int fvecsEachFilter(sqlite3_vtab_cursor *pVtabCursor,
+                           int idxNum,
+                           const char *idxStr,
+                           int argc,
+                           sqlite3_value **argv) {
+
+    auto pCur = static_cast<fvecsEach_cursor *>(pVtabCursor);
+
+    int size = sqlite3_value_bytes(argv[0]);
+    const void *blob = sqlite3_value_blob(argv[0]);
+
+    if (pCur->pBlob)
+        sqlite3_free(pCur->pBlob);
+
+    pCur->pBlob = sqlite3_malloc(size);
+    if (size > 0 && pCur->pBlob == nullptr)
+        return SQLITE_NOMEM;
+
+    pCur->iBlobN = size;
+    pCur->iRowid = 1;
+    if (size > 0)
+        memcpy(pCur->pBlob, blob, size);
+
+    pCur->pCurrentVector = vec_ptr(new vector<float>());
+    pCur->p = 0;
+    fvecsEachRead(pCur);
+
+    return SQLITE_OK;
+}
+
+static int fvecsEachNext(sqlite3_vtab_cursor *cur) {
+
+    auto pCur = static_cast<fvecsEach_cursor *>(cur);
+
+    fvecsEachRead(pCur);
+    pCur->iRowid++;
+    return SQLITE_OK;
+}
+
+static int fvecsEachEof(sqlite3_vtab_cursor *cur) {
+
+    auto pCur = (fvecsEach_cursor *)cur;
+    return pCur->p > pCur->iBlobN;
+}
+
+static int fvecsEachRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+
+    fvecsEach_cursor *pCur = (fvecsEach_cursor *)cur;
+    *pRowid = pCur->iRowid;
+    return SQLITE_OK;
+}
+
+static int fvecsEachColumn(sqlite3_vtab_cursor *cur,
+                           sqlite3_context *context,
+                           int i) {
+
+    auto pCur = static_cast<fvecsEach_cursor *>(cur);
+
+    switch (i) {
+
+        case FVECS_EACH_DIMENSIONS:
+            sqlite3_result_int(context, pCur->iCurrentD);
+            break;
+
+        case FVECS_EACH_VECTOR:
+            resultVector(context, pCur->pCurrentVector.get());
+            break;
+
+        case FVECS_EACH_INPUT:
+            sqlite3_result_null(context);
+            break;
+    }
+    return SQLITE_OK;
+}
+
+/*
+ * This following structure defines all the methods for the
+ * virtual table.
+ */
+static sqlite3_module fvecsEachModule = {
+    /* iVersion    */ 0,
+    /* xCreate     */ fvecsEachConnect,
+    /* xConnect    */ fvecsEachConnect,
+    /* xBestIndex  */ fvecsEachBestIndex,
+    /* xDisconnect */ fvecsEachDisconnect,
     /* xDestroy    */ 0,
     /* xOpen       */ fvecsEachOpen,
     /* xClose      */ fvecsEachClose,
@@ -598,6 +1223,926 @@ static sqlite3_module fvecsEachModule = {
 
 #pragma endregion
 
+#pragma region vecs file vtab
+
+// A read-only memory mapping of a .fvecs, .bvecs or .ivecs file. Shared with
+// every vector handed out of it, so it stays mapped as long as one of them is
+// still alive.
+struct VecsFile {
+
+    ~VecsFile() {
+
+#ifdef _WIN32
+        if (data != nullptr)
+            UnmapViewOfFile(data);
+        if (mapping != nullptr)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+#else
+        if (data != nullptr)
+            munmap((void *)data, size);
+#endif
+    }
+
+    // Maps the file at path, or returns nullptr with an error message.
+    static shared_ptr<VecsFile> open(const char *path, string &error) {
+
+        auto file = shared_ptr<VecsFile>(new VecsFile());
+
+#ifdef _WIN32
+        file->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr,
+                                 OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file->file == INVALID_HANDLE_VALUE) {
+            error = "could not open file";
+            return nullptr;
+        }
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file->file, &size)) {
+            error = "could not read file size";
+            return nullptr;
+        }
+        file->size = size.QuadPart;
+
+        if (file->size > 0) {
+
+            file->mapping = CreateFileMappingA(file->file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (file->mapping == nullptr) {
+                error = "could not map file";
+                return nullptr;
+            }
+
+            file->data = (const char *)MapViewOfFile(file->mapping, FILE_MAP_READ, 0, 0, 0);
+            if (file->data == nullptr) {
+                error = "could not map file";
+                return nullptr;
+            }
+        }
+#else
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            error = strerror(errno);
+            return nullptr;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            error = strerror(errno);
+            close(fd);
+            return nullptr;
+        }
+        file->size = st.st_size;
+
+        if (file->size > 0) {
+
+            void *data = mmap(nullptr, file->size, PROT_READ, MAP_SHARED, fd, 0);
+            if (data == MAP_FAILED) {
+                error = strerror(errno);
+                close(fd);
+                return nullptr;
+            }
+
+            // Rows are read front to back, let the kernel read ahead.
+            madvise(data, file->size, MADV_SEQUENTIAL);
+            file->data = (const char *)data;
+        }
+
+        // The mapping stays valid after the descriptor is closed.
+        close(fd);
+#endif
+
+        return file;
+    }
+
+    const char *data = nullptr;
+    sqlite3_int64 size = 0;
+
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+
+  private:
+    VecsFile() {}
+};
+
+// A vectorf32v0 pointer whose data lives in a mapped .fvecs file rather than
+// in memory from sqlite3_malloc.
+struct MappedVectorFloat : VectorFloat {
+
+    shared_ptr<VecsFile> file;
+};
+
+void delMappedVectorFloat(void *p) {
+
+    auto vx = static_cast<MappedVectorFloat *>(p);
+    delete vx;
+}
+
+enum VecsFormat { fvecs, bvecs, ivecs };
+
+static const char *vecs_format_names[] = {"fvecs", "bvecs", "ivecs"};
+
+// Size in bytes of a single component, for each VecsFormat.
+static const sqlite3_int64 vecs_component_size[] = {4, 1, 4};
+
+static bool vecsFormatFromName(const char *name, VecsFormat *format) {
+
+    for (int i = 0; i < 3; i++) {
+        if (sqlite3_stricmp(name, vecs_format_names[i]) == 0) {
+            *format = (VecsFormat)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+struct vecsEach_vtab : public sqlite3_vtab {
+
+    vecsEach_vtab() {
+
+        pModule = nullptr;
+        nRef = 0;
+        zErrMsg = nullptr;
+    }
+
+    ~vecsEach_vtab() {
+
+        if (zErrMsg != nullptr)
+            sqlite3_free(zErrMsg);
+    }
+};
+
+struct vecsEach_cursor : public sqlite3_vtab_cursor {
+
+    explicit vecsEach_cursor(sqlite3_vtab *pVtab) {
+
+        this->pVtab = pVtab;
+    }
+
+    shared_ptr<VecsFile> file;
+    string path;
+    VecsFormat format = fvecs;
+
+    sqlite3_int64 iRowid = 0;
+
+    // Offset of the current record in the file, and its dimensions.
+    sqlite3_int64 offset = 0;
+    int dimensions = 0;
+    bool eof = true;
+};
+
+#define VECS_EACH_DIMENSIONS 0
+#define VECS_EACH_VECTOR 1
+#define VECS_EACH_PATH 2
+#define VECS_EACH_FORMAT 3
+
+static int vecsEachConnect(sqlite3 *db,
+                           void *pAux,
+                           int argc,
+                           const char *const *argv,
+                           sqlite3_vtab **ppVtab,
+                           char **pzErr) {
+
+    int rc = sqlite3_declare_vtab(db, "create table x(dimensions, vector, path hidden, format hidden)");
+
+    // Reads arbitrary files, so it must not be usable from a schema (views,
+    // triggers) an attacker could have written.
+    if (rc == SQLITE_OK)
+        rc = sqlite3_vtab_config(db, SQLITE_VTAB_DIRECTONLY);
+
+    if (rc == SQLITE_OK) {
+
+        auto pNew = new vecsEach_vtab();
+        if (pNew == 0)
+            return SQLITE_NOMEM;
+
+        *ppVtab = pNew;
+    }
+    return rc;
+}
+
+static int vecsEachDisconnect(sqlite3_vtab *pVtab) {
+
+    auto pTable = static_cast<vecsEach_vtab *>(pVtab);
+    delete pTable;
+    return SQLITE_OK;
+}
+
+static int vecsEachOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
+
+    auto pCur = new vecsEach_cursor(p);
+    if (pCur == nullptr)
+        return SQLITE_NOMEM;
+
+    *ppCursor = pCur;
+    return SQLITE_OK;
+}
+
+static int vecsEachClose(sqlite3_vtab_cursor *cur) {
+
+    auto pCur = static_cast<vecsEach_cursor *>(cur);
+    delete pCur;
+    return SQLITE_OK;
+}
+
+// idxNum is 1 when only the path is given, 2 when the format is as well.
+static int vecsEachBestIndex(sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo) {
+
+    int pathConstraint = -1;
+    int formatConstraint = -1;
+    bool pathUnusable = false;
+
+    for (int i = 0; i < pIdxInfo->nConstraint; i++) {
+
+        auto pCons = pIdxInfo->aConstraint[i];
+        if (pCons.op != SQLITE_INDEX_CONSTRAINT_EQ)
+            continue;
+
+        switch (pCons.iColumn) {
+
+            case VECS_EACH_PATH:
+                if (pCons.usable)
+                    pathConstraint = i;
+                else
+                    pathUnusable = true;
+                break;
+
+            case VECS_EACH_FORMAT:
+                if (pCons.usable)
+                    formatConstraint = i;
+                break;
+        }
+    }
+
+    if (pathConstraint < 0) {
+
+        if (pathUnusable)
+            return SQLITE_CONSTRAINT;
+
+        sqlite3_free(tab->zErrMsg);
+        tab->zErrMsg = sqlite3_mprintf("vector_vecs_each() requires a path argument");
+        return SQLITE_ERROR;
+    }
+
+    pIdxInfo->aConstraintUsage[pathConstraint].argvIndex = 1;
+    pIdxInfo->aConstraintUsage[pathConstraint].omit = 1;
+    pIdxInfo->idxNum = 1;
+
+    if (formatConstraint >= 0) {
+        pIdxInfo->aConstraintUsage[formatConstraint].argvIndex = 2;
+        pIdxInfo->aConstraintUsage[formatConstraint].omit = 1;
+        pIdxInfo->idxNum = 2;
+    }
+
+    pIdxInfo->estimatedCost = (double)1000000;
+    pIdxInfo->estimatedRows = 1000000;
+    return SQLITE_OK;
+}
+
+// Validates the record at pCur->offset and reads its dimensions, or sets eof
+// at the end of the file.
+static int vecsEachRead(vecsEach_cursor *pCur) {
+
+    auto file = pCur->file.get();
+
+    if (pCur->offset == file->size) {
+        pCur->eof = true;
+        return SQLITE_OK;
+    }
+
+    auto pVtab = pCur->pVtab;
+    sqlite3_int64 end = pCur->offset + sizeof(int);
+
+    if (end <= file->size) {
+        memcpy(&pCur->dimensions, file->data + pCur->offset, sizeof(int));
+        end += pCur->dimensions * vecs_component_size[pCur->format];
+    }
+
+    if (end > file->size || pCur->dimensions < 0) {
+        sqlite3_free(pVtab->zErrMsg);
+        pVtab->zErrMsg = sqlite3_mprintf("%s is not a valid %s file: record %lld is truncated",
+                                         pCur->path.c_str(),
+                                         vecs_format_names[pCur->format],
+                                         pCur->iRowid);
+        return SQLITE_ERROR;
+    }
+
+    pCur->eof = false;
+    return SQLITE_OK;
+}
+
+static int vecsEachFilter(sqlite3_vtab_cursor *pVtabCursor,
+                          int idxNum,
+                          const char *idxStr,
+                          int argc,
+                          sqlite3_value **argv) {
+
+    auto pCur = static_cast<vecsEach_cursor *>(pVtabCursor);
+    auto pVtab = pVtabCursor->pVtab;
+
+    pCur->file = nullptr;
+    pCur->eof = true;
+
+    auto path = (const char *)sqlite3_value_text(argv[0]);
+    if (path == nullptr) {
+        sqlite3_free(pVtab->zErrMsg);
+        pVtab->zErrMsg = sqlite3_mprintf("vector_vecs_each() path must be text");
+        return SQLITE_ERROR;
+    }
+    pCur->path = path;
+
+    // Without an explicit format, go by the file extension.
+    const char *format = argc > 1 ? (const char *)sqlite3_value_text(argv[1]) : nullptr;
+    if (format == nullptr) {
+        auto dot = strrchr(path, '.');
+        format = dot != nullptr ? dot + 1 : "";
+    }
+
+    if (!vecsFormatFromName(format, &pCur->format)) {
+        sqlite3_free(pVtab->zErrMsg);
+        pVtab->zErrMsg = sqlite3_mprintf(
+            "Unknown format '%s', expected fvecs, bvecs or ivecs", format);
+        return SQLITE_ERROR;
+    }
+
+    string error;
+    pCur->file = VecsFile::open(path, error);
+    if (pCur->file == nullptr) {
+        sqlite3_free(pVtab->zErrMsg);
+        pVtab->zErrMsg = sqlite3_mprintf("Could not open %s: %s", path, error.c_str());
+        return SQLITE_ERROR;
+    }
+
+    pCur->iRowid = 1;
+    pCur->offset = 0;
+    return vecsEachRead(pCur);
+}
+
+static int vecsEachNext(sqlite3_vtab_cursor *cur) {
+
+    auto pCur = static_cast<vecsEach_cursor *>(cur);
+
+    pCur->offset += sizeof(int) + pCur->dimensions * vecs_component_size[pCur->format];
+    pCur->iRowid++;
+    return vecsEachRead(pCur);
+}
+
+static int vecsEachEof(sqlite3_vtab_cursor *cur) {
+
+    auto pCur = static_cast<vecsEach_cursor *>(cur);
+    return pCur->eof;
+}
+
+static int vecsEachRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+
+    auto pCur = static_cast<vecsEach_cursor *>(cur);
+    *pRowid = pCur->iRowid;
+    return SQLITE_OK;
+}
+
+static int vecsEachColumn(sqlite3_vtab_cursor *cur,
+                          sqlite3_context *context,
+                          int i) {
+
+    auto pCur = static_cast<vecsEach_cursor *>(cur);
+    auto record = pCur->file->data + pCur->offset + sizeof(int);
+
+    switch (i) {
+
+        case VECS_EACH_DIMENSIONS:
+            sqlite3_result_int(context, pCur->dimensions);
+            break;
+
+        case VECS_EACH_VECTOR: {
+
+            // fvecs records are already 4-byte aligned floats, so they're
+            // handed out straight from the mapping.
+            if (pCur->format == fvecs) {
+
+                auto vec = new MappedVectorFloat();
+                vec->size = pCur->dimensions;
+                vec->data = (float *)record;
+                vec->file = pCur->file;
+                sqlite3_result_pointer(context, vec, VECTOR_FLOAT_POINTER_NAME, delMappedVectorFloat);
+                break;
+            }
+
+            auto vec = newVectorFloat(pCur->dimensions);
+            if (vec == nullptr)
+                return SQLITE_NOMEM;
+
+            if (pCur->format == bvecs) {
+
+                auto components = (const uint8_t *)record;
+                for (int j = 0; j < pCur->dimensions; j++)
+                    vec->data[j] = components[j];
+
+            } else {
+
+                for (int j = 0; j < pCur->dimensions; j++) {
+                    int32_t component;
+                    memcpy(&component, record + j * sizeof(int32_t), sizeof(int32_t));
+                    vec->data[j] = (float)component;
+                }
+            }
+
+            sqlite3_result_pointer(context, vec, VECTOR_FLOAT_POINTER_NAME, delVectorFloat);
+            break;
+        }
+
+        case VECS_EACH_PATH:
+            sqlite3_result_text(context, pCur->path.c_str(), -1, SQLITE_TRANSIENT);
+            break;
+
+        case VECS_EACH_FORMAT:
+            sqlite3_result_text(context, vecs_format_names[pCur->format], -1, SQLITE_STATIC);
+            break;
+    }
+    return SQLITE_OK;
+}
+
+static sqlite3_module vecsEachModule = {
+    /* iVersion    */ 0,
+    /* xCreate     */ 0,
+    /* xConnect    */ vecsEachConnect,
+    /* xBestIndex  */ vecsEachBestIndex,
+    /* xDisconnect */ vecsEachDisconnect,
+    /* xDestroy    */ 0,
+    /* xOpen       */ vecsEachOpen,
+    /* xClose      */ vecsEachClose,
+    /* xFilter     */ vecsEachFilter,
+    /* xNext       */ vecsEachNext,
+    /* xEof        */ vecsEachEof,
+    /* xColumn     */ vecsEachColumn,
+    /* xRowid      */ vecsEachRowid,
+    /* xUpdate     */ 0,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ 0,
+    /* xRename     */ 0,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ 0};
+
+#pragma endregion
+
+#pragma region Matrix
+
+/*
+Matrix blobs hold many vectors of the same dimensions in one contiguous
+buffer, so a whole numpy or Arrow array can be handed over with one copy.
+Integers are in native byte order, like in .fvecs files.
+
+|Offset | Size          | Description
+|-|-|-
+|0      | 1             | 'm'
+|1      | 1             | Element type, 1 for float32
+|2      | 2             | Reserved, 0
+|4      | 4             | Dimensions, int32
+|8      | 8             | Rows, int64
+|16     | rows * d * 4  | Row-major float32 values
+*/
+
+char VECTOR_MATRIX_HEADER_BYTE = 'm';
+const sqlite3_int64 VECTOR_MATRIX_HEADER_SIZE = 16;
+
+// Returns a pointer to the first value of a matrix blob, inside the value's
+// own storage, so it isn't necessarily aligned for floats.
+static const void *valueAsMatrix(sqlite3_value *value,
+                                 int64_t *rows,
+                                 int64_t *dimensions,
+                                 const char **pzErrMsg) {
+
+    if (sqlite3_value_type(value) != SQLITE_BLOB) {
+        *pzErrMsg = "Matrix must be a blob";
+        return nullptr;
+    }
+
+    sqlite3_int64 size = sqlite3_value_bytes(value);
+    auto pBlob = (const char *)sqlite3_value_blob(value);
+
+    if (size < VECTOR_MATRIX_HEADER_SIZE) {
+        *pzErrMsg = "Matrix blob size less than header length";
+        return nullptr;
+    }
+
+    if (pBlob[0] != VECTOR_MATRIX_HEADER_BYTE) {
+        *pzErrMsg = "Blob not well-formatted matrix blob";
+        return nullptr;
+    }
+
+    if (pBlob[1] != VECTOR_BLOB_HEADER_TYPE) {
+        *pzErrMsg = "Matrix blob type not right";
+        return nullptr;
+    }
+
+    int32_t d;
+    int64_t n;
+    memcpy(&d, pBlob + 4, sizeof(d));
+    memcpy(&n, pBlob + 8, sizeof(n));
+
+    auto dataSize = size - VECTOR_MATRIX_HEADER_SIZE;
+    bool fits = d > 0 ? n >= 0 && n <= dataSize / ((sqlite3_int64)d * (sqlite3_int64)sizeof(float))
+                      : d == 0 && n >= 0;
+
+    if (!fits || n * d * (sqlite3_int64)sizeof(float) != dataSize) {
+        *pzErrMsg = "Matrix blob size doesn't match its header";
+        return nullptr;
+    }
+
+    *rows = n;
+    *dimensions = d;
+    return pBlob + VECTOR_MATRIX_HEADER_SIZE;
+}
+
+// State of a vector_matrix() aggregate, allocated by the first row.
+struct VectorMatrixBuilder {
+
+    int64_t dimensions = -1;
+    int64_t rows = 0;
+    vector<float> data;
+};
+
+static void vector_matrix_step(sqlite3_context *context,
+                               int argc,
+                               sqlite3_value **argv) {
+
+    auto ppBuilder = (VectorMatrixBuilder **)sqlite3_aggregate_context(context, sizeof(VectorMatrixBuilder *));
+    if (ppBuilder == nullptr) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+
+    vec_ptr pVec = valueAsVector(argv[0]);
+    if (pVec == nullptr) {
+
+        // Vector pointers are NULL to SQL, so this is checked second.
+        if (sqlite3_value_type(argv[0]) == SQLITE_NULL)
+            return;
+
+        sqlite3_result_error(context, "vector_matrix() value is not a vector", -1);
+        return;
+    }
+
+    if (*ppBuilder == nullptr)
+        *ppBuilder = new VectorMatrixBuilder();
+
+    auto builder = *ppBuilder;
+
+    if (builder->dimensions < 0) {
+        builder->dimensions = pVec->size();
+    } else if (builder->dimensions != (int64_t)pVec->size()) {
+
+        auto zErrMsg = sqlite3_mprintf("vector_matrix() vectors must all have %lld dimensions, got one with %lld",
+                                       (sqlite3_int64)builder->dimensions,
+                                       (sqlite3_int64)pVec->size());
+        sqlite3_result_error(context, zErrMsg, -1);
+        sqlite3_free(zErrMsg);
+        return;
+    }
+
+    builder->data.insert(builder->data.end(), pVec->begin(), pVec->end());
+    builder->rows++;
+}
+
+static void resultMatrix(sqlite3_context *context, const float *data, int64_t rows, int64_t dimensions) {
+
+    int32_t d = (int32_t)dimensions;
+    int64_t n = rows;
+
+    sqlite3_int64 dataSize = n * d * sizeof(float);
+    auto pBlob = (char *)sqlite3_malloc64(VECTOR_MATRIX_HEADER_SIZE + dataSize);
+    if (pBlob == nullptr) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+
+    memset(pBlob, 0, VECTOR_MATRIX_HEADER_SIZE);
+    pBlob[0] = VECTOR_MATRIX_HEADER_BYTE;
+    pBlob[1] = VECTOR_BLOB_HEADER_TYPE;
+    memcpy(pBlob + 4, &d, sizeof(d));
+    memcpy(pBlob + 8, &n, sizeof(n));
+    if (dataSize > 0)
+        memcpy(pBlob + VECTOR_MATRIX_HEADER_SIZE, data, dataSize);
+
+    sqlite3_result_blob64(context, pBlob, VECTOR_MATRIX_HEADER_SIZE + dataSize, sqlite3_free);
+}
+
+static void vector_matrix_final(sqlite3_context *context) {
+
+    auto ppBuilder = (VectorMatrixBuilder **)sqlite3_aggregate_context(context, 0);
+    unique_ptr<VectorMatrixBuilder> builder(ppBuilder != nullptr ? *ppBuilder : nullptr);
+
+    // No rows (or only NULLs) still make a valid, empty matrix.
+    if (builder == nullptr)
+        resultMatrix(context, nullptr, 0, 0);
+    else
+        resultMatrix(context, builder->data.data(), builder->rows, builder->dimensions);
+}
+
+struct matrixEach_vtab : public sqlite3_vtab {
+
+    matrixEach_vtab() {
+
+        pModule = nullptr;
+        nRef = 0;
+        zErrMsg = nullptr;
+    }
+
+    ~matrixEach_vtab() {
+
+        if (zErrMsg != nullptr)
+            sqlite3_free(zErrMsg);
+    }
+};
+
+struct matrixEach_cursor : public sqlite3_vtab_cursor {
+
+    explicit matrixEach_cursor(sqlite3_vtab *pVtab) {
+
+        this->pVtab = pVtab;
+    }
+
+    // Copy of the matrix values, the argument doesn't outlive xFilter.
+    vector<float> data;
+    int64_t rows = 0;
+    int64_t dimensions = 0;
+
+    sqlite3_int64 iRowid = 0;
+};
+
+#define MATRIX_EACH_VECTOR 0
+#define MATRIX_EACH_MATRIX 1
+
+static int matrixEachConnect(sqlite3 *db,
+                             void *pAux,
+                             int argc,
+                             const char *const *argv,
+                             sqlite3_vtab **ppVtab,
+                             char **pzErr) {
+
+    int rc = sqlite3_declare_vtab(db, "create table x(vector, matrix hidden)");
+
+    if (rc == SQLITE_OK) {
+
+        auto pNew = new matrixEach_vtab();
+        if (pNew == 0)
+            return SQLITE_NOMEM;
+
+        *ppVtab = pNew;
+    }
+    return rc;
+}
+
+static int matrixEachDisconnect(sqlite3_vtab *pVtab) {
+
+    auto pTable = static_cast<matrixEach_vtab *>(pVtab);
+    delete pTable;
+    return SQLITE_OK;
+}
+
+static int matrixEachOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
+
+    auto pCur = new matrixEach_cursor(p);
+    if (pCur == nullptr)
+        return SQLITE_NOMEM;
+
+    *ppCursor = pCur;
+    return SQLITE_OK;
+}
+
+static int matrixEachClose(sqlite3_vtab_cursor *cur) {
+
+    auto pCur = static_cast<matrixEach_cursor *>(cur);
+    delete pCur;
+    return SQLITE_OK;
+}
+
+static int matrixEachBestIndex(sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo) {
+
+    int matrixConstraint = -1;
+    bool matrixUnusable = false;
+
+    for (int i = 0; i < pIdxInfo->nConstraint; i++) {
+
+        auto pCons = pIdxInfo->aConstraint[i];
+        if (pCons.op != SQLITE_INDEX_CONSTRAINT_EQ || pCons.iColumn != MATRIX_EACH_MATRIX)
+            continue;
+
+        if (pCons.usable)
+            matrixConstraint = i;
+        else
+            matrixUnusable = true;
+    }
+
+    if (matrixConstraint < 0) {
+
+        if (matrixUnusable)
+            return SQLITE_CONSTRAINT;
+
+        sqlite3_free(tab->zErrMsg);
+        tab->zErrMsg = sqlite3_mprintf("vector_matrix_each() requires a matrix argument");
+        return SQLITE_ERROR;
+    }
+
+    pIdxInfo->aConstraintUsage[matrixConstraint].argvIndex = 1;
+    pIdxInfo->aConstraintUsage[matrixConstraint].omit = 1;
+    pIdxInfo->estimatedCost = (double)1000;
+    pIdxInfo->estimatedRows = 1000;
+    return SQLITE_OK;
+}
+
+static int matrixEachFilter(sqlite3_vtab_cursor *pVtabCursor,
+                            int idxNum,
+                            const char *idxStr,
+                            int argc,
+                            sqlite3_value **argv) {
+
+    auto pCur = static_cast<matrixEach_cursor *>(pVtabCursor);
+    auto pVtab = pVtabCursor->pVtab;
+
+    const char *pzErrMsg = nullptr;
+    auto values = valueAsMatrix(argv[0], &pCur->rows, &pCur->dimensions, &pzErrMsg);
+    if (values == nullptr) {
+        pCur->rows = 0;
+        sqlite3_free(pVtab->zErrMsg);
+        pVtab->zErrMsg = sqlite3_mprintf("%s", pzErrMsg);
+        return SQLITE_ERROR;
+    }
+
+    pCur->data.resize(pCur->rows * pCur->dimensions);
+    if (!pCur->data.empty())
+        memcpy(pCur->data.data(), values, pCur->data.size() * sizeof(float));
+
+    pCur->iRowid = 1;
+    return SQLITE_OK;
+}
+
+static int matrixEachNext(sqlite3_vtab_cursor *cur) {
+
+    auto pCur = static_cast<matrixEach_cursor *>(cur);
+    pCur->iRowid++;
+    return SQLITE_OK;
+}
+
+static int matrixEachEof(sqlite3_vtab_cursor *cur) {
+
+    auto pCur = static_cast<matrixEach_cursor *>(cur);
+    return pCur->iRowid > pCur->rows;
+}
+
+static int matrixEachRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+
+    auto pCur = static_cast<matrixEach_cursor *>(cur);
+    *pRowid = pCur->iRowid;
+    return SQLITE_OK;
+}
+
+static int matrixEachColumn(sqlite3_vtab_cursor *cur,
+                            sqlite3_context *context,
+                            int i) {
+
+    auto pCur = static_cast<matrixEach_cursor *>(cur);
+
+    switch (i) {
+
+        case MATRIX_EACH_VECTOR: {
+
+            auto vec = newVectorFloat(pCur->dimensions);
+            if (vec == nullptr)
+                return SQLITE_NOMEM;
+
+            auto row = pCur->data.data() + (pCur->iRowid - 1) * pCur->dimensions;
+            memcpy(vec->data, row, pCur->dimensions * sizeof(float));
+            sqlite3_result_pointer(context, vec, VECTOR_FLOAT_POINTER_NAME, delVectorFloat);
+            break;
+        }
+
+        case MATRIX_EACH_MATRIX:
+            sqlite3_result_null(context);
+            break;
+    }
+    return SQLITE_OK;
+}
+
+static sqlite3_module matrixEachModule = {
+    /* iVersion    */ 0,
+    /* xCreate     */ 0,
+    /* xConnect    */ matrixEachConnect,
+    /* xBestIndex  */ matrixEachBestIndex,
+    /* xDisconnect */ matrixEachDisconnect,
+    /* xDestroy    */ 0,
+    /* xOpen       */ matrixEachOpen,
+    /* xClose      */ matrixEachClose,
+    /* xFilter     */ matrixEachFilter,
+    /* xNext       */ matrixEachNext,
+    /* xEof        */ matrixEachEof,
+    /* xColumn     */ matrixEachColumn,
+    /* xRowid      */ matrixEachRowid,
+    /* xUpdate     */ 0,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ 0,
+    /* xRename     */ 0,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ 0};
+
+#pragma endregion
+
+#pragma region Aggregates
+
+// State of a vector_sum() or vector_avg() aggregate, allocated by the first
+// row. Sums are kept in double precision, the loop over them still
+// vectorizes.
+struct VectorSum {
+
+    int64_t rows = 0;
+    vector<double> sum;
+};
+
+static void vector_sum_step(sqlite3_context *context,
+                            int argc,
+                            sqlite3_value **argv) {
+
+    auto ppSum = (VectorSum **)sqlite3_aggregate_context(context, sizeof(VectorSum *));
+    if (ppSum == nullptr) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+
+    vec_ptr pVec = valueAsVector(argv[0]);
+    if (pVec == nullptr) {
+
+        // Vector pointers are NULL to SQL, so this is checked second.
+        if (sqlite3_value_type(argv[0]) == SQLITE_NULL)
+            return;
+
+        auto zErrMsg = sqlite3_mprintf("%s() value is not a vector", (const char *)sqlite3_user_data(context));
+        sqlite3_result_error(context, zErrMsg, -1);
+        sqlite3_free(zErrMsg);
+        return;
+    }
+
+    if (*ppSum == nullptr) {
+        *ppSum = new VectorSum();
+        (*ppSum)->sum.resize(pVec->size());
+    }
+
+    auto state = *ppSum;
+
+    if (state->sum.size() != pVec->size()) {
+
+        auto zErrMsg = sqlite3_mprintf("%s() vectors must all have %lld dimensions, got one with %lld",
+                                       (const char *)sqlite3_user_data(context),
+                                       (sqlite3_int64)state->sum.size(),
+                                       (sqlite3_int64)pVec->size());
+        sqlite3_result_error(context, zErrMsg, -1);
+        sqlite3_free(zErrMsg);
+        return;
+    }
+
+    auto sum = state->sum.data();
+    auto values = pVec->data();
+    auto n = pVec->size();
+    for (size_t i = 0; i < n; i++)
+        sum[i] += values[i];
+
+    state->rows++;
+}
+
+// Shared by vector_sum() and vector_avg(), told apart by their user data.
+// NULL when there were no rows.
+static void vector_sum_final(sqlite3_context *context) {
+
+    auto ppSum = (VectorSum **)sqlite3_aggregate_context(context, 0);
+    unique_ptr<VectorSum> state(ppSum != nullptr ? *ppSum : nullptr);
+
+    if (state == nullptr || state->rows == 0) {
+        sqlite3_result_null(context);
+        return;
+    }
+
+    bool average = strcmp((const char *)sqlite3_user_data(context), "vector_avg") == 0;
+    double scale = average ? 1.0 / state->rows : 1.0;
+
+    vector<float> result(state->sum.size());
+    for (size_t i = 0; i < result.size(); i++)
+        result[i] = (float)(state->sum[i] * scale);
+
+    resultVector(context, &result);
+}
+
+#pragma endregion
+
 #pragma region Entrypoint
 
 static void vector0(sqlite3_context *context, int argc, sqlite3_value **argv) {
@@ -625,9 +2170,11 @@ __declspec(dllexport)
         SQLITE_EXTENSION_INIT2(pApi);
 
         auto api = new vector0_api();
-        api->iVersion = 0;
+        api->iVersion = 2;
         api->xValueAsVector = valueAsVector;
         api->xResultVector = resultVector;
+        api->xValueAsMatrix = valueAsMatrix;
+        api->xResultMatrix = resultMatrix;
 
         rc = sqlite3_create_function_v2(db,
                                         "vector0",
@@ -665,6 +2212,11 @@ __declspec(dllexport)
             { (char *)"vector_to_blob",    1, nullptr, vector_to_blob,   SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS },
             { (char *)"vector_from_raw",   1, nullptr, vector_from_raw,  SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS },
             { (char *)"vector_to_raw",     1, nullptr, vector_to_raw,    SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS },
+            { (char *)"vector_to_f16",     1, nullptr, vector_to_f16,    SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS },
+            { (char *)"vector_to_bf16",    1, nullptr, vector_to_bf16,   SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS },
+            { (char *)"vector_quantize_i8", -1, nullptr, vector_quantize_i8, SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS },
+            { (char *)"vector_binarize",   1, nullptr, vector_binarize,  SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS },
+            { (char *)"vector_random",     2, nullptr, vector_random,    SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS },
         };
 
         for (int i = 0; i < sizeof(aFunc) / sizeof(aFunc[0]) && rc == SQLITE_OK; i++) {
@@ -686,6 +2238,41 @@ __declspec(dllexport)
             }
         }
 
+        rc = sqlite3_create_function_v2(db,
+                                        "vector_matrix",
+                                        1,
+                                        SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS,
+                                        nullptr,
+                                        0,
+                                        vector_matrix_step,
+                                        vector_matrix_final,
+                                        0);
+
+        if (rc != SQLITE_OK) {
+
+            *pzErrMsg = sqlite3_mprintf("%s: %s", "vector_matrix", sqlite3_errmsg(db));
+            return rc;
+        }
+
+        for (auto name : {"vector_sum", "vector_avg"}) {
+
+            rc = sqlite3_create_function_v2(db,
+                                            name,
+                                            1,
+                                            SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS,
+                                            (void *)name,
+                                            0,
+                                            vector_sum_step,
+                                            vector_sum_final,
+                                            0);
+
+            if (rc != SQLITE_OK) {
+
+                *pzErrMsg = sqlite3_mprintf("%s: %s", name, sqlite3_errmsg(db));
+                return rc;
+            }
+        }
+
         rc = sqlite3_create_module_v2(db, "vector_fvecs_each", &fvecsEachModule, nullptr, nullptr);
         if (rc != SQLITE_OK) {
 
@@ -693,6 +2280,27 @@ __declspec(dllexport)
             return rc;
         }
 
+        rc = sqlite3_create_module_v2(db, "vector_matrix_each", &matrixEachModule, nullptr, nullptr);
+        if (rc != SQLITE_OK) {
+
+            *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+            return rc;
+        }
+
+        rc = sqlite3_create_module_v2(db, "vector_random_each", &randomEachModule, nullptr, nullptr);
+        if (rc != SQLITE_OK) {
+
+            *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+            return rc;
+        }
+
+        rc = sqlite3_create_module_v2(db, "vector_vecs_each", &vecsEachModule, nullptr, nullptr);
+        if (rc != SQLITE_OK) {
+
+            *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+            return rc;
+        }
+
         return SQLITE_OK;
     }
 }
@@ -5,25 +5,47 @@
 #include "sqlite3ext.h"
 SQLITE_EXTENSION_INIT1
 
+#include <algorithm>
+#include <chrono>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <random>
 #include <fstream>
 #include <functional>
+#include <list>
+#include <map>
+#include <mutex>
+#include <numeric>
 #include <optional>
-
+#include <typeinfo>
+#include <unordered_set>
+#include <variant>
+
+#include <faiss/Clustering.h>
+#include <faiss/IndexBinaryFlat.h>
+#include <faiss/IndexBinaryHNSW.h>
+#include <faiss/IndexBinaryIVF.h>
 #include <faiss/IndexFlat.h>
+#include <faiss/IndexHNSW.h>
+#include <faiss/IndexIDMap.h>
+#include <faiss/IndexIVFFlat.h>
 #include <faiss/IndexIVFPQ.h>
+#include <faiss/IndexPreTransform.h>
 #include <faiss/impl/AuxIndexStructures.h>
 #include <faiss/impl/IDSelector.h>
+#include <faiss/impl/ProductQuantizer.h>
 #include <faiss/impl/io.h>
 #include <faiss/index_factory.h>
 #include <faiss/index_io.h>
+#include <faiss/invlists/InvertedLists.h>
 #include <faiss/utils/distances.h>
 #include <faiss/utils/utils.h>
 
+#include <omp.h>
+
 #include "sqlite-vector.h"
+#include "vector-distance.h"
 
 using namespace std;
 
@@ -57,138 +79,274 @@ static void vss_debug(sqlite3_context *context,
 
 #pragma region Distances
 
-static void vss_distance_l1(sqlite3_context *context,
-                            int argc,
-                            sqlite3_value **argv) {
+// A decoded argument of the distance functions.
+struct VssOperand {
 
-    auto vector_api = (vector0_api *)sqlite3_user_data(context);
+    vec_ptr vector;
 
-    vec_ptr lhs = vector_api->xValueAsVector(argv[0]);
-    if (lhs == nullptr) {
-        sqlite3_result_error(context, "LHS is not a vector", -1);
-        return;
+    // Packed bits, for vss_distance_hamming() only.
+    std::vector<uint8_t> bits;
+
+    // Squared L2 norm, computed on first use.
+    float norm = -1;
+
+    float norm_L2sqr() {
+
+        if (norm < 0)
+            norm = faiss::fvec_norm_L2sqr(vector->data(), vector->size());
+        return norm;
     }
+};
 
-    vec_ptr rhs = vector_api->xValueAsVector(argv[1]);
-    if (rhs == nullptr) {
-        sqlite3_result_error(context, "RHS is not a vector", -1);
-        return;
+void delVssOperand(void *p) {
+
+    auto self = static_cast<VssOperand *>(p);
+    delete self;
+}
+
+// The two arguments of a distance function call. A constant argument, like
+// the bound query vector of a full-table scan, is decoded on the first row
+// only: it's kept with sqlite3_set_auxdata() and reused on every following row
+// of the statement. SQLite drops auxdata of non-constant arguments after each
+// call, so column values are still decoded once per row.
+struct VssOperands {
+
+    VssOperands(sqlite3_context *context, sqlite3_value **argv)
+      : context(context),
+        argv(argv),
+        vector_api((vector0_api *)sqlite3_user_data(context)) {}
+
+    // sqlite3_set_auxdata() may free the operand right away, so it's only
+    // called once the result was computed.
+    ~VssOperands() {
+
+        for (int i = 0; i < 2; i++) {
+            if (decoded[i] != nullptr)
+                sqlite3_set_auxdata(context, i, decoded[i], delVssOperand);
+        }
     }
 
-    if (lhs->size() != rhs->size()) {
-        sqlite3_result_error(context, "LHS and RHS are not vectors of the same size",
-                             -1);
-        return;
+    // Null when argument i isn't a vector.
+    VssOperand *get(int i) {
+
+        if (operands[i] != nullptr)
+            return operands[i];
+
+        operands[i] = static_cast<VssOperand *>(sqlite3_get_auxdata(context, i));
+        if (operands[i] != nullptr)
+            return operands[i];
+
+        vec_ptr vector = vector_api->xValueAsVector(argv[i]);
+        if (vector == nullptr)
+            return nullptr;
+
+        operands[i] = decoded[i] = new VssOperand();
+        operands[i]->vector = move(vector);
+        return operands[i];
     }
 
-    sqlite3_result_double(context, faiss::fvec_L1(lhs->data(), rhs->data(), lhs->size()));
-}
+    // Argument i as packed bits. Blobs are taken as packed bits, like
+    // vector_binarize() returns, unless they're well-formed 'v' vector blobs.
+    // Those and anything else are read as a vector and binarized first.
+    VssOperand *get_bits(int i) {
 
-static void vss_distance_l2(sqlite3_context *context, int argc,
-                            sqlite3_value **argv) {
+        if (operands[i] != nullptr)
+            return operands[i];
 
-    auto vector_api = (vector0_api *)sqlite3_user_data(context);
+        operands[i] = static_cast<VssOperand *>(sqlite3_get_auxdata(context, i));
+        if (operands[i] != nullptr)
+            return operands[i];
 
-    vec_ptr lhs = vector_api->xValueAsVector(argv[0]);
-    if (lhs == nullptr) {
-        sqlite3_result_error(context, "LHS is not a vector", -1);
-        return;
+        auto operand = new VssOperand();
+
+        VectorView view;
+        if (sqlite3_value_type(argv[i]) == SQLITE_BLOB &&
+            !vectorViewFromBlob(sqlite3_value_blob(argv[i]), sqlite3_value_bytes(argv[i]), &view)) {
+
+            auto blob = (const uint8_t *)sqlite3_value_blob(argv[i]);
+            operand->bits.assign(blob, blob + sqlite3_value_bytes(argv[i]));
+
+        } else {
+
+            vec_ptr vector = vector_api->xValueAsVector(argv[i]);
+            if (vector == nullptr) {
+                delete operand;
+                return nullptr;
+            }
+
+            operand->bits.resize(vectorBinarySize(vector->size()));
+            vectorBinarize(vector->data(), operand->bits.data(), vector->size());
+        }
+
+        operands[i] = decoded[i] = operand;
+        return operands[i];
     }
 
-    vec_ptr rhs = vector_api->xValueAsVector(argv[1]);
-    if (rhs == nullptr) {
-        sqlite3_result_error(context, "RHS is not a vector", -1);
-        return;
+    // Both arguments as vectors of the same size, or false after setting an
+    // error.
+    bool get_pair(VssOperand **lhs, VssOperand **rhs) {
+
+        if ((*lhs = get(0)) == nullptr) {
+            sqlite3_result_error(context, "LHS is not a vector", -1);
+            return false;
+        }
+
+        if ((*rhs = get(1)) == nullptr) {
+            sqlite3_result_error(context, "RHS is not a vector", -1);
+            return false;
+        }
+
+        if ((*lhs)->vector->size() != (*rhs)->vector->size()) {
+            sqlite3_result_error(context, "LHS and RHS are not vectors of the same size",
+                                 -1);
+            return false;
+        }
+        return true;
     }
 
-    if (lhs->size() != rhs->size()) {
-        sqlite3_result_error(context, "LHS and RHS are not vectors of the same size",
-                             -1);
-        return;
+    sqlite3_context *context;
+    sqlite3_value **argv;
+    vector0_api *vector_api;
+
+    VssOperand *operands[2] = {nullptr, nullptr};
+
+    // Operands decoded by this call, handed to SQLite when it ends.
+    VssOperand *decoded[2] = {nullptr, nullptr};
+};
+
+// When one argument is a 'v' blob, any element type, it's read in place by the
+// kernels in vector-distance.h and only the other one is decoded. Returns 0
+// when neither is, and -1 after setting an error.
+static int vss_distance_view(VssOperands &operands,
+                             VectorView *view,
+                             VssOperand **other) {
+
+    auto argv = operands.argv;
+
+    for (int i = 0; i < 2; i++) {
+
+        if (sqlite3_value_type(argv[i]) != SQLITE_BLOB ||
+            !vectorViewFromBlob(sqlite3_value_blob(argv[i]), sqlite3_value_bytes(argv[i]), view))
+            continue;
+
+        *other = operands.get(1 - i);
+        if (*other == nullptr) {
+            sqlite3_result_error(operands.context, i == 0 ? "RHS is not a vector" : "LHS is not a vector", -1);
+            return -1;
+        }
+
+        if ((int64_t)(*other)->vector->size() != view->size) {
+            sqlite3_result_error(operands.context, "LHS and RHS are not vectors of the same size",
+                                 -1);
+            return -1;
+        }
+        return 1;
     }
+    return 0;
+}
+
+static void vss_distance_l1(sqlite3_context *context,
+                            int argc,
+                            sqlite3_value **argv) {
 
-    sqlite3_result_double(context, faiss::fvec_L2sqr(lhs->data(), rhs->data(), lhs->size()));
+    VssOperands operands(context, argv);
+    VssOperand *lhs, *rhs;
+    if (!operands.get_pair(&lhs, &rhs))
+        return;
+
+    sqlite3_result_double(context, faiss::fvec_L1(lhs->vector->data(), rhs->vector->data(), lhs->vector->size()));
 }
 
-static void vss_distance_linf(sqlite3_context *context, int argc,
-                              sqlite3_value **argv) {
+static void vss_distance_l2(sqlite3_context *context, int argc,
+                            sqlite3_value **argv) {
 
-    auto vector_api = (vector0_api *)sqlite3_user_data(context);
+    VssOperands operands(context, argv);
 
-    vec_ptr lhs = vector_api->xValueAsVector(argv[0]);
-    if (lhs == nullptr) {
-        sqlite3_result_error(context, "LHS is not a vector", -1);
-        return;
+    VectorView view;
+    VssOperand *other;
+    switch (vss_distance_view(operands, &view, &other)) {
+        case 1:
+            sqlite3_result_double(context, vectorViewDistanceL2sqr(view, other->vector->data()));
+            return;
+        case -1:
+            return;
     }
 
-    vec_ptr rhs = vector_api->xValueAsVector(argv[1]);
-    if (rhs == nullptr) {
-        sqlite3_result_error(context, "RHS is not a vector", -1);
+    VssOperand *lhs, *rhs;
+    if (!operands.get_pair(&lhs, &rhs))
         return;
-    }
 
-    if (lhs->size() != rhs->size()) {
-        sqlite3_result_error(context, "LHS and RHS are not vectors of the same size",
-                             -1);
+    sqlite3_result_double(context, faiss::fvec_L2sqr(lhs->vector->data(), rhs->vector->data(), lhs->vector->size()));
+}
+
+static void vss_distance_linf(sqlite3_context *context, int argc,
+                              sqlite3_value **argv) {
+
+    VssOperands operands(context, argv);
+    VssOperand *lhs, *rhs;
+    if (!operands.get_pair(&lhs, &rhs))
         return;
-    }
 
-    sqlite3_result_double(context, faiss::fvec_Linf(lhs->data(), rhs->data(), lhs->size()));
+    sqlite3_result_double(context, faiss::fvec_Linf(lhs->vector->data(), rhs->vector->data(), lhs->vector->size()));
 }
 
 static void vss_inner_product(sqlite3_context *context, int argc,
                               sqlite3_value **argv) {
 
-    auto vector_api = (vector0_api *)sqlite3_user_data(context);
-
-    vec_ptr lhs = vector_api->xValueAsVector(argv[0]);
-    if (lhs == nullptr) {
-        sqlite3_result_error(context, "LHS is not a vector", -1);
-        return;
-    }
+    VssOperands operands(context, argv);
 
-    vec_ptr rhs = vector_api->xValueAsVector(argv[1]);
-    if (rhs == nullptr) {
-        sqlite3_result_error(context, "RHS is not a vector", -1);
-        return;
+    VectorView view;
+    VssOperand *other;
+    switch (vss_distance_view(operands, &view, &other)) {
+        case 1:
+            sqlite3_result_double(context, vectorViewDistanceInnerProduct(view, other->vector->data()));
+            return;
+        case -1:
+            return;
     }
 
-    if (lhs->size() != rhs->size()) {
-        sqlite3_result_error(context, "LHS and RHS are not vectors of the same size",
-                             -1);
+    VssOperand *lhs, *rhs;
+    if (!operands.get_pair(&lhs, &rhs))
         return;
-    }
 
     sqlite3_result_double(context,
-                          faiss::fvec_inner_product(lhs->data(), rhs->data(), lhs->size()));
+                          faiss::fvec_inner_product(lhs->vector->data(), rhs->vector->data(), lhs->vector->size()));
 }
 
 static void vss_cosine_similarity(sqlite3_context *context, int argc,
                               sqlite3_value **argv) {
 
-    auto vector_api = (vector0_api *)sqlite3_user_data(context);
-
-    vec_ptr lhs = vector_api->xValueAsVector(argv[0]);
-    if (lhs == nullptr) {
-        sqlite3_result_error(context, "LHS is not a vector", -1);
-        return;
-    }
+    VssOperands operands(context, argv);
+
+    // The norm of a constant argument is only computed once, with the
+    // operand it's cached on.
+    VectorView view;
+    VssOperand *other;
+    switch (vss_distance_view(operands, &view, &other)) {
+        case 1: {
+            float inner_product = vectorViewDistanceInnerProduct(view, other->vector->data());
+            float view_norm = vectorViewDistanceNormL2sqr(view);
+            float other_norm = other->norm_L2sqr();
+
+            if (view_norm == 0.0f || other_norm == 0.0f) {
+                sqlite3_result_error(context, "One or both vectors are zero-vectors", -1);
+                return;
+            }
 
-    vec_ptr rhs = vector_api->xValueAsVector(argv[1]);
-    if (rhs == nullptr) {
-        sqlite3_result_error(context, "RHS is not a vector", -1);
-        return;
+            sqlite3_result_double(context, inner_product / (sqrt(view_norm) * sqrt(other_norm)));
+            return;
+        }
+        case -1:
+            return;
     }
 
-    if (lhs->size() != rhs->size()) {
-        sqlite3_result_error(context, "LHS and RHS are not vectors of the same size",
-                             -1);
+    VssOperand *lhs, *rhs;
+    if (!operands.get_pair(&lhs, &rhs))
         return;
-    }
 
-    float inner_product = faiss::fvec_inner_product(lhs->data(), rhs->data(), lhs->size());
-    float lhs_norm = faiss::fvec_norm_L2sqr(lhs->data(), lhs->size());
-    float rhs_norm = faiss::fvec_norm_L2sqr(rhs->data(), rhs->size());
+    float inner_product = faiss::fvec_inner_product(lhs->vector->data(), rhs->vector->data(), lhs->vector->size());
+    float lhs_norm = lhs->norm_L2sqr();
+    float rhs_norm = rhs->norm_L2sqr();
 
     if (lhs_norm == 0.0f || rhs_norm == 0.0f) {
         sqlite3_result_error(context, "One or both vectors are zero-vectors", -1);
@@ -198,32 +356,43 @@ static void vss_cosine_similarity(sqlite3_context *context, int argc,
     sqlite3_result_double(context, inner_product / (sqrt(lhs_norm) * sqrt(rhs_norm)));
 }
 
-static void vss_fvec_add(sqlite3_context *context, int argc,
-                         sqlite3_value **argv) {
+static void vss_distance_hamming(sqlite3_context *context, int argc,
+                                 sqlite3_value **argv) {
 
-    auto vector_api = (vector0_api *)sqlite3_user_data(context);
+    VssOperands operands(context, argv);
 
-    vec_ptr lhs = vector_api->xValueAsVector(argv[0]);
+    auto lhs = operands.get_bits(0);
     if (lhs == nullptr) {
-        sqlite3_result_error(context, "LHS is not a vector", -1);
+        sqlite3_result_error(context, "LHS is not a binary vector", -1);
         return;
     }
 
-    vec_ptr rhs = vector_api->xValueAsVector(argv[1]);
+    auto rhs = operands.get_bits(1);
     if (rhs == nullptr) {
-        sqlite3_result_error(context, "RHS is not a vector", -1);
+        sqlite3_result_error(context, "RHS is not a binary vector", -1);
         return;
     }
 
-    if (lhs->size() != rhs->size()) {
-        sqlite3_result_error(context, "LHS and RHS are not vectors of the same size",
+    if (lhs->bits.size() != rhs->bits.size()) {
+        sqlite3_result_error(context, "LHS and RHS are not binary vectors of the same size",
                              -1);
         return;
     }
 
-    auto size = lhs->size();
+    sqlite3_result_int64(context, vectorHamming(lhs->bits.data(), rhs->bits.data(), lhs->bits.size()));
+}
+
+static void vss_fvec_add(sqlite3_context *context, int argc,
+                         sqlite3_value **argv) {
+
+    VssOperands operands(context, argv);
+    VssOperand *lhs, *rhs;
+    if (!operands.get_pair(&lhs, &rhs))
+        return;
+
+    auto size = lhs->vector->size();
     vec_ptr c(new vector<float>(size));
-    faiss::fvec_add(size, lhs->data(), rhs->data(), c->data());
+    faiss::fvec_add(size, lhs->vector->data(), rhs->vector->data(), c->data());
 
     sqlite3_result_blob64(context, c->data(), c->size() * sizeof(float), SQLITE_TRANSIENT);
 }
@@ -231,28 +400,14 @@ static void vss_fvec_add(sqlite3_context *context, int argc,
 static void vss_fvec_sub(sqlite3_context *context, int argc,
                          sqlite3_value **argv) {
 
-    auto vector_api = (vector0_api *)sqlite3_user_data(context);
-
-    vec_ptr lhs = vector_api->xValueAsVector(argv[0]);
-    if (lhs == nullptr) {
-        sqlite3_result_error(context, "LHS is not a vector", -1);
-        return;
-    }
-
-    vec_ptr rhs = vector_api->xValueAsVector(argv[1]);
-    if (rhs == nullptr) {
-        sqlite3_result_error(context, "RHS is not a vector", -1);
-        return;
-    }
-
-    if (lhs->size() != rhs->size()) {
-        sqlite3_result_error(context, "LHS and RHS are not vectors of the same size", -1);
+    VssOperands operands(context, argv);
+    VssOperand *lhs, *rhs;
+    if (!operands.get_pair(&lhs, &rhs))
         return;
-    }
 
-    int size = lhs->size();
+    int size = lhs->vector->size();
     vec_ptr c = vec_ptr(new vector<float>(size));
-    faiss::fvec_sub(size, lhs->data(), rhs->data(), c->data());
+    faiss::fvec_sub(size, lhs->vector->data(), rhs->vector->data(), c->data());
     sqlite3_result_blob64(context, c->data(), c->size() * sizeof(float), SQLITE_TRANSIENT);
 }
 
@@ -262,8 +417,19 @@ static void vss_fvec_sub(sqlite3_context *context, int argc,
 
 struct VssSearchParams {
 
+    ~VssSearchParams() { sqlite3_value_free(value); }
+
     vec_ptr vector;
     sqlite3_int64 k;
+
+    // How wide to search, see vss_search_width. -1 keeps the index's own.
+    sqlite3_int64 nprobe = -1;
+    sqlite3_int64 ef_search = -1;
+
+    // Copy of the query when it was given as a blob, which a binary column
+    // reads as packed bits instead. vector is null when the blob isn't a
+    // float vector at all.
+    sqlite3_value *value = nullptr;
 };
 
 void delVssSearchParams(void *p) {
@@ -274,8 +440,13 @@ void delVssSearchParams(void *p) {
 
 struct VssRangeSearchParams {
 
+    ~VssRangeSearchParams() { sqlite3_value_free(value); }
+
     vec_ptr vector;
     float distance;
+
+    // Same as VssSearchParams::value.
+    sqlite3_value *value = nullptr;
 };
 
 void delVssRangeSearchParams(void *p) {
@@ -286,1543 +457,8776 @@ void delVssRangeSearchParams(void *p) {
 
 #pragma endregion
 
-#pragma region Vtab
+#pragma region Binary indexes
 
-// StorageType enum gives options for where to store faiss indices. Default is faiss_shadow.
-// faiss_ondisk -> create files in the same directory as the database file for the indices.
-enum StorageType { faiss_shadow, faiss_ondisk };
+// A faiss::Index over a faiss::IndexBinary, so binary columns share the
+// insert, training, sync and search paths of float columns. Vectors come in as
+// floats and are binarized with vectorBinarize() before reaching the binary
+// index, which only ever stores the bits. Distances are Hamming distances.
+struct vss_binary_index : faiss::Index {
 
-enum QueryType { search, range_search, fullscan };
+    explicit vss_binary_index(faiss::IndexBinary *binary)
+      : faiss::Index(binary->d, faiss::METRIC_L2),
+        binary(binary) {
 
-// Wrapper around a single faiss index, with training data, insert records, and
-// delete records.
-struct vss_index {
+        refresh();
+    }
 
-    explicit vss_index(faiss::Index *index) : index(index) {}
-    explicit vss_index(faiss::Index *index, string name, StorageType storage_type) : index(index), name(name), storage_type(storage_type) {}
+    ~vss_binary_index() { delete binary; }
 
-    ~vss_index() {
-        if (index != nullptr) {
-            delete index;
-        }
+    faiss::IndexBinary *binary;
+
+    // The index doing the searching, under the IDMap every binary column has.
+    faiss::IndexBinary *inner() const {
+
+        auto idmap = dynamic_cast<faiss::IndexBinaryIDMap *>(binary);
+        return idmap != nullptr ? idmap->index : binary;
     }
 
-    faiss::Index *index;
-    vector<float> trainings;
-    vector<float> insert_data;
-    vector<faiss::idx_t> insert_ids;
-    vector<faiss::idx_t> delete_ids;
-    string name;
-    StorageType storage_type;
-};
+    vector<uint8_t> binarize(faiss::idx_t n, const float *x) const {
 
-struct vss_index_vtab : public sqlite3_vtab {
+        vector<uint8_t> codes(n * binary->code_size);
+        for (faiss::idx_t i = 0; i < n; i++)
+            vectorBinarize(x + i * d, codes.data() + i * binary->code_size, d);
+        return codes;
+    }
 
-    vss_index_vtab(sqlite3 *db, vector0_api *vector_api, char *schema, char *name)
-      : db(db),
-        vector_api(vector_api),
-        schema(schema),
-        name(name) { }
+    void refresh() {
 
-    ~vss_index_vtab() {
+        ntotal = binary->ntotal;
+        is_trained = binary->is_trained;
+    }
 
-        if (name)
-            sqlite3_free(name);
-        if (schema)
-            sqlite3_free(schema);
-        for (auto iter = indexes.begin(); iter != indexes.end(); ++iter) {
-            delete (*iter);
-        }
+    void train(faiss::idx_t n, const float *x) override {
+
+        binary->train(n, binarize(n, x).data());
+        refresh();
     }
 
-    sqlite3 *db;
-    vector0_api *vector_api;
+    void add(faiss::idx_t n, const float *x) override {
 
-    // Name of the virtual table. Must be freed during disconnect
-    char *name;
+        binary->add(n, binarize(n, x).data());
+        refresh();
+    }
 
-    // Name of the schema the virtual table exists in. Must be freed during
-    // disconnect
-    char *schema;
+    void add_with_ids(faiss::idx_t n, const float *x, const faiss::idx_t *xids) override {
 
-    // Vector holding all the  faiss Indices the vtab uses, and their state,
-    // implying which items are to be deleted and inserted.
-    vector<vss_index*> indexes;
-};
+        binary->add_with_ids(n, binarize(n, x).data(), xids);
+        refresh();
+    }
 
-struct vss_index_cursor : public sqlite3_vtab_cursor {
+    void search(faiss::idx_t n,
+                const float *x,
+                faiss::idx_t k,
+                float *distances,
+                faiss::idx_t *labels,
+                const faiss::SearchParameters *params = nullptr) const override {
 
-    explicit vss_index_cursor(vss_index_vtab *table)
-      : table(table),
-        sqlite3_vtab_cursor({0}),
-        stmt(nullptr) { }
+        vector<int32_t> hamming(n * k);
+        binary->search(n, binarize(n, x).data(), k, hamming.data(), labels, params);
+        copy(hamming.begin(), hamming.end(), distances);
+    }
 
-    ~vss_index_cursor() {
-        if (stmt != nullptr)
-            sqlite3_finalize(stmt);
+    void range_search(faiss::idx_t n,
+                      const float *x,
+                      float radius,
+                      faiss::RangeSearchResult *result,
+                      const faiss::SearchParameters *params = nullptr) const override {
+
+        binary->range_search(n, binarize(n, x).data(), (int)ceil(radius), result, params);
     }
 
-    vss_index_vtab *table;
+    void reset() override {
 
-    sqlite3_int64 iCurrent;
-    sqlite3_int64 iRowid;
+        binary->reset();
+        refresh();
+    }
 
-    QueryType query_type;
+    size_t remove_ids(const faiss::IDSelector &sel) override {
 
-    // For query_type == QueryType::search
-    sqlite3_int64 limit;
-    vector<faiss::idx_t> search_ids;
-    vector<float> search_distances;
+        auto removed = binary->remove_ids(sel);
+        refresh();
+        return removed;
+    }
 
-    // For query_type == QueryType::range_search
-    unique_ptr<faiss::RangeSearchResult> range_search_result;
+    // As 0 and 1 elements, see vectorUnpackBits().
+    void reconstruct(faiss::idx_t key, float *recons) const override {
 
-    // For query_type == QueryType::fullscan
-    sqlite3_stmt *stmt;
-    int step_result;
+        vector<uint8_t> code(binary->code_size);
+        binary->reconstruct(key, code.data());
+        vectorUnpackBits(code.data(), recons, d);
+    }
 };
 
-struct VssIndexColumn {
+#pragma endregion
+
+// Approximate memory of one entry of an std::unordered_map from rowids: the
+// heap node with its key, value and next pointer, the cached hash and the
+// bucket slot pointing at it.
+static const size_t VSS_HASH_ENTRY_BYTES = 48;
+
+#pragma region SQLite inverted lists
+
+// Clean inverted lists of a storage_type=faiss_ivflists column are evicted
+// once the cache holds more than about this many bytes.
+static const size_t VSS_IVFLISTS_CACHE_BYTES = 64 * 1024 * 1024;
+
+// Inverted lists of a storage_type=faiss_ivflists column, stored one row per
+// list in the <table>_ivflists shadow table. Only the list sizes are kept in
+// memory: a list is read through SQLite the first time a search probes it,
+// and kept in an LRU cache of recently used lists. Lists changed by adds and
+// removes stay pinned in the cache until flush() writes them back, so only
+// the lists a transaction touched are written.
+//
+// When the IVF has no IDMap over it, its lists hold the rowids themselves
+// and track_rows is set: the list each rowid is in is kept in the
+// <table>_ivfrows shadow table, so removing or reading back a row only reads
+// the one list it is in.
+//
+// Lists are read through the table's connection, so faiss runs single
+// threaded on these columns (see vss_faiss_threads): an OpenMP worker would
+// block on the connection mutex the calling thread already holds.
+struct vss_sqlite_invlists : faiss::InvertedLists {
+
+    vss_sqlite_invlists(sqlite3 *db, const char *schema, const char *name, int column, size_t nlist, size_t code_size)
+      : faiss::InvertedLists(nlist, code_size),
+        db(db),
+        schema(schema),
+        name(name),
+        column(column),
+        sizes(nlist, 0) {}
+
+    ~vss_sqlite_invlists() { sqlite3_finalize(select); }
 
+    sqlite3 *db;
+    string schema;
     string name;
-    sqlite3_int64 dimensions;
-    string factory;
-    faiss::MetricType metric;
-    StorageType storage_type;
-};
+    int column;
+    bool track_rows = false;
+
+    struct cached_list {
+        vector<faiss::idx_t> ids;
+        vector<uint8_t> codes;
+        bool dirty = false;
+        int pins = 0;
+        std::list<size_t>::iterator lru;
+    };
 
-static void vssSearchParamsFunc(sqlite3_context *context,
-                                int argc,
-                                sqlite3_value **argv) {
+    vector<size_t> sizes;
 
-    auto vector_api = (vector0_api *)sqlite3_user_data(context);
+    // Most recently used lists first.
+    mutable std::unordered_map<size_t, cached_list> cache;
+    mutable std::list<size_t> lru;
+    mutable size_t cached_bytes = 0;
+    mutable sqlite3_stmt *select = nullptr;
+    mutable std::mutex mutex;
 
-    vec_ptr vector = vector_api->xValueAsVector(argv[0]);
-    if (vector == nullptr) {
-        sqlite3_result_error(context, "1st argument is not a vector", -1);
-        return;
+    // Lists rowids moved to since the last flush, -1 once removed. With
+    // rows_cleared, every row of the column in _ivfrows is stale.
+    std::unordered_map<faiss::idx_t, int64_t> moved;
+    bool rows_cleared = false;
+
+    // Memory held by the list sizes and the lists in the cache.
+    size_t resident_bytes() const {
+
+        std::lock_guard<std::mutex> lock(mutex);
+        return sizes.size() * sizeof(size_t) + cached_bytes +
+               moved.size() * VSS_HASH_ENTRY_BYTES;
     }
 
-    auto limit = sqlite3_value_int64(argv[1]);
-    auto params = new VssSearchParams();
-    params->vector = vec_ptr(vector.release());
-    params->k = limit;
-    sqlite3_result_pointer(context, params, "vss0_searchparams", delVssSearchParams);
-}
+    // Reads the size of every list, without reading the lists.
+    int load_sizes() {
 
-static void vssRangeSearchParamsFunc(sqlite3_context *context, int argc,
-                                     sqlite3_value **argv) {
+        std::lock_guard<std::mutex> lock(mutex);
 
-    auto vector_api = (vector0_api *)sqlite3_user_data(context);
+        sqlite3_stmt *stmt;
+        auto sql = sqlite3_mprintf("select list, length(ids) / 8 from \"%w\".\"%w_ivflists\" where col = ?",
+                                   schema.c_str(), name.c_str());
+        auto rc = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK)
+            return rc;
 
-    vec_ptr vector = vector_api->xValueAsVector(argv[0]);
-    if (vector == nullptr) {
-        sqlite3_result_error(context, "1st argument is not a vector", -1);
-        return;
+        sqlite3_bind_int(stmt, 1, column);
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            auto list_no = sqlite3_column_int64(stmt, 0);
+            if (list_no >= 0 && (size_t)list_no < nlist)
+                sizes[list_no] = sqlite3_column_int64(stmt, 1);
+        }
+        sqlite3_finalize(stmt);
+        return rc == SQLITE_DONE ? SQLITE_OK : rc;
     }
 
-    auto params = new VssRangeSearchParams();
+    // Writes every list of lists to the shadow table, replacing the column's
+    // rows, and takes over their sizes.
+    int replace_all(const faiss::InvertedLists *lists) {
 
-    params->vector = vec_ptr(vector.release());
-    params->distance = sqlite3_value_double(argv[1]);
-
-    sqlite3_result_pointer(context, params, "vss0_rangesearchparams", delVssRangeSearchParams);
-}
-
-string get_index_filename(sqlite3 *db, const char *schema, const char *table_name, string col_name) {
-    const char *db_filename = sqlite3_db_filename(db, "main");
-    std::stringstream ss;
-    ss << db_filename << "." << schema << "." << table_name << "." << col_name << ".faissindex";
-    return ss.str();
-}
-
-void finalize_and_free(sqlite3_stmt *stmt, char *sql) {
-    sqlite3_finalize(stmt);
-    sqlite3_free(sql);
-}
-
-static int write_index_insert(faiss::Index *index,
-                              sqlite3 *db,
-                              char *schema,
-                              char *name,
-                              int rowId,
-                              string col_name,
-                              StorageType storage_type) {
+        std::lock_guard<std::mutex> lock(mutex);
 
+        auto sql = sqlite3_mprintf("delete from \"%w\".\"%w_ivflists\" where col = %d",
+                                   schema.c_str(), name.c_str(), column);
+        auto rc = sqlite3_exec(db, sql, nullptr, nullptr, nullptr);
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK)
+            return rc;
 
-    faiss::VectorIOWriter writer;
-    faiss::write_index(index, &writer);
-    sqlite3_int64 indexSize = writer.data.size();
+        cache.clear();
+        lru.clear();
+        cached_bytes = 0;
+        moved.clear();
+        rows_cleared = track_rows;
 
-    // First try to insert into xyz_index. If that fails with a rowid constraint
-    // error, that means the index is already on disk, we just have to UPDATE
-    // instead.
+        for (size_t list_no = 0; list_no < nlist && rc == SQLITE_OK; list_no++) {
 
-    if (storage_type == StorageType::faiss_ondisk) {
-        const string index_filename = get_index_filename(db, schema, name, col_name);
+            sizes[list_no] = lists->list_size(list_no);
+            if (sizes[list_no] == 0)
+                continue;
 
-        ofstream outFile(index_filename, ios::binary);
-        if (!outFile) {
-            return SQLITE_ERROR;
-        }
+            faiss::InvertedLists::ScopedIds ids(lists, list_no);
+            faiss::InvertedLists::ScopedCodes codes(lists, list_no);
+            rc = write_list(list_no, ids.get(), codes.get(), sizes[list_no]);
 
-        outFile.write(reinterpret_cast<const char*>(writer.data.data()), indexSize);
-        outFile.close();
-        if (!outFile) {
-            return SQLITE_ERROR;
+            if (track_rows)
+                for (size_t i = 0; i < sizes[list_no]; i++)
+                    moved[ids.get()[i]] = list_no;
         }
+        return rc == SQLITE_OK ? write_rows() : rc;
+    }
 
-        return SQLITE_OK;
+    // Writes back the lists changed since the last flush.
+    int flush() {
 
-    } else {
+        std::lock_guard<std::mutex> lock(mutex);
 
-        sqlite3_stmt *stmt;
-        char *sql = sqlite3_mprintf(
-            "insert into \"%w\".\"%w_index\"(rowid, idx) values (?, ?)",
-            schema,
-            name);
+        for (auto &entry : cache) {
 
-        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
-        if (rc != SQLITE_OK || stmt == nullptr) {
-            sqlite3_free(sql);
-            return SQLITE_ERROR;
-        }
+            if (!entry.second.dirty)
+                continue;
 
-        rc = sqlite3_bind_int64(stmt, 1, rowId);
-        if (rc != SQLITE_OK) {
-            finalize_and_free(stmt, sql);
-            return SQLITE_ERROR;
+            auto rc = write_list(entry.first, entry.second.ids.data(), entry.second.codes.data(),
+                                 entry.second.ids.size());
+            if (rc != SQLITE_OK)
+                return rc;
+            entry.second.dirty = false;
         }
 
-        rc = sqlite3_bind_blob64(stmt, 2, writer.data.data(), indexSize, SQLITE_TRANSIENT);
-        if (rc != SQLITE_OK) {
-            finalize_and_free(stmt, sql);
-            return SQLITE_ERROR;
-        }
+        evict();
+        return write_rows();
+    }
 
-        int result = sqlite3_step(stmt);
-        finalize_and_free(stmt, sql);
+    // Finds the list and offset of rowid id, false when no list holds it.
+    // Only for track_rows lists, throws when the read fails.
+    bool locate(faiss::idx_t id, size_t *list_no, size_t *offset) const {
 
-        if (result == SQLITE_DONE) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return locate_locked(id, list_no, offset);
+    }
 
-            // INSERT was success, index wasn't written yet, all good to exit
-            return SQLITE_OK;
+    // Removes the given rowids, each from the one list it is in, moving the
+    // last entry of the list into its place. Returns how many were found.
+    // Only for track_rows lists, throws when a read fails.
+    size_t remove_ids(const vector<faiss::idx_t> &ids) {
 
-        } else if (sqlite3_extended_errcode(db) != SQLITE_CONSTRAINT_PRIMARYKEY) {
-            // INSERT failed for another unknown reason, bad, return error
-            return SQLITE_ERROR;
-        }
+        std::lock_guard<std::mutex> lock(mutex);
 
-        // INSERT failed because index already is on disk, so we do an UPDATE instead
+        size_t removed = 0;
+        for (auto id : ids) {
 
-        sql = sqlite3_mprintf(
-            "update \"%w\".\"%w_index\" set idx = ? where rowid = ?", schema, name);
+            size_t list_no, offset;
+            if (!locate_locked(id, &list_no, &offset))
+                continue;
 
-        rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
-        if (rc != SQLITE_OK || stmt == nullptr) {
-            sqlite3_free(sql);
-            return SQLITE_ERROR;
+            auto &entry = load(list_no);
+            auto last = entry.ids.size() - 1;
+            if (offset != last) {
+                entry.ids[offset] = entry.ids[last];
+                memcpy(entry.codes.data() + offset * code_size, entry.codes.data() + last * code_size, code_size);
+            }
+            entry.ids.pop_back();
+            entry.codes.resize(last * code_size);
+            entry.dirty = true;
+
+            cached_bytes -= sizeof(faiss::idx_t) + code_size;
+            sizes[list_no] = last;
+            moved[id] = -1;
+            removed++;
         }
+        return removed;
+    }
 
-        rc = sqlite3_bind_blob64(stmt, 1, writer.data.data(), indexSize, SQLITE_TRANSIENT);
-        if (rc != SQLITE_OK) {
-            finalize_and_free(stmt, sql);
-            return SQLITE_ERROR;
-        }
+    // Every rowid in the lists, in no particular order. Only for track_rows
+    // lists.
+    int all_ids(vector<faiss::idx_t> *ids) const {
 
-        rc = sqlite3_bind_int64(stmt, 2, rowId);
-        if (rc != SQLITE_OK) {
-            finalize_and_free(stmt, sql);
-            return SQLITE_ERROR;
-        }
+        std::lock_guard<std::mutex> lock(mutex);
 
-        result = sqlite3_step(stmt);
-        finalize_and_free(stmt, sql);
+        ids->clear();
+        if (!rows_cleared) {
 
-        if (result == SQLITE_DONE) {
-            return SQLITE_OK;
+            sqlite3_stmt *stmt;
+            auto sql = sqlite3_mprintf("select id from \"%w\".\"%w_ivfrows\" where col = ?",
+                                       schema.c_str(), name.c_str());
+            auto rc = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
+            sqlite3_free(sql);
+            if (rc != SQLITE_OK)
+                return rc;
+
+            sqlite3_bind_int(stmt, 1, column);
+            while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                auto id = sqlite3_column_int64(stmt, 0);
+                if (moved.find(id) == moved.end())
+                    ids->push_back(id);
+            }
+            sqlite3_finalize(stmt);
+            if (rc != SQLITE_DONE)
+                return rc;
         }
 
-        return result;
+        for (auto &entry : moved)
+            if (entry.second >= 0)
+                ids->push_back(entry.first);
+        return SQLITE_OK;
     }
-}
 
-static int shadow_data_insert(sqlite3 *db,
-                              char *schema,
-                              char *name,
-                              sqlite3_int64 *rowid,
-                              sqlite3_int64 *retRowid) {
+    size_t list_size(size_t list_no) const override { return sizes[list_no]; }
 
-    sqlite3_stmt *stmt;
+    const uint8_t *get_codes(size_t list_no) const override {
 
-    if (rowid == nullptr) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto &entry = load(list_no);
+        entry.pins++;
+        evict();
+        return entry.codes.data();
+    }
 
-        auto sql = sqlite3_mprintf(
-            "insert into \"%w\".\"%w_data\"(_) values (?)", schema, name);
+    const faiss::idx_t *get_ids(size_t list_no) const override {
 
-        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
-        sqlite3_free(sql);
+        std::lock_guard<std::mutex> lock(mutex);
+        auto &entry = load(list_no);
+        entry.pins++;
+        evict();
+        return entry.ids.data();
+    }
 
-        if (rc != SQLITE_OK || stmt == nullptr) {
-            return SQLITE_ERROR;
-        }
+    void release_codes(size_t list_no, const uint8_t *) const override { release(list_no); }
 
-        sqlite3_bind_null(stmt, 1);
-        if (sqlite3_step(stmt) != SQLITE_DONE) {
-            sqlite3_finalize(stmt);
-            return SQLITE_ERROR;
-        }
+    void release_ids(size_t list_no, const faiss::idx_t *) const override { release(list_no); }
 
-    } else {
+    size_t add_entries(size_t list_no, size_t n_entry, const faiss::idx_t *ids, const uint8_t *codes) override {
 
-        auto sql = sqlite3_mprintf(
-            "insert into \"%w\".\"%w_data\"(rowid, _) values (?, ?);", schema,
-            name);
+        std::lock_guard<std::mutex> lock(mutex);
+        auto &entry = load(list_no);
 
-        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
-        sqlite3_free(sql);
+        auto offset = entry.ids.size();
+        entry.ids.insert(entry.ids.end(), ids, ids + n_entry);
+        entry.codes.insert(entry.codes.end(), codes, codes + n_entry * code_size);
+        entry.dirty = true;
 
-        if (rc != SQLITE_OK || stmt == nullptr)
-            return SQLITE_ERROR;
+        if (track_rows)
+            for (size_t i = 0; i < n_entry; i++)
+                moved[ids[i]] = list_no;
 
-        sqlite3_bind_int64(stmt, 1, *rowid);
-        sqlite3_bind_null(stmt, 2);
-        if (sqlite3_step(stmt) != SQLITE_DONE) {
-            sqlite3_finalize(stmt);
-            return SQLITE_ERROR;
-        }
+        cached_bytes += n_entry * (sizeof(faiss::idx_t) + code_size);
+        sizes[list_no] = entry.ids.size();
+        return offset;
+    }
 
-        if (retRowid != nullptr)
-            *retRowid = sqlite3_last_insert_rowid(db);
+    void update_entries(size_t list_no, size_t offset, size_t n_entry, const faiss::idx_t *ids, const uint8_t *codes) override {
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto &entry = load(list_no);
+
+        // memmove, faiss moves entries within the same list when removing.
+        memmove(entry.ids.data() + offset, ids, n_entry * sizeof(faiss::idx_t));
+        memmove(entry.codes.data() + offset * code_size, codes, n_entry * code_size);
+        entry.dirty = true;
     }
 
-    sqlite3_finalize(stmt);
-    return SQLITE_OK;
-}
+    void resize(size_t list_no, size_t new_size) override {
 
-static int shadow_data_delete(sqlite3 *db,
-                              char *schema,
-                              char *name,
-                              sqlite3_int64 rowid) {
-    sqlite3_stmt *stmt;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto &entry = load(list_no);
 
-    // TODO: We should strive to use only one concept and idea while creating
-    // SQL statements.
-    auto query = sqlite3_str_new(0);
+        cached_bytes -= entry.ids.size() * (sizeof(faiss::idx_t) + code_size);
+        entry.ids.resize(new_size);
+        entry.codes.resize(new_size * code_size);
+        entry.dirty = true;
 
-    sqlite3_str_appendf(query, "delete from \"%w\".\"%w_data\" where rowid = ?",
-                        schema, name);
+        cached_bytes += new_size * (sizeof(faiss::idx_t) + code_size);
+        sizes[list_no] = new_size;
+    }
 
-    auto sql = sqlite3_str_finish(query);
+    // Empties every list without reading them first.
+    void reset() override {
 
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
-    if (rc != SQLITE_OK || stmt == nullptr)
-        return SQLITE_ERROR;
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t list_no = 0; list_no < nlist; list_no++) {
 
-    sqlite3_bind_int64(stmt, 1, rowid);
-    if (sqlite3_step(stmt) != SQLITE_DONE) {
-        sqlite3_finalize(stmt);
-        return SQLITE_ERROR;
+            if (sizes[list_no] == 0)
+                continue;
+
+            auto &entry = load_empty(list_no);
+            cached_bytes -= entry.ids.size() * (sizeof(faiss::idx_t) + code_size);
+            entry.ids.clear();
+            entry.codes.clear();
+            entry.dirty = true;
+            sizes[list_no] = 0;
+        }
+
+        moved.clear();
+        rows_cleared = track_rows;
     }
 
-    sqlite3_free(sql);
-    sqlite3_finalize(stmt);
-    return SQLITE_OK;
-}
+  private:
 
-static faiss::Index *read_index_select(sqlite3 *db, const char *schema, const char *table_name, int indexId, string col_name, StorageType storage_type) {
+    cached_list &load_empty(size_t list_no) const {
 
+        auto it = cache.find(list_no);
+        if (it != cache.end()) {
+            lru.splice(lru.begin(), lru, it->second.lru);
+            return it->second;
+        }
 
-    if (storage_type == StorageType::faiss_ondisk) {
+        auto &entry = cache[list_no];
+        lru.push_front(list_no);
+        entry.lru = lru.begin();
+        return entry;
+    }
 
-        const string index_filename = get_index_filename(db, schema, table_name, col_name);
-        return faiss::read_index(index_filename.c_str());
+    // The cached list, read from the shadow table if needed. Throws when the
+    // read fails.
+    cached_list &load(size_t list_no) const {
 
-    } else {
+        auto cached = cache.find(list_no) != cache.end();
+        auto &entry = load_empty(list_no);
+        if (cached || sizes[list_no] == 0)
+            return entry;
 
-        sqlite3_stmt *stmt;
-        auto sql = sqlite3_mprintf("select idx from \"%w_index\" where rowid = ?", table_name);
+        auto rc = SQLITE_OK;
+        if (select == nullptr) {
+            auto sql = sqlite3_mprintf("select ids, codes from \"%w\".\"%w_ivflists\" where col = ? and list = ?",
+                                       schema.c_str(), name.c_str());
+            rc = sqlite3_prepare_v2(db, sql, -1, &select, nullptr);
+            sqlite3_free(sql);
+        }
 
-        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
-        if (rc != SQLITE_OK || stmt == nullptr) {
-            finalize_and_free(stmt, sql);
-            return nullptr;
+        if (rc == SQLITE_OK) {
+            sqlite3_bind_int(select, 1, column);
+            sqlite3_bind_int64(select, 2, list_no);
+            rc = sqlite3_step(select);
         }
 
-        sqlite3_bind_int64(stmt, 1, indexId);
-        if ((rc = sqlite3_step(stmt)) != SQLITE_ROW) {
-            finalize_and_free(stmt, sql);
-            return nullptr;
+        size_t n = sizes[list_no];
+        if (rc != SQLITE_ROW || (size_t)sqlite3_column_bytes(select, 0) != n * sizeof(faiss::idx_t) ||
+            (size_t)sqlite3_column_bytes(select, 1) != n * code_size) {
+
+            auto message = string("could not read inverted list ") + std::to_string(list_no) + ": " + sqlite3_errmsg(db);
+            if (select != nullptr)
+                sqlite3_reset(select);
+            cache.erase(list_no);
+            lru.pop_front();
+            throw faiss::FaissException(message);
         }
 
-        auto index_data = sqlite3_column_blob(stmt, 0);
-        int64_t size = sqlite3_column_bytes(stmt, 0);
+        entry.ids.resize(n);
+        entry.codes.resize(n * code_size);
+        memcpy(entry.ids.data(), sqlite3_column_blob(select, 0), n * sizeof(faiss::idx_t));
+        memcpy(entry.codes.data(), sqlite3_column_blob(select, 1), n * code_size);
+        sqlite3_reset(select);
 
-        faiss::VectorIOReader reader;
-        copy((const uint8_t *)index_data,
-            ((const uint8_t *)index_data) + size,
-            back_inserter(reader.data));
+        cached_bytes += n * (sizeof(faiss::idx_t) + code_size);
+        return entry;
+    }
 
-        finalize_and_free(stmt, sql);
+    void release(size_t list_no) const {
 
-        return faiss::read_index(&reader);
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = cache.find(list_no);
+        if (it != cache.end() && it->second.pins > 0)
+            it->second.pins--;
+        evict();
     }
-}
 
-static int create_shadow_tables(sqlite3 *db,
-                                const char *schema,
-                                const char *name,
-                                vector<vss_index *> indices) {
+    // Drops least recently used lists that are neither in use nor waiting to
+    // be written, until the cache fits its budget again.
+    void evict() const {
 
+        for (auto it = lru.end(); cached_bytes > VSS_IVFLISTS_CACHE_BYTES && it != lru.begin();) {
 
-    // make the _index shadow tables if there's at least 1 column that uses the default faiss_shadow
-    bool skip_shadow_index = true;
-    for (auto i : indices) {
-        if (i->storage_type == StorageType::faiss_shadow) {
-            skip_shadow_index = false;
+            --it;
+            auto &entry = cache.at(*it);
+            if (entry.pins > 0 || entry.dirty)
+                continue;
+
+            cached_bytes -= entry.ids.size() * (sizeof(faiss::idx_t) + code_size);
+            cache.erase(*it);
+            it = lru.erase(it);
         }
     }
 
-    if (!skip_shadow_index) {
-        auto sql = sqlite3_mprintf("create table \"%w\".\"%w_index\"(rowid integer primary key autoincrement, idx)",
-                                    schema,
-                                    name);
+    int write_list(size_t list_no, const faiss::idx_t *ids, const uint8_t *codes, size_t n) {
 
-        auto rc = sqlite3_exec(db, sql, 0, 0, 0);
+        sqlite3_stmt *stmt;
+        auto sql = n == 0
+            ? sqlite3_mprintf("delete from \"%w\".\"%w_ivflists\" where col = ?1 and list = ?2",
+                              schema.c_str(), name.c_str())
+            : sqlite3_mprintf("insert or replace into \"%w\".\"%w_ivflists\"(col, list, ids, codes) values (?1, ?2, ?3, ?4)",
+                              schema.c_str(), name.c_str());
+        auto rc = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
         sqlite3_free(sql);
         if (rc != SQLITE_OK)
             return rc;
 
+        sqlite3_bind_int(stmt, 1, column);
+        sqlite3_bind_int64(stmt, 2, list_no);
+        if (n > 0) {
+            sqlite3_bind_blob64(stmt, 3, ids, n * sizeof(faiss::idx_t), SQLITE_STATIC);
+            sqlite3_bind_blob64(stmt, 4, codes, n * code_size, SQLITE_STATIC);
+        }
+
+        sqlite3_step(stmt);
+        return sqlite3_finalize(stmt);
     }
 
-    auto sql = sqlite3_mprintf("create table \"%w\".\"%w_data\"(rowid integer primary key autoincrement, _);",
-                          schema,
-                          name);
+    // The list rowid id is in, -1 when none holds it.
+    int64_t list_of(faiss::idx_t id) const {
 
-    auto rc = sqlite3_exec(db, sql, nullptr, nullptr, nullptr);
-    sqlite3_free(sql);
-    return rc;
-}
+        auto it = moved.find(id);
+        if (it != moved.end())
+            return it->second;
+        if (rows_cleared)
+            return -1;
 
-static int drop_shadow_tables(sqlite3 *db, char *name) {
+        sqlite3_stmt *stmt;
+        auto sql = sqlite3_mprintf("select list from \"%w\".\"%w_ivfrows\" where col = ? and id = ?",
+                                   schema.c_str(), name.c_str());
+        auto rc = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK)
+            throw faiss::FaissException(string("could not read _ivfrows: ") + sqlite3_errmsg(db));
 
-    const char *drops[2] = {"drop table \"%w_index\";",
-                            "drop table \"%w_data\";"};
+        sqlite3_bind_int(stmt, 1, column);
+        sqlite3_bind_int64(stmt, 2, id);
+        rc = sqlite3_step(stmt);
+        int64_t list_no = rc == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : -1;
+        sqlite3_finalize(stmt);
 
-    for (int i = 0; i < 2; i++) {
+        if (rc != SQLITE_ROW && rc != SQLITE_DONE)
+            throw faiss::FaissException(string("could not read _ivfrows: ") + sqlite3_errmsg(db));
+        return list_no;
+    }
 
-        auto curSql = drops[i];
+    bool locate_locked(faiss::idx_t id, size_t *list_no, size_t *offset) const {
 
-        sqlite3_stmt *stmt;
+        auto list = list_of(id);
+        if (list < 0 || (size_t)list >= nlist)
+            return false;
 
-        // TODO: Use of one construct to create SQL statements.
-        sqlite3_str *query = sqlite3_str_new(0);
-        sqlite3_str_appendf(query, curSql, name);
-        char *sql = sqlite3_str_finish(query);
+        auto &entry = load(list);
+        auto found = std::find(entry.ids.begin(), entry.ids.end(), id);
+        if (found == entry.ids.end())
+            return false;
 
-        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
-        if (rc != SQLITE_OK || stmt == nullptr) {
-            sqlite3_free(sql);
-            return SQLITE_ERROR;
-        }
+        *list_no = list;
+        *offset = found - entry.ids.begin();
+        return true;
+    }
 
-        if (sqlite3_step(stmt) != SQLITE_DONE) {
+    // Writes the lists rowids moved to since the last flush to _ivfrows.
+    int write_rows() {
+
+        if (!track_rows || (moved.empty() && !rows_cleared))
+            return SQLITE_OK;
+
+        int rc;
+        if (rows_cleared) {
+            auto sql = sqlite3_mprintf("delete from \"%w\".\"%w_ivfrows\" where col = %d",
+                                       schema.c_str(), name.c_str(), column);
+            rc = sqlite3_exec(db, sql, nullptr, nullptr, nullptr);
             sqlite3_free(sql);
-            sqlite3_finalize(stmt);
-            return SQLITE_ERROR;
+            if (rc != SQLITE_OK)
+                return rc;
         }
 
+        sqlite3_stmt *upsert, *remove = nullptr;
+        auto sql = sqlite3_mprintf("insert or replace into \"%w\".\"%w_ivfrows\"(col, id, list) values (?1, ?2, ?3)",
+                                   schema.c_str(), name.c_str());
+        rc = sqlite3_prepare_v2(db, sql, -1, &upsert, nullptr);
         sqlite3_free(sql);
-        sqlite3_finalize(stmt);
-    }
-    return SQLITE_OK;
-}
+        if (rc != SQLITE_OK)
+            return rc;
 
-#define VSS_SEARCH_FUNCTION SQLITE_INDEX_CONSTRAINT_FUNCTION
-#define VSS_RANGE_SEARCH_FUNCTION SQLITE_INDEX_CONSTRAINT_FUNCTION + 1
+        sql = sqlite3_mprintf("delete from \"%w\".\"%w_ivfrows\" where col = ?1 and id = ?2",
+                              schema.c_str(), name.c_str());
+        rc = sqlite3_prepare_v2(db, sql, -1, &remove, nullptr);
+        sqlite3_free(sql);
 
-// Tokens types when parsing vss0 column definitions
-enum TokenType {
-  LPAREN = 1,
-  RPAREN = 2,
-  EQUAL = 3,
-  IDENTIFIER = 50,
-  STRING = 51,
-  INTEGER = 52
-};
+        for (auto it = moved.begin(); it != moved.end() && rc == SQLITE_OK; ++it) {
 
-// Tokens types when parsing vss0 column definitions
-struct Token {
-public:
-  TokenType token_type;
-  // Only definied when token_type == TokenType::IDENTIFIER
-  string identifier_value;
-  // Only definied when token_type == TokenType::STRING
-  string string_value;
-  // Only definied when token_type == TokenType::INTEGER
-  int int_value;
+            auto stmt = it->second >= 0 ? upsert : remove;
+            sqlite3_bind_int(stmt, 1, column);
+            sqlite3_bind_int64(stmt, 2, it->first);
+            if (it->second >= 0)
+                sqlite3_bind_int64(stmt, 3, it->second);
 
-  explicit Token(TokenType token_type) : token_type(token_type) {}
-  // TODO: maybe these should just be different classes that inherit Token? idk C++ man
-  static Token IdentifierToken(string value){
-    Token token(TokenType::IDENTIFIER);
-    token.identifier_value = value;
-    return token;
-  }
-  static Token StringToken(string value){
-    Token token(TokenType::STRING);
-    token.string_value = value;
-    return token;
-  }
-  static Token IntToken(int value){
-    Token token(TokenType::INTEGER);
-    token.int_value = value;
-    return token;
-  }
+            rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode(db);
+            sqlite3_reset(stmt);
+        }
+
+        sqlite3_finalize(upsert);
+        sqlite3_finalize(remove);
+        if (rc != SQLITE_OK)
+            return rc;
+
+        moved.clear();
+        rows_cleared = false;
+        return SQLITE_OK;
+    }
 };
 
-// scans through a vss0 column definition string
-struct Scanner {
-public:
-  explicit Scanner(string source): source(source), idx(0), len(source.length()) {}
-  char advance() {
-    return source[idx++];
-  }
-  optional<char> peek() {
-    if(idx >= len) {
-      return {};
+#pragma endregion
+
+#pragma region Vamana graph index
+
+// Size of the candidate list kept while searching or inserting into a Vamana
+// column, raised to k for larger searches.
+static const size_t VSS_VAMANA_SEARCH_LIST = 100;
+
+// Pruning slack when choosing a node's neighbors: a candidate is dropped when
+// an already chosen neighbor is VSS_VAMANA_ALPHA times closer to it.
+static const float VSS_VAMANA_ALPHA = 1.2f;
+
+// A search expands this many nodes per step, read in one query.
+static const size_t VSS_VAMANA_BEAM_WIDTH = 4;
+
+// Nodes are read through a statement with this many placeholders.
+static const size_t VSS_VAMANA_READ_BATCH = 16;
+
+// Clean nodes are evicted once the cache holds more than about this many bytes.
+static const size_t VSS_VAMANA_CACHE_BYTES = 64 * 1024 * 1024;
+
+// Deleted nodes stay in the graph, and keep it navigable, until they are more
+// than this fraction of the live ones. The graph is then repaired in one pass.
+static const double VSS_VAMANA_CONSOLIDATE_RATIO = 0.1;
+
+static const char VSS_VAMANA_MAGIC[4] = {'V', 's', 'V', 'm'};
+
+// A Vamana (DiskANN) graph index, built with factory="Vamana{R}" or
+// "Vamana{R},PQ{M}". Each node's full vector and its at most R neighbors are a
+// row of the <table>_graph shadow table, read as searches visit them and kept
+// in an LRU cache. Only the rowids and, with PQ, the M byte codes of the
+// vectors stay in memory: searches rank candidates with the codes and rerank
+// the visited nodes with their full vectors.
+//
+// New nodes, and the nodes whose neighbors they change, stay in the cache
+// until flush() writes them. Until the index is first written it has no
+// table, and holds every node in memory.
+struct vss_vamana_index : faiss::Index {
+
+    vss_vamana_index(int d, faiss::MetricType metric, int R, int pq_m)
+      : faiss::Index(d, metric), R(R) {
+
+        if (metric != faiss::METRIC_L2 && metric != faiss::METRIC_INNER_PRODUCT)
+            throw faiss::FaissException("Vamana indexes only support the L2 and INNER_PRODUCT metrics");
+        if (R < 2)
+            throw faiss::FaissException("Vamana indexes need at least 2 neighbors per node");
+
+        if (pq_m > 0)
+            pq.reset(new faiss::ProductQuantizer(d, pq_m, 8));
+        is_trained = pq == nullptr;
+    }
+
+    ~vss_vamana_index() { sqlite3_finalize(select); }
+
+    int R;
+    size_t search_list = VSS_VAMANA_SEARCH_LIST;
+    float alpha = VSS_VAMANA_ALPHA;
+    unique_ptr<faiss::ProductQuantizer> pq;
+    faiss::idx_t entry = -1;
+
+    // Live nodes: the rowid of each slot, the slot of each rowid, and the PQ
+    // codes by slot.
+    vector<faiss::idx_t> ids;
+    std::unordered_map<faiss::idx_t, size_t> slots;
+    vector<uint8_t> codes;
+
+    // Deleted nodes still linked in the graph, with their PQ codes.
+    std::unordered_map<faiss::idx_t, vector<uint8_t>> deleted;
+
+    // Work done by the last search() call, see record_search_work().
+    mutable size_t nodes_read = 0;
+    mutable size_t distances_computed = 0;
+
+    sqlite3 *db = nullptr;
+    string schema;
+    string name;
+    int column = -1;
+
+    struct node {
+        vector<float> x;
+        vector<faiss::idx_t> neighbors;
+        bool dirty = false;
+        std::list<faiss::idx_t>::iterator lru;
+    };
+
+    // Most recently used nodes first.
+    mutable std::unordered_map<faiss::idx_t, node> cache;
+    mutable std::list<faiss::idx_t> lru;
+    mutable size_t cached_bytes = 0;
+    mutable sqlite3_stmt *select = nullptr;
+
+    // Rows to delete on the next flush, and whether the column's rows must
+    // all be replaced.
+    std::unordered_set<faiss::idx_t> removed_rows;
+    bool rewrite = true;
+
+    size_t code_size() const { return pq != nullptr ? pq->code_size : 0; }
+
+    void train(faiss::idx_t n, const float *x) override {
+
+        if (pq != nullptr)
+            pq->train(n, x);
+        is_trained = true;
+    }
+
+    void add(faiss::idx_t, const float *) override {
+        throw faiss::FaissException("Vamana indexes need rowids, use add_with_ids()");
+    }
+
+    void add_with_ids(faiss::idx_t n, const float *x, const faiss::idx_t *xids) override {
+
+        if (!is_trained)
+            throw faiss::FaissException("Vamana index is not trained");
+
+        for (faiss::idx_t i = 0; i < n; i++) {
+            insert(xids[i], x + i * d);
+            evict();
+        }
+    }
+
+    void search(faiss::idx_t n,
+                const float *x,
+                faiss::idx_t k,
+                float *distances,
+                faiss::idx_t *labels,
+                const faiss::SearchParameters * = nullptr) const override {
+
+        nodes_read = 0;
+        distances_computed = 0;
+
+        for (faiss::idx_t i = 0; i < n; i++) {
+
+            auto visited = beam_search(x + i * d, max(search_list, (size_t)k), metric_type, true);
+
+            faiss::idx_t found = 0;
+            for (auto &candidate : visited) {
+                if (found == k)
+                    break;
+                if (slots.count(candidate.second) == 0)
+                    continue;
+
+                distances[i * k + found] = metric_type == faiss::METRIC_INNER_PRODUCT ? -candidate.first : candidate.first;
+                labels[i * k + found] = candidate.second;
+                found++;
+            }
+
+            for (; found < k; found++) {
+                distances[i * k + found] = metric_type == faiss::METRIC_INNER_PRODUCT ? -HUGE_VALF : HUGE_VALF;
+                labels[i * k + found] = -1;
+            }
+            evict();
+        }
+    }
+
+    void reset() override {
+
+        ids.clear();
+        slots.clear();
+        codes.clear();
+        deleted.clear();
+        cache.clear();
+        lru.clear();
+        removed_rows.clear();
+        cached_bytes = 0;
+        entry = -1;
+        ntotal = 0;
+        rewrite = true;
+    }
+
+    size_t remove_ids(const faiss::IDSelector &sel) override {
+
+        size_t removed = 0;
+        for (size_t slot = 0; slot < ids.size();) {
+
+            if (!sel.is_member(ids[slot])) {
+                slot++;
+                continue;
+            }
+
+            auto id = ids[slot];
+            auto code = codes.begin() + slot * code_size();
+            deleted[id] = vector<uint8_t>(code, code + code_size());
+            remove_slot(slot);
+            removed++;
+        }
+
+        if (deleted.size() > VSS_VAMANA_CONSOLIDATE_RATIO * ntotal)
+            consolidate();
+        return removed;
+    }
+
+    void reconstruct(faiss::idx_t key, float *recons) const override {
+
+        if (slots.count(key) == 0)
+            throw faiss::FaissException("rowid " + std::to_string(key) + " is not in the Vamana index");
+
+        auto &found = fetch(key);
+        memcpy(recons, found.x.data(), d * sizeof(float));
+        evict();
+    }
+
+    // Bytes held in memory besides the serialized header: the slots and
+    // their hash map, the codes, the deleted nodes, and the cached nodes with
+    // their map entries and LRU links.
+    size_t resident_bytes() const {
+
+        return ids.size() * sizeof(faiss::idx_t) + slots.size() * VSS_HASH_ENTRY_BYTES + codes.size() +
+               deleted.size() * (VSS_HASH_ENTRY_BYTES + sizeof(vector<uint8_t>) + code_size()) +
+               removed_rows.size() * VSS_HASH_ENTRY_BYTES +
+               cache.size() * (VSS_HASH_ENTRY_BYTES + sizeof(node) + 3 * sizeof(void *)) + cached_bytes;
+    }
+
+    // The header: parameters, entry point, PQ centroids and deleted rowids.
+    // Nodes live in the _graph shadow table.
+    void write(faiss::IOWriter *writer) const {
+
+        int32_t header[5] = {d, (int32_t)metric_type, R, is_trained, pq != nullptr};
+        int64_t counts[3] = {(int64_t)search_list, entry, (int64_t)deleted.size()};
+
+        (*writer)(VSS_VAMANA_MAGIC, 1, sizeof(VSS_VAMANA_MAGIC));
+        (*writer)(header, sizeof(int32_t), 5);
+        (*writer)(&alpha, sizeof(float), 1);
+        (*writer)(counts, sizeof(int64_t), 3);
+
+        for (auto &tombstone : deleted)
+            (*writer)(&tombstone.first, sizeof(faiss::idx_t), 1);
+
+        if (pq != nullptr)
+            faiss::write_ProductQuantizer(pq.get(), writer);
+    }
+
+    static bool is_header(const void *data, size_t size) {
+        return size >= sizeof(VSS_VAMANA_MAGIC) && memcmp(data, VSS_VAMANA_MAGIC, sizeof(VSS_VAMANA_MAGIC)) == 0;
+    }
+
+    // Reads a header written by write(), and the codes of its nodes from the
+    // _graph shadow table.
+    static vss_vamana_index *read(faiss::IOReader *reader, sqlite3 *db, const char *schema, const char *name, int column) {
+
+        char magic[4];
+        int32_t header[5];
+        float alpha;
+        int64_t counts[3];
+
+        if ((*reader)(magic, 1, sizeof(magic)) != sizeof(magic) ||
+            (*reader)(header, sizeof(int32_t), 5) != 5 ||
+            (*reader)(&alpha, sizeof(float), 1) != 1 ||
+            (*reader)(counts, sizeof(int64_t), 3) != 3)
+            throw faiss::FaissException("truncated Vamana index header");
+
+        unique_ptr<vss_vamana_index> index(new vss_vamana_index(header[0], (faiss::MetricType)header[1], header[2], 0));
+        index->is_trained = header[3];
+        index->alpha = alpha;
+        index->search_list = counts[0];
+        index->entry = counts[1];
+
+        vector<faiss::idx_t> deleted(counts[2]);
+        if ((*reader)(deleted.data(), sizeof(faiss::idx_t), deleted.size()) != deleted.size())
+            throw faiss::FaissException("truncated Vamana index header");
+
+        if (header[4])
+            index->pq.reset(faiss::read_ProductQuantizer(reader));
+
+        index->db = db;
+        index->schema = schema;
+        index->name = name;
+        index->column = column;
+        index->rewrite = false;
+
+        std::unordered_set<faiss::idx_t> tombstones(deleted.begin(), deleted.end());
+        index->load_codes(tombstones);
+        return index.release();
+    }
+
+    // Writes the changed nodes to the _graph shadow table, replacing all of
+    // the column's rows the first time.
+    int flush(sqlite3 *db, const char *schema, const char *name, int column) {
+
+        if (this->db == nullptr) {
+            this->db = db;
+            this->schema = schema;
+            this->name = name;
+            this->column = column;
+            rewrite = true;
+        }
+
+        int rc;
+        if (rewrite) {
+            auto sql = sqlite3_mprintf("delete from \"%w\".\"%w_graph\" where col = %d", schema, name, column);
+            rc = sqlite3_exec(db, sql, nullptr, nullptr, nullptr);
+            sqlite3_free(sql);
+            if (rc != SQLITE_OK)
+                return rc;
+            removed_rows.clear();
+        }
+
+        sqlite3_stmt *stmt;
+        auto sql = sqlite3_mprintf("delete from \"%w\".\"%w_graph\" where col = ?1 and node = ?2", schema, name);
+        rc = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK)
+            return rc;
+
+        for (auto id : removed_rows) {
+            sqlite3_bind_int(stmt, 1, column);
+            sqlite3_bind_int64(stmt, 2, id);
+            sqlite3_step(stmt);
+            if ((rc = sqlite3_reset(stmt)) != SQLITE_OK)
+                break;
+        }
+        sqlite3_finalize(stmt);
+        if (rc != SQLITE_OK)
+            return rc;
+        removed_rows.clear();
+
+        sql = sqlite3_mprintf("insert or replace into \"%w\".\"%w_graph\"(col, node, code, vector, neighbors) values (?1, ?2, ?3, ?4, ?5)",
+                              schema, name);
+        rc = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK)
+            return rc;
+
+        for (auto &cached : cache) {
+
+            if (!cached.second.dirty)
+                continue;
+
+            sqlite3_bind_int(stmt, 1, column);
+            sqlite3_bind_int64(stmt, 2, cached.first);
+            sqlite3_bind_blob64(stmt, 3, code_of(cached.first), code_size(), SQLITE_STATIC);
+            sqlite3_bind_blob64(stmt, 4, cached.second.x.data(), cached.second.x.size() * sizeof(float), SQLITE_STATIC);
+            sqlite3_bind_blob64(stmt, 5, cached.second.neighbors.data(),
+                                cached.second.neighbors.size() * sizeof(faiss::idx_t), SQLITE_STATIC);
+            sqlite3_step(stmt);
+            if ((rc = sqlite3_reset(stmt)) != SQLITE_OK)
+                break;
+            cached.second.dirty = false;
+        }
+        sqlite3_finalize(stmt);
+        if (rc != SQLITE_OK)
+            return rc;
+
+        rewrite = false;
+        evict();
+        return SQLITE_OK;
+    }
+
+  private:
+
+    void load_codes(const std::unordered_set<faiss::idx_t> &tombstones) {
+
+        sqlite3_stmt *stmt;
+        auto sql = sqlite3_mprintf("select node, code from \"%w\".\"%w_graph\" where col = ? order by node",
+                                   schema.c_str(), name.c_str());
+        auto rc = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK)
+            throw faiss::FaissException(string("could not read Vamana nodes: ") + sqlite3_errmsg(db));
+
+        sqlite3_bind_int(stmt, 1, column);
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+
+            auto id = sqlite3_column_int64(stmt, 0);
+            auto code = (const uint8_t *)sqlite3_column_blob(stmt, 1);
+            if ((size_t)sqlite3_column_bytes(stmt, 1) != code_size())
+                break;
+
+            if (tombstones.count(id) > 0) {
+                deleted[id] = vector<uint8_t>(code, code + code_size());
+                continue;
+            }
+
+            slots[id] = ids.size();
+            ids.push_back(id);
+            codes.insert(codes.end(), code, code + code_size());
+        }
+        sqlite3_finalize(stmt);
+
+        if (rc != SQLITE_DONE)
+            throw faiss::FaissException(string("could not read Vamana nodes: ") + sqlite3_errmsg(db));
+        ntotal = ids.size();
+    }
+
+    const uint8_t *code_of(faiss::idx_t id) const {
+
+        auto slot = slots.find(id);
+        if (slot != slots.end())
+            return codes.data() + slot->second * code_size();
+
+        auto tombstone = deleted.find(id);
+        return tombstone != deleted.end() ? tombstone->second.data() : nullptr;
+    }
+
+    bool in_graph(faiss::idx_t id) const { return slots.count(id) > 0 || deleted.count(id) > 0; }
+
+    void remove_slot(size_t slot) {
+
+        auto last = ids.size() - 1;
+        slots.erase(ids[slot]);
+
+        if (slot != last) {
+            ids[slot] = ids[last];
+            slots[ids[slot]] = slot;
+            memcpy(codes.data() + slot * code_size(), codes.data() + last * code_size(), code_size());
+        }
+
+        ids.pop_back();
+        codes.resize(ids.size() * code_size());
+        ntotal = ids.size();
+    }
+
+    static size_t node_bytes(const node &n) {
+        return n.x.size() * sizeof(float) + n.neighbors.size() * sizeof(faiss::idx_t);
+    }
+
+    // Smaller is closer, inner products are negated.
+    float distance(const float *a, const float *b, faiss::MetricType metric) const {
+        return metric == faiss::METRIC_INNER_PRODUCT ? -faiss::fvec_inner_product(a, b, d) : faiss::fvec_L2sqr(a, b, d);
+    }
+
+    void drop(faiss::idx_t id) const {
+
+        auto found = cache.find(id);
+        if (found == cache.end())
+            return;
+
+        cached_bytes -= node_bytes(found->second);
+        lru.erase(found->second.lru);
+        cache.erase(found);
+    }
+
+    node &touch(faiss::idx_t id) const {
+
+        auto &found = cache.at(id);
+        lru.splice(lru.begin(), lru, found.lru);
+        return found;
+    }
+
+    // Reads the rows of the nodes that aren't cached yet, VSS_VAMANA_READ_BATCH
+    // at a time. Throws when a node can't be read.
+    void prefetch(const vector<faiss::idx_t> &wanted) const {
+
+        vector<faiss::idx_t> missing;
+        for (auto id : wanted)
+            if (cache.count(id) == 0 && find(missing.begin(), missing.end(), id) == missing.end())
+                missing.push_back(id);
+
+        if (missing.empty())
+            return;
+        if (db == nullptr)
+            throw faiss::FaissException("Vamana node " + std::to_string(missing[0]) + " is missing");
+
+        if (select == nullptr) {
+
+            auto str = sqlite3_str_new(nullptr);
+            sqlite3_str_appendf(str, "select node, vector, neighbors from \"%w\".\"%w_graph\" where col = ? and node in (?",
+                                schema.c_str(), name.c_str());
+            for (size_t i = 1; i < VSS_VAMANA_READ_BATCH; i++)
+                sqlite3_str_appendall(str, ", ?");
+            sqlite3_str_appendall(str, ")");
+
+            auto sql = sqlite3_str_finish(str);
+            auto rc = sqlite3_prepare_v2(db, sql, -1, &select, nullptr);
+            sqlite3_free(sql);
+            if (rc != SQLITE_OK)
+                throw faiss::FaissException(string("could not read Vamana nodes: ") + sqlite3_errmsg(db));
+        }
+
+        for (size_t start = 0; start < missing.size(); start += VSS_VAMANA_READ_BATCH) {
+
+            sqlite3_bind_int(select, 1, column);
+            for (size_t i = 0; i < VSS_VAMANA_READ_BATCH; i++) {
+                if (start + i < missing.size())
+                    sqlite3_bind_int64(select, i + 2, missing[start + i]);
+                else
+                    sqlite3_bind_null(select, i + 2);
+            }
+
+            int rc;
+            while ((rc = sqlite3_step(select)) == SQLITE_ROW) {
+
+                auto id = sqlite3_column_int64(select, 0);
+                if ((size_t)sqlite3_column_bytes(select, 1) != d * sizeof(float))
+                    break;
+
+                auto &loaded = cache[id];
+                loaded.x.resize(d);
+                memcpy(loaded.x.data(), sqlite3_column_blob(select, 1), d * sizeof(float));
+                loaded.neighbors.resize(sqlite3_column_bytes(select, 2) / sizeof(faiss::idx_t));
+                if (!loaded.neighbors.empty())
+                    memcpy(loaded.neighbors.data(), sqlite3_column_blob(select, 2),
+                           loaded.neighbors.size() * sizeof(faiss::idx_t));
+
+                lru.push_front(id);
+                loaded.lru = lru.begin();
+                cached_bytes += node_bytes(loaded);
+                nodes_read++;
+            }
+            sqlite3_reset(select);
+
+            if (rc != SQLITE_DONE)
+                throw faiss::FaissException(string("could not read Vamana nodes: ") + sqlite3_errmsg(db));
+        }
+
+        for (auto id : missing)
+            if (cache.count(id) == 0)
+                throw faiss::FaissException("Vamana node " + std::to_string(id) + " is missing");
+    }
+
+    node &fetch(faiss::idx_t id) const {
+
+        if (cache.count(id) == 0)
+            prefetch({id});
+        return touch(id);
+    }
+
+    // Drops least recently used nodes that aren't waiting to be written,
+    // until the cache fits its budget again. Only called between operations,
+    // so no node reference is held.
+    void evict() const {
+
+        if (db == nullptr)
+            return;
+
+        for (auto it = lru.end(); cached_bytes > VSS_VAMANA_CACHE_BYTES && it != lru.begin();) {
+
+            --it;
+            auto &entry = cache.at(*it);
+            if (entry.dirty)
+                continue;
+
+            cached_bytes -= node_bytes(entry);
+            cache.erase(*it);
+            it = lru.erase(it);
+        }
+    }
+
+    // Greedy beam search for query from the entry point. Candidates are ranked
+    // with the PQ codes when there are some, the nodes expanded along the way
+    // are returned closest first, by their full vectors.
+    vector<pair<float, faiss::idx_t>> beam_search(const float *query, size_t L, faiss::MetricType metric, bool use_codes) const {
+
+        vector<pair<float, faiss::idx_t>> visited;
+        if (entry == -1)
+            return visited;
+
+        vector<float> table;
+        use_codes = use_codes && pq != nullptr;
+        if (use_codes) {
+            table.resize(pq->M * pq->ksub);
+            if (metric == faiss::METRIC_INNER_PRODUCT) {
+                pq->compute_inner_prod_table(query, table.data());
+                for (auto &value : table)
+                    value = -value;
+            } else {
+                pq->compute_distance_table(query, table.data());
+            }
+        }
+
+        auto approximate = [&](faiss::idx_t id) {
+            distances_computed++;
+            if (!use_codes)
+                return distance(query, fetch(id).x.data(), metric);
+
+            auto code = code_of(id);
+            float dis = 0;
+            for (size_t m = 0; m < pq->M; m++)
+                dis += table[m * pq->ksub + code[m]];
+            return dis;
+        };
+
+        struct candidate {
+            float dis;
+            faiss::idx_t id;
+            bool expanded;
+        };
+
+        vector<candidate> candidates;
+        std::unordered_set<faiss::idx_t> seen = {entry};
+        candidates.push_back({approximate(entry), entry, false});
+
+        while (true) {
+
+            vector<faiss::idx_t> batch;
+            for (auto &c : candidates) {
+                if (batch.size() == VSS_VAMANA_BEAM_WIDTH)
+                    break;
+                if (!c.expanded) {
+                    c.expanded = true;
+                    batch.push_back(c.id);
+                }
+            }
+            if (batch.empty())
+                break;
+
+            prefetch(batch);
+
+            vector<faiss::idx_t> found;
+            for (auto id : batch) {
+
+                auto &expanded = touch(id);
+                distances_computed++;
+                visited.push_back({distance(query, expanded.x.data(), metric), id});
+
+                for (auto neighbor : expanded.neighbors)
+                    if (in_graph(neighbor) && seen.insert(neighbor).second)
+                        found.push_back(neighbor);
+            }
+
+            // Without codes, ranking the new candidates reads them anyway.
+            if (!use_codes)
+                prefetch(found);
+
+            for (auto id : found) {
+
+                auto dis = approximate(id);
+                if (candidates.size() == L && dis >= candidates.back().dis)
+                    continue;
+
+                auto position = upper_bound(candidates.begin(), candidates.end(), dis,
+                                            [](float value, const candidate &c) { return value < c.dis; });
+                candidates.insert(position, {dis, id, false});
+                if (candidates.size() > L)
+                    candidates.pop_back();
+            }
+        }
+
+        sort(visited.begin(), visited.end());
+        return visited;
+    }
+
+    // Chooses at most R neighbors of x from candidates, closest first,
+    // skipping the ones an already chosen neighbor covers. candidates hold L2
+    // distances to x.
+    vector<faiss::idx_t> robust_prune(faiss::idx_t id, vector<pair<float, faiss::idx_t>> candidates) const {
+
+        sort(candidates.begin(), candidates.end());
+        candidates.erase(unique(candidates.begin(), candidates.end(),
+                                [](const pair<float, faiss::idx_t> &a, const pair<float, faiss::idx_t> &b) {
+                                    return a.second == b.second;
+                                }),
+                         candidates.end());
+
+        vector<faiss::idx_t> pool;
+        for (auto &candidate : candidates)
+            if (candidate.second != id && slots.count(candidate.second) > 0)
+                pool.push_back(candidate.second);
+        prefetch(pool);
+
+        vector<faiss::idx_t> chosen;
+        vector<bool> dropped(candidates.size(), false);
+
+        for (size_t i = 0; i < candidates.size() && chosen.size() < (size_t)R; i++) {
+
+            auto candidate = candidates[i].second;
+            if (dropped[i] || candidate == id || slots.count(candidate) == 0)
+                continue;
+
+            chosen.push_back(candidate);
+            auto &closest = touch(candidate);
+
+            for (size_t j = i + 1; j < candidates.size(); j++) {
+                if (dropped[j] || slots.count(candidates[j].second) == 0)
+                    continue;
+                auto &other = touch(candidates[j].second);
+                if (alpha * distance(closest.x.data(), other.x.data(), faiss::METRIC_L2) <= candidates[j].first)
+                    dropped[j] = true;
+            }
+        }
+        return chosen;
+    }
+
+    // Adds neighbor to the neighbors of id, pruning them when there are too many.
+    void link(faiss::idx_t id, faiss::idx_t neighbor) {
+
+        auto &n = fetch(id);
+        if (find(n.neighbors.begin(), n.neighbors.end(), neighbor) != n.neighbors.end())
+            return;
+
+        cached_bytes -= node_bytes(n);
+        n.dirty = true;
+
+        if (n.neighbors.size() < (size_t)R) {
+            n.neighbors.push_back(neighbor);
+        } else {
+            vector<faiss::idx_t> pool(n.neighbors);
+            pool.push_back(neighbor);
+            prefetch(pool);
+
+            vector<pair<float, faiss::idx_t>> candidates;
+            for (auto other : pool)
+                if (slots.count(other) > 0)
+                    candidates.push_back({distance(n.x.data(), touch(other).x.data(), faiss::METRIC_L2), other});
+            n.neighbors = robust_prune(id, candidates);
+        }
+        cached_bytes += node_bytes(n);
+    }
+
+    void insert(faiss::idx_t id, const float *x) {
+
+        if (slots.count(id) > 0)
+            throw faiss::FaissException("rowid " + std::to_string(id) + " is already in the Vamana index");
+
+        // A rowid deleted and inserted again in the same transaction takes
+        // over its old node: edges to it stay, its own are chosen again.
+        if (deleted.erase(id) > 0) {
+            drop(id);
+            if (entry == id)
+                entry = ids.empty() ? -1 : ids[0];
+        }
+
+        auto visited = entry == -1 ? vector<pair<float, faiss::idx_t>>()
+                                   : beam_search(x, max(search_list, (size_t)R), faiss::METRIC_L2, false);
+
+        slots[id] = ids.size();
+        ids.push_back(id);
+        codes.resize(ids.size() * code_size());
+        if (pq != nullptr)
+            pq->compute_codes(x, codes.data() + slots[id] * code_size(), 1);
+        ntotal = ids.size();
+
+        auto &n = cache[id];
+        lru.push_front(id);
+        n.lru = lru.begin();
+        n.x.assign(x, x + d);
+        n.neighbors = robust_prune(id, visited);
+        n.dirty = true;
+        cached_bytes += node_bytes(n);
+
+        if (entry == -1)
+            entry = id;
+
+        auto neighbors = n.neighbors;
+        for (auto neighbor : neighbors)
+            link(neighbor, id);
+    }
+
+    // Unlinks the deleted nodes: every live node that pointed to one gets
+    // its neighbors re-chosen from its other neighbors and those of the
+    // deleted ones. Reads the whole graph.
+    void consolidate() {
+
+        auto live = ids;
+        for (auto id : live) {
+
+            auto &n = fetch(id);
+            auto touches = any_of(n.neighbors.begin(), n.neighbors.end(),
+                                  [&](faiss::idx_t neighbor) { return deleted.count(neighbor) > 0; });
+            if (!touches) {
+                evict();
+                continue;
+            }
+
+            auto neighbors = n.neighbors;
+            vector<faiss::idx_t> pool;
+            for (auto neighbor : neighbors) {
+
+                if (deleted.count(neighbor) == 0) {
+                    pool.push_back(neighbor);
+                    continue;
+                }
+                for (auto second : fetch(neighbor).neighbors)
+                    if (second != id && slots.count(second) > 0)
+                        pool.push_back(second);
+            }
+            prefetch(pool);
+
+            auto &x = touch(id).x;
+            vector<pair<float, faiss::idx_t>> candidates;
+            for (auto other : pool)
+                if (slots.count(other) > 0)
+                    candidates.push_back({distance(x.data(), touch(other).x.data(), faiss::METRIC_L2), other});
+
+            auto &updated = touch(id);
+            cached_bytes -= node_bytes(updated);
+            updated.neighbors = robust_prune(id, candidates);
+            updated.dirty = true;
+            cached_bytes += node_bytes(updated);
+            evict();
+        }
+
+        if (deleted.count(entry) > 0) {
+
+            auto replacement = ids.empty() ? -1 : ids[0];
+            if (cache.count(entry) > 0 || db != nullptr)
+                for (auto neighbor : fetch(entry).neighbors)
+                    if (slots.count(neighbor) > 0) {
+                        replacement = neighbor;
+                        break;
+                    }
+            entry = replacement;
+        }
+
+        for (auto &tombstone : deleted) {
+            drop(tombstone.first);
+            removed_rows.insert(tombstone.first);
+        }
+        deleted.clear();
+    }
+};
+
+// A Vamana index for factory strings like "Vamana64" or "Vamana64,PQ32",
+// null for other factory strings.
+static vss_vamana_index *vss_vamana_factory(int d, const string &factory, faiss::MetricType metric) {
+
+    if (factory.rfind("Vamana", 0) != 0)
+        return nullptr;
+
+    int R = 0;
+    int M = 0;
+    int consumed = 0;
+    auto spec = factory.c_str();
+
+    if (sscanf(spec, "Vamana%d%n", &R, &consumed) != 1)
+        throw faiss::FaissException("could not parse Vamana factory string " + factory);
+
+    if (spec[consumed] != '\0') {
+        auto rest = spec + consumed;
+        consumed = 0;
+        if (sscanf(rest, ",PQ%d%n", &M, &consumed) != 1 || rest[consumed] != '\0' || M <= 0)
+            throw faiss::FaissException("could not parse Vamana factory string " + factory);
+    }
+
+    return new vss_vamana_index(d, metric, R, M);
+}
+
+#pragma endregion
+
+#pragma region Vtab
+
+// StorageType enum gives options for where to store faiss indices. Default is faiss_shadow.
+// faiss_ondisk -> create files in the same directory as the database file for the indices.
+// faiss_ivflists -> IVF only, the index without its inverted lists goes in the _index shadow
+// table and each inverted list is a row of the _ivflists shadow table, see vss_sqlite_invlists.
+enum StorageType { faiss_shadow, faiss_ondisk, faiss_ivflists };
+
+static const char *storage_type_name(StorageType storage_type) {
+
+    switch (storage_type) {
+        case StorageType::faiss_ondisk: return "faiss_ondisk";
+        case StorageType::faiss_ivflists: return "faiss_ivflists";
+        default: return "faiss_shadow";
+    }
+}
+
+enum QueryType { search, range_search, fullscan };
+
+// Float columns store float32 vectors in a faiss::Index. Binary columns store
+// one bit per dimension in a faiss::IndexBinary, see vss_binary_index.
+enum VectorType { vector_float, vector_binary };
+
+#define VSS_FLAT_BELOW_DEFAULT 10000
+
+struct VssIndexColumn {
+
+    string name;
+    sqlite3_int64 dimensions;
+    string factory;
+    faiss::MetricType metric;
+    StorageType storage_type;
+    VectorType vector_type;
+
+    // Every Nth search also runs an exhaustive search to estimate recall. 0
+    // disables sampling.
+    sqlite3_int64 recall_sample;
+
+    // On partitioned tables, partitions with fewer vectors than this keep a
+    // Flat index instead of one built from factory.
+    sqlite3_int64 flat_below = VSS_FLAT_BELOW_DEFAULT;
+};
+
+// Rolling search statistics for a single vss0 column, reported by vss_stats.
+// Latencies are kept for the most recent searches only, so percentiles follow
+// the current workload instead of averaging over the connection's lifetime.
+struct vss_index_stats {
+
+    static const size_t window = 1024;
+
+    sqlite3_int64 searches = 0;
+    sqlite3_int64 lists_probed = 0;
+    sqlite3_int64 candidates_scanned = 0;
+
+    sqlite3_int64 recall_samples = 0;
+    double recall_sum = 0;
+
+    // Microseconds, ring buffers of at most `window` entries.
+    vector<double> total_us;
+    vector<double> faiss_us;
+    vector<double> sqlite_us;
+    size_t next = 0;
+
+    void record_latency(double total, double faiss) {
+
+        if (total_us.size() < window) {
+            total_us.push_back(total);
+            faiss_us.push_back(faiss);
+            sqlite_us.push_back(max(total - faiss, 0.0));
+        } else {
+            total_us[next] = total;
+            faiss_us[next] = faiss;
+            sqlite_us[next] = max(total - faiss, 0.0);
+        }
+        next = (next + 1) % window;
+    }
+
+    // Returns the p-th percentile (0 < p <= 1) of samples in milliseconds, or
+    // a negative value when nothing was recorded yet.
+    static double percentile(const vector<double> &samples, double p) {
+
+        if (samples.empty())
+            return -1;
+
+        vector<double> sorted(samples);
+        size_t rank = min(sorted.size() - 1, (size_t)ceil(p * sorted.size()) - 1);
+        nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+        return sorted[rank] / 1000.0;
+    }
+};
+
+// Wrapper around a single faiss index, with training data, insert records, and
+// delete records.
+struct vss_index {
+
+    explicit vss_index(faiss::Index *index) : index(index) {}
+    explicit vss_index(faiss::Index *index, const VssIndexColumn &column)
+      : index(index),
+        name(column.name),
+        factory(column.factory),
+        storage_type(column.storage_type),
+        vector_type(column.vector_type),
+        recall_sample(column.recall_sample),
+        flat_below(column.flat_below) {}
+
+    ~vss_index() {
+        if (index != nullptr) {
+            delete index;
+        }
+        delete imported;
+    }
+
+    faiss::Index *index;
+
+    // Trained index from a 'load_trained' insert, swapped in by the next
+    // xSync.
+    faiss::Index *imported = nullptr;
+
+    vector<float> trainings;
+    vector<float> insert_data;
+    vector<faiss::idx_t> insert_ids;
+    vector<faiss::idx_t> delete_ids;
+    string name;
+    string factory;
+    StorageType storage_type;
+    VectorType vector_type = VectorType::vector_float;
+    sqlite3_int64 recall_sample = 0;
+    sqlite3_int64 flat_below = VSS_FLAT_BELOW_DEFAULT;
+    vss_index_stats stats;
+
+    // For the indexes of a partition, the table's column they belong to.
+    // Searches add up in that column's stats, which vss_stats reports and
+    // which outlive the partition being unloaded.
+    vss_index *column = nullptr;
+
+    vss_index_stats &search_stats() { return column != nullptr ? column->stats : stats; }
+
+    // Microseconds spent reading (or building) the index when the table was
+    // connected, and in the last xSync that had to write it.
+    double load_us = 0;
+    double last_sync_us = -1;
+};
+
+struct vss_index_vtab;
+
+// What a single vss0 scan did, collected for vss_explain(). A scan is one
+// xFilter call, so a vss0 table on the inner side of a join reports one scan
+// per outer row.
+struct vss_scan_trace {
+
+    string table_name;
+    string column_name;
+    string plan;
+
+    // Constraints the plan consumed, and whether LIMIT was handed to faiss as
+    // k instead of being applied by SQLite afterwards.
+    vector<string> constraints;
+    bool limit_pushed_down = false;
+
+    // Search parameters, negative when they don't apply to the plan or index.
+    sqlite3_int64 k = -1;
+    sqlite3_int64 nprobe = -1;
+    sqlite3_int64 ef_search = -1;
+
+    sqlite3_int64 lists_probed = 0;
+    sqlite3_int64 candidates_scanned = 0;
+    sqlite3_int64 rows = 0;
+
+    // Microseconds spent decoding the query, inside faiss (or scanning the
+    // _data table for fullscans), and producing rows in xNext/xColumn.
+    double parse_us = 0;
+    double search_us = 0;
+    double materialize_us = 0;
+};
+
+// Per-connection state shared by the vss0 module and the table functions that
+// need to reach the vss0 tables currently connected on that connection.
+struct vss_connection {
+
+    explicit vss_connection(vector0_api *vector_api) : vector_api(vector_api) {}
+
+    vector0_api *vector_api;
+    vector<vss_index_vtab *> tables;
+
+    // Set while vss_explain() runs a statement, every vss0 scan on the
+    // connection appends to it.
+    vector<vss_scan_trace> *trace = nullptr;
+};
+
+void delVssConnection(void *p) {
+
+    auto self = static_cast<vss_connection *>(p);
+    delete self;
+}
+
+// Value of the partition column of a partitioned vss0 table. Keys are
+// integers or text, compared like the untyped key column of _partitions.
+typedef std::variant<sqlite3_int64, string> vss_partition_key;
+
+// The column indexes of one partition of a partitioned vss0 table, loaded
+// from the _index shadow table the first time the partition is used.
+struct vss_partition {
+
+    // Position of the partition in _partitions, its indexes are at rowids
+    // number * columns + column of _index.
+    sqlite3_int64 number;
+
+    vector<vss_index *> indexes;
+
+    // Added to _partitions in the current transaction, forgotten on rollback
+    // and always written by the next xSync.
+    bool created = false;
+
+    // When the partition was last looked up, on the table's partition_uses
+    // clock, and how many cursors search it. Only unused, clean partitions
+    // are unloaded.
+    sqlite3_int64 last_used = 0;
+    int cursors = 0;
+};
+
+static void vss_partition_free(vss_partition &partition) {
+
+    for (auto index : partition.indexes)
+        delete index;
+    partition.indexes.clear();
+}
+
+struct vss_index_vtab : public sqlite3_vtab {
+
+    vss_index_vtab(sqlite3 *db, vss_connection *connection, char *schema, char *name)
+      : db(db),
+        connection(connection),
+        vector_api(connection->vector_api),
+        schema(schema),
+        name(name) {
+
+        connection->tables.push_back(this);
+    }
+
+    ~vss_index_vtab() {
+
+        auto &tables = connection->tables;
+        tables.erase(std::remove(tables.begin(), tables.end(), this), tables.end());
+
+        if (name)
+            sqlite3_free(name);
+        if (schema)
+            sqlite3_free(schema);
+        for (auto iter = indexes.begin(); iter != indexes.end(); ++iter) {
+            delete (*iter);
+        }
+        for (auto iter = partitions.begin(); iter != partitions.end(); ++iter) {
+            vss_partition_free(iter->second);
+        }
+    }
+
+    sqlite3 *db;
+    vss_connection *connection;
+    vector0_api *vector_api;
+
+    // Name of the virtual table. Must be freed during disconnect
+    char *name;
+
+    // Name of the schema the virtual table exists in. Must be freed during
+    // disconnect
+    char *schema;
+
+    // Vector holding all the  faiss Indices the vtab uses, and their state,
+    // implying which items are to be deleted and inserted. On partitioned
+    // tables these stay empty, and only describe the columns.
+    vector<vss_index*> indexes;
+
+    // Name of the partition key column, empty for unpartitioned tables.
+    string partition_column;
+
+    // Partitions loaded on this connection, by key, at most
+    // VSS_PARTITIONS_LOADED of them once their changes are written.
+    map<vss_partition_key, vss_partition> partitions;
+    sqlite3_int64 partition_uses = 0;
+
+    bool partitioned() const { return !partition_column.empty(); }
+};
+
+typedef chrono::steady_clock vss_clock;
+
+static double elapsed_us(vss_clock::time_point since) {
+
+    return chrono::duration<double, micro>(vss_clock::now() - since).count();
+}
+
+struct vss_index_cursor : public sqlite3_vtab_cursor {
+
+    explicit vss_index_cursor(vss_index_vtab *table)
+      : table(table),
+        sqlite3_vtab_cursor({0}),
+        stmt(nullptr),
+        searched_index(nullptr) { }
+
+    ~vss_index_cursor() {
+        finish_search();
+        release_partition();
+        if (stmt != nullptr)
+            sqlite3_finalize(stmt);
+        sqlite3_value_free(partition_key);
+    }
+
+    // Records the latency of the last search made with this cursor, from
+    // xFilter until the cursor was closed or re-filtered.
+    void finish_search() {
+
+        if (searched_index == nullptr)
+            return;
+
+        searched_index->search_stats().record_latency(elapsed_us(search_start), faiss_us);
+        searched_index = nullptr;
+    }
+
+    vss_index_vtab *table;
+
+    sqlite3_int64 iCurrent;
+    sqlite3_int64 iRowid;
+
+    QueryType query_type;
+
+    // For query_type == QueryType::search
+    sqlite3_int64 limit;
+    vector<faiss::idx_t> search_ids;
+    vector<float> search_distances;
+
+    // For query_type == QueryType::range_search
+    unique_ptr<faiss::RangeSearchResult> range_search_result;
+
+    // For query_type == QueryType::fullscan
+    sqlite3_stmt *stmt;
+    int step_result;
+
+    // Indexes the current search ran on: the table's, or those of the
+    // partition it was restricted to. Null when that partition doesn't exist.
+    vector<vss_index *> *indexes = nullptr;
+
+    // Key of the partition a single partition plan was restricted to.
+    sqlite3_value *partition_key = nullptr;
+
+    // That partition, kept loaded while the cursor reads its indexes.
+    vss_partition *partition = nullptr;
+
+    void release_partition() {
+
+        if (partition != nullptr)
+            partition->cursors--;
+        partition = nullptr;
+    }
+
+    // Index the current search ran against, with its timings, for vss_stats.
+    vss_index *searched_index;
+    vss_clock::time_point search_start;
+    double faiss_us;
+
+    // Position of the current scan in the connection's vss_explain() trace,
+    // or -1 when nothing is being traced.
+    int trace_entry = -1;
+
+    vss_scan_trace *trace() {
+
+        auto trace = table->connection->trace;
+        if (trace_entry < 0 || trace == nullptr || (size_t)trace_entry >= trace->size())
+            return nullptr;
+        return &trace->at(trace_entry);
+    }
+};
+
+static void vssSearchParamsFunc(sqlite3_context *context,
+                                int argc,
+                                sqlite3_value **argv) {
+
+    auto vector_api = (vector0_api *)sqlite3_user_data(context);
+
+    bool isBlob = sqlite3_value_type(argv[0]) == SQLITE_BLOB;
+
+    vec_ptr vector = vector_api->xValueAsVector(argv[0]);
+    if (vector == nullptr && !isBlob) {
+        sqlite3_result_error(context, "1st argument is not a vector", -1);
+        return;
+    }
+
+    // Optional nprobe and efSearch, null keeps the index's own.
+    sqlite3_int64 width[2] = {-1, -1};
+    for (int i = 2; i < argc; i++) {
+
+        if (sqlite3_value_type(argv[i]) == SQLITE_NULL)
+            continue;
+
+        width[i - 2] = sqlite3_value_int64(argv[i]);
+        if (sqlite3_value_type(argv[i]) != SQLITE_INTEGER || width[i - 2] <= 0) {
+            sqlite3_result_error(context, i == 2 ? "nprobe must be a positive integer" : "ef_search must be a positive integer", -1);
+            return;
+        }
+    }
+
+    auto limit = sqlite3_value_int64(argv[1]);
+    auto params = new VssSearchParams();
+    params->vector = vec_ptr(vector.release());
+    params->k = limit;
+    params->nprobe = width[0];
+    params->ef_search = width[1];
+    if (isBlob)
+        params->value = sqlite3_value_dup(argv[0]);
+    sqlite3_result_pointer(context, params, "vss0_searchparams", delVssSearchParams);
+}
+
+static void vssRangeSearchParamsFunc(sqlite3_context *context, int argc,
+                                     sqlite3_value **argv) {
+
+    auto vector_api = (vector0_api *)sqlite3_user_data(context);
+
+    bool isBlob = sqlite3_value_type(argv[0]) == SQLITE_BLOB;
+
+    vec_ptr vector = vector_api->xValueAsVector(argv[0]);
+    if (vector == nullptr && !isBlob) {
+        sqlite3_result_error(context, "1st argument is not a vector", -1);
+        return;
+    }
+
+    auto params = new VssRangeSearchParams();
+
+    params->vector = vec_ptr(vector.release());
+    params->distance = sqlite3_value_double(argv[1]);
+    if (isBlob)
+        params->value = sqlite3_value_dup(argv[0]);
+
+    sqlite3_result_pointer(context, params, "vss0_rangesearchparams", delVssRangeSearchParams);
+}
+
+// Binary columns also take their vectors as the packed bits from
+// vector_binarize(), a blob of exactly (d + 7) / 8 bytes. Returns null for
+// anything else.
+static vec_ptr vss_unpack_bits(vss_index *column, sqlite3_value *value) {
+
+    if (column->vector_type != VectorType::vector_binary || value == nullptr ||
+        sqlite3_value_type(value) != SQLITE_BLOB ||
+        sqlite3_value_bytes(value) != vectorBinarySize(column->index->d))
+        return nullptr;
+
+    vec_ptr vec(new vector<float>(column->index->d));
+    vectorUnpackBits((const uint8_t *)sqlite3_value_blob(value), vec->data(), vec->size());
+    return vec;
+}
+
+// Reads the vector a statement gave for column.
+static vec_ptr vss_value_as_vector(vss_index_vtab *table, vss_index *column, sqlite3_value *value) {
+
+    auto bits = vss_unpack_bits(column, value);
+    if (bits != nullptr)
+        return bits;
+    return table->vector_api->xValueAsVector(value);
+}
+
+string get_index_filename(sqlite3 *db, const char *schema, const char *table_name, string col_name) {
+    const char *db_filename = sqlite3_db_filename(db, "main");
+    std::stringstream ss;
+    ss << db_filename << "." << schema << "." << table_name << "." << col_name << ".faissindex";
+    return ss.str();
+}
+
+void finalize_and_free(sqlite3_stmt *stmt, char *sql) {
+    sqlite3_finalize(stmt);
+    sqlite3_free(sql);
+}
+
+static faiss::Index *unwrap_index(faiss::Index *index);
+
+// Whether an IndexIDMap maps the ids of index, or of an index it wraps.
+static bool vss_index_has_idmap(faiss::Index *index) {
+
+    while (true) {
+
+        if (dynamic_cast<faiss::IndexIDMap *>(index) != nullptr)
+            return true;
+        auto transform = dynamic_cast<faiss::IndexPreTransform *>(index);
+        if (transform == nullptr)
+            return false;
+        index = transform->index;
+    }
+}
+
+// Binary columns persist the faiss::IndexBinary they wrap. IVF indexes over
+// vss_sqlite_invlists are written with empty inverted lists, the lists
+// themselves are rows of the _ivflists shadow table.
+static void write_column_index(const faiss::Index *index, faiss::IOWriter *writer) {
+
+    if (auto binary = dynamic_cast<const vss_binary_index *>(index)) {
+        faiss::write_index_binary(binary->binary, writer);
+        return;
+    }
+
+    if (auto vamana = dynamic_cast<const vss_vamana_index *>(index)) {
+        vamana->write(writer);
+        return;
+    }
+
+    auto ivf = dynamic_cast<faiss::IndexIVF *>(unwrap_index(const_cast<faiss::Index *>(index)));
+    if (ivf == nullptr || dynamic_cast<vss_sqlite_invlists *>(ivf->invlists) == nullptr) {
+        faiss::write_index(index, writer);
+        return;
+    }
+
+    faiss::ArrayInvertedLists empty(ivf->nlist, ivf->code_size);
+    auto lists = ivf->invlists;
+    ivf->invlists = &empty;
+    try {
+        faiss::write_index(index, writer);
+    } catch (faiss::FaissException &) {
+        ivf->invlists = lists;
+        throw;
+    }
+    ivf->invlists = lists;
+}
+
+// Writes the inverted lists of a faiss_ivflists column: only the changed ones
+// when they're already SQLite backed, otherwise all of them, after which the
+// index reads them from SQLite too.
+static int write_ivflists(faiss::Index *index, sqlite3 *db, const char *schema, const char *name, int column) {
+
+    auto ivf = dynamic_cast<faiss::IndexIVF *>(unwrap_index(index));
+    if (ivf == nullptr)
+        return SQLITE_ERROR;
+
+    if (auto lists = dynamic_cast<vss_sqlite_invlists *>(ivf->invlists))
+        return lists->flush();
+
+    auto lists = new vss_sqlite_invlists(db, schema, name, column, ivf->nlist, ivf->code_size);
+    lists->track_rows = !vss_index_has_idmap(index);
+    auto rc = lists->replace_all(ivf->invlists);
+    if (rc != SQLITE_OK) {
+        delete lists;
+        return rc;
+    }
+
+    ivf->replace_invlists(lists, true);
+    return SQLITE_OK;
+}
+
+static int write_index_insert(faiss::Index *index,
+                              sqlite3 *db,
+                              char *schema,
+                              char *name,
+                              int rowId,
+                              string col_name,
+                              StorageType storage_type) {
+
+    // Lists go to xyz_ivflists first, so the header below is written without them.
+    if (storage_type == StorageType::faiss_ivflists) {
+        int rc = write_ivflists(index, db, schema, name, rowId);
+        if (rc != SQLITE_OK)
+            return rc;
+    }
+
+    // Likewise for the changed nodes of Vamana columns, to xyz_graph.
+    if (auto vamana = dynamic_cast<vss_vamana_index *>(index)) {
+        int rc = vamana->flush(db, schema, name, rowId);
+        if (rc != SQLITE_OK)
+            return rc;
+    }
+
+    faiss::VectorIOWriter writer;
+    write_column_index(index, &writer);
+    sqlite3_int64 indexSize = writer.data.size();
+
+    // First try to insert into xyz_index. If that fails with a rowid constraint
+    // error, that means the index is already on disk, we just have to UPDATE
+    // instead.
+
+    if (storage_type == StorageType::faiss_ondisk) {
+        const string index_filename = get_index_filename(db, schema, name, col_name);
+
+        ofstream outFile(index_filename, ios::binary);
+        if (!outFile) {
+            return SQLITE_ERROR;
+        }
+
+        outFile.write(reinterpret_cast<const char*>(writer.data.data()), indexSize);
+        outFile.close();
+        if (!outFile) {
+            return SQLITE_ERROR;
+        }
+
+        return SQLITE_OK;
+
+    } else {
+
+        sqlite3_stmt *stmt;
+        char *sql = sqlite3_mprintf(
+            "insert into \"%w\".\"%w_index\"(rowid, idx) values (?, ?)",
+            schema,
+            name);
+
+        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+        if (rc != SQLITE_OK || stmt == nullptr) {
+            sqlite3_free(sql);
+            return SQLITE_ERROR;
+        }
+
+        rc = sqlite3_bind_int64(stmt, 1, rowId);
+        if (rc != SQLITE_OK) {
+            finalize_and_free(stmt, sql);
+            return SQLITE_ERROR;
+        }
+
+        rc = sqlite3_bind_blob64(stmt, 2, writer.data.data(), indexSize, SQLITE_TRANSIENT);
+        if (rc != SQLITE_OK) {
+            finalize_and_free(stmt, sql);
+            return SQLITE_ERROR;
+        }
+
+        int result = sqlite3_step(stmt);
+        finalize_and_free(stmt, sql);
+
+        if (result == SQLITE_DONE) {
+
+            // INSERT was success, index wasn't written yet, all good to exit
+            return SQLITE_OK;
+
+        } else if (sqlite3_extended_errcode(db) != SQLITE_CONSTRAINT_PRIMARYKEY) {
+            // INSERT failed for another unknown reason, bad, return error
+            return SQLITE_ERROR;
+        }
+
+        // INSERT failed because index already is on disk, so we do an UPDATE instead
+
+        sql = sqlite3_mprintf(
+            "update \"%w\".\"%w_index\" set idx = ? where rowid = ?", schema, name);
+
+        rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+        if (rc != SQLITE_OK || stmt == nullptr) {
+            sqlite3_free(sql);
+            return SQLITE_ERROR;
+        }
+
+        rc = sqlite3_bind_blob64(stmt, 1, writer.data.data(), indexSize, SQLITE_TRANSIENT);
+        if (rc != SQLITE_OK) {
+            finalize_and_free(stmt, sql);
+            return SQLITE_ERROR;
+        }
+
+        rc = sqlite3_bind_int64(stmt, 2, rowId);
+        if (rc != SQLITE_OK) {
+            finalize_and_free(stmt, sql);
+            return SQLITE_ERROR;
+        }
+
+        result = sqlite3_step(stmt);
+        finalize_and_free(stmt, sql);
+
+        if (result == SQLITE_DONE) {
+            return SQLITE_OK;
+        }
+
+        return result;
+    }
+}
+
+// The _data table's "_" column holds the row's partition key on partitioned
+// tables, and is NULL otherwise.
+static int shadow_data_insert(sqlite3 *db,
+                              char *schema,
+                              char *name,
+                              sqlite3_int64 *rowid,
+                              sqlite3_int64 *retRowid,
+                              sqlite3_value *partition_key = nullptr) {
+
+    sqlite3_stmt *stmt;
+
+    if (rowid == nullptr) {
+
+        auto sql = sqlite3_mprintf(
+            "insert into \"%w\".\"%w_data\"(_) values (?)", schema, name);
+
+        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+        sqlite3_free(sql);
+
+        if (rc != SQLITE_OK || stmt == nullptr) {
+            return SQLITE_ERROR;
+        }
+
+        if (partition_key != nullptr)
+            sqlite3_bind_value(stmt, 1, partition_key);
+        else
+            sqlite3_bind_null(stmt, 1);
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+            sqlite3_finalize(stmt);
+            return SQLITE_ERROR;
+        }
+
+    } else {
+
+        auto sql = sqlite3_mprintf(
+            "insert into \"%w\".\"%w_data\"(rowid, _) values (?, ?);", schema,
+            name);
+
+        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+        sqlite3_free(sql);
+
+        if (rc != SQLITE_OK || stmt == nullptr)
+            return SQLITE_ERROR;
+
+        sqlite3_bind_int64(stmt, 1, *rowid);
+        if (partition_key != nullptr)
+            sqlite3_bind_value(stmt, 2, partition_key);
+        else
+            sqlite3_bind_null(stmt, 2);
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+            sqlite3_finalize(stmt);
+            return SQLITE_ERROR;
+        }
+
+        if (retRowid != nullptr)
+            *retRowid = sqlite3_last_insert_rowid(db);
+    }
+
+    sqlite3_finalize(stmt);
+    return SQLITE_OK;
+}
+
+// Adds many _data rows through one prepared statement, for matrix inserts
+// and vss_bulk_load(). Rows without a rowid get the next one the table's
+// AUTOINCREMENT hands out, like shadow_data_insert(), so the rowids of
+// deleted rows are never reused.
+struct vss_data_inserter {
+
+    ~vss_data_inserter() { sqlite3_finalize(stmt); }
+
+    int prepare(sqlite3 *db, const char *schema, const char *name) {
+
+        this->db = db;
+        auto sql = sqlite3_mprintf("insert into \"%w\".\"%w_data\"(rowid, _) values (?, null)", schema, name);
+        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
+        sqlite3_free(sql);
+        return rc;
+    }
+
+    // Inserts rowid, or a new rowid when it's null, returned in *inserted.
+    int insert(const sqlite3_int64 *rowid, sqlite3_int64 *inserted) {
+
+        if (rowid != nullptr)
+            sqlite3_bind_int64(stmt, 1, *rowid);
+        else
+            sqlite3_bind_null(stmt, 1);
+
+        int rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if (rc != SQLITE_DONE)
+            return SQLITE_ERROR;
+
+        *inserted = rowid != nullptr ? *rowid : sqlite3_last_insert_rowid(db);
+        return SQLITE_OK;
+    }
+
+    sqlite3 *db = nullptr;
+    sqlite3_stmt *stmt = nullptr;
+};
+
+static int shadow_data_delete(sqlite3 *db,
+                              char *schema,
+                              char *name,
+                              sqlite3_int64 rowid) {
+    sqlite3_stmt *stmt;
+
+    // TODO: We should strive to use only one concept and idea while creating
+    // SQL statements.
+    auto query = sqlite3_str_new(0);
+
+    sqlite3_str_appendf(query, "delete from \"%w\".\"%w_data\" where rowid = ?",
+                        schema, name);
+
+    auto sql = sqlite3_str_finish(query);
+
+    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+    if (rc != SQLITE_OK || stmt == nullptr)
+        return SQLITE_ERROR;
+
+    sqlite3_bind_int64(stmt, 1, rowid);
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        sqlite3_finalize(stmt);
+        return SQLITE_ERROR;
+    }
+
+    sqlite3_free(sql);
+    sqlite3_finalize(stmt);
+    return SQLITE_OK;
+}
+
+static faiss::Index *read_index_select(sqlite3 *db, const char *schema, const char *table_name, int indexId, string col_name, StorageType storage_type, VectorType vector_type) {
+
+
+    if (storage_type == StorageType::faiss_ondisk) {
+
+        const string index_filename = get_index_filename(db, schema, table_name, col_name);
+        if (vector_type == VectorType::vector_binary)
+            return new vss_binary_index(faiss::read_index_binary(index_filename.c_str()));
+        return faiss::read_index(index_filename.c_str());
+
+    } else {
+
+        sqlite3_stmt *stmt;
+        auto sql = sqlite3_mprintf("select idx from \"%w_index\" where rowid = ?", table_name);
+
+        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
+        if (rc != SQLITE_OK || stmt == nullptr) {
+            finalize_and_free(stmt, sql);
+            return nullptr;
+        }
+
+        sqlite3_bind_int64(stmt, 1, indexId);
+        if ((rc = sqlite3_step(stmt)) != SQLITE_ROW) {
+            finalize_and_free(stmt, sql);
+            return nullptr;
+        }
+
+        auto index_data = sqlite3_column_blob(stmt, 0);
+        int64_t size = sqlite3_column_bytes(stmt, 0);
+
+        faiss::VectorIOReader reader;
+        copy((const uint8_t *)index_data,
+            ((const uint8_t *)index_data) + size,
+            back_inserter(reader.data));
+
+        finalize_and_free(stmt, sql);
+
+        if (vss_vamana_index::is_header(reader.data.data(), reader.data.size()))
+            return vss_vamana_index::read(&reader, db, schema, table_name, indexId);
+
+        if (vector_type == VectorType::vector_binary)
+            return new vss_binary_index(faiss::read_index_binary(&reader));
+
+        auto index = faiss::read_index(&reader);
+        if (storage_type != StorageType::faiss_ivflists)
+            return index;
+
+        // The header was written with empty lists, they are read from
+        // xyz_ivflists as searches probe them. Flat partitions of the column
+        // are written whole.
+        auto ivf = dynamic_cast<faiss::IndexIVF *>(unwrap_index(index));
+        if (ivf == nullptr)
+            return index;
+
+        auto lists = new vss_sqlite_invlists(db, schema, table_name, indexId, ivf->nlist, ivf->code_size);
+        lists->track_rows = !vss_index_has_idmap(index);
+        if (lists->load_sizes() != SQLITE_OK) {
+            delete lists;
+            delete index;
+            return nullptr;
+        }
+
+        ivf->replace_invlists(lists, true);
+        return index;
+    }
+}
+
+// Factories and metrics of the columns vss_rebuild() switched, see
+// vss_read_factories.
+static int create_factories_table(sqlite3 *db, const char *schema, const char *name) {
+
+    auto sql = sqlite3_mprintf("create table if not exists \"%w\".\"%w_factories\"(col integer primary key, factory text, metric integer)",
+                               schema,
+                               name);
+    auto rc = sqlite3_exec(db, sql, nullptr, nullptr, nullptr);
+    sqlite3_free(sql);
+    return rc;
+}
+
+// Replaces the factory and metric of the columns vss_rebuild() switched with
+// the ones it recorded, the table definition keeps the original ones.
+static int vss_read_factories(sqlite3 *db, const char *schema, const char *name, vector<VssIndexColumn> *columns) {
+
+    sqlite3_stmt *stmt;
+    auto sql = sqlite3_mprintf("select 1 from \"%w\".sqlite_master where type = 'table' and name = '%q_factories'",
+                               schema, name);
+    auto rc = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (rc == SQLITE_DONE)
+        return SQLITE_OK;
+    if (rc != SQLITE_ROW)
+        return rc;
+
+    sql = sqlite3_mprintf("select col, factory, metric from \"%w\".\"%w_factories\"", schema, name);
+    rc = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+
+        auto col = sqlite3_column_int64(stmt, 0);
+        if (col < 0 || (size_t)col >= columns->size())
+            continue;
+        (*columns)[col].factory = (const char *)sqlite3_column_text(stmt, 1);
+        (*columns)[col].metric = (faiss::MetricType)sqlite3_column_int(stmt, 2);
+    }
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+// Nodes of the Vamana columns of a table, see vss_vamana_index.
+static int create_graph_table(sqlite3 *db, const char *schema, const char *name) {
+
+    auto sql = sqlite3_mprintf("create table if not exists \"%w\".\"%w_graph\"(col integer, node integer, code blob, vector blob, neighbors blob, primary key(col, node))",
+                               schema,
+                               name);
+
+    auto rc = sqlite3_exec(db, sql, 0, 0, 0);
+    sqlite3_free(sql);
+    return rc;
+}
+
+// Partitions of a partitioned table, numbered from 1 in the order their keys
+// were first inserted. key has no type affinity, so 1 and '1' are different
+// partitions.
+static int create_partitions_table(sqlite3 *db, const char *schema, const char *name) {
+
+    auto sql = sqlite3_mprintf("create table \"%w\".\"%w_partitions\"(key primary key, partition integer)",
+                               schema,
+                               name);
+
+    auto rc = sqlite3_exec(db, sql, 0, 0, 0);
+    sqlite3_free(sql);
+    return rc;
+}
+
+static int create_shadow_tables(sqlite3 *db,
+                                const char *schema,
+                                const char *name,
+                                vector<vss_index *> indices) {
+
+
+    // make the _index shadow tables if there's at least 1 column that uses the default faiss_shadow
+    // (faiss_ivflists columns keep their index header there too)
+    bool skip_shadow_index = true;
+    bool skip_ivflists = true;
+    for (auto i : indices) {
+        if (i->storage_type != StorageType::faiss_ondisk) {
+            skip_shadow_index = false;
+        }
+        if (i->storage_type == StorageType::faiss_ivflists) {
+            skip_ivflists = false;
+        }
+    }
+
+    if (!skip_shadow_index) {
+        auto sql = sqlite3_mprintf("create table \"%w\".\"%w_index\"(rowid integer primary key autoincrement, idx)",
+                                    schema,
+                                    name);
+
+        auto rc = sqlite3_exec(db, sql, 0, 0, 0);
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK)
+            return rc;
+
+    }
+
+    for (auto i : indices) {
+        if (dynamic_cast<vss_vamana_index *>(i->index) != nullptr) {
+            auto rc = create_graph_table(db, schema, name);
+            if (rc != SQLITE_OK)
+                return rc;
+            break;
+        }
+    }
+
+    if (!skip_ivflists) {
+        auto sql = sqlite3_mprintf("create table \"%w\".\"%w_ivflists\"(col integer, list integer, ids blob, codes blob, primary key(col, list));"
+                                   "create table \"%w\".\"%w_ivfrows\"(col integer, id integer, list integer, primary key(col, id)) without rowid",
+                                    schema,
+                                    name,
+                                    schema,
+                                    name);
+
+        auto rc = sqlite3_exec(db, sql, 0, 0, 0);
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK)
+            return rc;
+    }
+
+    auto sql = sqlite3_mprintf("create table \"%w\".\"%w_data\"(rowid integer primary key autoincrement, _);",
+                          schema,
+                          name);
+
+    auto rc = sqlite3_exec(db, sql, nullptr, nullptr, nullptr);
+    sqlite3_free(sql);
+    return rc;
+}
+
+static int drop_shadow_tables(sqlite3 *db, char *name) {
+
+    const char *drops[7] = {"drop table if exists \"%w_ivflists\";",
+                            "drop table if exists \"%w_ivfrows\";",
+                            "drop table if exists \"%w_factories\";",
+                            "drop table if exists \"%w_graph\";",
+                            "drop table if exists \"%w_partitions\";",
+                            "drop table \"%w_index\";",
+                            "drop table \"%w_data\";"};
+
+    for (int i = 0; i < 7; i++) {
+
+        auto curSql = drops[i];
+
+        sqlite3_stmt *stmt;
+
+        // TODO: Use of one construct to create SQL statements.
+        sqlite3_str *query = sqlite3_str_new(0);
+        sqlite3_str_appendf(query, curSql, name);
+        char *sql = sqlite3_str_finish(query);
+
+        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+        if (rc != SQLITE_OK || stmt == nullptr) {
+            sqlite3_free(sql);
+            return SQLITE_ERROR;
+        }
+
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+            sqlite3_free(sql);
+            sqlite3_finalize(stmt);
+            return SQLITE_ERROR;
+        }
+
+        sqlite3_free(sql);
+        sqlite3_finalize(stmt);
+    }
+    return SQLITE_OK;
+}
+
+#define VSS_SEARCH_FUNCTION SQLITE_INDEX_CONSTRAINT_FUNCTION
+#define VSS_RANGE_SEARCH_FUNCTION SQLITE_INDEX_CONSTRAINT_FUNCTION + 1
+
+// Tokens types when parsing vss0 column definitions
+enum TokenType {
+  LPAREN = 1,
+  RPAREN = 2,
+  EQUAL = 3,
+  IDENTIFIER = 50,
+  STRING = 51,
+  INTEGER = 52
+};
+
+// Tokens types when parsing vss0 column definitions
+struct Token {
+public:
+  TokenType token_type;
+  // Only definied when token_type == TokenType::IDENTIFIER
+  string identifier_value;
+  // Only definied when token_type == TokenType::STRING
+  string string_value;
+  // Only definied when token_type == TokenType::INTEGER
+  int int_value;
+
+  explicit Token(TokenType token_type) : token_type(token_type) {}
+  // TODO: maybe these should just be different classes that inherit Token? idk C++ man
+  static Token IdentifierToken(string value){
+    Token token(TokenType::IDENTIFIER);
+    token.identifier_value = value;
+    return token;
+  }
+  static Token StringToken(string value){
+    Token token(TokenType::STRING);
+    token.string_value = value;
+    return token;
+  }
+  static Token IntToken(int value){
+    Token token(TokenType::INTEGER);
+    token.int_value = value;
+    return token;
+  }
+};
+
+// scans through a vss0 column definition string
+struct Scanner {
+public:
+  explicit Scanner(string source): source(source), idx(0), len(source.length()) {}
+  char advance() {
+    return source[idx++];
+  }
+  optional<char> peek() {
+    if(idx >= len) {
+      return {};
+    }
+    return source[idx];
+  }
+  bool eof() {
+    return idx >= len;
+  }
+
+private:
+  string source;
+  int idx;
+  int len;
+
+};
+
+// Valid chatacters allowed in an identifier, except the 1st character (most be a-zA-Z_)
+bool is_identifier_char(optional<char> c) {
+  if(!c.has_value()) {
+    return false;
+  }
+  return (c >= 'a' && c <= 'z')
+  || (c >= 'A' && c <= 'Z')
+  || (c >= '0' && c <= '9')
+  || (c == '_');
+}
+
+// sus out the tokens in a vss0 column definition
+vector<Token> tokenize(string source) {
+  vector<Token> tokens;
+  Scanner scanner(source);
+  while (!scanner.eof()) {
+    char c = scanner.advance();
+    if(c == ' ' || c == '\n' || c == '\t') {
+      continue;
+    }
+    else if(c=='(') {
+      tokens.push_back(Token(TokenType::LPAREN));
+    }
+    else if(c==')') {
+      tokens.push_back(Token(TokenType::RPAREN));
+    }
+    else if(c=='=') {
+      tokens.push_back(Token(TokenType::EQUAL));
+    }
+    else if((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) {
+      string identifier;
+      identifier.push_back(c);
+      while (is_identifier_char(scanner.peek())) {
+        identifier.push_back(scanner.advance());
+      }
+      tokens.push_back(Token::IdentifierToken(identifier));
+
+    }
+    else if(c >= '0' && c <= '9') {
+      string number_literal;
+      number_literal.push_back(c);
+      optional<char> next;
+      while((next = scanner.peek()) && next.has_value() && next >= '0' && next <= '9') {
+        number_literal.push_back(*next);
+        scanner.advance();
+      }
+      tokens.push_back(Token::IntToken(atoi(number_literal.c_str())));
+    }
+    else if (c == '"') {
+      string string_literal;
+      optional<char> next;
+      while(!scanner.eof() && (next = scanner.peek()) && next != '"') {
+        string_literal.push_back(*next);
+        scanner.advance();
+      }
+      if (next == '"') {
+        scanner.advance();
+        tokens.push_back(Token::StringToken(string_literal));
+      }else {
+        throw invalid_argument("unterminated string");
+      }
+
+    }
+  }
+  return tokens;
+}
+
+static const std::unordered_map<std::string, faiss::MetricType> metric_type_map = {
+        {"L1", faiss::METRIC_L1},
+        {"L2", faiss::METRIC_L2},
+        {"INNER_PRODUCT", faiss::METRIC_INNER_PRODUCT},
+        {"Linf", faiss::METRIC_Linf},
+        // {"Lp", faiss::METRIC_Lp}, unavailable until metric arg is added
+        {"Canberra", faiss::METRIC_Canberra},
+        {"BrayCurtis", faiss::METRIC_BrayCurtis},
+        {"JensenShannon", faiss::METRIC_JensenShannon}
+    };
+
+// Inverse of metric_type_map, for reporting the metric of an index.
+const char *metric_type_name(faiss::MetricType metric) {
+
+    for (auto &entry : metric_type_map) {
+        if (entry.second == metric)
+            return entry.first.c_str();
+    }
+    return nullptr;
+}
+
+// parse a vss0 column definition. Throws on errors
+VssIndexColumn parse_vss0_column_definition(string source) {
+  string name;
+  sqlite3_int64 dimensions;
+  string factory = "Flat,IDMap2";
+  faiss::MetricType metric_type = faiss::MetricType::METRIC_L2;
+  StorageType storage_type = StorageType::faiss_shadow;
+  VectorType vector_type = VectorType::vector_float;
+  sqlite3_int64 recall_sample = 0;
+  sqlite3_int64 flat_below = VSS_FLAT_BELOW_DEFAULT;
+  bool has_factory = false;
+  bool has_metric_type = false;
+
+  vector<Token> tokens = tokenize(source);
+  std::vector<Token>::iterator it = tokens.begin();
+
+  // STEP 1: expect a column name as a first token (identifier)
+  if(it == tokens.end()) {
+    throw invalid_argument("No tokens available.");
+  }
+  if((*it).token_type != TokenType::IDENTIFIER) {
+    throw invalid_argument("Expected identifier as first token, got ");
+  }
+  name = (*it).identifier_value;
+
+  // STEP 2: ensure a '(' immediately follows
+  it++;
+  if(it == tokens.end()) {
+    throw invalid_argument("Expected dimensions after column name declaration");
+  }
+  if((*it).token_type != TokenType::LPAREN) {
+    throw invalid_argument("Expected left parethesis '('");
+  }
+
+  // STEP 3: ensure an integer token (# dimensions) immediately follows
+  it++;
+  if(it == tokens.end()) {
+    throw invalid_argument("Expected dimensions after column name declaration");
+  }
+  if((*it).token_type != TokenType::INTEGER) {
+    throw invalid_argument("Expected integer");
+  }
+  dimensions = (*it).int_value;
+
+  // STEP 4: ensure a ')' token immediately follows
+  it++;
+  if(it == tokens.end()) {
+    throw invalid_argument("Expected dimensions after column name declaration");
+  }
+  if((*it).token_type != TokenType::RPAREN) {
+    throw invalid_argument("Expected right parethesis ')'");
+  }
+
+  // STEP 5: parse any column options
+  it++;
+  while(it != tokens.end()) {
+    // every column option must start with an identifier
+    if((*it).token_type != TokenType::IDENTIFIER) {
+      throw invalid_argument("Expected an identifier for column arguments");
+    }
+    string key = (*it).identifier_value;
+    if(key != "factory" && key != "metric_type" && key != "storage_type" && key != "recall_sample" && key != "flat_below" && key != "type") {
+      throw invalid_argument("Unknown vss0 column option '" + key + "'");
+    }
+
+    // ensure it is followed by an '='
+    it++;
+    if(it == tokens.end() || (*it).token_type != TokenType::EQUAL) {
+      throw invalid_argument("Expected '=' ");
+    }
+
+    // now parse the value - different legal values for each key
+    it++;
+    if(it == tokens.end()) {
+      throw invalid_argument("Expected column option value for " + key);
+    }
+    if (key == "factory") {
+      if((*it).token_type != TokenType::STRING) {
+        throw invalid_argument("Expected string value for factory column option, got ");
+      }
+      factory = (*it).string_value;
+      has_factory = true;
+    }
+    else if (key == "metric_type") {
+      if((*it).token_type != TokenType::IDENTIFIER) {
+        throw invalid_argument("Expected an identifier value for the 'metric_type' column option");
+      }
+      string value = (*it).identifier_value;
+      auto it2 = metric_type_map.find(value);
+
+      if( it2 == metric_type_map.end())  {
+        throw invalid_argument("Unknown metric type: " + value);
+      }
+
+      metric_type = it2->second;
+      has_metric_type = true;
+    }
+    else if (key == "storage_type") {
+      if((*it).token_type != TokenType::IDENTIFIER) {
+        throw invalid_argument("Expected an identifier value for the 'storage_type' column option");
+      }
+      string value = (*it).identifier_value;
+      if(value == "faiss_shadow") {
+        storage_type = StorageType::faiss_shadow;
+      }
+      else if(value == "faiss_ondisk") {
+        storage_type = StorageType::faiss_ondisk;
+      }
+      else if(value == "faiss_ivflists") {
+        storage_type = StorageType::faiss_ivflists;
+      }else {
+        throw invalid_argument("storage_type value must be one of faiss_shadow, faiss_ondisk or faiss_ivflists");
+      }
+    }
+    else if (key == "recall_sample") {
+      if((*it).token_type != TokenType::INTEGER) {
+        throw invalid_argument("Expected an integer value for the 'recall_sample' column option");
+      }
+      recall_sample = (*it).int_value;
+    }
+    else if (key == "flat_below") {
+      if((*it).token_type != TokenType::INTEGER) {
+        throw invalid_argument("Expected an integer value for the 'flat_below' column option");
+      }
+      flat_below = (*it).int_value;
+    }
+    else if (key == "type") {
+      if((*it).token_type != TokenType::IDENTIFIER) {
+        throw invalid_argument("Expected an identifier value for the 'type' column option");
+      }
+      string value = (*it).identifier_value;
+      if(value == "float") {
+        vector_type = VectorType::vector_float;
+      }
+      else if(value == "binary") {
+        vector_type = VectorType::vector_binary;
+      }else {
+        throw invalid_argument("type value must be one of float or binary");
+      }
+    }
+
+    it++;
+  }
+
+  // binary columns take faiss binary factory strings, and always compare
+  // with Hamming distances
+  if(vector_type == VectorType::vector_binary) {
+    if(has_metric_type) {
+      throw invalid_argument("metric_type can't be used on binary columns, they use Hamming distances");
+    }
+    if(!has_factory) {
+      factory = "BFlat";
+    }
+  }
+
+  return VssIndexColumn {
+    name,
+    dimensions,
+    factory,
+    metric_type,
+    storage_type,
+    vector_type,
+    recall_sample,
+    flat_below
+  };
+}
+
+// Whether a vss0 argument declares the partition key column, as in
+// "tenant_id partition".
+static bool is_partition_definition(const string &source, string *name) {
+
+  auto tokens = tokenize(source);
+  if(tokens.size() != 2 ||
+     tokens[0].token_type != TokenType::IDENTIFIER ||
+     tokens[1].token_type != TokenType::IDENTIFIER ||
+     tokens[1].identifier_value != "partition") {
+    return false;
+  }
+  *name = tokens[0].identifier_value;
+  return true;
+}
+
+// Parses the vss0 arguments into vector columns, and the name of the
+// partition key column into partition_column when one is declared. Throws on
+// errors.
+unique_ptr<vector<VssIndexColumn>> parse_constructor(int argc,
+                                                     const char* const* argv,
+                                                     sqlite3 *db,
+                                                     string *partition_column) {
+    auto columns = unique_ptr<vector<VssIndexColumn>>(new vector<VssIndexColumn>());
+
+    for (int i = 3; i < argc; i++) {
+        string partition_name;
+        if (is_partition_definition(string(argv[i]), &partition_name)) {
+            if (!partition_column->empty()) {
+                throw invalid_argument("Only one partition column is allowed");
+            }
+            *partition_column = partition_name;
+            continue;
+        }
+
+        auto column = parse_vss0_column_definition(string(argv[i]));
+        if (column.storage_type == StorageType::faiss_ondisk && sqlite3_db_filename(db, "main")[0] == '\0') {
+            throw invalid_argument("Cannot use on disk storage for in memory db");
+        }
+        columns->push_back(column);
+    }
+
+    if (!partition_column->empty() && columns->empty()) {
+        throw invalid_argument("A partitioned table needs at least one vector column");
+    }
+
+    return columns;
+}
+
+// Builds the empty index of a new column. Binary columns get their binary
+// factory index under an IndexBinaryIDMap2, so rows keep their rowids and
+// can be read back like the default "Flat,IDMap2" float columns. IVF columns
+// stored as faiss_ivflists drop the IDMap of their factory: their lists hold
+// the rowids, found again through the _ivfrows shadow table instead of an
+// id map kept in the index header.
+static faiss::Index *create_column_index(const VssIndexColumn &column) {
+
+    if (column.vector_type == VectorType::vector_binary) {
+
+        auto binary = faiss::index_binary_factory(column.dimensions, column.factory.c_str());
+        auto idmap = new faiss::IndexBinaryIDMap2(binary);
+        idmap->own_fields = true;
+        return new vss_binary_index(idmap);
+    }
+
+    if (auto vamana = vss_vamana_factory(column.dimensions, column.factory, column.metric))
+        return vamana;
+
+    auto index = faiss::index_factory(column.dimensions, column.factory.c_str(), column.metric);
+
+    auto idmap = dynamic_cast<faiss::IndexIDMap *>(index);
+    if (column.storage_type == StorageType::faiss_ivflists && idmap != nullptr &&
+        dynamic_cast<faiss::IndexIVF *>(unwrap_index(idmap->index)) != nullptr) {
+
+        index = idmap->index;
+        idmap->own_fields = false;
+        delete idmap;
+    }
+    return index;
+}
+
+static int init(sqlite3 *db,
+                void *pAux,
+                int argc,
+                const char *const *argv,
+                sqlite3_vtab **ppVtab,
+                char **pzErr,
+                bool isCreate) {
+
+    sqlite3_vtab_config(db, SQLITE_VTAB_CONSTRAINT_SUPPORT, 1);
+    int rc;
+
+    sqlite3_str *str = sqlite3_str_new(nullptr);
+    sqlite3_str_appendall(str,
+                          "create table x(distance hidden, operation hidden, rowids hidden");
+
+    unique_ptr<vector<VssIndexColumn>> columns;
+    string partition_column;
+    try {
+        columns = parse_constructor(argc, argv, db, &partition_column);
+    } catch (const invalid_argument& e) {
+        *pzErr = sqlite3_mprintf("Error parsing constructor: %s", e.what());
+        return SQLITE_ERROR;
+    }
+
+    if (columns == nullptr) {
+        *pzErr = sqlite3_mprintf("Error parsing constructor");
+        return rc;
+    }
+
+    for (auto column = columns->begin(); column != columns->end(); ++column) {
+        sqlite3_str_appendf(str, ", \"%w\"", column->name.c_str());
+    }
+    if (!partition_column.empty()) {
+        sqlite3_str_appendf(str, ", \"%w\"", partition_column.c_str());
+    }
+
+    sqlite3_str_appendall(str, ")");
+    auto sql = sqlite3_str_finish(str);
+    rc = sqlite3_declare_vtab(db, sql);
+    sqlite3_free(sql);
+
+#define VSS_INDEX_COLUMN_DISTANCE 0
+#define VSS_INDEX_COLUMN_OPERATION 1
+#define VSS_INDEX_COLUMN_ROWIDS 2
+#define VSS_INDEX_COLUMN_VECTORS 3
+
+    if (rc != SQLITE_OK)
+        return rc;
+
+    auto pTable = new vss_index_vtab(db,
+                                     (vss_connection *)pAux,
+                                     sqlite3_mprintf("%s", argv[1]),
+                                     sqlite3_mprintf("%s", argv[2]));
+    pTable->partition_column = partition_column;
+    *ppVtab = pTable;
+
+    if (isCreate) {
+
+        for (auto iter = columns->begin(); iter != columns->end(); ++iter) {
+
+            try {
+
+                auto load_start = vss_clock::now();
+                auto index = create_column_index(*iter);
+
+                if (iter->storage_type == StorageType::faiss_ivflists &&
+                    (iter->vector_type == VectorType::vector_binary ||
+                     dynamic_cast<faiss::IndexIVF *>(unwrap_index(index)) == nullptr)) {
+
+                    *pzErr = sqlite3_mprintf("storage_type=faiss_ivflists on %s needs a float IVF factory",
+                                             iter->name.c_str());
+                    delete index;
+                    delete pTable;
+                    return SQLITE_ERROR;
+                }
+
+                if (dynamic_cast<vss_vamana_index *>(index) != nullptr &&
+                    iter->storage_type != StorageType::faiss_shadow) {
+
+                    *pzErr = sqlite3_mprintf("Vamana column %s is stored in the _graph shadow table, it takes no storage_type",
+                                             iter->name.c_str());
+                    delete index;
+                    delete pTable;
+                    return SQLITE_ERROR;
+                }
+
+                // Without a Flat phase, new partitions would need training
+                // before their first insert.
+                if (pTable->partitioned() && iter->flat_below <= 0 && !index->is_trained) {
+
+                    *pzErr = sqlite3_mprintf("flat_below=0 on %s needs a factory that doesn't need training",
+                                             iter->name.c_str());
+                    delete index;
+                    delete pTable;
+                    return SQLITE_ERROR;
+                }
+
+                pTable->indexes.push_back(new vss_index(index, *iter));
+                pTable->indexes.back()->load_us = elapsed_us(load_start);
+
+            } catch (faiss::FaissException &e) {
+
+                *pzErr = sqlite3_mprintf("Error building index factory for %s: %s",
+                                         iter->name.c_str(),
+                                         e.msg.c_str());
+
+                delete pTable;
+                return SQLITE_ERROR;
+            }
+        }
+
+        rc = create_shadow_tables(db, argv[1], argv[2], pTable->indexes);
+        if (rc == SQLITE_OK && pTable->partitioned())
+            rc = create_partitions_table(db, argv[1], argv[2]);
+        if (rc != SQLITE_OK){
+          *pzErr = sqlite3_mprintf("Error creating shadow tables");
+          delete pTable;
+          return rc;
+        }
+
+
+        // Shadow tables were successully created.
+        // After shadow tables are created, write the initial index state to
+        // shadow _index.
+        auto i = 0;
+        for (auto iter = pTable->indexes.begin(); iter != pTable->indexes.end(); ++iter, i++) {
+
+            try {
+
+                int rc = write_index_insert((*iter)->index,
+                                            pTable->db,
+                                            pTable->schema,
+                                            pTable->name,
+                                            i,
+                                            (*iter)->name,
+                                            (*iter)->storage_type);
+
+                if (rc != SQLITE_OK) {
+                  *pzErr = sqlite3_mprintf("Error initializing _index shadow tables");
+                  delete pTable;
+                  return rc;
+                }
+
+            } catch (faiss::FaissException &e) {
+              *pzErr = sqlite3_mprintf("Faiss error when initializing shadow tables: %s", e.what());
+                delete pTable;
+                return SQLITE_ERROR;
+            }
+        }
+
+    } else {
+
+        rc = vss_read_factories(db, argv[1], argv[2], columns.get());
+        if (rc != SQLITE_OK) {
+            *pzErr = sqlite3_mprintf("Could not read the _factories shadow table: %s", sqlite3_errmsg(db));
+            delete pTable;
+            return rc;
+        }
+
+        for (int i = 0; i < (int)columns->size(); i++) {
+
+            auto load_start = vss_clock::now();
+            faiss::Index *index;
+            try {
+                index = read_index_select(db, argv[1], argv[2], i, (*columns)[i].name, (*columns)[i].storage_type, (*columns)[i].vector_type);
+            } catch (faiss::FaissException &e) {
+                *pzErr = sqlite3_mprintf("Could not read index at position %d: %s", i, e.msg.c_str());
+                delete pTable;
+                return SQLITE_ERROR;
+            }
+
+            // Index in shadow table should always be available, integrity check
+            // to avoid null pointer
+            if (index == nullptr) {
+                *pzErr = sqlite3_mprintf("Could not read index at position %d", i);
+                delete pTable;
+                return SQLITE_ERROR;
+            }
+            pTable->indexes.push_back(new vss_index(index, (*columns)[i]));
+            pTable->indexes.back()->load_us = elapsed_us(load_start);
+        }
+    }
+
+    return SQLITE_OK;
+}
+
+static int vssIndexCreate(sqlite3 *db, void *pAux,
+                          int argc,
+                          const char *const *argv,
+                          sqlite3_vtab **ppVtab,
+                          char **pzErr) {
+
+    return init(db, pAux, argc, argv, ppVtab, pzErr, true);
+}
+
+static int vssIndexConnect(sqlite3 *db,
+                           void *pAux, int argc,
+                           const char *const *argv,
+                           sqlite3_vtab **ppVtab,
+                           char **pzErr) {
+
+    return init(db, pAux, argc, argv, ppVtab, pzErr, false);
+}
+
+static int vssIndexDisconnect(sqlite3_vtab *pVtab) {
+
+    auto pTable = static_cast<vss_index_vtab *>(pVtab);
+    delete pTable;
+    return SQLITE_OK;
+}
+
+static int vssIndexDestroy(sqlite3_vtab *pVtab) {
+
+    auto pTable = static_cast<vss_index_vtab *>(pVtab);
+    drop_shadow_tables(pTable->db, pTable->name);
+    vssIndexDisconnect(pVtab);
+    return SQLITE_OK;
+}
+
+static int vssIndexOpen(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor) {
+
+    auto pTable = static_cast<vss_index_vtab *>(pVtab);
+
+    auto pCursor = new vss_index_cursor(pTable);
+    if (pCursor == nullptr)
+        return SQLITE_NOMEM;
+
+    *ppCursor = pCursor;
+
+    return SQLITE_OK;
+}
+
+static int vssIndexClose(sqlite3_vtab_cursor *cur) {
+
+    auto pCursor = static_cast<vss_index_cursor *>(cur);
+    delete pCursor;
+    return SQLITE_OK;
+}
+
+// Defined with vss_train(), partitions use them to switch indexes.
+static VssIndexColumn vss_index_definition(vss_index *column);
+static int vss_train_sample_stored(vss_index *column,
+                                   size_t sample_size,
+                                   std::mt19937_64 &rng,
+                                   vector<float> *sample,
+                                   char **errmsg);
+static int vss_index_copy_vectors(vss_index *column, faiss::Index *index, const char *function, char **errmsg);
+
+// Partitions that reach flat_below train their factory on at most this many
+// of their vectors.
+static const size_t VSS_PARTITION_SAMPLE_SIZE = 64 * 1024;
+
+// Loaded partitions a table keeps beyond this many are unloaded, least
+// recently used first, as long as nothing of theirs is left to write.
+static const size_t VSS_PARTITIONS_LOADED = 64;
+
+// Whether a partition can be unloaded and read again from its shadow tables
+// without losing anything: it is written, and no cursor uses it.
+static bool vss_partition_unloadable(const vss_partition &partition) {
+
+    if (partition.created || partition.cursors > 0)
+        return false;
+
+    for (auto index : partition.indexes) {
+        if (!index->trainings.empty() || !index->insert_ids.empty() ||
+            !index->delete_ids.empty() || index->imported != nullptr)
+            return false;
+    }
+    return true;
+}
+
+// Unloads the least recently used partitions over VSS_PARTITIONS_LOADED,
+// skipping those that can't be, and keep.
+static void vss_partition_evict(vss_index_vtab *pTable, const vss_partition *keep) {
+
+    while (pTable->partitions.size() > VSS_PARTITIONS_LOADED) {
+
+        auto oldest = pTable->partitions.end();
+        for (auto iter = pTable->partitions.begin(); iter != pTable->partitions.end(); ++iter) {
+            if (&iter->second != keep && vss_partition_unloadable(iter->second) &&
+                (oldest == pTable->partitions.end() || iter->second.last_used < oldest->second.last_used))
+                oldest = iter;
+        }
+
+        if (oldest == pTable->partitions.end())
+            return;
+
+        vss_partition_free(oldest->second);
+        pTable->partitions.erase(oldest);
+    }
+}
+
+// Whether index is a plain Flat index, under its IDMap.
+static bool vss_index_is_flat(faiss::Index *index) {
+
+    auto inner = unwrap_index(index);
+    if (auto binary = dynamic_cast<vss_binary_index *>(inner))
+        return dynamic_cast<faiss::IndexBinaryFlat *>(binary->inner()) != nullptr;
+    return dynamic_cast<faiss::IndexFlat *>(inner) != nullptr;
+}
+
+// Position of the partition key among the declared columns of a partitioned
+// table, after the vector columns.
+static int vss_partition_column_index(vss_index_vtab *pTable) {
+
+    return VSS_INDEX_COLUMN_VECTORS + (int)pTable->indexes.size();
+}
+
+// _index rowid of a column's index in a partition. Partition 0 is the table's
+// own columns, at their position.
+static int vss_partition_index_id(vss_index_vtab *pTable, sqlite3_int64 partition, size_t column) {
+
+    return (int)(partition * pTable->indexes.size() + column);
+}
+
+// Column name storage_type=faiss_ondisk index files are named after.
+static string vss_partition_file_column(vss_index *column, sqlite3_int64 partition) {
+
+    return partition == 0 ? column->name : column->name + "." + to_string(partition);
+}
+
+// Flat partitions of a faiss_ivflists column have no lists to keep in
+// _ivflists, they're written whole to _index.
+static StorageType vss_partition_storage_type(vss_index *column) {
+
+    if (column->storage_type == StorageType::faiss_ivflists &&
+        dynamic_cast<faiss::IndexIVF *>(unwrap_index(column->index)) == nullptr)
+        return StorageType::faiss_shadow;
+    return column->storage_type;
+}
+
+// Reads a partition key, false when value is neither an integer nor text.
+static bool vss_partition_key_from_value(sqlite3_value *value, vss_partition_key *key) {
+
+    switch (sqlite3_value_type(value)) {
+    case SQLITE_INTEGER:
+        *key = (sqlite3_int64)sqlite3_value_int64(value);
+        return true;
+    case SQLITE_TEXT:
+        *key = string((const char *)sqlite3_value_text(value), sqlite3_value_bytes(value));
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void vss_partition_key_bind(sqlite3_stmt *stmt, int i, const vss_partition_key &key) {
+
+    if (auto integer = std::get_if<sqlite3_int64>(&key))
+        sqlite3_bind_int64(stmt, i, *integer);
+    else
+        sqlite3_bind_text(stmt, i, std::get<string>(key).c_str(), -1, SQLITE_TRANSIENT);
+}
+
+// The index a new partition of column starts with: Flat, unless flat_below
+// is 0.
+static faiss::Index *vss_partition_create_index(vss_index *column) {
+
+    auto definition = vss_index_definition(column);
+    if (definition.flat_below > 0)
+        definition.factory = definition.vector_type == VectorType::vector_binary ? "BFlat" : "Flat,IDMap2";
+    return create_column_index(definition);
+}
+
+// Finds the partition for key, reading its indexes on first use. Unknown
+// keys get a new partition with create, otherwise *partition is null.
+static int vss_partition_lookup(vss_index_vtab *pTable,
+                                const vss_partition_key &key,
+                                bool create,
+                                vss_partition **partition,
+                                char **errmsg) {
+
+    *partition = nullptr;
+
+    auto found = pTable->partitions.find(key);
+    if (found != pTable->partitions.end()) {
+        *partition = &found->second;
+        (*partition)->last_used = ++pTable->partition_uses;
+        return SQLITE_OK;
+    }
+
+    sqlite3_stmt *stmt = nullptr;
+    auto sql = sqlite3_mprintf("select partition from \"%w\".\"%w_partitions\" where key = ?",
+                               pTable->schema, pTable->name);
+    int rc = sqlite3_prepare_v2(pTable->db, sql, -1, &stmt, nullptr);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) {
+        *errmsg = sqlite3_mprintf("Could not read partitions of %s: %s", pTable->name, sqlite3_errmsg(pTable->db));
+        return rc;
+    }
+
+    vss_partition_key_bind(stmt, 1, key);
+    rc = sqlite3_step(stmt);
+
+    vss_partition loaded;
+    loaded.number = rc == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : 0;
+    sqlite3_finalize(stmt);
+
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+        *errmsg = sqlite3_mprintf("Could not read partitions of %s: %s", pTable->name, sqlite3_errmsg(pTable->db));
+        return SQLITE_ERROR;
+    }
+
+    if (rc == SQLITE_DONE) {
+
+        if (!create)
+            return SQLITE_OK;
+
+        sql = sqlite3_mprintf("select coalesce(max(partition), 0) + 1 from \"%w\".\"%w_partitions\"",
+                              pTable->schema, pTable->name);
+        rc = sqlite3_prepare_v2(pTable->db, sql, -1, &stmt, nullptr);
+        sqlite3_free(sql);
+        if (rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW)
+            loaded.number = sqlite3_column_int64(stmt, 0);
+        sqlite3_finalize(stmt);
+
+        rc = SQLITE_ERROR;
+        if (loaded.number > 0) {
+            sql = sqlite3_mprintf("insert into \"%w\".\"%w_partitions\"(key, partition) values (?, ?)",
+                                  pTable->schema, pTable->name);
+            rc = sqlite3_prepare_v2(pTable->db, sql, -1, &stmt, nullptr);
+            sqlite3_free(sql);
+            if (rc == SQLITE_OK) {
+                vss_partition_key_bind(stmt, 1, key);
+                sqlite3_bind_int64(stmt, 2, loaded.number);
+                rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+                sqlite3_finalize(stmt);
+            }
+        }
+
+        if (rc != SQLITE_OK) {
+            *errmsg = sqlite3_mprintf("Could not add a partition to %s: %s", pTable->name, sqlite3_errmsg(pTable->db));
+            return SQLITE_ERROR;
+        }
+        loaded.created = true;
+    }
+
+    try {
+
+        for (size_t i = 0; i < pTable->indexes.size(); i++) {
+
+            auto column = pTable->indexes[i];
+            auto load_start = vss_clock::now();
+
+            faiss::Index *index;
+            if (loaded.created)
+                index = vss_partition_create_index(column);
+            else
+                index = read_index_select(pTable->db,
+                                          pTable->schema,
+                                          pTable->name,
+                                          vss_partition_index_id(pTable, loaded.number, i),
+                                          vss_partition_file_column(column, loaded.number),
+                                          column->storage_type,
+                                          column->vector_type);
+
+            if (index == nullptr) {
+                *errmsg = sqlite3_mprintf("Could not read index of %s for partition %lld",
+                                          column->name.c_str(), loaded.number);
+                vss_partition_free(loaded);
+                return SQLITE_ERROR;
+            }
+
+            loaded.indexes.push_back(new vss_index(index, vss_index_definition(column)));
+            loaded.indexes.back()->column = column;
+            loaded.indexes.back()->load_us = elapsed_us(load_start);
+        }
+
+    } catch (faiss::FaissException &e) {
+
+        *errmsg = sqlite3_mprintf("Error loading partition %lld of %s: %s",
+                                  loaded.number, pTable->name, e.msg.c_str());
+        vss_partition_free(loaded);
+        return SQLITE_ERROR;
+    }
+
+    *partition = &pTable->partitions.emplace(key, std::move(loaded)).first->second;
+    (*partition)->last_used = ++pTable->partition_uses;
+    vss_partition_evict(pTable, *partition);
+    return SQLITE_OK;
+}
+
+// Partition key of a row, from the "_" column of _data. found is false when
+// the row doesn't exist.
+static int vss_partition_key_of_row(vss_index_vtab *pTable,
+                                    sqlite3_int64 rowid,
+                                    vss_partition_key *key,
+                                    bool *found) {
+
+    sqlite3_stmt *stmt = nullptr;
+    auto sql = sqlite3_mprintf("select _ from \"%w\".\"%w_data\" where rowid = ?",
+                               pTable->schema, pTable->name);
+    int rc = sqlite3_prepare_v2(pTable->db, sql, -1, &stmt, nullptr);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    sqlite3_bind_int64(stmt, 1, rowid);
+    rc = sqlite3_step(stmt);
+    *found = rc == SQLITE_ROW && vss_partition_key_from_value(sqlite3_column_value(stmt, 0), key);
+    sqlite3_finalize(stmt);
+
+    return rc == SQLITE_ROW || rc == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+}
+
+static int vssIndexBestIndex(sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo) {
+
+    auto pTable = static_cast<vss_index_vtab *>(tab);
+
+    int iSearchTerm = -1;
+    int iRangeSearchTerm = -1;
+    int iXSearchColumn = -1;
+    int iLimit = -1;
+    int iPartitionTerm = -1;
+
+    for (int i = 0; i < pIdxInfo->nConstraint; i++) {
+
+        auto constraint = pIdxInfo->aConstraint[i];
+
+        if (!constraint.usable)
+            continue;
+
+        if (constraint.op == VSS_SEARCH_FUNCTION) {
+
+            iSearchTerm = i;
+            iXSearchColumn = constraint.iColumn;
+
+        } else if (constraint.op == VSS_RANGE_SEARCH_FUNCTION) {
+
+            iRangeSearchTerm = i;
+            iXSearchColumn = constraint.iColumn;
+
+        } else if (constraint.op == SQLITE_INDEX_CONSTRAINT_LIMIT) {
+            iLimit = i;
+
+        } else if (constraint.op == SQLITE_INDEX_CONSTRAINT_EQ &&
+                   pTable->partitioned() &&
+                   constraint.iColumn == vss_partition_column_index(pTable)) {
+            iPartitionTerm = i;
+        }
+    }
+
+    // Plans on a single partition are prefixed with "partition_", and take
+    // its key as their first argument. Searching every partition at once
+    // isn't supported, so those plans are priced out.
+    int argvIndex = 1;
+    double unrestricted = pTable->partitioned() ? 1e12 : 1;
+    if (iPartitionTerm >= 0) {
+        pIdxInfo->aConstraintUsage[iPartitionTerm].argvIndex = argvIndex++;
+        pIdxInfo->aConstraintUsage[iPartitionTerm].omit = 1;
+        unrestricted = 1;
+    }
+    auto partitioned = iPartitionTerm >= 0;
+
+    if (iSearchTerm >= 0) {
+
+        pIdxInfo->idxNum = iXSearchColumn - VSS_INDEX_COLUMN_VECTORS;
+        pIdxInfo->idxStr = (char *)(partitioned ? "partition_search" : "search");
+        pIdxInfo->aConstraintUsage[iSearchTerm].argvIndex = argvIndex++;
+        pIdxInfo->aConstraintUsage[iSearchTerm].omit = 1;
+        if (iLimit >= 0) {
+            pIdxInfo->aConstraintUsage[iLimit].argvIndex = argvIndex++;
+            pIdxInfo->aConstraintUsage[iLimit].omit = 1;
+        }
+        pIdxInfo->estimatedCost = 300.0 * unrestricted;
+        pIdxInfo->estimatedRows = 10;
+
+        return SQLITE_OK;
+    }
+
+    if (iRangeSearchTerm >= 0) {
+
+        pIdxInfo->idxNum = iXSearchColumn - VSS_INDEX_COLUMN_VECTORS;
+        pIdxInfo->idxStr = (char *)(partitioned ? "partition_range_search" : "range_search");
+        pIdxInfo->aConstraintUsage[iRangeSearchTerm].argvIndex = argvIndex++;
+        pIdxInfo->aConstraintUsage[iRangeSearchTerm].omit = 1;
+        pIdxInfo->estimatedCost = 300.0 * unrestricted;
+        pIdxInfo->estimatedRows = 10;
+        return SQLITE_OK;
+    }
+
+    pIdxInfo->idxNum = -1;
+    pIdxInfo->idxStr = (char *)(partitioned ? "partition_fullscan" : "fullscan");
+    pIdxInfo->estimatedCost = partitioned ? 30000.0 : 3000000.0;
+    pIdxInfo->estimatedRows = partitioned ? 1000 : 100000;
+    return SQLITE_OK;
+}
+
+// Strips the IDMap and pre-transform wrappers a factory string can add, to
+// reach the index that actually does the searching.
+static faiss::Index *unwrap_index(faiss::Index *index) {
+
+    while (true) {
+
+        if (auto idmap = dynamic_cast<faiss::IndexIDMap *>(index))
+            index = idmap->index;
+        else if (auto transform = dynamic_cast<faiss::IndexPreTransform *>(index))
+            index = transform->index;
+        else
+            return index;
+    }
+}
+
+// Whether index keeps approximate codes instead of the vectors it was given,
+// like PQ and SQ codecs or a PCA/OPQ transform. Reconstructing from such an
+// index returns the decoded vectors, and an exhaustive search over it shares
+// its quantization error.
+static bool vss_index_is_lossy(faiss::Index *index) {
+
+    while (auto idmap = dynamic_cast<faiss::IndexIDMap *>(index))
+        index = idmap->index;
+
+    if (dynamic_cast<faiss::IndexFlat *>(index) != nullptr ||
+        dynamic_cast<faiss::IndexIVFFlat *>(index) != nullptr ||
+        dynamic_cast<vss_binary_index *>(index) != nullptr ||
+        dynamic_cast<vss_vamana_index *>(index) != nullptr)
+        return false;
+
+    if (auto hnsw = dynamic_cast<faiss::IndexHNSW *>(index))
+        return dynamic_cast<faiss::IndexFlat *>(hnsw->storage) == nullptr;
+
+    return true;
+}
+
+// Inverted lists of a float or binary IVF column, null for other indexes.
+static faiss::InvertedLists *vss_index_invlists(faiss::Index *index) {
+
+    if (auto ivf = dynamic_cast<faiss::IndexIVF *>(unwrap_index(index)))
+        return ivf->invlists;
+
+    auto binary = dynamic_cast<vss_binary_index *>(unwrap_index(index));
+    auto binary_ivf = binary != nullptr ? dynamic_cast<faiss::IndexBinaryIVF *>(binary->inner()) : nullptr;
+    return binary_ivf != nullptr ? binary_ivf->invlists : nullptr;
+}
+
+// The SQLite backed lists of an IVF column that holds rowids in its lists,
+// see vss_sqlite_invlists::track_rows. Null for every other index.
+static vss_sqlite_invlists *vss_index_rows(faiss::Index *index) {
+
+    auto lists = dynamic_cast<vss_sqlite_invlists *>(vss_index_invlists(index));
+    return lists != nullptr && lists->track_rows ? lists : nullptr;
+}
+
+// Removes rowids from a column, through the _ivfrows shadow table when the
+// index has one so only the lists holding them are read.
+static void vss_index_remove(faiss::Index *index, const vector<faiss::idx_t> &ids) {
+
+    auto lists = vss_index_rows(index);
+    if (lists == nullptr) {
+        faiss::IDSelectorBatch selector(ids.size(), ids.data());
+        index->remove_ids(selector);
+        return;
+    }
+
+    auto removed = lists->remove_ids(ids);
+    for (auto level = index; level != nullptr;) {
+        level->ntotal -= removed;
+        auto transform = dynamic_cast<faiss::IndexPreTransform *>(level);
+        level = transform != nullptr ? transform->index : nullptr;
+    }
+}
+
+// Reads back the vector stored under rowid id. IVF columns with _ivfrows
+// decode it from the one list it is in, others use faiss' reconstruct.
+// Throws when the vector can't be read.
+static void vss_index_reconstruct(faiss::Index *index, faiss::idx_t id, float *recons) {
+
+    auto lists = vss_index_rows(index);
+    if (lists == nullptr) {
+        index->reconstruct(id, recons);
+        return;
+    }
+
+    size_t list_no, offset;
+    if (!lists->locate(id, &list_no, &offset))
+        throw faiss::FaissException("rowid " + to_string(id) + " is not in the index");
+
+    vector<faiss::IndexPreTransform *> transforms;
+    auto level = index;
+    while (auto transform = dynamic_cast<faiss::IndexPreTransform *>(level)) {
+        transforms.push_back(transform);
+        level = transform->index;
+    }
+
+    auto ivf = dynamic_cast<faiss::IndexIVF *>(level);
+    vector<float> decoded(ivf->d);
+    ivf->reconstruct_from_offset(list_no, offset, decoded.data());
+
+    for (auto transform = transforms.rbegin(); transform != transforms.rend(); ++transform) {
+        vector<float> reversed((*transform)->d);
+        (*transform)->reverse_chain(1, decoded.data(), reversed.data());
+        decoded.swap(reversed);
+    }
+    copy(decoded.begin(), decoded.end(), recons);
+}
+
+// Limits faiss to the calling thread while searching or changing a
+// storage_type=faiss_ivflists column, see vss_sqlite_invlists. No-op for
+// every other index.
+struct vss_faiss_threads {
+
+    explicit vss_faiss_threads(faiss::Index *index) {
+
+        if (dynamic_cast<vss_sqlite_invlists *>(vss_index_invlists(index)) == nullptr)
+            return;
+
+        saved = omp_get_max_threads();
+        omp_set_num_threads(1);
+    }
+
+    ~vss_faiss_threads() {
+        if (saved > 0)
+            omp_set_num_threads(saved);
+    }
+
+    int saved = 0;
+};
+
+// Whether faiss counts the work of searching index in its process-wide
+// indexIVF_stats or hnsw_stats.
+static bool vss_index_reports_faiss_stats(faiss::Index *index) {
+
+    auto inner = unwrap_index(index);
+    if (dynamic_cast<faiss::IndexIVF *>(inner) != nullptr ||
+        dynamic_cast<faiss::IndexHNSW *>(inner) != nullptr)
+        return true;
+
+    auto binary = dynamic_cast<vss_binary_index *>(inner);
+    return binary != nullptr &&
+           (dynamic_cast<faiss::IndexBinaryIVF *>(binary->inner()) != nullptr ||
+            dynamic_cast<faiss::IndexBinaryHNSW *>(binary->inner()) != nullptr);
+}
+
+static std::mutex vss_faiss_trace_mutex;
+
+// faiss counts the work of IVF and HNSW searches in the process-wide
+// faiss::indexIVF_stats and faiss::hnsw_stats. A search reads its own work
+// back as the growth of those counters since this snapshot, which also
+// counts whatever other threads searched meanwhile: lists_probed and
+// candidates_scanned are best-effort. Searches traced by vss_explain() hold
+// a lock, so at least two traces don't count each other's work.
+struct vss_faiss_work {
+
+    vss_faiss_work(faiss::Index *index, bool traced) {
+
+        if (!vss_index_reports_faiss_stats(index))
+            return;
+
+        if (traced)
+            lock = std::unique_lock<std::mutex>(vss_faiss_trace_mutex);
+        ivf_nlist = faiss::indexIVF_stats.nlist;
+        ivf_ndis = faiss::indexIVF_stats.ndis;
+        hnsw_ndis = faiss::hnsw_stats.ndis;
+    }
+
+    sqlite3_int64 ivf_lists_probed() const { return (sqlite3_int64)(faiss::indexIVF_stats.nlist - ivf_nlist); }
+    sqlite3_int64 ivf_candidates() const { return (sqlite3_int64)(faiss::indexIVF_stats.ndis - ivf_ndis); }
+    sqlite3_int64 hnsw_candidates() const { return (sqlite3_int64)(faiss::hnsw_stats.ndis - hnsw_ndis); }
+
+    void release() {
+        if (lock.owns_lock())
+            lock.unlock();
+    }
+
+    size_t ivf_nlist = 0;
+    size_t ivf_ndis = 0;
+    size_t hnsw_ndis = 0;
+    std::unique_lock<std::mutex> lock;
+};
+
+// Sets how wide an index searches, for the searches made while it lives:
+// nprobe for IVF indexes, efSearch for HNSW ones and the candidate list for
+// Vamana ones. Values of 0 or less keep the index's own, which are put back
+// afterwards. Binary IVF and HNSW indexes have the same knobs.
+struct vss_search_width {
+
+    vss_search_width(faiss::Index *index, sqlite3_int64 nprobe, sqlite3_int64 ef_search) {
+
+        auto inner = unwrap_index(index);
+        nlist = 0;
+
+        if (auto ivf = dynamic_cast<faiss::IndexIVF *>(inner)) {
+            this->nprobe = &ivf->nprobe;
+            nlist = ivf->nlist;
+        } else if (auto hnsw = dynamic_cast<faiss::IndexHNSW *>(inner)) {
+            efSearch = &hnsw->hnsw.efSearch;
+        } else if (auto binary = dynamic_cast<vss_binary_index *>(inner)) {
+            if (auto ivf = dynamic_cast<faiss::IndexBinaryIVF *>(binary->inner())) {
+                this->nprobe = &ivf->nprobe;
+                nlist = ivf->nlist;
+            } else if (auto hnsw = dynamic_cast<faiss::IndexBinaryHNSW *>(binary->inner())) {
+                efSearch = &hnsw->hnsw.efSearch;
+            }
+        } else if (auto vamana = dynamic_cast<vss_vamana_index *>(inner)) {
+            search_list = &vamana->search_list;
+        }
+
+        if (this->nprobe != nullptr) {
+            previous = *this->nprobe;
+            if (nprobe > 0)
+                *this->nprobe = min((size_t)nprobe, nlist);
+        } else if (efSearch != nullptr) {
+            previous = *efSearch;
+            if (ef_search > 0)
+                *efSearch = (int)min(ef_search, (sqlite3_int64)INT32_MAX);
+        } else if (search_list != nullptr) {
+            previous = *search_list;
+            if (ef_search > 0)
+                *search_list = ef_search;
+        }
+    }
+
+    ~vss_search_width() {
+
+        if (nprobe != nullptr)
+            *nprobe = previous;
+        else if (efSearch != nullptr)
+            *efSearch = previous;
+        else if (search_list != nullptr)
+            *search_list = previous;
+    }
+
+    size_t *nprobe = nullptr;
+    size_t nlist;
+    int *efSearch = nullptr;
+    size_t *search_list = nullptr;
+    size_t previous = 0;
+};
+
+// Searches with the IVF/HNSW knobs turned all the way up, used as the
+// reference the sampled recall estimate is measured against. Exact for
+// lossless indexes, see vss_index_is_lossy() for the others.
+static void exhaustive_search(faiss::Index *index,
+                              const float *x,
+                              faiss::idx_t k,
+                              float *distances,
+                              faiss::idx_t *ids) {
+
+    vss_faiss_threads threads(index);
+
+    // Every list, and a candidate list as long as the index.
+    vss_search_width width(index, INT64_MAX, max((sqlite3_int64)unwrap_index(index)->ntotal, (sqlite3_int64)k));
+
+    index->search(1, x, k, distances, ids);
+}
+
+// Adds the work faiss reported for the last search to the column's stats, and
+// to the scan's trace when it's being explained. Flat indexes don't report
+// anything, but always scan every vector.
+static void record_search_work(vss_index *vssIndex, const vss_faiss_work &work, vss_scan_trace *trace) {
+
+    auto inner = unwrap_index(vssIndex->index);
+    sqlite3_int64 lists_probed = 0;
+    sqlite3_int64 candidates_scanned;
+
+    auto binary = dynamic_cast<vss_binary_index *>(inner);
+    auto binary_ivf = binary != nullptr ? dynamic_cast<faiss::IndexBinaryIVF *>(binary->inner()) : nullptr;
+    auto binary_hnsw = binary != nullptr ? dynamic_cast<faiss::IndexBinaryHNSW *>(binary->inner()) : nullptr;
+
+    if (auto ivf = dynamic_cast<faiss::IndexIVF *>(inner)) {
+
+        lists_probed = work.ivf_lists_probed();
+        candidates_scanned = work.ivf_candidates();
+        if (trace != nullptr)
+            trace->nprobe = ivf->nprobe;
+
+    } else if (binary_ivf != nullptr) {
+
+        lists_probed = work.ivf_lists_probed();
+        candidates_scanned = work.ivf_candidates();
+        if (trace != nullptr)
+            trace->nprobe = binary_ivf->nprobe;
+
+    } else if (auto hnsw = dynamic_cast<faiss::IndexHNSW *>(inner)) {
+
+        candidates_scanned = work.hnsw_candidates();
+        if (trace != nullptr)
+            trace->ef_search = hnsw->hnsw.efSearch;
+
+    } else if (binary_hnsw != nullptr) {
+
+        candidates_scanned = work.hnsw_candidates();
+        if (trace != nullptr)
+            trace->ef_search = binary_hnsw->hnsw.efSearch;
+
+    } else if (auto vamana = dynamic_cast<vss_vamana_index *>(inner)) {
+
+        // Graph nodes read from the _graph shadow table count as lists.
+        lists_probed = vamana->nodes_read;
+        candidates_scanned = vamana->distances_computed;
+        if (trace != nullptr)
+            trace->ef_search = vamana->search_list;
+
+    } else {
+
+        candidates_scanned = vssIndex->index->ntotal;
+    }
+
+    vssIndex->search_stats().lists_probed += lists_probed;
+    vssIndex->search_stats().candidates_scanned += candidates_scanned;
+
+    if (trace != nullptr) {
+        trace->lists_probed = lists_probed;
+        trace->candidates_scanned = candidates_scanned;
+    }
+}
+
+// Starts a new vss_explain() trace entry for the scan xFilter is about to run,
+// if the connection is being traced.
+static vss_scan_trace *start_scan_trace(vss_index_cursor *pCursor,
+                                        int idxNum,
+                                        const char *idxStr) {
+
+    auto trace = pCursor->table->connection->trace;
+    pCursor->trace_entry = -1;
+
+    if (trace == nullptr)
+        return nullptr;
+
+    vss_scan_trace entry;
+    entry.table_name = pCursor->table->name;
+    entry.plan = idxStr;
+    if (idxNum >= 0 && (size_t)idxNum < pCursor->table->indexes.size())
+        entry.column_name = pCursor->table->indexes.at(idxNum)->name;
+
+    trace->push_back(entry);
+    pCursor->trace_entry = trace->size() - 1;
+    return &trace->back();
+}
+
+// Compares the served results of a search against an exhaustive search of the
+// same index, and adds the recall@k to the column's stats.
+static void record_recall_sample(vss_index *vssIndex,
+                                 const float *query,
+                                 const vector<faiss::idx_t> &ids) {
+
+    vector<float> reference_distances(ids.size());
+    vector<faiss::idx_t> reference_ids(ids.size());
+
+    try {
+        exhaustive_search(vssIndex->index,
+                          query,
+                          ids.size(),
+                          reference_distances.data(),
+                          reference_ids.data());
+    } catch (faiss::FaissException &e) {
+        return;
+    }
+
+    size_t expected = 0;
+    size_t found = 0;
+    for (auto id : reference_ids) {
+        if (id == -1)
+            continue;
+        expected++;
+        if (find(ids.begin(), ids.end(), id) != ids.end())
+            found++;
+    }
+
+    if (expected == 0)
+        return;
+
+    vssIndex->search_stats().recall_samples++;
+    vssIndex->search_stats().recall_sum += (double)found / expected;
+}
+
+static int vssIndexFilter(sqlite3_vtab_cursor *pVtabCursor,
+                          int idxNum,
+                          const char *idxStr,
+                          int argc,
+                          sqlite3_value **argv) {
+
+    auto pCursor = static_cast<vss_index_cursor *>(pVtabCursor);
+    auto pTable = pCursor->table;
+
+    pCursor->finish_search();
+    auto filter_start = vss_clock::now();
+
+    // Single partition plans take the partition key first, and run like the
+    // plan they prefix on that partition's indexes.
+    sqlite3_value_free(pCursor->partition_key);
+    pCursor->partition_key = nullptr;
+    pCursor->release_partition();
+    pCursor->indexes = &pTable->indexes;
+
+    auto partition_plan = strncmp(idxStr, "partition_", strlen("partition_")) == 0;
+    if (partition_plan) {
+
+        idxStr += strlen("partition_");
+        pCursor->partition_key = sqlite3_value_dup(argv[0]);
+        argv++;
+        argc--;
+
+        vss_partition_key key;
+        vss_partition *partition = nullptr;
+        char *errmsg = nullptr;
+
+        if (strcmp(idxStr, "fullscan") != 0 &&
+            vss_partition_key_from_value(pCursor->partition_key, &key) &&
+            vss_partition_lookup(pTable, key, false, &partition, &errmsg) != SQLITE_OK) {
+
+            sqlite3_free(pVtabCursor->pVtab->zErrMsg);
+            pVtabCursor->pVtab->zErrMsg = errmsg;
+            return SQLITE_ERROR;
+        }
+        pCursor->indexes = partition != nullptr ? &partition->indexes : nullptr;
+        pCursor->partition = partition;
+        if (partition != nullptr)
+            partition->cursors++;
+
+    } else if (pTable->partitioned() && strcmp(idxStr, "fullscan") != 0) {
+
+        sqlite3_free(pVtabCursor->pVtab->zErrMsg);
+        pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf(
+            "%s() on partitioned table %s needs a %s = constraint",
+            strcmp(idxStr, "search") == 0 ? "vss_search" : "vss_range_search",
+            pTable->name,
+            pTable->partition_column.c_str());
+        return SQLITE_ERROR;
+    }
+
+    auto trace = start_scan_trace(pCursor, idxNum, idxStr);
+    if (trace != nullptr && partition_plan)
+        trace->constraints.push_back("partition");
+
+    if (strcmp(idxStr, "search") == 0 && pCursor->indexes == nullptr) {
+
+        // No rows were ever inserted with that key.
+        pCursor->query_type = QueryType::search;
+        pCursor->limit = 0;
+        pCursor->search_ids.clear();
+        pCursor->search_distances.clear();
+
+    } else if (strcmp(idxStr, "search") == 0) {
+
+        pCursor->query_type = QueryType::search;
+        vec_ptr query_vector;
+        auto vssIndex = pCursor->indexes->at(idxNum);
+
+        auto params = static_cast<VssSearchParams *>(sqlite3_value_pointer(argv[0], "vss0_searchparams"));
+        if (params != nullptr) {
+
+            pCursor->limit = params->k;
+            query_vector = vss_unpack_bits(vssIndex, params->value);
+            if (query_vector == nullptr && params->vector != nullptr)
+                query_vector = vec_ptr(new vector<float>(*params->vector));
+
+            if (query_vector == nullptr) {
+                sqlite3_free(pVtabCursor->pVtab->zErrMsg);
+                pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf(
+                    "2nd argument to vss_search() must be a vector");
+                return SQLITE_ERROR;
+            }
+
+            if (trace != nullptr)
+                trace->constraints.push_back("vss_search_params");
+
+        } else if (sqlite3_libversion_number() < 3041000) {
+
+            // https://sqlite.org/forum/info/6b32f818ba1d97ef
+            sqlite3_free(pVtabCursor->pVtab->zErrMsg);
+            pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf(
+                "vss_search() only support vss_search_params() as a "
+                "2nd parameter for SQLite versions below 3.41.0");
+            return SQLITE_ERROR;
+
+        } else if ((query_vector = vss_value_as_vector(pCursor->table, vssIndex, argv[0])) != nullptr) {
+
+            if (argc > 1) {
+                pCursor->limit = sqlite3_value_int(argv[1]);
+
+                if (trace != nullptr) {
+                    trace->constraints.push_back("vss_search");
+                    trace->constraints.push_back("limit");
+                    trace->limit_pushed_down = true;
+                }
+            } else {
+                sqlite3_free(pVtabCursor->pVtab->zErrMsg);
+                pVtabCursor->pVtab->zErrMsg =
+                    sqlite3_mprintf("LIMIT required on vss_search() queries");
+                return SQLITE_ERROR;
+            }
+
+        } else {
+
+            if (pVtabCursor->pVtab->zErrMsg != nullptr)
+                sqlite3_free(pVtabCursor->pVtab->zErrMsg);
+
+            pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf(
+                "2nd argument to vss_search() must be a vector");
+            return SQLITE_ERROR;
+        }
+
+        int nq = 1;
+        auto index = vssIndex->index;
+        auto nprobe = params != nullptr ? params->nprobe : -1;
+        auto ef_search = params != nullptr ? params->ef_search : -1;
+
+        if (query_vector->size() != (size_t)index->d) {
+
+            // TODO: To support index that transforms vectors
+            // (to conserve spage, eg?), we should probably
+            // have some logic in place that transforms the vectors here?
+            sqlite3_free(pVtabCursor->pVtab->zErrMsg);
+            pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf(
+                "Input query size doesn't match index dimensions: %ld != %ld",
+                query_vector->size(),
+                index->d);
+            return SQLITE_ERROR;
+        }
+
+        if (pCursor->limit <= 0) {
+
+            sqlite3_free(pVtabCursor->pVtab->zErrMsg);
+            pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf(
+                "Limit must be greater than 0, got %ld", pCursor->limit);
+            return SQLITE_ERROR;
+        }
+
+        // To avoid trying to select more records than number of records in index.
+        auto searchMax = min(static_cast<faiss::idx_t>(pCursor->limit) * nq, index->ntotal * nq);
+
+        pCursor->search_distances = vector<float>(searchMax, 0);
+        pCursor->search_ids = vector<faiss::idx_t>(searchMax, 0);
+
+        vss_faiss_work work(index, trace != nullptr);
+        unique_ptr<vss_search_width> width(new vss_search_width(index, nprobe, ef_search));
+        auto faiss_start = vss_clock::now();
+
+        if (trace != nullptr) {
+            trace->parse_us = chrono::duration<double, micro>(faiss_start - filter_start).count();
+            trace->k = searchMax;
+        }
+
+        try {
+            vss_faiss_threads threads(index);
+            index->search(nq,
+                          query_vector->data(),
+                          searchMax,
+                          pCursor->search_distances.data(),
+                          pCursor->search_ids.data());
+        } catch (faiss::FaissException &e) {
+            sqlite3_free(pVtabCursor->pVtab->zErrMsg);
+            pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf("Error searching %s: %s", vssIndex->name.c_str(), e.msg.c_str());
+            return SQLITE_ERROR;
+        }
+
+        pCursor->faiss_us = elapsed_us(faiss_start);
+        pCursor->searched_index = vssIndex;
+        pCursor->search_start = filter_start;
+
+        vssIndex->search_stats().searches++;
+        record_search_work(vssIndex, work, trace);
+        width.reset();
+        work.release();
+        if (trace != nullptr)
+            trace->search_us = pCursor->faiss_us;
+
+        if (vssIndex->recall_sample > 0 && searchMax > 0 &&
+            vssIndex->search_stats().searches % vssIndex->recall_sample == 0) {
+
+            record_recall_sample(vssIndex, query_vector->data(), pCursor->search_ids);
+        }
+
+    } else if (strcmp(idxStr, "range_search") == 0 && pCursor->indexes == nullptr) {
+
+        pCursor->query_type = QueryType::range_search;
+        pCursor->range_search_result = unique_ptr<faiss::RangeSearchResult>(new faiss::RangeSearchResult(1, true));
+
+    } else if (strcmp(idxStr, "range_search") == 0) {
+
+        pCursor->query_type = QueryType::range_search;
+
+        auto params = static_cast<VssRangeSearchParams *>(
+            sqlite3_value_pointer(argv[0], "vss0_rangesearchparams"));
+
+        int nq = 1;
+
+        vector<faiss::idx_t> nns(params->distance * nq);
+        pCursor->range_search_result = unique_ptr<faiss::RangeSearchResult>(new faiss::RangeSearchResult(nq, true));
+
+        auto vssIndex = pCursor->indexes->at(idxNum);
+        auto index = vssIndex->index;
+
+        auto query_vector = vss_unpack_bits(vssIndex, params->value);
+        if (query_vector == nullptr && params->vector != nullptr)
+            query_vector = vec_ptr(new vector<float>(*params->vector));
+
+        if (query_vector == nullptr || query_vector->size() != (size_t)index->d) {
+            sqlite3_free(pVtabCursor->pVtab->zErrMsg);
+            pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf(
+                "2nd argument to vss_range_search() must be a vector of %d dimensions", index->d);
+            return SQLITE_ERROR;
+        }
+
+        vss_faiss_work work(index, trace != nullptr);
+        auto faiss_start = vss_clock::now();
+
+        if (trace != nullptr) {
+            trace->constraints.push_back("vss_range_search");
+            trace->parse_us = chrono::duration<double, micro>(faiss_start - filter_start).count();
+        }
+
+        try {
+            vss_faiss_threads threads(index);
+            index->range_search(nq,
+                                query_vector->data(),
+                                params->distance,
+                                pCursor->range_search_result.get());
+        } catch (faiss::FaissException &e) {
+            sqlite3_free(pVtabCursor->pVtab->zErrMsg);
+            pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf("Error searching %s: %s", vssIndex->name.c_str(), e.msg.c_str());
+            return SQLITE_ERROR;
+        }
+
+        pCursor->faiss_us = elapsed_us(faiss_start);
+        pCursor->searched_index = vssIndex;
+        pCursor->search_start = filter_start;
+
+        vssIndex->search_stats().searches++;
+        record_search_work(vssIndex, work, trace);
+        work.release();
+        if (trace != nullptr)
+            trace->search_us = pCursor->faiss_us;
+
+    } else if (strcmp(idxStr, "fullscan") == 0) {
+
+        pCursor->query_type = QueryType::fullscan;
+        sqlite3_stmt *stmt;
+
+        // Partitioned tables also read the partition key of every row.
+        const char *sql = !pTable->partitioned() ? "select rowid from \"%w_data\""
+                        : partition_plan ? "select rowid, _ from \"%w_data\" where _ = ?"
+                        : "select rowid, _ from \"%w_data\"";
+
+        int res = sqlite3_prepare_v2(
+            pCursor->table->db,
+            sqlite3_mprintf(sql, pCursor->table->name),
+            -1, &pCursor->stmt, nullptr);
+
+        if (res != SQLITE_OK)
+            return res;
+
+        if (partition_plan)
+            sqlite3_bind_value(pCursor->stmt, 1, pCursor->partition_key);
+
+        pCursor->step_result = sqlite3_step(pCursor->stmt);
+
+        if (trace != nullptr)
+            trace->search_us = elapsed_us(filter_start);
+
+    } else {
+
+        if (pVtabCursor->pVtab->zErrMsg != 0)
+            sqlite3_free(pVtabCursor->pVtab->zErrMsg);
+
+        pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf(
+            "%s %s", "vssIndexFilter error: unhandled idxStr", idxStr);
+        return SQLITE_ERROR;
+    }
+
+    pCursor->iCurrent = 0;
+    return SQLITE_OK;
+}
+
+static int vssIndexNext(sqlite3_vtab_cursor *cur) {
+
+    auto pCursor = static_cast<vss_index_cursor *>(cur);
+    auto trace = pCursor->trace();
+    auto next_start = trace != nullptr ? vss_clock::now() : vss_clock::time_point();
+
+    switch (pCursor->query_type) {
+
+      case QueryType::search:
+      case QueryType::range_search:
+          pCursor->iCurrent++;
+          break;
+
+      case QueryType::fullscan:
+          pCursor->step_result = sqlite3_step(pCursor->stmt);
+    }
+
+    if (trace != nullptr)
+        trace->materialize_us += elapsed_us(next_start);
+
+    return SQLITE_OK;
+}
+
+static int vssIndexRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+
+    auto pCursor = static_cast<vss_index_cursor *>(cur);
+
+    switch (pCursor->query_type) {
+
+        case QueryType::search:
+            *pRowid = pCursor->search_ids.at(pCursor->iCurrent);
+            break;
+
+        case QueryType::range_search:
+            *pRowid = pCursor->range_search_result->labels[pCursor->iCurrent];
+            break;
+
+        case QueryType::fullscan:
+            *pRowid = sqlite3_column_int64(pCursor->stmt, 0);
+            break;
+    }
+    return SQLITE_OK;
+}
+
+static int vssIndexEof(sqlite3_vtab_cursor *cur) {
+
+    auto pCursor = static_cast<vss_index_cursor *>(cur);
+    int eof = 1;
+
+    switch (pCursor->query_type) {
+
+      case QueryType::search:
+          eof = pCursor->iCurrent >= pCursor->limit ||
+                (size_t)pCursor->iCurrent >= pCursor->search_ids.size()
+                || (pCursor->search_ids.at(pCursor->iCurrent) == -1);
+          break;
+
+      case QueryType::range_search:
+          eof = (size_t)pCursor->iCurrent >= pCursor->range_search_result->lims[1];
+          break;
+
+      case QueryType::fullscan:
+          eof = pCursor->step_result != SQLITE_ROW;
+          break;
+    }
+
+    // SQLite checks xEof once after xFilter and after every xNext, so each
+    // non-eof answer is one row handed to the statement.
+    auto trace = pCursor->trace();
+    if (trace != nullptr && !eof)
+        trace->rows++;
+
+    return eof;
+}
+
+static int vssIndexColumn(sqlite3_vtab_cursor *cur,
+                          sqlite3_context *ctx,
+                          int i) {
+
+    auto pCursor = static_cast<vss_index_cursor *>(cur);
+
+    if (i == VSS_INDEX_COLUMN_DISTANCE) {
+
+        switch (pCursor->query_type) {
+
+          case QueryType::search:
+              sqlite3_result_double(ctx,
+                                    pCursor->search_distances.at(pCursor->iCurrent));
+              break;
+
+          case QueryType::range_search:
+              sqlite3_result_double(ctx,
+                                    pCursor->range_search_result->distances[pCursor->iCurrent]);
+              break;
+
+          case QueryType::fullscan:
+              break;
+        }
+
+    } else if (pCursor->table->partitioned() && i == vss_partition_column_index(pCursor->table)) {
+
+        if (pCursor->query_type == QueryType::fullscan)
+            sqlite3_result_value(ctx, sqlite3_column_value(pCursor->stmt, 1));
+        else
+            sqlite3_result_value(ctx, pCursor->partition_key);
+
+    } else if (i >= VSS_INDEX_COLUMN_VECTORS) {
+
+        // Fullscans of partitioned tables go through every partition, each
+        // row is read from the one its key names.
+        auto indexes = pCursor->indexes;
+        if (pCursor->table->partitioned() && pCursor->query_type == QueryType::fullscan) {
+
+            vss_partition_key key;
+            vss_partition *partition = nullptr;
+            char *errmsg = nullptr;
+
+            if (vss_partition_key_from_value(sqlite3_column_value(pCursor->stmt, 1), &key) &&
+                vss_partition_lookup(pCursor->table, key, false, &partition, &errmsg) != SQLITE_OK) {
+
+                sqlite3_result_error(ctx, errmsg, -1);
+                sqlite3_free(errmsg);
+                return SQLITE_ERROR;
+            }
+            indexes = partition != nullptr ? &partition->indexes : nullptr;
+        }
+
+        if (indexes == nullptr)
+            return SQLITE_OK;
+
+        auto index = indexes->at(i - VSS_INDEX_COLUMN_VECTORS)->index;
+
+        auto trace = pCursor->trace();
+        auto reconstruct_start = trace != nullptr ? vss_clock::now() : vss_clock::time_point();
+
+        vector<float> vec(index->d);
+        sqlite3_int64 rowId;
+        vssIndexRowid(cur, &rowId);
+
+        try {
+
+            // Binary columns read back as the packed bits they were stored as.
+            if (auto binary = dynamic_cast<vss_binary_index *>(index)) {
+
+                vector<uint8_t> code(binary->binary->code_size);
+                binary->binary->reconstruct(rowId, code.data());
+                sqlite3_result_blob64(ctx, code.data(), code.size(), SQLITE_TRANSIENT);
+
+                if (trace != nullptr)
+                    trace->materialize_us += elapsed_us(reconstruct_start);
+                return SQLITE_OK;
+            }
+
+            vss_index_reconstruct(index, rowId, vec.data());
+
+        } catch (faiss::FaissException &e) {
+
+            char *errmsg =
+                (char *)sqlite3_mprintf("Error reconstructing vector - Does "
+                                        "the column factory string end "
+                                        "with IDMap2? Full error: %s",
+                                        e.msg.c_str());
+
+            sqlite3_result_error(ctx, errmsg, -1);
+            sqlite3_free(errmsg);
+            return SQLITE_ERROR;
+        }
+        sqlite3_result_blob64(ctx, vec.data(), vec.size() * sizeof(float), SQLITE_TRANSIENT);
+
+        if (trace != nullptr)
+            trace->materialize_us += elapsed_us(reconstruct_start);
+    }
+    return SQLITE_OK;
+}
+
+static int vssIndexBegin(sqlite3_vtab *tab) {
+
+    return SQLITE_OK;
+}
+
+// Drops the trainings, inserts and deletes buffered for indexes, after a
+// failed xSync or on rollback.
+static void vss_clear_pending(vector<vss_index *> &indexes) {
+
+    for (auto iter = indexes.begin(); iter != indexes.end(); ++iter) {
+
+        (*iter)->trainings.clear();
+        (*iter)->trainings.shrink_to_fit();
+
+        (*iter)->insert_data.clear();
+        (*iter)->insert_data.shrink_to_fit();
+
+        (*iter)->insert_ids.clear();
+        (*iter)->insert_ids.shrink_to_fit();
+
+        (*iter)->delete_ids.clear();
+        (*iter)->delete_ids.shrink_to_fit();
+
+        delete (*iter)->imported;
+        (*iter)->imported = nullptr;
+    }
+}
+
+// Builds the factory index of a partition that outgrew flat_below, trained
+// on a sample of its vectors, and moves the vectors into it. Throws on faiss
+// errors.
+static int vss_partition_promote(vss_index *column, char **errmsg) {
+
+    unique_ptr<faiss::Index> index(create_column_index(vss_index_definition(column)));
+
+    if (!index->is_trained) {
+
+        std::mt19937_64 rng(0);
+        vector<float> sample;
+        auto rc = vss_train_sample_stored(column, VSS_PARTITION_SAMPLE_SIZE, rng, &sample, errmsg);
+        if (rc != SQLITE_OK)
+            return rc;
+        index->train(sample.size() / index->d, sample.data());
+    }
+
+    auto rc = vss_index_copy_vectors(column, index.get(), "vss0", errmsg);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    delete column->index;
+    column->index = index.release();
+    return SQLITE_OK;
+}
+
+// Applies what was buffered for one set of column indexes, the table's own
+// (partition 0) or a partition's, and writes them if anything changed, or
+// unconditionally with force. Throws on faiss errors.
+static int vss_sync_indexes(vss_index_vtab *pTable,
+                            vector<vss_index *> &indexes,
+                            sqlite3_int64 partition,
+                            bool force,
+                            char **errmsg) {
+
+    bool needsWriting = force;
+    vector<double> sync_us(indexes.size(), 0);
+
+    auto idxCol = 0;
+    for (auto iter = indexes.begin(); iter != indexes.end(); ++iter, idxCol++) {
+
+        auto sync_start = vss_clock::now();
+
+        // Checking if a trained index was loaded into the column.
+        if ((*iter)->imported != nullptr) {
+
+            delete (*iter)->index;
+            (*iter)->index = (*iter)->imported;
+            (*iter)->imported = nullptr;
+
+            needsWriting = true;
+        }
+
+        vss_faiss_threads threads((*iter)->index);
+
+        // Checking if index needs training.
+        if (!(*iter)->trainings.empty()) {
+
+            (*iter)->index->train(
+                (*iter)->trainings.size() / (*iter)->index->d,
+                (*iter)->trainings.data());
+
+            (*iter)->trainings.clear();
+            (*iter)->trainings.shrink_to_fit();
+
+            needsWriting = true;
+        }
+
+        // Checking if we're deleting records from the index.
+        if (!(*iter)->delete_ids.empty()) {
+
+            vss_index_remove((*iter)->index, (*iter)->delete_ids);
+            (*iter)->delete_ids.clear();
+            (*iter)->delete_ids.shrink_to_fit();
+
+            needsWriting = true;
+        }
+
+        // Checking if we're inserting records to the index.
+        if (!(*iter)->insert_data.empty()) {
+
+            (*iter)->index->add_with_ids(
+                (*iter)->insert_ids.size(),
+                (*iter)->insert_data.data(),
+                (faiss::idx_t *)(*iter)->insert_ids.data());
+
+            (*iter)->insert_ids.clear();
+            (*iter)->insert_ids.shrink_to_fit();
+
+            (*iter)->insert_data.clear();
+            (*iter)->insert_data.shrink_to_fit();
+
+            needsWriting = true;
+        }
+
+        // Partitions that reached flat_below switch to the column's factory.
+        if (partition > 0 &&
+            vss_index_is_flat((*iter)->index) &&
+            !vss_index_is_flat(pTable->indexes[idxCol]->index) &&
+            (*iter)->index->ntotal >= (*iter)->flat_below) {
+
+            int rc = vss_partition_promote(*iter, errmsg);
+            if (rc != SQLITE_OK)
+                return rc;
+
+            needsWriting = true;
+        }
+
+        sync_us[idxCol] = elapsed_us(sync_start);
+    }
+
+    if (!needsWriting)
+        return SQLITE_OK;
+
+    int i = 0;
+    for (auto iter = indexes.begin(); iter != indexes.end(); ++iter, i++) {
+
+        auto write_start = vss_clock::now();
+
+        int rc = write_index_insert((*iter)->index,
+                                    pTable->db,
+                                    pTable->schema,
+                                    pTable->name,
+                                    vss_partition_index_id(pTable, partition, i),
+                                    vss_partition_file_column(*iter, partition),
+                                    vss_partition_storage_type(*iter));
+
+        if (rc != SQLITE_OK) {
+
+            *errmsg = sqlite3_mprintf("Error saving index (%d): %s",
+                                      rc, sqlite3_errmsg(pTable->db));
+            return rc;
+        }
+
+        (*iter)->last_sync_us = sync_us[i] + elapsed_us(write_start);
+    }
+
+    return SQLITE_OK;
+}
+
+static int vssIndexSync(sqlite3_vtab *pVTab) {
+
+    auto pTable = static_cast<vss_index_vtab *>(pVTab);
+    char *errmsg = nullptr;
+
+    try {
+
+        int rc = vss_sync_indexes(pTable, pTable->indexes, 0, false, &errmsg);
+
+        for (auto iter = pTable->partitions.begin(); rc == SQLITE_OK && iter != pTable->partitions.end(); ++iter) {
+
+            rc = vss_sync_indexes(pTable, iter->second.indexes, iter->second.number, iter->second.created, &errmsg);
+            if (rc == SQLITE_OK)
+                iter->second.created = false;
+        }
+
+        if (rc != SQLITE_OK) {
+            sqlite3_free(pVTab->zErrMsg);
+            pVTab->zErrMsg = errmsg;
+        }
+        return rc;
+
+    } catch (faiss::FaissException &e) {
+
+        sqlite3_free(errmsg);
+        sqlite3_free(pVTab->zErrMsg);
+        pVTab->zErrMsg =
+            sqlite3_mprintf("Error during synchroning index. Full error: %s",
+                            e.msg.c_str());
+
+        vss_clear_pending(pTable->indexes);
+        for (auto iter = pTable->partitions.begin(); iter != pTable->partitions.end(); ++iter)
+            vss_clear_pending(iter->second.indexes);
+
+        return SQLITE_ERROR;
+    }
+}
+
+static int vssIndexCommit(sqlite3_vtab *pVTab) { return SQLITE_OK; }
+
+static int vssIndexRollback(sqlite3_vtab *pVTab) {
+
+    auto pTable = static_cast<vss_index_vtab *>(pVTab);
+
+    vss_clear_pending(pTable->indexes);
+
+    // Partitions created in the transaction are gone from _partitions again.
+    for (auto iter = pTable->partitions.begin(); iter != pTable->partitions.end();) {
+
+        if (iter->second.created) {
+            vss_partition_free(iter->second);
+            iter = pTable->partitions.erase(iter);
+        } else {
+            vss_clear_pending(iter->second.indexes);
+            ++iter;
+        }
+    }
+    return SQLITE_OK;
+}
+
+// Inserts every row of the matrix blobs given for the table's columns, with
+// the rowids from the rowids column: an int64 blob with one rowid per row, or
+// NULL to use the next free rowids. Like single-row inserts, the vectors are
+// added to the indexes in xSync.
+static int vss_matrix_insert(vss_index_vtab *pTable,
+                             sqlite3_value **argv,
+                             sqlite_int64 *pRowid) {
+
+    auto setError = [&](char *zErrMsg) {
+        sqlite3_free(pTable->zErrMsg);
+        pTable->zErrMsg = zErrMsg;
+        return SQLITE_ERROR;
+    };
+
+    if (pTable->vector_api->iVersion < 1)
+        return setError(sqlite3_mprintf("Matrix inserts need a newer vector0 extension"));
+
+    struct ColumnMatrix {
+        vss_index *index;
+        const void *values;
+    };
+
+    vector<ColumnMatrix> matrices;
+    int64_t rows = -1;
+
+    auto i = 0;
+    for (auto iter = pTable->indexes.begin(); iter != pTable->indexes.end(); ++iter, i++) {
+
+        auto value = argv[2 + VSS_INDEX_COLUMN_VECTORS + i];
+        if (sqlite3_value_type(value) == SQLITE_NULL)
+            continue;
+
+        int64_t n, d;
+        const char *pzErrMsg = nullptr;
+        auto values = pTable->vector_api->xValueAsMatrix(value, &n, &d, &pzErrMsg);
+
+        if (values == nullptr)
+            return setError(sqlite3_mprintf("Column %s: %s", (*iter)->name.c_str(), pzErrMsg));
+
+        if (d != (*iter)->index->d)
+            return setError(sqlite3_mprintf("Column %s has %d dimensions, the matrix has %lld",
+                                            (*iter)->name.c_str(), (*iter)->index->d, (sqlite3_int64)d));
+
+        if (rows >= 0 && n != rows)
+            return setError(sqlite3_mprintf("All matrices of an insert must have the same number of rows"));
+
+        if (!(*iter)->index->is_trained)
+            return setError(sqlite3_mprintf("Index at i=%d requires training before inserting data.", i));
+
+        rows = n;
+        matrices.push_back({*iter, values});
+    }
+
+    if (matrices.empty())
+        return setError(sqlite3_mprintf("Matrix inserts need a matrix for at least one column"));
+
+    vector<faiss::idx_t> rowids(rows);
+    auto rowidsValue = argv[2 + VSS_INDEX_COLUMN_ROWIDS];
+    auto given = sqlite3_value_type(rowidsValue) != SQLITE_NULL;
+
+    if (given) {
+
+        if (sqlite3_value_type(rowidsValue) != SQLITE_BLOB ||
+            sqlite3_value_bytes(rowidsValue) != rows * (int64_t)sizeof(int64_t))
+            return setError(sqlite3_mprintf("rowids must be a blob of %lld int64 values", (sqlite3_int64)rows));
+
+        if (rows > 0)
+            memcpy(rowids.data(), sqlite3_value_blob(rowidsValue), rows * sizeof(int64_t));
+    }
+
+    // One statement for all the _data rows, instead of one per row. Without
+    // a rowids blob, the rows take new rowids.
+    vss_data_inserter inserter;
+    int rc = inserter.prepare(pTable->db, pTable->schema, pTable->name);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    for (auto &rowid : rowids) {
+
+        sqlite3_int64 given_rowid = rowid, inserted;
+        if (inserter.insert(given ? &given_rowid : nullptr, &inserted) != SQLITE_OK)
+            return setError(given ? sqlite3_mprintf("Could not insert rowid %lld: %s",
+                                                    given_rowid, sqlite3_errmsg(pTable->db))
+                                  : sqlite3_mprintf("Could not insert a row: %s", sqlite3_errmsg(pTable->db)));
+        rowid = inserted;
+    }
+
+    for (auto &matrix : matrices) {
+
+        auto index = matrix.index;
+        auto offset = index->insert_data.size();
+        auto count = (size_t)rows * index->index->d;
+
+        // memcpy, the matrix values aren't necessarily aligned for floats.
+        index->insert_data.resize(offset + count);
+        if (count > 0)
+            memcpy(index->insert_data.data() + offset, matrix.values, count * sizeof(float));
+
+        index->insert_ids.insert(index->insert_ids.end(), rowids.begin(), rowids.end());
+    }
+
+    if (rows > 0)
+        *pRowid = rowids.back();
+
+    return SQLITE_OK;
+}
+
+// Installs IVF centroids into a fresh index built from the column's factory.
+// Flat inverted lists are then ready for vectors, other encodings still need
+// a 'training' insert, which skips the coarse quantizer faiss finds trained.
+static faiss::Index *vss_index_from_centroids(vss_index *column,
+                                              const vector<float> &centroids,
+                                              char **errmsg) {
+
+    auto current = column->index;
+    unique_ptr<faiss::Index> index(create_column_index(vss_index_definition(column)));
+
+    for (auto wrapper = index.get(); wrapper != unwrap_index(wrapper);) {
+
+        if (dynamic_cast<faiss::IndexPreTransform *>(wrapper) != nullptr) {
+            *errmsg = sqlite3_mprintf("Column %s transforms its vectors, load a trained index instead of centroids",
+                                      column->name.c_str());
+            return nullptr;
+        }
+        wrapper = static_cast<faiss::IndexIDMap *>(wrapper)->index;
+    }
+
+    auto ivf = dynamic_cast<faiss::IndexIVF *>(unwrap_index(index.get()));
+    if (ivf == nullptr) {
+        *errmsg = sqlite3_mprintf("Column %s isn't an IVF index, centroids can't be loaded into it",
+                                  column->name.c_str());
+        return nullptr;
+    }
+
+    auto rows = centroids.size() / current->d;
+    if (ivf->nlist != rows) {
+        *errmsg = sqlite3_mprintf("Column %s has %lld IVF lists, got %lld centroids",
+                                  column->name.c_str(), (sqlite3_int64)ivf->nlist, (sqlite3_int64)rows);
+        return nullptr;
+    }
+
+    ivf->quantizer->reset();
+    ivf->quantizer->add(rows, centroids.data());
+    ivf->quantizer->is_trained = true;
+    ivf->is_trained = dynamic_cast<faiss::IndexIVFFlat *>(ivf) != nullptr;
+    index->is_trained = ivf->is_trained;
+
+    return index.release();
+}
+
+// Puts an empty loaded index under the IDMap the column's empty index has:
+// a plain IndexIDMap or none becomes an IndexIDMap2, so rows can be read
+// back, and faiss_ivflists IVF columns lose theirs, see create_column_index().
+static faiss::Index *vss_index_rewrap(faiss::Index *index, faiss::Index *expected) {
+
+    if (auto binary = dynamic_cast<vss_binary_index *>(index)) {
+
+        auto loaded = binary->binary;
+        if (auto idmap = dynamic_cast<faiss::IndexBinaryIDMap *>(loaded)) {
+            loaded = idmap->index;
+            idmap->own_fields = false;
+            delete idmap;
+        }
+
+        auto idmap = new faiss::IndexBinaryIDMap2(loaded);
+        idmap->own_fields = true;
+        binary->binary = idmap;
+        binary->refresh();
+        return binary;
+    }
+
+    if (auto idmap = dynamic_cast<faiss::IndexIDMap *>(index)) {
+        index = idmap->index;
+        idmap->own_fields = false;
+        delete idmap;
+    }
+
+    if (dynamic_cast<faiss::IndexIDMap *>(expected) == nullptr)
+        return index;
+
+    auto idmap = new faiss::IndexIDMap2(index);
+    idmap->own_fields = true;
+    return idmap;
+}
+
+// Whether two indexes, rewrapped alike, are built the same way: the same
+// classes and transforms down to the codes, and for IVF and flat codes the
+// same number of lists and code size.
+static bool vss_index_same_kind(faiss::Index *expected, faiss::Index *loaded) {
+
+    auto binary_expected = dynamic_cast<vss_binary_index *>(expected);
+    auto binary_loaded = dynamic_cast<vss_binary_index *>(loaded);
+    if (binary_expected != nullptr || binary_loaded != nullptr) {
+
+        if (binary_expected == nullptr || binary_loaded == nullptr)
+            return false;
+
+        auto a = binary_expected->inner(), b = binary_loaded->inner();
+        if (typeid(*a) != typeid(*b) || a->code_size != b->code_size)
+            return false;
+
+        auto ivf_a = dynamic_cast<faiss::IndexBinaryIVF *>(a);
+        auto ivf_b = dynamic_cast<faiss::IndexBinaryIVF *>(b);
+        return ivf_a == nullptr || ivf_a->nlist == ivf_b->nlist;
+    }
+
+    // Loaded indexes always get an IndexIDMap2, a factory may end in IDMap.
+    auto idmap_expected = dynamic_cast<faiss::IndexIDMap *>(expected);
+    auto idmap_loaded = dynamic_cast<faiss::IndexIDMap *>(loaded);
+    if ((idmap_expected == nullptr) != (idmap_loaded == nullptr))
+        return false;
+    if (idmap_expected != nullptr) {
+        expected = idmap_expected->index;
+        loaded = idmap_loaded->index;
+    }
+
+    while (true) {
+
+        if (typeid(*expected) != typeid(*loaded))
+            return false;
+
+        if (auto transform = dynamic_cast<faiss::IndexPreTransform *>(expected)) {
+            auto other = static_cast<faiss::IndexPreTransform *>(loaded);
+            if (transform->chain.size() != other->chain.size())
+                return false;
+            for (size_t i = 0; i < transform->chain.size(); i++) {
+                auto a = transform->chain[i], b = other->chain[i];
+                if (typeid(*a) != typeid(*b) || a->d_in != b->d_in || a->d_out != b->d_out)
+                    return false;
+            }
+            expected = transform->index;
+            loaded = other->index;
+            continue;
+        }
+
+        break;
+    }
+
+    if (auto ivf = dynamic_cast<faiss::IndexIVF *>(expected)) {
+        auto other = static_cast<faiss::IndexIVF *>(loaded);
+        return ivf->nlist == other->nlist && ivf->code_size == other->code_size;
+    }
+
+    if (auto flat = dynamic_cast<faiss::IndexFlatCodes *>(expected))
+        return flat->code_size == static_cast<faiss::IndexFlatCodes *>(loaded)->code_size;
+
+    return true;
+}
+
+// Reads the trained index a 'load_trained' insert gives for a column: a
+// serialized faiss index or a matrix blob of IVF centroids. Paths aren't
+// read here, inserts can come from triggers and views; vss_import_index()
+// reads files. The index must match the column's dimensions, metric and
+// factory, and be empty, only its training is kept. Throws on faiss errors.
+static faiss::Index *vss_load_trained_index(vss_index_vtab *pTable,
+                                            vss_index *column,
+                                            sqlite3_value *value,
+                                            char **errmsg) {
+
+    auto current = column->index;
+    auto name = column->name.c_str();
+    bool binary = column->vector_type == VectorType::vector_binary;
+
+    int64_t rows, d;
+    const char *pzErrMsg = nullptr;
+    const void *matrix = sqlite3_value_type(value) == SQLITE_BLOB && pTable->vector_api->iVersion >= 1
+        ? pTable->vector_api->xValueAsMatrix(value, &rows, &d, &pzErrMsg)
+        : nullptr;
+
+    if (matrix != nullptr) {
+
+        if (binary) {
+            *errmsg = sqlite3_mprintf("Column %s is binary, load a trained index instead of centroids", name);
+            return nullptr;
+        }
+
+        if (d != current->d) {
+            *errmsg = sqlite3_mprintf("Column %s has %d dimensions, the centroids have %lld",
+                                      name, current->d, (sqlite3_int64)d);
+            return nullptr;
+        }
+
+        // memcpy, the matrix values aren't necessarily aligned for floats.
+        vector<float> centroids(rows * d);
+        if (!centroids.empty())
+            memcpy(centroids.data(), matrix, centroids.size() * sizeof(float));
+
+        return vss_index_from_centroids(column, centroids, errmsg);
+    }
+
+    if (sqlite3_value_type(value) != SQLITE_BLOB) {
+        *errmsg = sqlite3_mprintf("Column %s: 'load_trained' takes a faiss index blob or a matrix of centroids, "
+                                  "use vss_import_index() to load an index file",
+                                  name);
+        return nullptr;
+    }
+
+    faiss::VectorIOReader reader;
+    auto blob = (const uint8_t *)sqlite3_value_blob(value);
+    reader.data.assign(blob, blob + sqlite3_value_bytes(value));
+
+    unique_ptr<faiss::Index> index;
+    if (binary)
+        index.reset(new vss_binary_index(faiss::read_index_binary(&reader)));
+    else
+        index.reset(faiss::read_index(&reader));
+
+    if (index->d != current->d) {
+        *errmsg = sqlite3_mprintf("Column %s has %d dimensions, the loaded index has %d",
+                                  name, current->d, index->d);
+        return nullptr;
+    }
+
+    if (!binary && index->metric_type != current->metric_type) {
+        *errmsg = sqlite3_mprintf("Column %s uses the %s metric, the loaded index uses %s",
+                                  name, metric_type_name(current->metric_type), metric_type_name(index->metric_type));
+        return nullptr;
+    }
+
+    if (!index->is_trained) {
+        *errmsg = sqlite3_mprintf("Column %s: the loaded index isn't trained", name);
+        return nullptr;
+    }
+
+    if (index->ntotal != 0) {
+        *errmsg = sqlite3_mprintf("Column %s: the loaded index must be empty, only its training is loaded", name);
+        return nullptr;
+    }
+
+    // The column keeps its factory for vss_train() and vss_rebuild(), so the
+    // loaded index must be one the factory builds, under the same IDMap.
+    unique_ptr<faiss::Index> expected(create_column_index(vss_index_definition(column)));
+    index.reset(vss_index_rewrap(index.release(), expected.get()));
+
+    if (!vss_index_same_kind(expected.get(), index.get())) {
+        *errmsg = sqlite3_mprintf("Column %s: the loaded index isn't built like the column's factory \"%s\"",
+                                  name, column->factory.c_str());
+        return nullptr;
+    }
+
+    return index.release();
+}
+
+// insert into xyz(operation, a, b) values ('load_trained', :a, :b)
+//
+// Replaces the index of every column given with a trained one, for example a
+// coarse quantizer trained once offline and shared by many databases. The
+// columns must be empty. Like training, the new index is installed and
+// written when the transaction commits.
+static int vss_load_trained_insert(vss_index_vtab *pTable, sqlite3_value **argv) {
+
+    auto setError = [&](char *zErrMsg) {
+        sqlite3_free(pTable->zErrMsg);
+        pTable->zErrMsg = zErrMsg;
+        return SQLITE_ERROR;
+    };
+
+    auto i = 0;
+    for (auto iter = pTable->indexes.begin(); iter != pTable->indexes.end(); ++iter, i++) {
+
+        auto value = argv[2 + VSS_INDEX_COLUMN_VECTORS + i];
+        if (sqlite3_value_type(value) == SQLITE_NULL)
+            continue;
+
+        if ((*iter)->index->ntotal > 0 || !(*iter)->insert_ids.empty())
+            return setError(sqlite3_mprintf("Column %s already has vectors, a trained index can only be loaded into an empty column",
+                                            (*iter)->name.c_str()));
+
+        char *errmsg = nullptr;
+        faiss::Index *index;
+        try {
+            index = vss_load_trained_index(pTable, *iter, value, &errmsg);
+        } catch (faiss::FaissException &e) {
+            index = nullptr;
+            errmsg = sqlite3_mprintf("Column %s: could not load trained index: %s",
+                                     (*iter)->name.c_str(), e.msg.c_str());
+        }
+
+        if (index == nullptr)
+            return setError(errmsg);
+
+        delete (*iter)->imported;
+        (*iter)->imported = index;
+    }
+
+    return SQLITE_OK;
+}
+
+static int vssIndexUpdate(sqlite3_vtab *pVTab,
+                          int argc,
+                          sqlite3_value **argv,
+                          sqlite_int64 *pRowid) {
+
+    auto pTable = static_cast<vss_index_vtab *>(pVTab);
+
+    if (argc == 1 && sqlite3_value_type(argv[0]) != SQLITE_NULL) {
+
+        // DELETE operation
+        sqlite3_int64 rowid_to_delete = sqlite3_value_int64(argv[0]);
+
+        // Rows of partitioned tables are deleted from their partition.
+        auto indexes = &pTable->indexes;
+        if (pTable->partitioned()) {
+
+            vss_partition_key key;
+            vss_partition *partition = nullptr;
+            bool found = false;
+            char *errmsg = nullptr;
+
+            auto rc = vss_partition_key_of_row(pTable, rowid_to_delete, &key, &found);
+            if (rc == SQLITE_OK && found)
+                rc = vss_partition_lookup(pTable, key, false, &partition, &errmsg);
+            if (rc != SQLITE_OK) {
+                sqlite3_free(pVTab->zErrMsg);
+                pVTab->zErrMsg = errmsg;
+                return rc;
+            }
+            indexes = partition != nullptr ? &partition->indexes : nullptr;
+        }
+
+        auto rc = shadow_data_delete(pTable->db,
+                                     pTable->schema,
+                                     pTable->name,
+                                     rowid_to_delete);
+        if (rc != SQLITE_OK)
+            return rc;
+
+        if (indexes != nullptr) {
+            for (auto iter = indexes->begin(); iter != indexes->end(); ++iter) {
+                (*iter)->delete_ids.push_back(rowid_to_delete);
+            }
+        }
+
+    } else if (argc > 1 && sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+
+        // INSERT operation
+        // if no operation, we add it to the index
+        bool noOperation =
+            sqlite3_value_type(argv[2 + VSS_INDEX_COLUMN_OPERATION]) ==
+            SQLITE_NULL;
+
+        if (noOperation) {
+
+            vec_ptr vec;
+            sqlite3_int64 rowid = sqlite3_value_int64(argv[1]);
+            bool inserted_rowid = false;
+
+            // Rows of partitioned tables go to the partition of their key,
+            // which is created on its first row.
+            auto indexes = &pTable->indexes;
+            sqlite3_value *partition_value = nullptr;
+            if (pTable->partitioned()) {
+
+                partition_value = argv[2 + vss_partition_column_index(pTable)];
+
+                vss_partition_key key;
+                if (!vss_partition_key_from_value(partition_value, &key)) {
+                    sqlite3_free(pVTab->zErrMsg);
+                    pVTab->zErrMsg = sqlite3_mprintf("%s must be an integer or text partition key",
+                                                     pTable->partition_column.c_str());
+                    return SQLITE_ERROR;
+                }
+
+                vss_partition *partition;
+                char *errmsg = nullptr;
+                auto rc = vss_partition_lookup(pTable, key, true, &partition, &errmsg);
+                if (rc != SQLITE_OK) {
+                    sqlite3_free(pVTab->zErrMsg);
+                    pVTab->zErrMsg = errmsg;
+                    return rc;
+                }
+                indexes = &partition->indexes;
+            }
+
+            auto i = 0;
+            for (auto iter = indexes->begin(); iter != indexes->end(); ++iter, i++) {
+
+                if ((vec = vss_value_as_vector(pTable, *iter,
+                         argv[2 + VSS_INDEX_COLUMN_VECTORS + i])) != nullptr) {
+
+                    // Make sure the index is already trained, if it's needed
+                    if (!(*iter)->index->is_trained) {
+
+                        sqlite3_free(pVTab->zErrMsg);
+                        pVTab->zErrMsg =
+                            sqlite3_mprintf("Index at i=%d requires training "
+                                            "before inserting data.",
+                                            i);
+
+                        return SQLITE_ERROR;
+                    }
+
+                    if (!inserted_rowid) {
+
+                        sqlite_int64 retrowid;
+                        auto rc = shadow_data_insert(pTable->db, pTable->schema, pTable->name,
+                                                     &rowid, &retrowid, partition_value);
+                        if (rc != SQLITE_OK)
+                            return rc;
+
+                        inserted_rowid = true;
+                    }
+
+                    (*iter)->insert_data.reserve((*iter)->insert_data.size() + vec->size());
+                    (*iter)->insert_data.insert(
+                        (*iter)->insert_data.end(),
+                        vec->begin(),
+                        vec->end());
+
+                    (*iter)->insert_ids.push_back(rowid);
+
+                    *pRowid = rowid;
+                }
+            }
+
+        } else {
+
+            string operation((char *)sqlite3_value_text(argv[2 + VSS_INDEX_COLUMN_OPERATION]));
+
+            // They work on the table's own indexes, partitions train and
+            // switch factories by themselves.
+            if (pTable->partitioned()) {
+
+                sqlite3_free(pVTab->zErrMsg);
+                pVTab->zErrMsg = sqlite3_mprintf("'%s' operations aren't supported on partitioned tables",
+                                                 operation.c_str());
+                return SQLITE_ERROR;
+            }
+
+            if (operation.compare("training") == 0) {
+
+                auto i = 0;
+                for (auto iter = pTable->indexes.begin(); iter != pTable->indexes.end(); ++iter, i++) {
+
+                    vec_ptr vec = vss_value_as_vector(pTable, *iter, argv[2 + VSS_INDEX_COLUMN_VECTORS + i]);
+                    if (vec != nullptr) {
+
+                        (*iter)->trainings.reserve((*iter)->trainings.size() + vec->size());
+                        (*iter)->trainings.insert(
+                            (*iter)->trainings.end(),
+                            vec->begin(),
+                            vec->end());
+                    }
+                }
+
+            } else if (operation.compare("matrix") == 0) {
+
+                return vss_matrix_insert(pTable, argv, pRowid);
+
+            } else if (operation.compare("load_trained") == 0) {
+
+                return vss_load_trained_insert(pTable, argv);
+
+            } else {
+
+                return SQLITE_ERROR;
+            }
+        }
+
+    } else {
+
+        // TODO: Implement - UPDATE operation
+        sqlite3_free(pVTab->zErrMsg);
+
+        pVTab->zErrMsg =
+            sqlite3_mprintf("UPDATE statements on vss0 virtual tables not supported yet.");
+
+        return SQLITE_ERROR;
+    }
+
+    return SQLITE_OK;
+}
+
+static void vssSearchFunc(sqlite3_context *context,
+                          int argc,
+                          sqlite3_value **argv) { }
+
+static void faissMemoryUsageFunc(sqlite3_context *context,
+                                 int argc,
+                                 sqlite3_value **argv) {
+
+    sqlite3_result_int64(context, faiss::get_mem_usage_kb());
+}
+
+static void vssRangeSearchFunc(sqlite3_context *context,
+                               int argc,
+                               sqlite3_value **argv) { }
+
+static int vssIndexFindFunction(
+                    sqlite3_vtab *pVtab,
+                    int nArg,
+                    const char *zName,
+                    void (**pxFunc)(sqlite3_context *, int, sqlite3_value **),
+                    void **ppArg) {
+
+    if (sqlite3_stricmp(zName, "vss_search") == 0) {
+        *pxFunc = vssSearchFunc;
+        *ppArg = 0;
+        return VSS_SEARCH_FUNCTION;
+    }
+
+    if (sqlite3_stricmp(zName, "vss_range_search") == 0) {
+        *pxFunc = vssRangeSearchFunc;
+        *ppArg = 0;
+        return VSS_RANGE_SEARCH_FUNCTION;
+    }
+    return 0;
+};
+
+static int vssIndexShadowName(const char *zName) {
+
+    static const char *azName[] = {"index", "data", "ivflists", "ivfrows", "graph", "partitions", "factories"};
+
+    for (size_t i = 0; i < sizeof(azName) / sizeof(azName[0]); i++) {
+        if (sqlite3_stricmp(zName, azName[i]) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static sqlite3_module vssIndexModule = {
+    /* iVersion    */ 3,
+    /* xCreate     */ vssIndexCreate,
+    /* xConnect    */ vssIndexConnect,
+    /* xBestIndex  */ vssIndexBestIndex,
+    /* xDisconnect */ vssIndexDisconnect,
+    /* xDestroy    */ vssIndexDestroy,
+    /* xOpen       */ vssIndexOpen,
+    /* xClose      */ vssIndexClose,
+    /* xFilter     */ vssIndexFilter,
+    /* xNext       */ vssIndexNext,
+    /* xEof        */ vssIndexEof,
+    /* xColumn     */ vssIndexColumn,
+    /* xRowid      */ vssIndexRowid,
+    /* xUpdate     */ vssIndexUpdate,
+    /* xBegin      */ vssIndexBegin,
+    /* xSync       */ vssIndexSync,
+    /* xCommit     */ vssIndexCommit,
+    /* xRollback   */ vssIndexRollback,
+    /* xFindMethod */ vssIndexFindFunction,
+    /* xRename     */ 0,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ vssIndexShadowName};
+
+// Looks up a vss0 table on the connection by name. Tables that weren't used
+// yet on this connection are connected first, by preparing a statement that
+// references them. schema may be null to search every attached database.
+static vss_index_vtab *vss_table_lookup(vss_connection *connection,
+                                        sqlite3 *db,
+                                        const char *schema,
+                                        const char *name) {
+
+    auto find = [&]() -> vss_index_vtab * {
+        for (auto table : connection->tables) {
+            if (sqlite3_stricmp(table->name, name) == 0 &&
+                (schema == nullptr || sqlite3_stricmp(table->schema, schema) == 0))
+                return table;
+        }
+        return nullptr;
+    };
+
+    auto table = find();
+    if (table != nullptr)
+        return table;
+
+    char *sql = schema != nullptr
+        ? sqlite3_mprintf("select rowid from \"%w\".\"%w\" where 0", schema, name)
+        : sqlite3_mprintf("select rowid from \"%w\" where 0", name);
+
+    sqlite3_stmt *stmt = nullptr;
+    sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
+    finalize_and_free(stmt, sql);
+
+    return find();
+}
+
+#pragma endregion
+
+#pragma region vss_stats vtab
+
+struct vssStats_vtab : public sqlite3_vtab {
+
+    explicit vssStats_vtab(vss_connection *connection) : connection(connection) {
+
+        pModule = nullptr;
+        nRef = 0;
+        zErrMsg = nullptr;
+    }
+
+    ~vssStats_vtab() {
+
+        if (zErrMsg != nullptr)
+            sqlite3_free(zErrMsg);
+    }
+
+    vss_connection *connection;
+};
+
+struct vssStats_cursor : public sqlite3_vtab_cursor {
+
+    explicit vssStats_cursor(sqlite3_vtab *pVtab) : iRowid(0) {
+
+        this->pVtab = pVtab;
+    }
+
+    sqlite3_int64 iRowid;
+
+    // One entry per reported vss0 column: the table, and the column's position
+    // in the table's indexes.
+    vector<pair<vss_index_vtab *, size_t>> rows;
+};
+
+static int vssStatsConnect(sqlite3 *db,
+                           void *pAux,
+                           int argc,
+                           const char *const *argv,
+                           sqlite3_vtab **ppVtab,
+                           char **pzErr) {
+
+    int rc = sqlite3_declare_vtab(db,
+        "create table x(table_name, column_name, searches, lists_probed, "
+        "candidates_scanned, latency_p50, latency_p95, latency_p99, "
+        "faiss_p50, faiss_p95, faiss_p99, sqlite_p50, sqlite_p95, sqlite_p99, "
+        "recall_samples, recall, recall_exact, input hidden)");
+
+#define VSS_STATS_TABLE_NAME 0
+#define VSS_STATS_COLUMN_NAME 1
+#define VSS_STATS_SEARCHES 2
+#define VSS_STATS_LISTS_PROBED 3
+#define VSS_STATS_CANDIDATES_SCANNED 4
+#define VSS_STATS_LATENCY_P50 5
+#define VSS_STATS_LATENCY_P95 6
+#define VSS_STATS_LATENCY_P99 7
+#define VSS_STATS_FAISS_P50 8
+#define VSS_STATS_FAISS_P95 9
+#define VSS_STATS_FAISS_P99 10
+#define VSS_STATS_SQLITE_P50 11
+#define VSS_STATS_SQLITE_P95 12
+#define VSS_STATS_SQLITE_P99 13
+#define VSS_STATS_RECALL_SAMPLES 14
+#define VSS_STATS_RECALL 15
+#define VSS_STATS_RECALL_EXACT 16
+#define VSS_STATS_INPUT 17
+
+    if (rc == SQLITE_OK) {
+
+        auto pNew = new vssStats_vtab((vss_connection *)pAux);
+        if (pNew == nullptr)
+            return SQLITE_NOMEM;
+
+        *ppVtab = pNew;
+    }
+    return rc;
+}
+
+static int vssStatsDisconnect(sqlite3_vtab *pVtab) {
+
+    auto pTable = static_cast<vssStats_vtab *>(pVtab);
+    delete pTable;
+    return SQLITE_OK;
+}
+
+static int vssStatsOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
+
+    auto pCur = new vssStats_cursor(p);
+    if (pCur == nullptr)
+        return SQLITE_NOMEM;
+
+    *ppCursor = pCur;
+    return SQLITE_OK;
+}
+
+static int vssStatsClose(sqlite3_vtab_cursor *cur) {
+
+    auto pCur = static_cast<vssStats_cursor *>(cur);
+    delete pCur;
+    return SQLITE_OK;
+}
+
+static int vssStatsBestIndex(sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo) {
+
+    for (int i = 0; i < pIdxInfo->nConstraint; i++) {
+
+        auto pCons = pIdxInfo->aConstraint[i];
+
+        if (pCons.iColumn == VSS_STATS_INPUT &&
+            pCons.op == SQLITE_INDEX_CONSTRAINT_EQ && pCons.usable) {
+
+            pIdxInfo->aConstraintUsage[i].argvIndex = 1;
+            pIdxInfo->aConstraintUsage[i].omit = 1;
+        }
+    }
+
+    pIdxInfo->estimatedCost = (double)10;
+    pIdxInfo->estimatedRows = 10;
+    return SQLITE_OK;
+}
+
+static int vssStatsFilter(sqlite3_vtab_cursor *pVtabCursor,
+                          int idxNum,
+                          const char *idxStr,
+                          int argc,
+                          sqlite3_value **argv) {
+
+    auto pCur = static_cast<vssStats_cursor *>(pVtabCursor);
+    auto pTable = static_cast<vssStats_vtab *>(pVtabCursor->pVtab);
+
+    const char *only = argc > 0 ? (const char *)sqlite3_value_text(argv[0]) : nullptr;
+
+    pCur->rows.clear();
+    for (auto table : pTable->connection->tables) {
+
+        if (only != nullptr && sqlite3_stricmp(only, table->name) != 0)
+            continue;
+
+        for (size_t i = 0; i < table->indexes.size(); i++)
+            pCur->rows.push_back(make_pair(table, i));
+    }
+
+    pCur->iRowid = 0;
+    return SQLITE_OK;
+}
+
+static int vssStatsNext(sqlite3_vtab_cursor *cur) {
+
+    auto pCur = static_cast<vssStats_cursor *>(cur);
+    pCur->iRowid++;
+    return SQLITE_OK;
+}
+
+static int vssStatsEof(sqlite3_vtab_cursor *cur) {
+
+    auto pCur = static_cast<vssStats_cursor *>(cur);
+    return pCur->iRowid >= (sqlite3_int64)pCur->rows.size();
+}
+
+static int vssStatsRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+
+    auto pCur = static_cast<vssStats_cursor *>(cur);
+    *pRowid = pCur->iRowid;
+    return SQLITE_OK;
+}
+
+static void result_percentile(sqlite3_context *context,
+                              const vector<double> &samples,
+                              double p) {
+
+    double value = vss_index_stats::percentile(samples, p);
+    if (value < 0)
+        sqlite3_result_null(context);
+    else
+        sqlite3_result_double(context, value);
+}
+
+static int vssStatsColumn(sqlite3_vtab_cursor *cur,
+                          sqlite3_context *context,
+                          int i) {
+
+    auto pCur = static_cast<vssStats_cursor *>(cur);
+    auto row = pCur->rows.at(pCur->iRowid);
+    auto vssIndex = row.first->indexes.at(row.second);
+    auto &stats = vssIndex->stats;
+
+    switch (i) {
+
+        case VSS_STATS_TABLE_NAME:
+            sqlite3_result_text(context, row.first->name, -1, SQLITE_TRANSIENT);
+            break;
+
+        case VSS_STATS_COLUMN_NAME:
+            sqlite3_result_text(context, vssIndex->name.c_str(), -1, SQLITE_TRANSIENT);
+            break;
+
+        case VSS_STATS_SEARCHES:
+            sqlite3_result_int64(context, stats.searches);
+            break;
+
+        case VSS_STATS_LISTS_PROBED:
+            sqlite3_result_int64(context, stats.lists_probed);
+            break;
+
+        case VSS_STATS_CANDIDATES_SCANNED:
+            sqlite3_result_int64(context, stats.candidates_scanned);
+            break;
+
+        case VSS_STATS_LATENCY_P50:
+            result_percentile(context, stats.total_us, 0.50);
+            break;
+
+        case VSS_STATS_LATENCY_P95:
+            result_percentile(context, stats.total_us, 0.95);
+            break;
+
+        case VSS_STATS_LATENCY_P99:
+            result_percentile(context, stats.total_us, 0.99);
+            break;
+
+        case VSS_STATS_FAISS_P50:
+            result_percentile(context, stats.faiss_us, 0.50);
+            break;
+
+        case VSS_STATS_FAISS_P95:
+            result_percentile(context, stats.faiss_us, 0.95);
+            break;
+
+        case VSS_STATS_FAISS_P99:
+            result_percentile(context, stats.faiss_us, 0.99);
+            break;
+
+        case VSS_STATS_SQLITE_P50:
+            result_percentile(context, stats.sqlite_us, 0.50);
+            break;
+
+        case VSS_STATS_SQLITE_P95:
+            result_percentile(context, stats.sqlite_us, 0.95);
+            break;
+
+        case VSS_STATS_SQLITE_P99:
+            result_percentile(context, stats.sqlite_us, 0.99);
+            break;
+
+        case VSS_STATS_RECALL_SAMPLES:
+            sqlite3_result_int64(context, stats.recall_samples);
+            break;
+
+        case VSS_STATS_RECALL:
+            if (stats.recall_samples == 0)
+                sqlite3_result_null(context);
+            else
+                sqlite3_result_double(context, stats.recall_sum / stats.recall_samples);
+            break;
+
+        case VSS_STATS_RECALL_EXACT:
+            sqlite3_result_int(context, !vss_index_is_lossy(vssIndex->index));
+            break;
+
+        case VSS_STATS_INPUT:
+            sqlite3_result_null(context);
+            break;
+    }
+    return SQLITE_OK;
+}
+
+static sqlite3_module vssStatsModule = {
+    /* iVersion    */ 0,
+    /* xCreate     */ 0,
+    /* xConnect    */ vssStatsConnect,
+    /* xBestIndex  */ vssStatsBestIndex,
+    /* xDisconnect */ vssStatsDisconnect,
+    /* xDestroy    */ 0,
+    /* xOpen       */ vssStatsOpen,
+    /* xClose      */ vssStatsClose,
+    /* xFilter     */ vssStatsFilter,
+    /* xNext       */ vssStatsNext,
+    /* xEof        */ vssStatsEof,
+    /* xColumn     */ vssStatsColumn,
+    /* xRowid      */ vssStatsRowid,
+    /* xUpdate     */ 0,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ 0,
+    /* xRename     */ 0,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ 0};
+
+#pragma endregion
+
+#pragma region vss_indexes vtab
+
+struct vssIndexes_vtab : public sqlite3_vtab {
+
+    vssIndexes_vtab(sqlite3 *db, vss_connection *connection)
+      : db(db),
+        connection(connection) {
+
+        pModule = nullptr;
+        nRef = 0;
+        zErrMsg = nullptr;
+    }
+
+    ~vssIndexes_vtab() {
+
+        if (zErrMsg != nullptr)
+            sqlite3_free(zErrMsg);
+    }
+
+    sqlite3 *db;
+    vss_connection *connection;
+};
+
+struct vssIndexes_cursor : public sqlite3_vtab_cursor {
+
+    explicit vssIndexes_cursor(sqlite3_vtab *pVtab) : iRowid(0) {
+
+        this->pVtab = pVtab;
+    }
+
+    sqlite3_int64 iRowid;
+
+    // One entry per vss0 column: the table, and the column's position in the
+    // table's indexes.
+    vector<pair<vss_index_vtab *, size_t>> rows;
+};
+
+static int vssIndexesConnect(sqlite3 *db,
+                             void *pAux,
+                             int argc,
+                             const char *const *argv,
+                             sqlite3_vtab **ppVtab,
+                             char **pzErr) {
+
+    int rc = sqlite3_declare_vtab(db,
+        "create table x(schema, table_name, column_name, factory, metric_type, "
+        "storage_type, dimensions, ntotal, is_trained, serialized_size, "
+        "resident_bytes, pending_inserts, pending_deletes, pending_trainings, "
+        "imbalance_factor, last_sync_ms, load_ms)");
+
+#define VSS_INDEXES_SCHEMA 0
+#define VSS_INDEXES_TABLE_NAME 1
+#define VSS_INDEXES_COLUMN_NAME 2
+#define VSS_INDEXES_FACTORY 3
+#define VSS_INDEXES_METRIC_TYPE 4
+#define VSS_INDEXES_STORAGE_TYPE 5
+#define VSS_INDEXES_DIMENSIONS 6
+#define VSS_INDEXES_NTOTAL 7
+#define VSS_INDEXES_IS_TRAINED 8
+#define VSS_INDEXES_SERIALIZED_SIZE 9
+#define VSS_INDEXES_RESIDENT_BYTES 10
+#define VSS_INDEXES_PENDING_INSERTS 11
+#define VSS_INDEXES_PENDING_DELETES 12
+#define VSS_INDEXES_PENDING_TRAININGS 13
+#define VSS_INDEXES_IMBALANCE_FACTOR 14
+#define VSS_INDEXES_LAST_SYNC_MS 15
+#define VSS_INDEXES_LOAD_MS 16
+
+    if (rc == SQLITE_OK) {
+
+        auto pNew = new vssIndexes_vtab(db, (vss_connection *)pAux);
+        if (pNew == nullptr)
+            return SQLITE_NOMEM;
+
+        *ppVtab = pNew;
+    }
+    return rc;
+}
+
+static int vssIndexesDisconnect(sqlite3_vtab *pVtab) {
+
+    auto pTable = static_cast<vssIndexes_vtab *>(pVtab);
+    delete pTable;
+    return SQLITE_OK;
+}
+
+static int vssIndexesOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
+
+    auto pCur = new vssIndexes_cursor(p);
+    if (pCur == nullptr)
+        return SQLITE_NOMEM;
+
+    *ppCursor = pCur;
+    return SQLITE_OK;
+}
+
+static int vssIndexesClose(sqlite3_vtab_cursor *cur) {
+
+    auto pCur = static_cast<vssIndexes_cursor *>(cur);
+    delete pCur;
+    return SQLITE_OK;
+}
+
+static int vssIndexesBestIndex(sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo) {
+
+    pIdxInfo->estimatedCost = (double)100;
+    pIdxInfo->estimatedRows = 10;
+    return SQLITE_OK;
+}
+
+static int vssIndexesFilter(sqlite3_vtab_cursor *pVtabCursor,
+                            int idxNum,
+                            const char *idxStr,
+                            int argc,
+                            sqlite3_value **argv) {
+
+    auto pCur = static_cast<vssIndexes_cursor *>(pVtabCursor);
+    auto pTable = static_cast<vssIndexes_vtab *>(pVtabCursor->pVtab);
+
+    pCur->rows.clear();
+    pCur->iRowid = 0;
+
+    // Find every vss0 table in every attached database, including the ones
+    // that weren't connected yet on this connection.
+    sqlite3_stmt *schemas;
+    int rc = sqlite3_prepare_v2(pTable->db, "select name from pragma_database_list", -1, &schemas, nullptr);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    vector<pair<string, string>> names;
+    while (sqlite3_step(schemas) == SQLITE_ROW) {
+
+        auto schema = (const char *)sqlite3_column_text(schemas, 0);
+        auto sql = sqlite3_mprintf(
+            "select name from \"%w\".sqlite_master "
+            "where type = 'table' and sql like 'create virtual table%%using vss0%%' "
+            "order by name",
+            schema);
+
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(pTable->db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
+            while (sqlite3_step(stmt) == SQLITE_ROW)
+                names.push_back(make_pair(string(schema), string((const char *)sqlite3_column_text(stmt, 0))));
+        }
+        finalize_and_free(stmt, sql);
+    }
+    sqlite3_finalize(schemas);
+
+    for (auto &name : names) {
+
+        auto table = vss_table_lookup(pTable->connection,
+                                      pTable->db,
+                                      name.first.c_str(),
+                                      name.second.c_str());
+        if (table == nullptr)
+            continue;
+
+        for (size_t i = 0; i < table->indexes.size(); i++)
+            pCur->rows.push_back(make_pair(table, i));
+    }
+
+    return SQLITE_OK;
+}
+
+static int vssIndexesNext(sqlite3_vtab_cursor *cur) {
+
+    auto pCur = static_cast<vssIndexes_cursor *>(cur);
+    pCur->iRowid++;
+    return SQLITE_OK;
+}
+
+static int vssIndexesEof(sqlite3_vtab_cursor *cur) {
+
+    auto pCur = static_cast<vssIndexes_cursor *>(cur);
+    return pCur->iRowid >= (sqlite3_int64)pCur->rows.size();
+}
+
+static int vssIndexesRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+
+    auto pCur = static_cast<vssIndexes_cursor *>(cur);
+    *pRowid = pCur->iRowid;
+    return SQLITE_OK;
+}
+
+// Approximate memory held by an index, from the number of vectors and the
+// size of their codes, ids and links, without serializing it.
+static size_t vss_index_memory_bytes(faiss::Index *index) {
+
+    if (auto vamana = dynamic_cast<vss_vamana_index *>(index))
+        return vamana->resident_bytes();
+
+    if (auto binary = dynamic_cast<vss_binary_index *>(index)) {
+
+        size_t bytes = 0;
+        if (auto idmap = dynamic_cast<faiss::IndexBinaryIDMap *>(binary->binary)) {
+            bytes += idmap->id_map.size() * sizeof(faiss::idx_t);
+            if (dynamic_cast<faiss::IndexBinaryIDMap2 *>(idmap) != nullptr)
+                bytes += idmap->id_map.size() * VSS_HASH_ENTRY_BYTES;
+        }
+
+        auto inner = binary->inner();
+        bytes += inner->ntotal * inner->code_size;
+        if (dynamic_cast<faiss::IndexBinaryIVF *>(inner) != nullptr)
+            bytes += inner->ntotal * sizeof(faiss::idx_t);
+        if (auto hnsw = dynamic_cast<faiss::IndexBinaryHNSW *>(inner))
+            bytes += hnsw->hnsw.neighbors.size() * sizeof(faiss::HNSW::storage_idx_t) +
+                     hnsw->hnsw.offsets.size() * sizeof(size_t) + hnsw->hnsw.levels.size() * sizeof(int);
+        return bytes;
+    }
+
+    if (auto idmap = dynamic_cast<faiss::IndexIDMap *>(index)) {
+
+        auto bytes = idmap->id_map.size() * sizeof(faiss::idx_t);
+        if (dynamic_cast<faiss::IndexIDMap2 *>(idmap) != nullptr)
+            bytes += idmap->id_map.size() * VSS_HASH_ENTRY_BYTES;
+        return bytes + vss_index_memory_bytes(idmap->index);
+    }
+
+    if (auto transform = dynamic_cast<faiss::IndexPreTransform *>(index))
+        return vss_index_memory_bytes(transform->index);
+
+    if (auto ivf = dynamic_cast<faiss::IndexIVF *>(index)) {
+
+        auto bytes = vss_index_memory_bytes(ivf->quantizer);
+        if (auto lists = dynamic_cast<vss_sqlite_invlists *>(ivf->invlists))
+            return bytes + lists->resident_bytes();
+        return bytes + ivf->ntotal * (ivf->code_size + sizeof(faiss::idx_t));
+    }
+
+    if (auto hnsw = dynamic_cast<faiss::IndexHNSW *>(index))
+        return vss_index_memory_bytes(hnsw->storage) +
+               hnsw->hnsw.neighbors.size() * sizeof(faiss::HNSW::storage_idx_t) +
+               hnsw->hnsw.offsets.size() * sizeof(size_t) + hnsw->hnsw.levels.size() * sizeof(int);
+
+    if (auto flat = dynamic_cast<faiss::IndexFlatCodes *>(index))
+        return flat->codes.size();
+
+    // Other indexes, at least their codes when faiss knows their size.
+    try {
+        return index->ntotal * index->sa_code_size();
+    } catch (faiss::FaissException &) {
+        return index->ntotal * index->d * sizeof(float);
+    }
+}
+
+// Size in bytes of the persisted index at position i of table, or -1 if it
+// couldn't be read.
+static sqlite3_int64 serialized_index_size(vss_index_vtab *table, size_t i) {
+
+    auto vssIndex = table->indexes.at(i);
+
+    if (vssIndex->storage_type == StorageType::faiss_ondisk) {
+
+        auto filename = get_index_filename(table->db, table->schema, table->name, vssIndex->name);
+        ifstream file(filename, ios::binary | ios::ate);
+        if (!file)
+            return -1;
+        return (sqlite3_int64)file.tellg();
+    }
+
+    // faiss_ivflists columns add up the header and their lists, Vamana
+    // columns the header and their nodes.
+    sqlite3_stmt *stmt;
+    char *sql;
+    if (vssIndex->storage_type == StorageType::faiss_ivflists)
+        sql = sqlite3_mprintf("select (select length(idx) from \"%w\".\"%w_index\" where rowid = ?1) + "
+                              "(select coalesce(sum(length(ids) + length(codes)), 0) from \"%w\".\"%w_ivflists\" where col = ?1)",
+                              table->schema, table->name, table->schema, table->name);
+    else if (dynamic_cast<vss_vamana_index *>(vssIndex->index) != nullptr)
+        sql = sqlite3_mprintf("select (select length(idx) from \"%w\".\"%w_index\" where rowid = ?1) + "
+                              "(select coalesce(sum(coalesce(length(code), 0) + length(vector) + coalesce(length(neighbors), 0)), 0) from \"%w\".\"%w_graph\" where col = ?1)",
+                              table->schema, table->name, table->schema, table->name);
+    else
+        sql = sqlite3_mprintf("select length(idx) from \"%w\".\"%w_index\" where rowid = ?",
+                              table->schema,
+                              table->name);
+
+    sqlite3_int64 size = -1;
+    if (sqlite3_prepare_v2(table->db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
+
+        sqlite3_bind_int64(stmt, 1, i);
+        if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL)
+            size = sqlite3_column_int64(stmt, 0);
+    }
+    finalize_and_free(stmt, sql);
+    return size;
+}
+
+static int vssIndexesColumn(sqlite3_vtab_cursor *cur,
+                            sqlite3_context *context,
+                            int i) {
+
+    auto pCur = static_cast<vssIndexes_cursor *>(cur);
+    auto row = pCur->rows.at(pCur->iRowid);
+    auto table = row.first;
+    auto vssIndex = table->indexes.at(row.second);
+    auto index = vssIndex->index;
+
+    switch (i) {
+
+        case VSS_INDEXES_SCHEMA:
+            sqlite3_result_text(context, table->schema, -1, SQLITE_TRANSIENT);
+            break;
+
+        case VSS_INDEXES_TABLE_NAME:
+            sqlite3_result_text(context, table->name, -1, SQLITE_TRANSIENT);
+            break;
+
+        case VSS_INDEXES_COLUMN_NAME:
+            sqlite3_result_text(context, vssIndex->name.c_str(), -1, SQLITE_TRANSIENT);
+            break;
+
+        case VSS_INDEXES_FACTORY:
+            sqlite3_result_text(context, vssIndex->factory.c_str(), -1, SQLITE_TRANSIENT);
+            break;
+
+        case VSS_INDEXES_METRIC_TYPE:
+            if (vssIndex->vector_type == VectorType::vector_binary)
+                sqlite3_result_text(context, "Hamming", -1, SQLITE_STATIC);
+            else
+                sqlite3_result_text(context, metric_type_name(index->metric_type), -1, SQLITE_STATIC);
+            break;
+
+        case VSS_INDEXES_STORAGE_TYPE:
+            sqlite3_result_text(context,
+                                storage_type_name(vssIndex->storage_type),
+                                -1,
+                                SQLITE_STATIC);
+            break;
+
+        case VSS_INDEXES_DIMENSIONS:
+            sqlite3_result_int64(context, index->d);
+            break;
+
+        case VSS_INDEXES_NTOTAL:
+            sqlite3_result_int64(context, index->ntotal);
+            break;
+
+        case VSS_INDEXES_IS_TRAINED:
+            sqlite3_result_int(context, index->is_trained);
+            break;
+
+        case VSS_INDEXES_SERIALIZED_SIZE: {
+            auto size = serialized_index_size(table, row.second);
+            if (size < 0)
+                sqlite3_result_null(context);
+            else
+                sqlite3_result_int64(context, size);
+            break;
+        }
+
+        case VSS_INDEXES_RESIDENT_BYTES: {
+            sqlite3_result_int64(context,
+                                 vss_index_memory_bytes(index) +
+                                 vssIndex->trainings.size() * sizeof(float) +
+                                 vssIndex->insert_data.size() * sizeof(float) +
+                                 vssIndex->insert_ids.size() * sizeof(faiss::idx_t) +
+                                 vssIndex->delete_ids.size() * sizeof(faiss::idx_t));
+            break;
+        }
+
+        case VSS_INDEXES_PENDING_INSERTS:
+            sqlite3_result_int64(context, vssIndex->insert_ids.size());
+            break;
+
+        case VSS_INDEXES_PENDING_DELETES:
+            sqlite3_result_int64(context, vssIndex->delete_ids.size());
+            break;
+
+        case VSS_INDEXES_PENDING_TRAININGS:
+            sqlite3_result_int64(context, vssIndex->trainings.size() / index->d);
+            break;
+
+        case VSS_INDEXES_IMBALANCE_FACTOR: {
+            auto invlists = vss_index_invlists(index);
+            if (invlists != nullptr && index->ntotal > 0)
+                sqlite3_result_double(context, invlists->imbalance_factor());
+            else
+                sqlite3_result_null(context);
+            break;
+        }
+
+        case VSS_INDEXES_LAST_SYNC_MS:
+            if (vssIndex->last_sync_us < 0)
+                sqlite3_result_null(context);
+            else
+                sqlite3_result_double(context, vssIndex->last_sync_us / 1000.0);
+            break;
+
+        case VSS_INDEXES_LOAD_MS:
+            sqlite3_result_double(context, vssIndex->load_us / 1000.0);
+            break;
+    }
+    return SQLITE_OK;
+}
+
+static sqlite3_module vssIndexesModule = {
+    /* iVersion    */ 0,
+    /* xCreate     */ 0,
+    /* xConnect    */ vssIndexesConnect,
+    /* xBestIndex  */ vssIndexesBestIndex,
+    /* xDisconnect */ vssIndexesDisconnect,
+    /* xDestroy    */ 0,
+    /* xOpen       */ vssIndexesOpen,
+    /* xClose      */ vssIndexesClose,
+    /* xFilter     */ vssIndexesFilter,
+    /* xNext       */ vssIndexesNext,
+    /* xEof        */ vssIndexesEof,
+    /* xColumn     */ vssIndexesColumn,
+    /* xRowid      */ vssIndexesRowid,
+    /* xUpdate     */ 0,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ 0,
+    /* xRename     */ 0,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ 0};
+
+#pragma endregion
+
+#pragma region vss_explain
+
+static void json_append_string(sqlite3_str *str, const char *value) {
+
+    sqlite3_str_appendchar(str, 1, '"');
+    for (auto c = value; *c != '\0'; c++) {
+
+        switch (*c) {
+          case '"':  sqlite3_str_appendall(str, "\\\""); break;
+          case '\\': sqlite3_str_appendall(str, "\\\\"); break;
+          case '\n': sqlite3_str_appendall(str, "\\n"); break;
+          case '\r': sqlite3_str_appendall(str, "\\r"); break;
+          case '\t': sqlite3_str_appendall(str, "\\t"); break;
+          default:
+              if ((unsigned char)*c < 0x20)
+                  sqlite3_str_appendf(str, "\\u%04x", (unsigned char)*c);
+              else
+                  sqlite3_str_appendchar(str, 1, *c);
+        }
+    }
+    sqlite3_str_appendchar(str, 1, '"');
+}
+
+// Appends a search parameter, or null when it doesn't apply.
+static void json_append_param(sqlite3_str *str, const char *key, sqlite3_int64 value) {
+
+    if (value < 0)
+        sqlite3_str_appendf(str, ",\"%s\":null", key);
+    else
+        sqlite3_str_appendf(str, ",\"%s\":%lld", key, value);
+}
+
+static void json_append_scan(sqlite3_str *str, const vss_scan_trace &scan) {
+
+    sqlite3_str_appendall(str, "{\"table\":");
+    json_append_string(str, scan.table_name.c_str());
+
+    sqlite3_str_appendall(str, ",\"column\":");
+    if (scan.column_name.empty())
+        sqlite3_str_appendall(str, "null");
+    else
+        json_append_string(str, scan.column_name.c_str());
+
+    sqlite3_str_appendall(str, ",\"plan\":");
+    json_append_string(str, scan.plan.c_str());
+
+    sqlite3_str_appendall(str, ",\"constraints\":[");
+    for (size_t i = 0; i < scan.constraints.size(); i++) {
+        if (i > 0)
+            sqlite3_str_appendchar(str, 1, ',');
+        json_append_string(str, scan.constraints[i].c_str());
+    }
+    sqlite3_str_appendf(str, "],\"limit_pushed_down\":%s",
+                        scan.limit_pushed_down ? "true" : "false");
+
+    json_append_param(str, "k", scan.k);
+    json_append_param(str, "nprobe", scan.nprobe);
+    json_append_param(str, "ef_search", scan.ef_search);
+
+    sqlite3_str_appendf(str,
+                        ",\"lists_probed\":%lld"
+                        ",\"candidates_scanned\":%lld"
+                        ",\"rows\":%lld"
+                        ",\"parse_ms\":%.3f"
+                        ",\"search_ms\":%.3f"
+                        ",\"materialize_ms\":%.3f}",
+                        scan.lists_probed,
+                        scan.candidates_scanned,
+                        scan.rows,
+                        scan.parse_us / 1000.0,
+                        scan.search_us / 1000.0,
+                        scan.materialize_us / 1000.0);
+}
+
+// vss_explain(sql, ...) runs a single statement to completion, binding any
+// extra arguments as its parameters, and returns a JSON report of every vss0
+// scan the statement made.
+static void vssExplainFunc(sqlite3_context *context,
+                           int argc,
+                           sqlite3_value **argv) {
+
+    auto connection = static_cast<vss_connection *>(sqlite3_user_data(context));
+    auto db = sqlite3_context_db_handle(context);
+
+    if (argc < 1 || sqlite3_value_type(argv[0]) != SQLITE_TEXT) {
+        sqlite3_result_error(context, "1st argument to vss_explain() must be SQL text", -1);
+        return;
+    }
+
+    if (connection->trace != nullptr) {
+        sqlite3_result_error(context, "vss_explain() calls can't be nested", -1);
+        return;
+    }
+
+    sqlite3_stmt *stmt = nullptr;
+    const char *tail = nullptr;
+    auto sql = (const char *)sqlite3_value_text(argv[0]);
+
+    auto rc = sqlite3_prepare_v2(db, sql, -1, &stmt, &tail);
+    if (rc != SQLITE_OK || stmt == nullptr) {
+
+        auto errmsg = sqlite3_mprintf("vss_explain() could not prepare statement: %s",
+                                      rc != SQLITE_OK ? sqlite3_errmsg(db) : "no SQL");
+        sqlite3_result_error(context, errmsg, -1);
+        sqlite3_free(errmsg);
+        sqlite3_finalize(stmt);
+        return;
+    }
+
+    while (tail != nullptr && isspace((unsigned char)*tail))
+        tail++;
+
+    if (tail != nullptr && *tail != '\0') {
+        sqlite3_result_error(context, "vss_explain() accepts a single statement", -1);
+        sqlite3_finalize(stmt);
+        return;
+    }
+
+    // The statement runs to completion, a write would be applied for real.
+    if (!sqlite3_stmt_readonly(stmt)) {
+        sqlite3_result_error(context, "vss_explain() only runs read-only statements", -1);
+        sqlite3_finalize(stmt);
+        return;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        rc = sqlite3_bind_value(stmt, i, argv[i]);
+        if (rc != SQLITE_OK) {
+            sqlite3_result_error_code(context, rc);
+            sqlite3_finalize(stmt);
+            return;
+        }
+    }
+
+    vector<vss_scan_trace> trace;
+    sqlite3_int64 rows = 0;
+
+    connection->trace = &trace;
+    auto start = vss_clock::now();
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+        rows++;
+
+    auto total_us = elapsed_us(start);
+    auto step_rc = rc;
+    sqlite3_finalize(stmt);
+    connection->trace = nullptr;
+
+    if (step_rc != SQLITE_DONE) {
+
+        auto errmsg = sqlite3_mprintf("vss_explain() statement failed: %s", sqlite3_errmsg(db));
+        sqlite3_result_error(context, errmsg, -1);
+        sqlite3_free(errmsg);
+        return;
+    }
+
+    auto str = sqlite3_str_new(db);
+
+    sqlite3_str_appendf(str, "{\"rows\":%lld,\"total_ms\":%.3f,\"scans\":[",
+                        rows, total_us / 1000.0);
+
+    for (size_t i = 0; i < trace.size(); i++) {
+        if (i > 0)
+            sqlite3_str_appendchar(str, 1, ',');
+        json_append_scan(str, trace[i]);
+    }
+    sqlite3_str_appendall(str, "]}");
+
+    rc = sqlite3_str_errcode(str);
+    if (rc != SQLITE_OK) {
+        sqlite3_free(sqlite3_str_finish(str));
+        sqlite3_result_error_code(context, rc);
+        return;
+    }
+
+    sqlite3_result_text(context, sqlite3_str_finish(str), -1, sqlite3_free);
+}
+
+#pragma endregion
+
+#pragma region vss_bulk_load
+
+// Vectors are handed to faiss in batches of about this many bytes, so the
+// source is never held in memory whole.
+static const size_t VSS_BULK_LOAD_BATCH_BYTES = 64 * 1024 * 1024;
+
+// Whether source reads like SQL rather than a file path: it starts with the
+// keyword select, with or values, followed by a space or a parenthesis.
+static bool vss_bulk_load_is_query(const char *source) {
+
+    while (isspace((unsigned char)*source))
+        source++;
+
+    for (auto keyword : {"select", "with", "values"}) {
+
+        auto n = strlen(keyword);
+        if (sqlite3_strnicmp(source, keyword, n) == 0 &&
+            (isspace((unsigned char)source[n]) || source[n] == '('))
+            return true;
+    }
+    return false;
+}
+
+// Prepares the statement the vectors are read from. It returns the rowid in
+// its first column, null to pick the next free one, and the vector in its
+// second.
+static sqlite3_stmt *vss_bulk_load_source(sqlite3 *db,
+                                          vector0_api *vector_api,
+                                          const char *function,
+                                          sqlite3_value *source,
+                                          char **errmsg) {
+
+    sqlite3_stmt *stmt = nullptr;
+    int rc;
+
+    int64_t rows, dimensions;
+    const char *pzErrMsg = nullptr;
+
+    if (sqlite3_value_type(source) == SQLITE_BLOB && vector_api->iVersion >= 1 &&
+        vector_api->xValueAsMatrix(source, &rows, &dimensions, &pzErrMsg) != nullptr) {
+
+        // A matrix blob, like vector_matrix() returns.
+        rc = sqlite3_prepare_v2(db, "select null, vector from vector_matrix_each(?)", -1, &stmt, nullptr);
+        if (rc == SQLITE_OK)
+            rc = sqlite3_bind_value(stmt, 1, source);
+
+    } else if (sqlite3_value_type(source) == SQLITE_BLOB) {
+
+        // The contents of an .fvecs file, like readfile('x.fvecs') returns.
+        rc = sqlite3_prepare_v2(db, "select null, vector from vector_fvecs_each(?)", -1, &stmt, nullptr);
+        if (rc == SQLITE_OK)
+            rc = sqlite3_bind_value(stmt, 1, source);
+
+    } else if (sqlite3_value_type(source) == SQLITE_TEXT &&
+               vss_bulk_load_is_query((const char *)sqlite3_value_text(source))) {
+
+        const char *tail = nullptr;
+        rc = sqlite3_prepare_v2(db, (const char *)sqlite3_value_text(source), -1, &stmt, &tail);
+
+        while (rc == SQLITE_OK && tail != nullptr && isspace((unsigned char)*tail))
+            tail++;
+
+        if (rc == SQLITE_OK && tail != nullptr && *tail != '\0') {
+            *errmsg = sqlite3_mprintf("%s() accepts a single statement", function);
+            sqlite3_finalize(stmt);
+            return nullptr;
+        }
+
+        if (rc == SQLITE_OK && sqlite3_column_count(stmt) < 2) {
+            *errmsg = sqlite3_mprintf("%s() query must return a rowid and a vector", function);
+            sqlite3_finalize(stmt);
+            return nullptr;
+        }
+
+    } else if (sqlite3_value_type(source) == SQLITE_TEXT) {
+
+        // A path to an .fvecs, .bvecs or .ivecs file, read through a memory
+        // mapping.
+        rc = sqlite3_prepare_v2(db, "select null, vector from vector_vecs_each(?)", -1, &stmt, nullptr);
+        if (rc == SQLITE_OK)
+            rc = sqlite3_bind_value(stmt, 1, source);
+
+    } else {
+
+        *errmsg = sqlite3_mprintf("source of %s() must be a path, a blob or a query", function);
+        return nullptr;
+    }
+
+    if (rc != SQLITE_OK) {
+        *errmsg = sqlite3_mprintf("%s() could not read source: %s", function, sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return nullptr;
+    }
+
+    return stmt;
+}
+
+// Streams every vector of source into the column's index, then writes the
+// index once. Bypasses xUpdate, so no vector is buffered in insert_data and
+// the _data rowids go through a single prepared statement.
+static int vss_bulk_load(vss_index_vtab *pTable,
+                         size_t idxCol,
+                         sqlite3_stmt *source,
+                         sqlite3_int64 *loaded,
+                         char **errmsg) {
+
+    auto db = pTable->db;
+    auto column = pTable->indexes[idxCol];
+    auto d = (size_t)column->index->d;
+
+    vss_data_inserter inserter;
+    int rc = inserter.prepare(db, pTable->schema, pTable->name);
+    if (rc != SQLITE_OK) {
+        *errmsg = sqlite3_mprintf("vss_bulk_load() could not insert rowids: %s", sqlite3_errmsg(db));
+        return rc;
+    }
+
+    auto batch_size = max((size_t)1, VSS_BULK_LOAD_BATCH_BYTES / (d * sizeof(float)));
+    vector<float> batch;
+    vector<faiss::idx_t> batch_ids;
+    batch.reserve(batch_size * d);
+    batch_ids.reserve(batch_size);
+
+    vss_faiss_threads threads(column->index);
+    auto flush = [&]() {
+        if (!batch_ids.empty())
+            column->index->add_with_ids(batch_ids.size(), batch.data(), batch_ids.data());
+        batch.clear();
+        batch_ids.clear();
+    };
+
+    while ((rc = sqlite3_step(source)) == SQLITE_ROW) {
+
+        sqlite3_int64 given_rowid = 0;
+        auto given = sqlite3_column_type(source, 0) != SQLITE_NULL;
+        if (sqlite3_column_type(source, 0) == SQLITE_INTEGER) {
+            given_rowid = sqlite3_column_int64(source, 0);
+        } else if (given) {
+            *errmsg = sqlite3_mprintf("vss_bulk_load() rowids must be integers or null");
+            return SQLITE_ERROR;
+        }
+
+        // Rows without a rowid are named by their position in source.
+        auto row_name = [&]() {
+            return given ? sqlite3_mprintf("rowid %lld", given_rowid)
+                         : sqlite3_mprintf("row %lld of source", *loaded + 1);
+        };
+
+        // Vectors from vector_vecs_each() and the other vector0 functions are
+        // pointers, copy them straight into the batch.
+        auto value = sqlite3_column_value(source, 1);
+        auto pointer = (VectorFloat *)sqlite3_value_pointer(value, "vectorf32v0");
+        vec_ptr decoded;
+
+        const float *data;
+        size_t size;
+        if (pointer != nullptr) {
+            data = pointer->data;
+            size = pointer->size;
+        } else if ((decoded = vss_value_as_vector(pTable, column, value)) != nullptr) {
+            data = decoded->data();
+            size = decoded->size();
+        } else {
+            auto name = row_name();
+            *errmsg = sqlite3_mprintf("vss_bulk_load() value for %s is not a vector", name);
+            sqlite3_free(name);
+            return SQLITE_ERROR;
+        }
+
+        if (size != d) {
+            auto name = row_name();
+            *errmsg = sqlite3_mprintf("vss_bulk_load() vector for %s has %lld dimensions, expected %lld",
+                                      name, (sqlite3_int64)size, (sqlite3_int64)d);
+            sqlite3_free(name);
+            return SQLITE_ERROR;
+        }
+
+        sqlite3_int64 rowid;
+        if (inserter.insert(given ? &given_rowid : nullptr, &rowid) != SQLITE_OK) {
+            auto name = row_name();
+            *errmsg = sqlite3_mprintf("vss_bulk_load() could not insert %s: %s", name, sqlite3_errmsg(db));
+            sqlite3_free(name);
+            return SQLITE_ERROR;
+        }
+
+        batch.insert(batch.end(), data, data + d);
+        batch_ids.push_back(rowid);
+        (*loaded)++;
+
+        if (batch_ids.size() == batch_size)
+            flush();
+    }
+
+    if (rc != SQLITE_DONE) {
+        *errmsg = sqlite3_mprintf("vss_bulk_load() could not read source: %s", sqlite3_errmsg(db));
+        return rc;
+    }
+
+    flush();
+
+    rc = write_index_insert(column->index,
+                            db,
+                            pTable->schema,
+                            pTable->name,
+                            idxCol,
+                            column->name,
+                            column->storage_type);
+    if (rc != SQLITE_OK) {
+        *errmsg = sqlite3_mprintf("Error saving index (%d): %s", rc, sqlite3_errmsg(db));
+        return rc;
+    }
+
+    return SQLITE_OK;
+}
+
+static void vssBulkLoadFunc(sqlite3_context *context,
+                            int argc,
+                            sqlite3_value **argv) {
+
+    auto connection = static_cast<vss_connection *>(sqlite3_user_data(context));
+    auto db = sqlite3_context_db_handle(context);
+
+    auto table_name = (const char *)sqlite3_value_text(argv[0]);
+    auto column_name = (const char *)sqlite3_value_text(argv[1]);
+
+    if (table_name == nullptr || column_name == nullptr) {
+        sqlite3_result_error(context, "vss_bulk_load() requires a table and a column name", -1);
+        return;
+    }
+
+    // The index is changed in memory as vectors are added, it can't be put
+    // back if an enclosing transaction rolls back later on.
+    if (!sqlite3_get_autocommit(db)) {
+        sqlite3_result_error(context, "vss_bulk_load() can't run inside a transaction", -1);
+        return;
+    }
+
+    auto pTable = vss_table_lookup(connection, db, nullptr, table_name);
+    if (pTable == nullptr) {
+        auto errmsg = sqlite3_mprintf("vss_bulk_load() could not find vss0 table %s", table_name);
+        sqlite3_result_error(context, errmsg, -1);
+        sqlite3_free(errmsg);
+        return;
+    }
+
+    if (pTable->partitioned()) {
+        auto errmsg = sqlite3_mprintf("vss_bulk_load() doesn't support partitioned tables like %s", table_name);
+        sqlite3_result_error(context, errmsg, -1);
+        sqlite3_free(errmsg);
+        return;
+    }
+
+    size_t idxCol = 0;
+    while (idxCol < pTable->indexes.size() &&
+           sqlite3_stricmp(pTable->indexes[idxCol]->name.c_str(), column_name) != 0)
+        idxCol++;
+
+    if (idxCol == pTable->indexes.size()) {
+        auto errmsg = sqlite3_mprintf("vss_bulk_load() table %s has no column %s", table_name, column_name);
+        sqlite3_result_error(context, errmsg, -1);
+        sqlite3_free(errmsg);
+        return;
+    }
+
+    auto column = pTable->indexes[idxCol];
+    if (!column->index->is_trained) {
+        auto errmsg = sqlite3_mprintf("vss_bulk_load() column %s requires training before loading data", column_name);
+        sqlite3_result_error(context, errmsg, -1);
+        sqlite3_free(errmsg);
+        return;
+    }
+
+    char *errmsg = nullptr;
+    auto source = vss_bulk_load_source(db, connection->vector_api, "vss_bulk_load", argv[2], &errmsg);
+    if (source == nullptr) {
+        sqlite3_result_error(context, errmsg, -1);
+        sqlite3_free(errmsg);
+        return;
+    }
+
+    // The _data rowids and the written index are committed together.
+    auto rc = sqlite3_exec(db, "savepoint vss_bulk_load", nullptr, nullptr, nullptr);
+    if (rc != SQLITE_OK) {
+        sqlite3_finalize(source);
+        sqlite3_result_error(context, sqlite3_errmsg(db), -1);
+        return;
+    }
+
+    auto start = vss_clock::now();
+    sqlite3_int64 loaded = 0;
+
+    try {
+        rc = vss_bulk_load(pTable, idxCol, source, &loaded, &errmsg);
+    } catch (faiss::FaissException &e) {
+        errmsg = sqlite3_mprintf("vss_bulk_load() failed adding vectors: %s", e.msg.c_str());
+        rc = SQLITE_ERROR;
+    }
+
+    sqlite3_finalize(source);
+
+    if (rc == SQLITE_OK)
+        rc = sqlite3_exec(db, "release vss_bulk_load", nullptr, nullptr, nullptr);
+
+    if (rc != SQLITE_OK) {
+
+        sqlite3_exec(db, "rollback to vss_bulk_load; release vss_bulk_load", nullptr, nullptr, nullptr);
+
+        // Some of the vectors may already be in the index, go back to the
+        // copy that was last written.
+        try {
+            auto index = read_index_select(db, pTable->schema, pTable->name, idxCol,
+                                           column->name, column->storage_type, column->vector_type);
+            if (index != nullptr) {
+                delete column->index;
+                column->index = index;
+            }
+        } catch (faiss::FaissException &) {
+        }
+
+        sqlite3_result_error(context, errmsg != nullptr ? errmsg : sqlite3_errmsg(db), -1);
+        sqlite3_free(errmsg);
+        return;
+    }
+
+    column->last_sync_us = elapsed_us(start);
+    sqlite3_result_int64(context, loaded);
+}
+
+#pragma endregion
+
+#pragma region vss_import_index
+
+// select vss_import_index('xyz', 'a', :path_or_blob)
+//
+// Function form of a 'load_trained' insert for a single column, see
+// vss_load_trained_insert(), that also reads index files. Returns null,
+// errors if the index can't be installed.
+static void vssImportIndexFunc(sqlite3_context *context,
+                               int argc,
+                               sqlite3_value **argv) {
+
+    auto connection = static_cast<vss_connection *>(sqlite3_user_data(context));
+    auto db = sqlite3_context_db_handle(context);
+
+    auto table_name = (const char *)sqlite3_value_text(argv[0]);
+    auto column_name = (const char *)sqlite3_value_text(argv[1]);
+
+    if (table_name == nullptr || column_name == nullptr) {
+        sqlite3_result_error(context, "vss_import_index() requires a table and a column name", -1);
+        return;
+    }
+
+    auto pTable = vss_table_lookup(connection, db, nullptr, table_name);
+    if (pTable == nullptr) {
+        auto errmsg = sqlite3_mprintf("vss_import_index() could not find vss0 table %s", table_name);
+        sqlite3_result_error(context, errmsg, -1);
+        sqlite3_free(errmsg);
+        return;
+    }
+
+    if (pTable->partitioned()) {
+        auto errmsg = sqlite3_mprintf("vss_import_index() doesn't support partitioned tables like %s", table_name);
+        sqlite3_result_error(context, errmsg, -1);
+        sqlite3_free(errmsg);
+        return;
+    }
+
+    auto column = std::find_if(pTable->indexes.begin(), pTable->indexes.end(), [&](vss_index *index) {
+        return sqlite3_stricmp(index->name.c_str(), column_name) == 0;
+    });
+
+    if (column == pTable->indexes.end()) {
+        auto errmsg = sqlite3_mprintf("vss_import_index() table %s has no column %s", table_name, column_name);
+        sqlite3_result_error(context, errmsg, -1);
+        sqlite3_free(errmsg);
+        return;
+    }
+
+    // Index files are read here rather than by the insert, which triggers
+    // and views could run; this function is direct-only.
+    vector<char> contents;
+    if (sqlite3_value_type(argv[2]) == SQLITE_TEXT) {
+
+        auto filename = (const char *)sqlite3_value_text(argv[2]);
+        ifstream file(filename, ios::binary);
+        contents.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+
+        if (!file.good() && !file.eof()) {
+            auto errmsg = sqlite3_mprintf("vss_import_index() could not read %s", filename);
+            sqlite3_result_error(context, errmsg, -1);
+            sqlite3_free(errmsg);
+            return;
+        }
+    }
+
+    auto sql = sqlite3_mprintf("insert into \"%w\".\"%w\"(operation, \"%w\") values ('load_trained', ?)",
+                               pTable->schema, pTable->name, (*column)->name.c_str());
+
+    sqlite3_stmt *stmt;
+    auto rc = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
+    sqlite3_free(sql);
+
+    if (rc == SQLITE_OK) {
+        if (sqlite3_value_type(argv[2]) == SQLITE_TEXT)
+            sqlite3_bind_blob64(stmt, 1, contents.data(), contents.size(), SQLITE_STATIC);
+        else
+            sqlite3_bind_value(stmt, 1, argv[2]);
+        rc = sqlite3_step(stmt);
+        rc = sqlite3_finalize(stmt);
+    }
+
+    if (rc != SQLITE_OK) {
+        sqlite3_result_error(context, sqlite3_errmsg(db), -1);
+        return;
+    }
+
+    sqlite3_result_null(context);
+}
+
+#pragma endregion
+
+#pragma region vss_train
+
+// Vectors re-added to a retrained index are read back in batches of about
+// this many bytes.
+static const size_t VSS_TRAIN_BATCH_BYTES = 64 * 1024 * 1024;
+
+// Rowids of the vectors stored in a column. False when the index has no
+// IDMap or _ivfrows to read them from.
+static bool vss_index_ids(faiss::Index *index, vector<faiss::idx_t> *ids) {
+
+    if (auto binary = dynamic_cast<vss_binary_index *>(index)) {
+        auto idmap = dynamic_cast<faiss::IndexBinaryIDMap *>(binary->binary);
+        if (idmap == nullptr)
+            return false;
+        *ids = idmap->id_map;
+        return true;
+    }
+
+    if (auto vamana = dynamic_cast<vss_vamana_index *>(index)) {
+        *ids = vamana->ids;
+        return true;
+    }
+
+    if (auto lists = vss_index_rows(index))
+        return lists->all_ids(ids) == SQLITE_OK;
+
+    auto idmap = dynamic_cast<faiss::IndexIDMap *>(index);
+    if (idmap == nullptr)
+        return false;
+    *ids = idmap->id_map;
+    return true;
+}
+
+// IVF indexes only reconstruct vectors by id once they have a direct map,
+// unless _ivfrows says which list each rowid is in.
+static void vss_index_enable_reconstruct(faiss::Index *index) {
+
+    if (auto binary = dynamic_cast<vss_binary_index *>(index)) {
+        if (auto ivf = dynamic_cast<faiss::IndexBinaryIVF *>(binary->inner()))
+            ivf->make_direct_map(true);
+        return;
+    }
+
+    if (vss_index_rows(index) != nullptr)
+        return;
+
+    if (auto ivf = dynamic_cast<faiss::IndexIVF *>(unwrap_index(index)))
+        ivf->make_direct_map(true);
+}
+
+// Reservoir sample (Algorithm R) of the vectors of source, so memory stays
+// bounded by sample_size no matter how many rows the source has.
+static int vss_train_sample_source(vss_index_vtab *pTable,
+                                   vss_index *column,
+                                   sqlite3_stmt *source,
+                                   size_t sample_size,
+                                   std::mt19937_64 &rng,
+                                   vector<float> *sample,
+                                   char **errmsg) {
+
+    auto d = (size_t)column->index->d;
+    sqlite3_int64 seen = 0;
+    int rc;
+
+    while ((rc = sqlite3_step(source)) == SQLITE_ROW) {
+
+        auto value = sqlite3_column_value(source, 1);
+        auto pointer = (VectorFloat *)sqlite3_value_pointer(value, "vectorf32v0");
+        vec_ptr decoded;
+
+        const float *data;
+        size_t size;
+        if (pointer != nullptr) {
+            data = pointer->data;
+            size = pointer->size;
+        } else if ((decoded = vss_value_as_vector(pTable, column, value)) != nullptr) {
+            data = decoded->data();
+            size = decoded->size();
+        } else {
+            *errmsg = sqlite3_mprintf("vss_train() row %lld of the source is not a vector", seen);
+            return SQLITE_ERROR;
+        }
+
+        if (size != d) {
+            *errmsg = sqlite3_mprintf("vss_train() row %lld of the source has %lld dimensions, expected %lld",
+                                      seen, (sqlite3_int64)size, (sqlite3_int64)d);
+            return SQLITE_ERROR;
+        }
+
+        size_t slot;
+        if ((size_t)seen < sample_size) {
+            slot = seen;
+            sample->resize((slot + 1) * d);
+        } else {
+            slot = std::uniform_int_distribution<sqlite3_int64>(0, seen)(rng);
+        }
+        seen++;
+
+        if (slot < sample_size)
+            copy(data, data + d, sample->begin() + slot * d);
+    }
+
+    if (rc != SQLITE_DONE) {
+        *errmsg = sqlite3_mprintf("vss_train() could not read source: %s", sqlite3_errmsg(pTable->db));
+        return rc;
+    }
+    return SQLITE_OK;
+}
+
+// Uniform sample of the vectors already stored in the column, reconstructed
+// from its index by rowid.
+static int vss_train_sample_stored(vss_index *column,
+                                   size_t sample_size,
+                                   std::mt19937_64 &rng,
+                                   vector<float> *sample,
+                                   char **errmsg) {
+
+    vector<faiss::idx_t> ids;
+    if (!vss_index_ids(column->index, &ids)) {
+        *errmsg = sqlite3_mprintf("vss_train() can't read the vectors of column %s, its factory needs an IDMap2",
+                                  column->name.c_str());
+        return SQLITE_ERROR;
+    }
+
+    vector<faiss::idx_t> chosen;
+    std::sample(ids.begin(), ids.end(), back_inserter(chosen), sample_size, rng);
+
+    auto d = column->index->d;
+    vss_index_enable_reconstruct(column->index);
+
+    sample->resize(chosen.size() * d);
+    for (size_t i = 0; i < chosen.size(); i++)
+        vss_index_reconstruct(column->index, chosen[i], sample->data() + i * d);
+
+    return SQLITE_OK;
+}
+
+// The definition a column was created with, for building a new index for it.
+static VssIndexColumn vss_index_definition(vss_index *column) {
+
+    return VssIndexColumn {
+        column->name,
+        column->index->d,
+        column->factory,
+        column->index->metric_type,
+        column->storage_type,
+        column->vector_type,
+        column->recall_sample,
+        column->flat_below
+    };
+}
+
+// Vectors read back out of a lossy index are its decoded approximations, a
+// new index would encode them again and add its own error on every move.
+// Errors for lossy columns that hold vectors.
+static int vss_check_lossless(vss_index *column, const char *function, char **errmsg) {
+
+    if (column->index->ntotal == 0 || !vss_index_is_lossy(column->index))
+        return SQLITE_OK;
+
+    *errmsg = sqlite3_mprintf("%s() can't move the vectors of column %s, its index is lossy and only gives back "
+                              "approximations of them. Insert them into a new table instead",
+                              function, column->name.c_str());
+    return SQLITE_ERROR;
+}
+
+// Copies every vector of the column's current index into index, in batches,
+// under the same rowids. Errors for lossy indexes, see vss_check_lossless.
+// Throws on faiss errors.
+static int vss_index_copy_vectors(vss_index *column, faiss::Index *index, const char *function, char **errmsg) {
+
+    auto current = column->index;
+    if (current->ntotal == 0)
+        return SQLITE_OK;
+
+    auto rc = vss_check_lossless(column, function, errmsg);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    vector<faiss::idx_t> ids;
+    if (!vss_index_ids(current, &ids)) {
+        *errmsg = sqlite3_mprintf("%s() can't read the vectors of column %s, its factory needs an IDMap2",
+                                  function, column->name.c_str());
+        return SQLITE_ERROR;
+    }
+
+    vss_index_enable_reconstruct(current);
+
+    auto d = current->d;
+    auto batch_size = max((size_t)1, VSS_TRAIN_BATCH_BYTES / (d * sizeof(float)));
+    vector<float> batch;
+
+    for (size_t start = 0; start < ids.size(); start += batch_size) {
+
+        auto n = min(batch_size, ids.size() - start);
+        batch.resize(n * d);
+        for (size_t i = 0; i < n; i++)
+            vss_index_reconstruct(current, ids[start + i], batch.data() + i * d);
+
+        index->add_with_ids(n, batch.data(), ids.data() + start);
+    }
+
+    return SQLITE_OK;
+}
+
+// Trains a new index for the column on sample, moves the column's vectors
+// into it batch by batch, and writes it. The column keeps its old index if
+// anything fails. Throws on faiss errors.
+static int vss_train(vss_index_vtab *pTable,
+                     size_t idxCol,
+                     const vector<float> &sample,
+                     char **errmsg) {
+
+    auto column = pTable->indexes[idxCol];
+
+    unique_ptr<faiss::Index> index(create_column_index(vss_index_definition(column)));
+    index->train(sample.size() / index->d, sample.data());
+
+    auto rc = vss_index_copy_vectors(column, index.get(), "vss_train", errmsg);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    rc = write_index_insert(index.get(),
+                            pTable->db,
+                            pTable->schema,
+                            pTable->name,
+                            idxCol,
+                            column->name,
+                            column->storage_type);
+    if (rc != SQLITE_OK) {
+        *errmsg = sqlite3_mprintf("Error saving index (%d): %s", rc, sqlite3_errmsg(pTable->db));
+        return rc;
+    }
+
+    delete column->index;
+    column->index = index.release();
+    return SQLITE_OK;
+}
+
+// select vss_train('xyz', 'a', sample_size, seed, source, threads)
+//
+// Trains column a of xyz on a random sample of at most sample_size vectors,
+// taken from source (a path, blob or query, like vss_bulk_load() reads) or,
+// when source is null or missing, from the vectors the column already has.
+// Vectors already in the column are moved into the retrained index. threads
+// caps the OpenMP threads faiss trains with, 0 or missing keeps the default.
+// Returns the number of vectors trained on.
+static void vssTrainFunc(sqlite3_context *context,
+                         int argc,
+                         sqlite3_value **argv) {
+
+    auto connection = static_cast<vss_connection *>(sqlite3_user_data(context));
+    auto db = sqlite3_context_db_handle(context);
+
+    auto table_name = (const char *)sqlite3_value_text(argv[0]);
+    auto column_name = (const char *)sqlite3_value_text(argv[1]);
+
+    if (table_name == nullptr || column_name == nullptr) {
+        sqlite3_result_error(context, "vss_train() requires a table and a column name", -1);
+        return;
+    }
+
+    auto sample_size = sqlite3_value_int64(argv[2]);
+    if (sqlite3_value_type(argv[2]) != SQLITE_INTEGER || sample_size <= 0) {
+        sqlite3_result_error(context, "vss_train() sample_size must be a positive integer", -1);
+        return;
+    }
+
+    auto seed = argc > 3 ? sqlite3_value_int64(argv[3]) : 0;
+    auto source = argc > 4 && sqlite3_value_type(argv[4]) != SQLITE_NULL ? argv[4] : nullptr;
+
+    auto threads = argc > 5 ? sqlite3_value_int(argv[5]) : 0;
+    if (threads < 0) {
+        sqlite3_result_error(context, "vss_train() threads must be 0 or more", -1);
+        return;
+    }
+
+    // Like vss_bulk_load(), the new index replaces the old one in memory
+    // right away.
+    if (!sqlite3_get_autocommit(db)) {
+        sqlite3_result_error(context, "vss_train() can't run inside a transaction", -1);
+        return;
+    }
+
+    auto pTable = vss_table_lookup(connection, db, nullptr, table_name);
+    if (pTable == nullptr) {
+        auto errmsg = sqlite3_mprintf("vss_train() could not find vss0 table %s", table_name);
+        sqlite3_result_error(context, errmsg, -1);
+        sqlite3_free(errmsg);
+        return;
+    }
+
+    if (pTable->partitioned()) {
+        auto errmsg = sqlite3_mprintf("vss_train() doesn't support partitioned tables like %s", table_name);
+        sqlite3_result_error(context, errmsg, -1);
+        sqlite3_free(errmsg);
+        return;
+    }
+
+    size_t idxCol = 0;
+    while (idxCol < pTable->indexes.size() &&
+           sqlite3_stricmp(pTable->indexes[idxCol]->name.c_str(), column_name) != 0)
+        idxCol++;
+
+    if (idxCol == pTable->indexes.size()) {
+        auto errmsg = sqlite3_mprintf("vss_train() table %s has no column %s", table_name, column_name);
+        sqlite3_result_error(context, errmsg, -1);
+        sqlite3_free(errmsg);
+        return;
+    }
+
+    auto column = pTable->indexes[idxCol];
+
+    // Checked before sampling, vss_index_copy_vectors() would refuse the
+    // vectors after training.
+    char *lossy = nullptr;
+    if (vss_check_lossless(column, "vss_train", &lossy) != SQLITE_OK) {
+        sqlite3_result_error(context, lossy, -1);
+        sqlite3_free(lossy);
+        return;
+    }
+
+    auto start = vss_clock::now();
+
+    std::mt19937_64 rng(seed);
+    vector<float> sample;
+    char *errmsg = nullptr;
+    int rc;
+
+    auto max_threads = omp_get_max_threads();
+    if (threads > 0)
+        omp_set_num_threads(threads);
+
+    try {
+
+        if (source != nullptr) {
+
+            auto stmt = vss_bulk_load_source(db, connection->vector_api, "vss_train", source, &errmsg);
+            rc = stmt != nullptr
+                ? vss_train_sample_source(pTable, column, stmt, sample_size, rng, &sample, &errmsg)
+                : SQLITE_ERROR;
+            sqlite3_finalize(stmt);
+
+        } else {
+
+            rc = vss_train_sample_stored(column, sample_size, rng, &sample, &errmsg);
+        }
+
+        if (rc == SQLITE_OK && sample.empty()) {
+            errmsg = sqlite3_mprintf("vss_train() found no vectors to train column %s on", column_name);
+            rc = SQLITE_ERROR;
+        }
+
+        if (rc == SQLITE_OK)
+            rc = vss_train(pTable, idxCol, sample, &errmsg);
+
+    } catch (faiss::FaissException &e) {
+        errmsg = sqlite3_mprintf("vss_train() failed: %s", e.msg.c_str());
+        rc = SQLITE_ERROR;
+    }
+
+    omp_set_num_threads(max_threads);
+
+    if (rc != SQLITE_OK) {
+        sqlite3_result_error(context, errmsg != nullptr ? errmsg : sqlite3_errmsg(db), -1);
+        sqlite3_free(errmsg);
+        return;
+    }
+
+    column->last_sync_us = elapsed_us(start);
+    sqlite3_result_int64(context, sample.size() / column->index->d);
+}
+
+#pragma endregion
+
+#pragma region vss_rebuild
+
+// Columns rebuilt under a factory that needs training are trained on a
+// sample of at most this many of their vectors. faiss itself subsamples to
+// 256 vectors per centroid.
+static const size_t VSS_REBUILD_SAMPLE_SIZE = 256 * 1024;
+
+// Records the factory and metric a column was rebuilt with in the
+// _factories shadow table, which xConnect reads over the ones of the table
+// definition.
+static int vss_write_factory(vss_index_vtab *pTable,
+                             int column,
+                             const VssIndexColumn &definition,
+                             char **errmsg) {
+
+    auto db = pTable->db;
+    auto rc = create_factories_table(db, pTable->schema, pTable->name);
+
+    sqlite3_stmt *stmt = nullptr;
+    if (rc == SQLITE_OK) {
+        auto sql = sqlite3_mprintf("insert or replace into \"%w\".\"%w_factories\"(col, factory, metric) values (?, ?, ?)",
+                                   pTable->schema, pTable->name);
+        rc = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
+        sqlite3_free(sql);
+    }
+
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_int(stmt, 1, column);
+        sqlite3_bind_text(stmt, 2, definition.factory.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 3, (int)definition.metric);
+        sqlite3_step(stmt);
+        rc = sqlite3_finalize(stmt);
+    }
+
+    if (rc != SQLITE_OK) {
+        *errmsg = sqlite3_mprintf("Could not save the factory of %s: %s", definition.name.c_str(), sqlite3_errmsg(db));
+        return rc;
+    }
+    return SQLITE_OK;
+}
+
+// select vss_rebuild('xyz', 'a', 'IVF1024,PQ32,IDMap2', 'INNER_PRODUCT')
+//
+// Moves every vector of column a into a new index built from another factory
+// string, and optionally another metric. Factories that need training are
+// trained on a sample of the column first. The _index blob and the _factories
+// row are replaced together, the column keeps its old index if anything
+// fails. Returns the number of vectors moved. Columns with a lossy index
+// that hold vectors are refused, see vss_check_lossless.
+static void vssRebuildFunc(sqlite3_context *context,
+                           int argc,
+                           sqlite3_value **argv) {
+
+    auto connection = static_cast<vss_connection *>(sqlite3_user_data(context));
+    auto db = sqlite3_context_db_handle(context);
+
+    auto table_name = (const char *)sqlite3_value_text(argv[0]);
+    auto column_name = (const char *)sqlite3_value_text(argv[1]);
+    auto factory = (const char *)sqlite3_value_text(argv[2]);
+    auto metric_name = argc > 3 ? (const char *)sqlite3_value_text(argv[3]) : nullptr;
+
+    if (table_name == nullptr || column_name == nullptr || factory == nullptr) {
+        sqlite3_result_error(context, "vss_rebuild() requires a table, a column name and a factory string", -1);
+        return;
+    }
+
+    // The new index replaces the old one in memory once it's written.
+    if (!sqlite3_get_autocommit(db)) {
+        sqlite3_result_error(context, "vss_rebuild() can't run inside a transaction", -1);
+        return;
+    }
+
+    auto pTable = vss_table_lookup(connection, db, nullptr, table_name);
+    if (pTable == nullptr) {
+        auto errmsg = sqlite3_mprintf("vss_rebuild() could not find vss0 table %s", table_name);
+        sqlite3_result_error(context, errmsg, -1);
+        sqlite3_free(errmsg);
+        return;
+    }
+
+    if (pTable->partitioned()) {
+        auto errmsg = sqlite3_mprintf("vss_rebuild() doesn't support partitioned tables like %s", table_name);
+        sqlite3_result_error(context, errmsg, -1);
+        sqlite3_free(errmsg);
+        return;
+    }
+
+    size_t idxCol = 0;
+    while (idxCol < pTable->indexes.size() &&
+           sqlite3_stricmp(pTable->indexes[idxCol]->name.c_str(), column_name) != 0)
+        idxCol++;
+
+    if (idxCol == pTable->indexes.size()) {
+        auto errmsg = sqlite3_mprintf("vss_rebuild() table %s has no column %s", table_name, column_name);
+        sqlite3_result_error(context, errmsg, -1);
+        sqlite3_free(errmsg);
+        return;
+    }
+
+    auto column = pTable->indexes[idxCol];
+
+    // The index file would be replaced before the savepoint is released.
+    if (column->storage_type == StorageType::faiss_ondisk) {
+        auto errmsg = sqlite3_mprintf("vss_rebuild() doesn't support storage_type=faiss_ondisk columns like %s",
+                                      column->name.c_str());
+        sqlite3_result_error(context, errmsg, -1);
+        sqlite3_free(errmsg);
+        return;
+    }
+
+    auto definition = vss_index_definition(column);
+    definition.factory = factory;
+
+    if (metric_name != nullptr) {
+
+        auto metric = metric_type_map.find(metric_name);
+        if (metric == metric_type_map.end()) {
+            auto errmsg = sqlite3_mprintf("vss_rebuild() unknown metric type %s", metric_name);
+            sqlite3_result_error(context, errmsg, -1);
+            sqlite3_free(errmsg);
+            return;
+        }
+
+        if (definition.vector_type == VectorType::vector_binary) {
+            sqlite3_result_error(context, "vss_rebuild() binary columns use Hamming distances, they take no metric", -1);
+            return;
+        }
+        definition.metric = metric->second;
+    }
+
+    auto start = vss_clock::now();
+    unique_ptr<faiss::Index> index;
+    char *errmsg = nullptr;
+    int rc = SQLITE_OK;
+
+    try {
+
+        index.reset(create_column_index(definition));
+
+        if (column->storage_type == StorageType::faiss_ivflists &&
+            dynamic_cast<faiss::IndexIVF *>(unwrap_index(index.get())) == nullptr) {
+            errmsg = sqlite3_mprintf("vss_rebuild() storage_type=faiss_ivflists columns need an IVF factory");
+            rc = SQLITE_ERROR;
+        }
+
+        if (column->storage_type != StorageType::faiss_shadow &&
+            dynamic_cast<vss_vamana_index *>(index.get()) != nullptr) {
+            errmsg = sqlite3_mprintf("vss_rebuild() Vamana factories need the default storage_type");
+            rc = SQLITE_ERROR;
+        }
+
+        if (rc == SQLITE_OK)
+            rc = vss_check_lossless(column, "vss_rebuild", &errmsg);
+
+        if (rc == SQLITE_OK && !index->is_trained && column->index->ntotal > 0) {
+
+            std::mt19937_64 rng(0);
+            vector<float> sample;
+            rc = vss_train_sample_stored(column, VSS_REBUILD_SAMPLE_SIZE, rng, &sample, &errmsg);
+            if (rc == SQLITE_OK)
+                index->train(sample.size() / index->d, sample.data());
+        }
+
+        if (rc == SQLITE_OK)
+            rc = vss_index_copy_vectors(column, index.get(), "vss_rebuild", &errmsg);
+
+    } catch (faiss::FaissException &e) {
+        errmsg = sqlite3_mprintf("vss_rebuild() failed: %s", e.msg.c_str());
+        rc = SQLITE_ERROR;
+    }
+
+    if (rc != SQLITE_OK) {
+        sqlite3_result_error(context, errmsg != nullptr ? errmsg : sqlite3_errmsg(db), -1);
+        sqlite3_free(errmsg);
+        return;
+    }
+
+    // The _index blob and the factory are committed together.
+    rc = sqlite3_exec(db, "savepoint vss_rebuild", nullptr, nullptr, nullptr);
+    if (rc == SQLITE_OK) {
+
+        // Switching to or from a Vamana factory adds or clears the column's
+        // nodes in the _graph shadow table.
+        auto was_vamana = dynamic_cast<vss_vamana_index *>(column->index) != nullptr;
+        if (dynamic_cast<vss_vamana_index *>(index.get()) != nullptr) {
+            rc = create_graph_table(db, pTable->schema, pTable->name);
+        } else if (was_vamana) {
+            auto sql = sqlite3_mprintf("delete from \"%w\".\"%w_graph\" where col = %d",
+                                       pTable->schema, pTable->name, (int)idxCol);
+            rc = sqlite3_exec(db, sql, nullptr, nullptr, nullptr);
+            sqlite3_free(sql);
+        }
+
+        if (rc == SQLITE_OK)
+            rc = write_index_insert(index.get(),
+                                    db,
+                                    pTable->schema,
+                                    pTable->name,
+                                    idxCol,
+                                    column->name,
+                                    column->storage_type);
+        if (rc != SQLITE_OK)
+            errmsg = sqlite3_mprintf("Error saving index (%d): %s", rc, sqlite3_errmsg(db));
+
+        if (rc == SQLITE_OK)
+            rc = vss_write_factory(pTable, idxCol, definition, &errmsg);
+
+        if (rc == SQLITE_OK)
+            rc = sqlite3_exec(db, "release vss_rebuild", nullptr, nullptr, nullptr);
+        else
+            sqlite3_exec(db, "rollback to vss_rebuild; release vss_rebuild", nullptr, nullptr, nullptr);
+    }
+
+    if (rc != SQLITE_OK) {
+        sqlite3_result_error(context, errmsg != nullptr ? errmsg : sqlite3_errmsg(db), -1);
+        sqlite3_free(errmsg);
+        return;
+    }
+
+    delete column->index;
+    column->index = index.release();
+    column->factory = definition.factory;
+
+    column->last_sync_us = elapsed_us(start);
+    sqlite3_result_int64(context, column->index->ntotal);
+}
+
+#pragma endregion
+
+#pragma region vss_rebalance
+
+// Mean squared L2 distance between the vectors of sample and the IVF
+// centroids they're assigned to, how well the coarse quantizer still fits
+// the data. Negative for binary columns, which have no float centroids.
+static double vss_quantization_error(faiss::Index *index, const vector<float> &sample) {
+
+    auto ivf = dynamic_cast<faiss::IndexIVF *>(unwrap_index(index));
+    if (ivf == nullptr || sample.empty())
+        return -1;
+
+    auto d = index->d;
+    auto n = sample.size() / d;
+
+    // The quantizer of an IVF column sees the vectors after any transform.
+    const float *x = sample.data();
+    unique_ptr<const float[]> transformed;
+    auto inner = index;
+    if (auto idmap = dynamic_cast<faiss::IndexIDMap *>(inner))
+        inner = idmap->index;
+    if (auto pretransform = dynamic_cast<faiss::IndexPreTransform *>(inner)) {
+        auto applied = pretransform->apply_chain(n, x);
+        if (applied != x)
+            transformed.reset(applied);
+        x = applied;
     }
-    return source[idx];
-  }
-  bool eof() {
-    return idx >= len;
-  }
 
-private:
-  string source;
-  int idx;
-  int len;
+    vector<faiss::idx_t> labels(n);
+    ivf->quantizer->assign(n, x, labels.data());
 
-};
+    double sum = 0;
+    vector<float> centroid(ivf->d);
+    for (size_t i = 0; i < n; i++) {
+        ivf->quantizer->reconstruct(labels[i], centroid.data());
+        sum += faiss::fvec_L2sqr(x + i * ivf->d, centroid.data(), ivf->d);
+    }
+    return sum / n;
+}
 
-// Valid chatacters allowed in an identifier, except the 1st character (most be a-zA-Z_)
-bool is_identifier_char(optional<char> c) {
-  if(!c.has_value()) {
-    return false;
-  }
-  return (c >= 'a' && c <= 'z')
-  || (c >= 'A' && c <= 'Z')
-  || (c >= '0' && c <= '9')
-  || (c == '_');
+// One in this many sampled vectors is held out of training, the quantization
+// error is measured on those so the new centroids aren't scored on the
+// vectors they were fit to.
+static const size_t VSS_REBALANCE_HELD_OUT = 10;
+
+static void vss_rebalance_report(sqlite3_str *str, faiss::Index *index, const vector<float> &sample) {
+
+    auto invlists = vss_index_invlists(index);
+    auto error = vss_quantization_error(index, sample);
+
+    sqlite3_str_appendf(str, "{\"imbalance_factor\":%!.9g,\"quantization_error\":",
+                        index->ntotal > 0 ? invlists->imbalance_factor() : 1.0);
+    if (error < 0)
+        sqlite3_str_appendall(str, "null}");
+    else
+        sqlite3_str_appendf(str, "%!.9g}", error);
 }
 
-// sus out the tokens in a vss0 column definition
-vector<Token> tokenize(string source) {
-  vector<Token> tokens;
-  Scanner scanner(source);
-  while (!scanner.eof()) {
-    char c = scanner.advance();
-    if(c == ' ' || c == '\n' || c == '\t') {
-      continue;
+// select vss_rebalance('xyz', 'a', max_imbalance, sample_size)
+//
+// Measures how well the IVF lists of column a fit the vectors it now holds,
+// and retrains it on a fresh sample of them when it drifted: always when
+// max_imbalance is missing or null, otherwise only when the imbalance factor
+// of the lists is above it. The vectors are re-assigned to the new lists in
+// batches, and the new index is swapped in once it's written. Returns a JSON
+// report of the lists before, and after when the column was rebalanced.
+static void vssRebalanceFunc(sqlite3_context *context,
+                             int argc,
+                             sqlite3_value **argv) {
+
+    auto connection = static_cast<vss_connection *>(sqlite3_user_data(context));
+    auto db = sqlite3_context_db_handle(context);
+
+    auto table_name = (const char *)sqlite3_value_text(argv[0]);
+    auto column_name = (const char *)sqlite3_value_text(argv[1]);
+
+    if (table_name == nullptr || column_name == nullptr) {
+        sqlite3_result_error(context, "vss_rebalance() requires a table and a column name", -1);
+        return;
     }
-    else if(c=='(') {
-      tokens.push_back(Token(TokenType::LPAREN));
+
+    auto has_threshold = argc > 2 && sqlite3_value_type(argv[2]) != SQLITE_NULL;
+    auto max_imbalance = has_threshold ? sqlite3_value_double(argv[2]) : 0;
+
+    auto sample_size = argc > 3 ? sqlite3_value_int64(argv[3]) : (sqlite3_int64)VSS_REBUILD_SAMPLE_SIZE;
+    if (sample_size <= 0) {
+        sqlite3_result_error(context, "vss_rebalance() sample_size must be a positive integer", -1);
+        return;
     }
-    else if(c==')') {
-      tokens.push_back(Token(TokenType::RPAREN));
+
+    // Like vss_train(), the new index replaces the old one in memory.
+    if (!sqlite3_get_autocommit(db)) {
+        sqlite3_result_error(context, "vss_rebalance() can't run inside a transaction", -1);
+        return;
     }
-    else if(c=='=') {
-      tokens.push_back(Token(TokenType::EQUAL));
+
+    auto pTable = vss_table_lookup(connection, db, nullptr, table_name);
+    if (pTable == nullptr) {
+        auto errmsg = sqlite3_mprintf("vss_rebalance() could not find vss0 table %s", table_name);
+        sqlite3_result_error(context, errmsg, -1);
+        sqlite3_free(errmsg);
+        return;
     }
-    else if((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) {
-      string identifier;
-      identifier.push_back(c);
-      while (is_identifier_char(scanner.peek())) {
-        identifier.push_back(scanner.advance());
-      }
-      tokens.push_back(Token::IdentifierToken(identifier));
 
+    if (pTable->partitioned()) {
+        auto errmsg = sqlite3_mprintf("vss_rebalance() doesn't support partitioned tables like %s", table_name);
+        sqlite3_result_error(context, errmsg, -1);
+        sqlite3_free(errmsg);
+        return;
     }
-    else if(c >= '0' && c <= '9') {
-      string number_literal;
-      number_literal.push_back(c);
-      optional<char> next;
-      while((next = scanner.peek()) && next.has_value() && next >= '0' && next <= '9') {
-        number_literal.push_back(*next);
-        scanner.advance();
-      }
-      tokens.push_back(Token::IntToken(atoi(number_literal.c_str())));
+
+    size_t idxCol = 0;
+    while (idxCol < pTable->indexes.size() &&
+           sqlite3_stricmp(pTable->indexes[idxCol]->name.c_str(), column_name) != 0)
+        idxCol++;
+
+    if (idxCol == pTable->indexes.size()) {
+        auto errmsg = sqlite3_mprintf("vss_rebalance() table %s has no column %s", table_name, column_name);
+        sqlite3_result_error(context, errmsg, -1);
+        sqlite3_free(errmsg);
+        return;
     }
-    else if (c == '"') {
-      string string_literal;
-      optional<char> next;
-      while(!scanner.eof() && (next = scanner.peek()) && next != '"') {
-        string_literal.push_back(*next);
-        scanner.advance();
-      }
-      if (next == '"') {
-        scanner.advance();
-        tokens.push_back(Token::StringToken(string_literal));
-      }else {
-        throw invalid_argument("unterminated string");
-      }
 
+    auto column = pTable->indexes[idxCol];
+    if (vss_index_invlists(column->index) == nullptr || !column->index->is_trained) {
+        auto errmsg = sqlite3_mprintf("vss_rebalance() column %s isn't a trained IVF index", column_name);
+        sqlite3_result_error(context, errmsg, -1);
+        sqlite3_free(errmsg);
+        return;
     }
-  }
-  return tokens;
-}
 
-static const std::unordered_map<std::string, faiss::MetricType> metric_type_map = {
-        {"L1", faiss::METRIC_L1},
-        {"L2", faiss::METRIC_L2},
-        {"INNER_PRODUCT", faiss::METRIC_INNER_PRODUCT},
-        {"Linf", faiss::METRIC_Linf},
-        // {"Lp", faiss::METRIC_Lp}, unavailable until metric arg is added
-        {"Canberra", faiss::METRIC_Canberra},
-        {"BrayCurtis", faiss::METRIC_BrayCurtis},
-        {"JensenShannon", faiss::METRIC_JensenShannon}
-    };
+    auto start = vss_clock::now();
+    auto str = sqlite3_str_new(db);
+    char *errmsg = nullptr;
+    int rc = SQLITE_OK;
 
-// parse a vss0 column definition. Throws on errors
-VssIndexColumn parse_vss0_column_definition(string source) {
-  string name;
-  sqlite3_int64 dimensions;
-  string factory = "Flat,IDMap2";
-  faiss::MetricType metric_type = faiss::MetricType::METRIC_L2;
-  StorageType storage_type = StorageType::faiss_shadow;
+    try {
 
-  vector<Token> tokens = tokenize(source);
-  std::vector<Token>::iterator it = tokens.begin();
+        std::mt19937_64 rng(std::random_device{}());
+        vector<float> sample;
+        rc = vss_train_sample_stored(column, sample_size, rng, &sample, &errmsg);
+
+        // std::sample() keeps insertion order, shuffled so the held out
+        // vectors aren't just the newest ones.
+        auto d = (size_t)column->index->d;
+        auto n = sample.size() / d;
+        vector<size_t> order(n);
+        std::iota(order.begin(), order.end(), 0);
+        std::shuffle(order.begin(), order.end(), rng);
+
+        auto n_held_out = n >= 2 ? max((size_t)1, n / VSS_REBALANCE_HELD_OUT) : 0;
+        vector<float> training((n - n_held_out) * d), held_out(n_held_out * d);
+        for (size_t i = 0; i < n; i++) {
+            auto target = i < n_held_out ? held_out.data() + i * d : training.data() + (i - n_held_out) * d;
+            copy(sample.begin() + order[i] * d, sample.begin() + (order[i] + 1) * d, target);
+        }
 
-  // STEP 1: expect a column name as a first token (identifier)
-  if(it == tokens.end()) {
-    throw invalid_argument("No tokens available.");
-  }
-  if((*it).token_type != TokenType::IDENTIFIER) {
-    throw invalid_argument("Expected identifier as first token, got ");
-  }
-  name = (*it).identifier_value;
+        auto imbalance = column->index->ntotal > 0 ? vss_index_invlists(column->index)->imbalance_factor() : 1.0;
+        auto rebalance = !training.empty() && (!has_threshold || imbalance > max_imbalance);
 
-  // STEP 2: ensure a '(' immediately follows
-  it++;
-  if(it == tokens.end()) {
-    throw invalid_argument("Expected dimensions after column name declaration");
-  }
-  if((*it).token_type != TokenType::LPAREN) {
-    throw invalid_argument("Expected left parethesis '('");
-  }
+        if (rc == SQLITE_OK && rebalance)
+            rc = vss_check_lossless(column, "vss_rebalance", &errmsg);
 
-  // STEP 3: ensure an integer token (# dimensions) immediately follows
-  it++;
-  if(it == tokens.end()) {
-    throw invalid_argument("Expected dimensions after column name declaration");
-  }
-  if((*it).token_type != TokenType::INTEGER) {
-    throw invalid_argument("Expected integer");
-  }
-  dimensions = (*it).int_value;
+        if (rc == SQLITE_OK) {
+            sqlite3_str_appendf(str, "{\"ntotal\":%lld,\"sample_size\":%lld,\"held_out\":%lld,\"before\":",
+                                (sqlite3_int64)column->index->ntotal, (sqlite3_int64)(n - n_held_out),
+                                (sqlite3_int64)n_held_out);
+            vss_rebalance_report(str, column->index, held_out);
+        }
 
-  // STEP 4: ensure a ')' token immediately follows
-  it++;
-  if(it == tokens.end()) {
-    throw invalid_argument("Expected dimensions after column name declaration");
-  }
-  if((*it).token_type != TokenType::RPAREN) {
-    throw invalid_argument("Expected right parethesis ')'");
-  }
+        if (rc == SQLITE_OK && rebalance)
+            rc = vss_train(pTable, idxCol, training, &errmsg);
 
-  // STEP 5: parse any column options
-  it++;
-  while(it != tokens.end()) {
-    // every column option must start with an identifier
-    if((*it).token_type != TokenType::IDENTIFIER) {
-      throw invalid_argument("Expected an identifier for column arguments");
-    }
-    string key = (*it).identifier_value;
-    if(key != "factory" && key != "metric_type" && key != "storage_type") {
-      throw invalid_argument("Unknown vss0 column option '" + key + "'");
-    }
+        if (rc == SQLITE_OK) {
+            sqlite3_str_appendf(str, ",\"rebalanced\":%s", rebalance ? "true" : "false");
+            if (rebalance) {
+                sqlite3_str_appendall(str, ",\"after\":");
+                vss_rebalance_report(str, column->index, held_out);
+            }
+            sqlite3_str_appendall(str, "}");
+        }
 
-    // ensure it is followed by an '='
-    it++;
-    if(it == tokens.end() || (*it).token_type != TokenType::EQUAL) {
-      throw invalid_argument("Expected '=' ");
+    } catch (faiss::FaissException &e) {
+        errmsg = sqlite3_mprintf("vss_rebalance() failed: %s", e.msg.c_str());
+        rc = SQLITE_ERROR;
     }
 
-    // now parse the value - different legal values for each key
-    it++;
-    if(it == tokens.end()) {
-      throw invalid_argument("Expected column option value for " + key);
+    auto report = sqlite3_str_finish(str);
+
+    if (rc != SQLITE_OK) {
+        sqlite3_free(report);
+        sqlite3_result_error(context, errmsg != nullptr ? errmsg : sqlite3_errmsg(db), -1);
+        sqlite3_free(errmsg);
+        return;
     }
-    if (key == "factory") {
-      if((*it).token_type != TokenType::STRING) {
-        throw invalid_argument("Expected string value for factory column option, got ");
-      }
-      factory = (*it).string_value;
+
+    column->last_sync_us = elapsed_us(start);
+    sqlite3_result_text(context, report, -1, sqlite3_free);
+}
+
+#pragma endregion
+
+#pragma region vss_topk
+
+enum class TopkMetric { l2, l1, linf, inner_product, cosine };
+
+// Inner product and cosine are similarities: the best neighbours have the
+// largest values.
+static bool topk_metric_is_similarity(TopkMetric metric) {
+
+    return metric == TopkMetric::inner_product || metric == TopkMetric::cosine;
+}
+
+// Metric names accepted by vss_topk(), the vss0 metric_type names plus
+// cosine.
+static bool parse_topk_metric(const char *name, TopkMetric *metric) {
+
+    static const std::unordered_map<std::string, TopkMetric> names = {
+        {"L2", TopkMetric::l2},
+        {"L1", TopkMetric::l1},
+        {"Linf", TopkMetric::linf},
+        {"INNER_PRODUCT", TopkMetric::inner_product},
+        {"cosine", TopkMetric::cosine},
+    };
+
+    auto it = names.find(name);
+    if (it == names.end())
+        return false;
+
+    *metric = it->second;
+    return true;
+}
+
+// The k best (score, rowid) pairs pushed so far. A max-heap on the score,
+// which is the distance, or the negated similarity, so its top is always the
+// worst of the pairs kept.
+struct vss_topk_heap {
+
+    sqlite3_int64 k = 0;
+    vector<pair<float, sqlite3_int64>> entries;
+
+    void push(float score, sqlite3_int64 rowid) {
+
+        pair<float, sqlite3_int64> candidate(score, rowid);
+
+        if ((sqlite3_int64)entries.size() < k) {
+            entries.push_back(candidate);
+            push_heap(entries.begin(), entries.end());
+
+        } else if (candidate < entries.front()) {
+            pop_heap(entries.begin(), entries.end());
+            entries.back() = candidate;
+            push_heap(entries.begin(), entries.end());
+        }
     }
-    else if (key == "metric_type") {
-      if((*it).token_type != TokenType::IDENTIFIER) {
-        throw invalid_argument("Expected an identifier value for the 'metric_type' column option");
-      }
-      string value = (*it).identifier_value;
-      auto it2 = metric_type_map.find(value);
 
-      if( it2 == metric_type_map.end())  {
-        throw invalid_argument("Unknown metric type: " + value);
-      }
+    // Best first. Nothing can be pushed afterwards.
+    void sort() { sort_heap(entries.begin(), entries.end()); }
+};
 
-      metric_type = it2->second;
+// Aggregate state of one vss_topk() group.
+struct VssTopk {
+
+    TopkMetric metric;
+    vec_ptr query;
+    float query_norm;
+    vss_topk_heap heap;
+};
+
+// Distance or similarity between a row vector and the query. 'v' blobs of any
+// element type are read in place for the metrics vector-distance.h has
+// kernels for. Returns false after setting an error.
+static bool topk_distance(sqlite3_context *context, vector0_api *vector_api,
+                          VssTopk *topk, sqlite3_value *value, float *distance) {
+
+    auto query = topk->query->data();
+    auto d = (int64_t)topk->query->size();
+    float norm = 0;
+
+    VectorView view;
+    if (topk->metric != TopkMetric::l1 && topk->metric != TopkMetric::linf &&
+        sqlite3_value_type(value) == SQLITE_BLOB &&
+        vectorViewFromBlob(sqlite3_value_blob(value), sqlite3_value_bytes(value), &view)) {
+
+        if (view.size != d) {
+            sqlite3_result_error(context, "vectors passed to vss_topk() must have the size of the query", -1);
+            return false;
+        }
+
+        switch (topk->metric) {
+            case TopkMetric::inner_product:
+                *distance = vectorViewDistanceInnerProduct(view, query);
+                return true;
+            case TopkMetric::cosine:
+                *distance = vectorViewDistanceInnerProduct(view, query);
+                norm = vectorViewDistanceNormL2sqr(view);
+                break;
+            default:
+                *distance = vectorViewDistanceL2sqr(view, query);
+                return true;
+        }
+
+    } else {
+
+        vec_ptr vector = vector_api->xValueAsVector(value);
+        if (vector == nullptr) {
+            sqlite3_result_error(context, "2nd argument to vss_topk() must be a vector", -1);
+            return false;
+        }
+
+        if ((int64_t)vector->size() != d) {
+            sqlite3_result_error(context, "vectors passed to vss_topk() must have the size of the query", -1);
+            return false;
+        }
+
+        switch (topk->metric) {
+            case TopkMetric::l1:
+                *distance = faiss::fvec_L1(vector->data(), query, d);
+                return true;
+            case TopkMetric::linf:
+                *distance = faiss::fvec_Linf(vector->data(), query, d);
+                return true;
+            case TopkMetric::inner_product:
+                *distance = faiss::fvec_inner_product(vector->data(), query, d);
+                return true;
+            case TopkMetric::cosine:
+                *distance = faiss::fvec_inner_product(vector->data(), query, d);
+                norm = faiss::fvec_norm_L2sqr(vector->data(), d);
+                break;
+            default:
+                *distance = faiss::fvec_L2sqr(vector->data(), query, d);
+                return true;
+        }
     }
-    else if (key == "storage_type") {
-      if((*it).token_type != TokenType::IDENTIFIER) {
-        throw invalid_argument("Expected an identifier value for the 'storage_type' column option");
-      }
-      string value = (*it).identifier_value;
-      if(value == "faiss_shadow") {
-        storage_type = StorageType::faiss_shadow;
-      }
-      else if(value == "faiss_ondisk") {
-        storage_type = StorageType::faiss_ondisk;
-      }else {
-        throw invalid_argument("storage_type value must be one of faiss_shadow or faiss_ondisk");
-      }
+
+    if (norm == 0.0f || topk->query_norm == 0.0f) {
+        sqlite3_result_error(context, "One or both vectors are zero-vectors", -1);
+        return false;
     }
 
-    it++;
-  }
-  return VssIndexColumn {
-    name,
-    dimensions,
-    factory,
-    metric_type,
-    storage_type
-  };
+    *distance /= sqrt(norm) * sqrt(topk->query_norm);
+    return true;
 }
 
-unique_ptr<vector<VssIndexColumn>> parse_constructor(int argc,
-                                                     const char* const* argv,
-                                                     sqlite3 *db) {
-    auto columns = unique_ptr<vector<VssIndexColumn>>(new vector<VssIndexColumn>());
+// vss_topk(rowid, vector, query, k [, metric])
+//
+// Exact k nearest neighbours of query among the aggregated rows, as a JSON
+// array of {"rowid", "distance"} objects, nearest first. Only the k best rows
+// are kept while the rows stream by, unlike ORDER BY ... LIMIT k which sorts
+// every distance. query, k and metric are read from the first row of each
+// group. Rows with a null vector are skipped.
+static void vssTopkStep(sqlite3_context *context, int argc, sqlite3_value **argv) {
+
+    auto state = (VssTopk **)sqlite3_aggregate_context(context, sizeof(VssTopk *));
+    if (state == nullptr) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
 
-    for (int i = 3; i < argc; i++) {
-        auto column = parse_vss0_column_definition(string(argv[i]));
-        if (column.storage_type == StorageType::faiss_ondisk && sqlite3_db_filename(db, "main")[0] == '\0') {
-            throw invalid_argument("Cannot use on disk storage for in memory db");
+    auto vector_api = (vector0_api *)sqlite3_user_data(context);
+
+    if (*state == nullptr) {
+
+        if (sqlite3_value_type(argv[3]) != SQLITE_INTEGER || sqlite3_value_int64(argv[3]) <= 0) {
+            sqlite3_result_error(context, "4th argument to vss_topk() must be a positive integer", -1);
+            return;
         }
-        columns->push_back(column);
+
+        TopkMetric metric = TopkMetric::l2;
+        if (argc > 4 && sqlite3_value_type(argv[4]) != SQLITE_NULL &&
+            !parse_topk_metric((const char *)sqlite3_value_text(argv[4]), &metric)) {
+            sqlite3_result_error(context, "5th argument to vss_topk() must be one of L2, L1, Linf, INNER_PRODUCT or cosine", -1);
+            return;
+        }
+
+        vec_ptr query = vector_api->xValueAsVector(argv[2]);
+        if (query == nullptr) {
+            sqlite3_result_error(context, "3rd argument to vss_topk() must be a vector", -1);
+            return;
+        }
+
+        auto topk = new VssTopk();
+        topk->heap.k = sqlite3_value_int64(argv[3]);
+        topk->metric = metric;
+        topk->query_norm = faiss::fvec_norm_L2sqr(query->data(), query->size());
+        topk->query = move(query);
+
+        // Don't reserve k up front, it may be much larger than the group.
+        *state = topk;
     }
 
-    return columns;
-}
+    if (sqlite3_value_type(argv[1]) == SQLITE_NULL)
+        return;
+
+    auto topk = *state;
 
-static int init(sqlite3 *db,
-                void *pAux,
-                int argc,
-                const char *const *argv,
-                sqlite3_vtab **ppVtab,
-                char **pzErr,
-                bool isCreate) {
+    float distance;
+    if (!topk_distance(context, vector_api, topk, argv[1], &distance))
+        return;
 
-    sqlite3_vtab_config(db, SQLITE_VTAB_CONSTRAINT_SUPPORT, 1);
-    int rc;
+    topk->heap.push(topk_metric_is_similarity(topk->metric) ? -distance : distance,
+               sqlite3_value_int64(argv[0]));
+}
 
-    sqlite3_str *str = sqlite3_str_new(nullptr);
-    sqlite3_str_appendall(str,
-                          "create table x(distance hidden, operation hidden");
+static void vssTopkFinal(sqlite3_context *context) {
 
-    unique_ptr<vector<VssIndexColumn>> columns;
-    try {
-        columns = parse_constructor(argc, argv, db);
-    } catch (const invalid_argument& e) {
-        *pzErr = sqlite3_mprintf("Error parsing constructor: %s", e.what());
-        return SQLITE_ERROR;
-    }
+    auto state = (VssTopk **)sqlite3_aggregate_context(context, 0);
+    auto topk = state != nullptr ? *state : nullptr;
 
-    if (columns == nullptr) {
-        *pzErr = sqlite3_mprintf("Error parsing constructor");
-        return rc;
+    if (topk == nullptr) {
+        sqlite3_result_text(context, "[]", -1, SQLITE_STATIC);
+        return;
     }
 
-    for (auto column = columns->begin(); column != columns->end(); ++column) {
-        sqlite3_str_appendf(str, ", \"%w\"", column->name.c_str());
-    }
+    topk->heap.sort();
 
-    sqlite3_str_appendall(str, ")");
-    auto sql = sqlite3_str_finish(str);
-    rc = sqlite3_declare_vtab(db, sql);
-    sqlite3_free(sql);
+    auto str = sqlite3_str_new(sqlite3_context_db_handle(context));
+    sqlite3_str_appendchar(str, 1, '[');
 
-#define VSS_INDEX_COLUMN_DISTANCE 0
-#define VSS_INDEX_COLUMN_OPERATION 1
-#define VSS_INDEX_COLUMN_VECTORS 2
+    for (size_t i = 0; i < topk->heap.entries.size(); i++) {
 
-    if (rc != SQLITE_OK)
-        return rc;
+        auto &entry = topk->heap.entries[i];
+        float distance = topk_metric_is_similarity(topk->metric) ? -entry.first : entry.first;
 
-    auto pTable = new vss_index_vtab(db,
-                                     (vector0_api *)pAux,
-                                     sqlite3_mprintf("%s", argv[1]),
-                                     sqlite3_mprintf("%s", argv[2]));
-    *ppVtab = pTable;
+        sqlite3_str_appendf(str, "%s{\"rowid\":%lld,\"distance\":%!.9g}",
+                            i > 0 ? "," : "", entry.second, (double)distance);
+    }
+    sqlite3_str_appendchar(str, 1, ']');
 
-    if (isCreate) {
+    delete topk;
+    *state = nullptr;
 
-        for (auto iter = columns->begin(); iter != columns->end(); ++iter) {
+    auto rc = sqlite3_str_errcode(str);
+    if (rc != SQLITE_OK) {
+        sqlite3_free(sqlite3_str_finish(str));
+        sqlite3_result_error_code(context, rc);
+        return;
+    }
 
-            try {
+    sqlite3_result_text(context, sqlite3_str_finish(str), -1, sqlite3_free);
+}
 
-                auto index = faiss::index_factory(iter->dimensions, iter->factory.c_str(), iter->metric);
-                pTable->indexes.push_back(new vss_index(index, iter->name, iter->storage_type));
+#pragma endregion
 
-            } catch (faiss::FaissException &e) {
+#pragma region Clustering
 
-                *pzErr = sqlite3_mprintf("Error building index factory for %s: %s",
-                                         iter->name.c_str(),
-                                         e.msg.c_str());
+// State of a vss_kmeans() aggregate, allocated by the first row. Vectors are
+// buffered in one contiguous arena, the layout faiss::Clustering trains on.
+struct VssKmeans {
 
-                return SQLITE_ERROR;
-            }
-        }
+    size_t d = 0;
+    sqlite3_int64 rows = 0;
+    sqlite3_int64 k = 0;
+    int niter = 25;
+    vector<float> data;
+};
 
-        rc = create_shadow_tables(db, argv[1], argv[2], pTable->indexes);
-        if (rc != SQLITE_OK){
-          *pzErr = sqlite3_mprintf("Error creating shadow tables");
-          return rc;
-        }
+// vss_kmeans(vector, k [, niter])
+static void vssKmeansStep(sqlite3_context *context, int argc, sqlite3_value **argv) {
+
+    auto state = (VssKmeans **)sqlite3_aggregate_context(context, sizeof(VssKmeans *));
+    if (state == nullptr) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
 
+    auto vector_api = (vector0_api *)sqlite3_user_data(context);
 
-        // Shadow tables were successully created.
-        // After shadow tables are created, write the initial index state to
-        // shadow _index.
-        auto i = 0;
-        for (auto iter = pTable->indexes.begin(); iter != pTable->indexes.end(); ++iter, i++) {
+    vec_ptr vector = vector_api->xValueAsVector(argv[0]);
+    if (vector == nullptr) {
 
-            try {
+        // Vector pointers are NULL to SQL, so this is checked second.
+        if (sqlite3_value_type(argv[0]) == SQLITE_NULL)
+            return;
 
-                int rc = write_index_insert((*iter)->index,
-                                            pTable->db,
-                                            pTable->schema,
-                                            pTable->name,
-                                            i,
-                                            (*iter)->name,
-                                            (*iter)->storage_type);
+        sqlite3_result_error(context, "vss_kmeans() value is not a vector", -1);
+        return;
+    }
 
-                if (rc != SQLITE_OK) {
-                  *pzErr = sqlite3_mprintf("Error initializing _index shadow tables");
-                  return rc;
-                }
+    if (*state == nullptr) {
 
-            } catch (faiss::FaissException &e) {
-              *pzErr = sqlite3_mprintf("Faiss error when initializing shadow tables: %s", e.what());
-                return SQLITE_ERROR;
-            }
+        if (sqlite3_value_type(argv[1]) != SQLITE_INTEGER || sqlite3_value_int64(argv[1]) <= 0) {
+            sqlite3_result_error(context, "2nd argument to vss_kmeans() must be a positive integer", -1);
+            return;
         }
 
-    } else {
+        if (argc > 2 && (sqlite3_value_type(argv[2]) != SQLITE_INTEGER || sqlite3_value_int(argv[2]) <= 0)) {
+            sqlite3_result_error(context, "3rd argument to vss_kmeans() must be a positive integer", -1);
+            return;
+        }
 
-        for (int i = 0; i < columns->size(); i++) {
+        auto kmeans = new VssKmeans();
+        kmeans->d = vector->size();
+        kmeans->k = sqlite3_value_int64(argv[1]);
+        if (argc > 2)
+            kmeans->niter = sqlite3_value_int(argv[2]);
+        *state = kmeans;
+    }
 
-            auto index = read_index_select(db, argv[1], argv[2], i, (*columns)[i].name, (*columns)[i].storage_type);
+    auto kmeans = *state;
 
-            // Index in shadow table should always be available, integrity check
-            // to avoid null pointer
-            if (index == nullptr) {
-                *pzErr = sqlite3_mprintf("Could not read index at position %d", i);
-                return SQLITE_ERROR;
-            }
-            pTable->indexes.push_back(new vss_index(index));
-        }
+    if (vector->size() != kmeans->d) {
+        auto errmsg = sqlite3_mprintf("vss_kmeans() vectors must all have %lld dimensions, got one with %lld",
+                                      (sqlite3_int64)kmeans->d, (sqlite3_int64)vector->size());
+        sqlite3_result_error(context, errmsg, -1);
+        sqlite3_free(errmsg);
+        return;
     }
 
-    return SQLITE_OK;
+    kmeans->data.insert(kmeans->data.end(), vector->begin(), vector->end());
+    kmeans->rows++;
 }
 
-static int vssIndexCreate(sqlite3 *db, void *pAux,
-                          int argc,
-                          const char *const *argv,
-                          sqlite3_vtab **ppVtab,
-                          char **pzErr) {
+// Runs faiss::Clustering, multi-threaded through faiss's own OpenMP loops,
+// and returns the k centroids as a matrix blob. NULL when there were no rows.
+static void vssKmeansFinal(sqlite3_context *context) {
 
-    return init(db, pAux, argc, argv, ppVtab, pzErr, true);
-}
+    auto state = (VssKmeans **)sqlite3_aggregate_context(context, 0);
+    unique_ptr<VssKmeans> kmeans(state != nullptr ? *state : nullptr);
 
-static int vssIndexConnect(sqlite3 *db,
-                           void *pAux, int argc,
-                           const char *const *argv,
-                           sqlite3_vtab **ppVtab,
-                           char **pzErr) {
+    if (kmeans == nullptr) {
+        sqlite3_result_null(context);
+        return;
+    }
 
-    return init(db, pAux, argc, argv, ppVtab, pzErr, false);
-}
+    auto vector_api = (vector0_api *)sqlite3_user_data(context);
+    if (vector_api->iVersion < 2) {
+        sqlite3_result_error(context, "vss_kmeans() requires a newer vector0 extension", -1);
+        return;
+    }
 
-static int vssIndexDisconnect(sqlite3_vtab *pVtab) {
+    if (kmeans->rows < kmeans->k) {
+        auto errmsg = sqlite3_mprintf("vss_kmeans() needs at least %lld vectors for %lld centroids, got %lld",
+                                      kmeans->k, kmeans->k, kmeans->rows);
+        sqlite3_result_error(context, errmsg, -1);
+        sqlite3_free(errmsg);
+        return;
+    }
 
-    auto pTable = static_cast<vss_index_vtab *>(pVtab);
-    delete pTable;
-    return SQLITE_OK;
-}
+    try {
+        faiss::Clustering clustering(kmeans->d, kmeans->k);
+        clustering.niter = kmeans->niter;
 
-static int vssIndexDestroy(sqlite3_vtab *pVtab) {
+        faiss::IndexFlatL2 index(kmeans->d);
+        clustering.train(kmeans->rows, kmeans->data.data(), index);
 
-    auto pTable = static_cast<vss_index_vtab *>(pVtab);
-    drop_shadow_tables(pTable->db, pTable->name);
-    vssIndexDisconnect(pVtab);
-    return SQLITE_OK;
-}
+        vector_api->xResultMatrix(context, clustering.centroids.data(), kmeans->k, kmeans->d);
 
-static int vssIndexOpen(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor) {
+    } catch (faiss::FaissException &e) {
+        auto errmsg = sqlite3_mprintf("vss_kmeans() failed: %s", e.msg.c_str());
+        sqlite3_result_error(context, errmsg, -1);
+        sqlite3_free(errmsg);
+    }
+}
 
-    auto pTable = static_cast<vss_index_vtab *>(pVtab);
+// Centroids of a vss_assign() call, decoded once per statement when they're
+// constant.
+struct VssCentroids {
 
-    auto pCursor = new vss_index_cursor(pTable);
-    if (pCursor == nullptr)
-        return SQLITE_NOMEM;
+    int64_t rows;
+    int64_t d;
+    vector<float> data;
+};
 
-    *ppCursor = pCursor;
+void delVssCentroids(void *p) {
 
-    return SQLITE_OK;
+    auto self = static_cast<VssCentroids *>(p);
+    delete self;
 }
 
-static int vssIndexClose(sqlite3_vtab_cursor *cur) {
-
-    auto pCursor = static_cast<vss_index_cursor *>(cur);
-    delete pCursor;
-    return SQLITE_OK;
-}
+// vss_assign(vector, centroids)
+//
+// Position of the centroid nearest to vector, by L2 distance, in a matrix
+// blob of centroids like vss_kmeans() returns. Starts at 0.
+static void vss_assign(sqlite3_context *context, int argc, sqlite3_value **argv) {
 
-static int vssIndexBestIndex(sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo) {
+    auto vector_api = (vector0_api *)sqlite3_user_data(context);
 
-    int iSearchTerm = -1;
-    int iRangeSearchTerm = -1;
-    int iXSearchColumn = -1;
-    int iLimit = -1;
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        sqlite3_result_null(context);
+        return;
+    }
 
-    for (int i = 0; i < pIdxInfo->nConstraint; i++) {
+    auto centroids = static_cast<VssCentroids *>(sqlite3_get_auxdata(context, 1));
+    VssCentroids *decoded = nullptr;
 
-        auto constraint = pIdxInfo->aConstraint[i];
+    if (centroids == nullptr) {
 
-        if (!constraint.usable)
-            continue;
+        int64_t rows, d;
+        const char *pzErrMsg = "Matrix must be a blob";
+        const void *data = vector_api->iVersion >= 1
+            ? vector_api->xValueAsMatrix(argv[1], &rows, &d, &pzErrMsg)
+            : nullptr;
 
-        if (constraint.op == VSS_SEARCH_FUNCTION) {
+        if (data == nullptr) {
+            auto errmsg = sqlite3_mprintf("2nd argument to vss_assign() must be a matrix: %s", pzErrMsg);
+            sqlite3_result_error(context, errmsg, -1);
+            sqlite3_free(errmsg);
+            return;
+        }
 
-            iSearchTerm = i;
-            iXSearchColumn = constraint.iColumn;
+        if (rows == 0) {
+            sqlite3_result_error(context, "vss_assign() needs at least one centroid", -1);
+            return;
+        }
 
-        } else if (constraint.op == VSS_RANGE_SEARCH_FUNCTION) {
+        centroids = decoded = new VssCentroids();
+        centroids->rows = rows;
+        centroids->d = d;
+        centroids->data.resize(rows * d);
+        memcpy(centroids->data.data(), data, centroids->data.size() * sizeof(float));
+    }
 
-            iRangeSearchTerm = i;
-            iXSearchColumn = constraint.iColumn;
+    vec_ptr query = vector_api->xValueAsVector(argv[0]);
 
-        } else if (constraint.op == SQLITE_INDEX_CONSTRAINT_LIMIT) {
-            iLimit = i;
-        }
+    if (query == nullptr) {
+        sqlite3_result_error(context, "1st argument to vss_assign() must be a vector", -1);
+    } else if ((int64_t)query->size() != centroids->d) {
+        auto errmsg = sqlite3_mprintf("vss_assign() vector has %lld dimensions, the centroids have %lld",
+                                      (sqlite3_int64)query->size(), (sqlite3_int64)centroids->d);
+        sqlite3_result_error(context, errmsg, -1);
+        sqlite3_free(errmsg);
+    } else {
+        vector<float> distances(centroids->rows);
+        faiss::fvec_L2sqr_ny(distances.data(), query->data(), centroids->data.data(),
+                             centroids->d, centroids->rows);
+        sqlite3_result_int64(context, min_element(distances.begin(), distances.end()) - distances.begin());
     }
 
-    if (iSearchTerm >= 0) {
+    // Last, SQLite may free them right away.
+    if (decoded != nullptr)
+        sqlite3_set_auxdata(context, 1, decoded, delVssCentroids);
+}
 
-        pIdxInfo->idxNum = iXSearchColumn - VSS_INDEX_COLUMN_VECTORS;
-        pIdxInfo->idxStr = (char *)"search";
-        pIdxInfo->aConstraintUsage[iSearchTerm].argvIndex = 1;
-        pIdxInfo->aConstraintUsage[iSearchTerm].omit = 1;
-        if (iLimit >= 0) {
-            pIdxInfo->aConstraintUsage[iLimit].argvIndex = 2;
-            pIdxInfo->aConstraintUsage[iLimit].omit = 1;
-        }
-        pIdxInfo->estimatedCost = 300.0;
-        pIdxInfo->estimatedRows = 10;
+#pragma endregion
 
-        return SQLITE_OK;
+#pragma region vss_knn vtab
+
+// Source vectors are compared to the queries in blocks of about this many
+// bytes, each one a single call to faiss's blocked distance kernels.
+static const size_t VSS_KNN_BLOCK_BYTES = 32 * 1024 * 1024;
+
+struct vssKnn_vtab : public sqlite3_vtab {
+
+    vssKnn_vtab(sqlite3 *db, vector0_api *vector_api) : db(db), vector_api(vector_api) {
+
+        pModule = nullptr;
+        nRef = 0;
+        zErrMsg = nullptr;
     }
 
-    if (iRangeSearchTerm >= 0) {
+    ~vssKnn_vtab() {
 
-        pIdxInfo->idxNum = iXSearchColumn - VSS_INDEX_COLUMN_VECTORS;
-        pIdxInfo->idxStr = (char *)"range_search";
-        pIdxInfo->aConstraintUsage[iRangeSearchTerm].argvIndex = 1;
-        pIdxInfo->aConstraintUsage[iRangeSearchTerm].omit = 1;
-        pIdxInfo->estimatedCost = 300.0;
-        pIdxInfo->estimatedRows = 10;
-        return SQLITE_OK;
+        if (zErrMsg != nullptr)
+            sqlite3_free(zErrMsg);
     }
 
-    pIdxInfo->idxNum = -1;
-    pIdxInfo->idxStr = (char *)"fullscan";
-    pIdxInfo->estimatedCost = 3000000.0;
-    pIdxInfo->estimatedRows = 100000;
-    return SQLITE_OK;
-}
+    sqlite3 *db;
+    vector0_api *vector_api;
+};
 
-static int vssIndexFilter(sqlite3_vtab_cursor *pVtabCursor,
-                          int idxNum,
-                          const char *idxStr,
-                          int argc,
-                          sqlite3_value **argv) {
+struct vss_knn_result {
 
-    auto pCursor = static_cast<vss_index_cursor *>(pVtabCursor);
+    sqlite3_int64 query_idx;
+    sqlite3_int64 rowid;
+    float distance;
+};
 
-    if (strcmp(idxStr, "search") == 0) {
+struct vssKnn_cursor : public sqlite3_vtab_cursor {
 
-        pCursor->query_type = QueryType::search;
-        vec_ptr query_vector;
+    explicit vssKnn_cursor(sqlite3_vtab *pVtab) : iRowid(0) {
 
-        auto params = static_cast<VssSearchParams *>(sqlite3_value_pointer(argv[0], "vss0_searchparams"));
-        if (params != nullptr) {
+        this->pVtab = pVtab;
+    }
 
-            pCursor->limit = params->k;
-            query_vector = vec_ptr(new vector<float>(*params->vector));
+    sqlite3_int64 iRowid;
+    vector<vss_knn_result> results;
+};
 
-        } else if (sqlite3_libversion_number() < 3041000) {
+static int vssKnnConnect(sqlite3 *db,
+                         void *pAux,
+                         int argc,
+                         const char *const *argv,
+                         sqlite3_vtab **ppVtab,
+                         char **pzErr) {
+
+    int rc = sqlite3_declare_vtab(db,
+        "create table x(query_idx, rowid, distance, "
+        "source hidden, column_name hidden, queries hidden, k hidden, metric hidden)");
+
+#define VSS_KNN_QUERY_IDX 0
+#define VSS_KNN_ROWID 1
+#define VSS_KNN_DISTANCE 2
+#define VSS_KNN_SOURCE 3
+#define VSS_KNN_COLUMN_NAME 4
+#define VSS_KNN_QUERIES 5
+#define VSS_KNN_K 6
+#define VSS_KNN_METRIC 7
+
+    // Runs arbitrary SQL, like vss_explain(), so never from a schema.
+    if (rc == SQLITE_OK)
+        rc = sqlite3_vtab_config(db, SQLITE_VTAB_DIRECTONLY);
+
+    if (rc == SQLITE_OK) {
+
+        auto pNew = new vssKnn_vtab(db, (vector0_api *)pAux);
+        if (pNew == nullptr)
+            return SQLITE_NOMEM;
+
+        *ppVtab = pNew;
+    }
+    return rc;
+}
 
-            // https://sqlite.org/forum/info/6b32f818ba1d97ef
-            sqlite3_free(pVtabCursor->pVtab->zErrMsg);
-            pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf(
-                "vss_search() only support vss_search_params() as a "
-                "2nd parameter for SQLite versions below 3.41.0");
-            return SQLITE_ERROR;
+static int vssKnnDisconnect(sqlite3_vtab *pVtab) {
 
-        } else if ((query_vector = pCursor->table->vector_api->xValueAsVector(
-                        argv[0])) != nullptr) {
+    auto pTable = static_cast<vssKnn_vtab *>(pVtab);
+    delete pTable;
+    return SQLITE_OK;
+}
 
-            if (argc > 1) {
-                pCursor->limit = sqlite3_value_int(argv[1]);
-            } else {
-                sqlite3_free(pVtabCursor->pVtab->zErrMsg);
-                pVtabCursor->pVtab->zErrMsg =
-                    sqlite3_mprintf("LIMIT required on vss_search() queries");
-                return SQLITE_ERROR;
-            }
+static int vssKnnOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
 
-        } else {
+    auto pCur = new vssKnn_cursor(p);
+    if (pCur == nullptr)
+        return SQLITE_NOMEM;
 
-            if (pVtabCursor->pVtab->zErrMsg != nullptr)
-                sqlite3_free(pVtabCursor->pVtab->zErrMsg);
+    *ppCursor = pCur;
+    return SQLITE_OK;
+}
 
-            pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf(
-                "2nd argument to vss_search() must be a vector");
-            return SQLITE_ERROR;
-        }
+static int vssKnnClose(sqlite3_vtab_cursor *cur) {
+
+    auto pCur = static_cast<vssKnn_cursor *>(cur);
+    delete pCur;
+    return SQLITE_OK;
+}
 
-        int nq = 1;
-        auto index = pCursor->table->indexes.at(idxNum)->index;
+// idxNum has bit (column - VSS_KNN_SOURCE) set for every argument given, the
+// arguments are passed to xFilter in column order.
+static int vssKnnBestIndex(sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo) {
 
-        if (query_vector->size() != index->d) {
+    int positions[VSS_KNN_METRIC - VSS_KNN_SOURCE + 1] = {-1, -1, -1, -1, -1};
 
-            // TODO: To support index that transforms vectors
-            // (to conserve spage, eg?), we should probably
-            // have some logic in place that transforms the vectors here?
-            sqlite3_free(pVtabCursor->pVtab->zErrMsg);
-            pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf(
-                "Input query size doesn't match index dimensions: %ld != %ld",
-                query_vector->size(),
-                index->d);
-            return SQLITE_ERROR;
-        }
+    for (int i = 0; i < pIdxInfo->nConstraint; i++) {
 
-        if (pCursor->limit <= 0) {
+        auto pCons = pIdxInfo->aConstraint[i];
 
-            sqlite3_free(pVtabCursor->pVtab->zErrMsg);
-            pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf(
-                "Limit must be greater than 0, got %ld", pCursor->limit);
-            return SQLITE_ERROR;
+        if (pCons.iColumn >= VSS_KNN_SOURCE &&
+            pCons.op == SQLITE_INDEX_CONSTRAINT_EQ) {
+
+            // Arguments of a table-valued function are always usable, an
+            // unusable one means a join is asking for another plan.
+            if (!pCons.usable)
+                return SQLITE_CONSTRAINT;
+
+            positions[pCons.iColumn - VSS_KNN_SOURCE] = i;
         }
+    }
 
-        // To avoid trying to select more records than number of records in index.
-        auto searchMax = min(static_cast<faiss::idx_t>(pCursor->limit) * nq, index->ntotal * nq);
+    int idxNum = 0;
+    int argvIndex = 0;
+    for (int column = 0; column <= VSS_KNN_METRIC - VSS_KNN_SOURCE; column++) {
 
-        pCursor->search_distances = vector<float>(searchMax, 0);
-        pCursor->search_ids = vector<faiss::idx_t>(searchMax, 0);
+        if (positions[column] < 0)
+            continue;
 
-        index->search(nq,
-                      query_vector->data(),
-                      searchMax,
-                      pCursor->search_distances.data(),
-                      pCursor->search_ids.data());
+        idxNum |= 1 << column;
+        pIdxInfo->aConstraintUsage[positions[column]].argvIndex = ++argvIndex;
+        pIdxInfo->aConstraintUsage[positions[column]].omit = 1;
+    }
 
-    } else if (strcmp(idxStr, "range_search") == 0) {
+    pIdxInfo->idxNum = idxNum;
+    pIdxInfo->estimatedCost = (double)1000000;
+    pIdxInfo->estimatedRows = 100;
+    return SQLITE_OK;
+}
 
-        pCursor->query_type = QueryType::range_search;
+// Prepares the statement the source vectors are read from, with the rowid in
+// its first column. A table name reads rowid and column_name from that table.
+// A query reads its rowids from its first result column, and its vectors from
+// the result column called column_name, or the second one when it's null.
+// Errors name the calling function.
+static sqlite3_stmt *vss_knn_source(sqlite3 *db,
+                                    const char *function,
+                                    sqlite3_value *source,
+                                    sqlite3_value *column_name,
+                                    int *vector_column,
+                                    char **errmsg) {
+
+    sqlite3_stmt *stmt = nullptr;
+    auto text = (const char *)sqlite3_value_text(source);
+    auto column = (const char *)sqlite3_value_text(column_name);
+
+    if (sqlite3_value_type(source) != SQLITE_TEXT) {
+        *errmsg = sqlite3_mprintf("source of %s() must be a table name or a query", function);
+        return nullptr;
+    }
 
-        auto params = static_cast<VssRangeSearchParams *>(
-            sqlite3_value_pointer(argv[0], "vss0_rangesearchparams"));
+    if (!vss_bulk_load_is_query(text)) {
 
-        int nq = 1;
+        if (column == nullptr) {
+            *errmsg = sqlite3_mprintf("%s() needs the name of the vector column of table %s", function, text);
+            return nullptr;
+        }
 
-        vector<faiss::idx_t> nns(params->distance * nq);
-        pCursor->range_search_result = unique_ptr<faiss::RangeSearchResult>(new faiss::RangeSearchResult(nq, true));
+        auto sql = sqlite3_mprintf("select rowid, \"%w\" from \"%w\"", column, text);
+        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
+        sqlite3_free(sql);
 
-        auto index = pCursor->table->indexes.at(idxNum)->index;
+        if (rc != SQLITE_OK) {
+            *errmsg = sqlite3_mprintf("%s() could not read source: %s", function, sqlite3_errmsg(db));
+            return nullptr;
+        }
 
-        index->range_search(nq,
-                            params->vector->data(),
-                            params->distance,
-                            pCursor->range_search_result.get());
+        *vector_column = 1;
+        return stmt;
+    }
 
-    } else if (strcmp(idxStr, "fullscan") == 0) {
+    const char *tail = nullptr;
+    int rc = sqlite3_prepare_v2(db, text, -1, &stmt, &tail);
 
-        pCursor->query_type = QueryType::fullscan;
-        sqlite3_stmt *stmt;
+    while (rc == SQLITE_OK && tail != nullptr && isspace((unsigned char)*tail))
+        tail++;
 
-        int res = sqlite3_prepare_v2(
-            pCursor->table->db,
-            sqlite3_mprintf("select rowid from \"%w_data\"", pCursor->table->name),
-            -1, &pCursor->stmt, nullptr);
+    if (rc != SQLITE_OK) {
+        *errmsg = sqlite3_mprintf("%s() could not read source: %s", function, sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return nullptr;
+    }
 
-        if (res != SQLITE_OK)
-            return res;
+    if (tail != nullptr && *tail != '\0') {
+        *errmsg = sqlite3_mprintf("%s() accepts a single statement", function);
+        sqlite3_finalize(stmt);
+        return nullptr;
+    }
 
-        pCursor->step_result = sqlite3_step(pCursor->stmt);
+    // The source is only ever read.
+    if (!sqlite3_stmt_readonly(stmt)) {
+        *errmsg = sqlite3_mprintf("%s() source query must be read-only", function);
+        sqlite3_finalize(stmt);
+        return nullptr;
+    }
 
-    } else {
+    *vector_column = -1;
+    if (column == nullptr && sqlite3_column_count(stmt) >= 2)
+        *vector_column = 1;
 
-        if (pVtabCursor->pVtab->zErrMsg != 0)
-            sqlite3_free(pVtabCursor->pVtab->zErrMsg);
+    for (int i = 1; column != nullptr && i < sqlite3_column_count(stmt); i++) {
+        if (sqlite3_stricmp(sqlite3_column_name(stmt, i), column) == 0)
+            *vector_column = i;
+    }
 
-        pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf(
-            "%s %s", "vssIndexFilter error: unhandled idxStr", idxStr);
-        return SQLITE_ERROR;
+    if (*vector_column < 0) {
+        *errmsg = column == nullptr
+            ? sqlite3_mprintf("%s() query must return a rowid and a vector", function)
+            : sqlite3_mprintf("%s() query has no %s column after its rowid", function, column);
+        sqlite3_finalize(stmt);
+        return nullptr;
     }
 
-    pCursor->iCurrent = 0;
-    return SQLITE_OK;
+    return stmt;
 }
 
-static int vssIndexNext(sqlite3_vtab_cursor *cur) {
+// Exact search of every query against every source vector. Each block of
+// source vectors goes through faiss::knn_L2sqr() or knn_inner_product(),
+// which use BLAS matrix multiplies across all cores for large enough query
+// sets, and its k best per query are merged into one bounded heap per query.
+static int vss_knn(sqlite3 *db,
+                   vector0_api *vector_api,
+                   sqlite3_stmt *source,
+                   int vector_column,
+                   vector<float> &queries,
+                   size_t d,
+                   sqlite3_int64 k,
+                   TopkMetric metric,
+                   vector<vss_knn_result> &results,
+                   char **errmsg) {
+
+    auto nq = queries.size() / d;
+    auto similarity = topk_metric_is_similarity(metric);
+
+    if (metric == TopkMetric::cosine)
+        faiss::fvec_renorm_L2(d, nq, queries.data());
+
+    vector<vss_topk_heap> heaps(nq);
+    for (auto &heap : heaps)
+        heap.k = k;
+
+    auto block_size = max((size_t)1, VSS_KNN_BLOCK_BYTES / (d * sizeof(float)));
+    vector<float> block;
+    vector<sqlite3_int64> block_rowids;
+    block.reserve(block_size * d);
+    block_rowids.reserve(block_size);
+
+    auto block_k = (size_t)min(k, (sqlite3_int64)block_size);
+    vector<float> distances(nq * block_k);
+    vector<faiss::idx_t> labels(nq * block_k);
+
+    auto flush = [&]() {
+
+        auto ny = block_rowids.size();
+        if (ny == 0)
+            return;
+
+        auto kb = min(block_k, ny);
+        if (metric == TopkMetric::cosine)
+            faiss::fvec_renorm_L2(d, ny, block.data());
+
+        if (similarity)
+            faiss::knn_inner_product(queries.data(), block.data(), d, nq, ny, kb,
+                                     distances.data(), labels.data());
+        else
+            faiss::knn_L2sqr(queries.data(), block.data(), d, nq, ny, kb,
+                             distances.data(), labels.data());
+
+        for (size_t q = 0; q < nq; q++) {
+            for (size_t j = 0; j < kb; j++) {
+
+                auto label = labels[q * kb + j];
+                if (label < 0)
+                    continue;
+
+                auto distance = distances[q * kb + j];
+                heaps[q].push(similarity ? -distance : distance, block_rowids[label]);
+            }
+        }
 
-    auto pCursor = static_cast<vss_index_cursor *>(cur);
+        block.clear();
+        block_rowids.clear();
+    };
 
-    switch (pCursor->query_type) {
+    int rc;
+    while ((rc = sqlite3_step(source)) == SQLITE_ROW) {
 
-      case QueryType::search:
-      case QueryType::range_search:
-          pCursor->iCurrent++;
-          break;
+        auto value = sqlite3_column_value(source, vector_column);
+        if (sqlite3_value_type(value) == SQLITE_NULL)
+            continue;
 
-      case QueryType::fullscan:
-          pCursor->step_result = sqlite3_step(pCursor->stmt);
-    }
+        auto rowid = sqlite3_column_int64(source, 0);
+
+        // Vectors from vector_vecs_each() and the other vector0 functions are
+        // pointers, copy them straight into the block.
+        auto pointer = (VectorFloat *)sqlite3_value_pointer(value, "vectorf32v0");
+        vec_ptr decoded;
+
+        const float *data;
+        size_t size;
+        if (pointer != nullptr) {
+            data = pointer->data;
+            size = pointer->size;
+        } else if ((decoded = vector_api->xValueAsVector(value)) != nullptr) {
+            data = decoded->data();
+            size = decoded->size();
+        } else {
+            *errmsg = sqlite3_mprintf("vss_knn() value for rowid %lld is not a vector", rowid);
+            return SQLITE_ERROR;
+        }
 
-    return SQLITE_OK;
-}
+        if (size != d) {
+            *errmsg = sqlite3_mprintf("vss_knn() vector for rowid %lld has %lld dimensions, expected %lld",
+                                      rowid, (sqlite3_int64)size, (sqlite3_int64)d);
+            return SQLITE_ERROR;
+        }
 
-static int vssIndexRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+        block.insert(block.end(), data, data + d);
+        block_rowids.push_back(rowid);
 
-    auto pCursor = static_cast<vss_index_cursor *>(cur);
+        if (block_rowids.size() == block_size)
+            flush();
+    }
 
-    switch (pCursor->query_type) {
+    if (rc != SQLITE_DONE) {
+        *errmsg = sqlite3_mprintf("vss_knn() could not read source: %s", sqlite3_errmsg(db));
+        return rc;
+    }
 
-        case QueryType::search:
-            *pRowid = pCursor->search_ids.at(pCursor->iCurrent);
-            break;
+    flush();
 
-        case QueryType::range_search:
-            *pRowid = pCursor->range_search_result->labels[pCursor->iCurrent];
-            break;
+    results.clear();
+    for (size_t q = 0; q < nq; q++) {
 
-        case QueryType::fullscan:
-            *pRowid = sqlite3_column_int64(pCursor->stmt, 0);
-            break;
+        heaps[q].sort();
+        for (auto &entry : heaps[q].entries)
+            results.push_back({(sqlite3_int64)q, entry.second, similarity ? -entry.first : entry.first});
     }
     return SQLITE_OK;
 }
 
-static int vssIndexEof(sqlite3_vtab_cursor *cur) {
+static int vssKnnFilter(sqlite3_vtab_cursor *pVtabCursor,
+                        int idxNum,
+                        const char *idxStr,
+                        int argc,
+                        sqlite3_value **argv) {
 
-    auto pCursor = static_cast<vss_index_cursor *>(cur);
+    auto pCur = static_cast<vssKnn_cursor *>(pVtabCursor);
+    auto pTable = static_cast<vssKnn_vtab *>(pVtabCursor->pVtab);
 
-    switch (pCursor->query_type) {
+    sqlite3_value *args[VSS_KNN_METRIC - VSS_KNN_SOURCE + 1] = {nullptr, nullptr, nullptr, nullptr, nullptr};
+    for (int column = 0, i = 0; column <= VSS_KNN_METRIC - VSS_KNN_SOURCE; column++) {
+        if (idxNum & (1 << column))
+            args[column] = argv[i++];
+    }
 
-      case QueryType::search:
-          return pCursor->iCurrent >= pCursor->limit ||
-                pCursor->iCurrent >= pCursor->search_ids.size()
-                || (pCursor->search_ids.at(pCursor->iCurrent) == -1);
+    auto source_arg = args[VSS_KNN_SOURCE - VSS_KNN_SOURCE];
+    auto column_arg = args[VSS_KNN_COLUMN_NAME - VSS_KNN_SOURCE];
+    auto queries_arg = args[VSS_KNN_QUERIES - VSS_KNN_SOURCE];
+    auto k_arg = args[VSS_KNN_K - VSS_KNN_SOURCE];
+    auto metric_arg = args[VSS_KNN_METRIC - VSS_KNN_SOURCE];
 
-      case QueryType::range_search:
-          return pCursor->iCurrent >= pCursor->range_search_result->lims[1];
+    pCur->results.clear();
+    pCur->iRowid = 0;
 
-      case QueryType::fullscan:
-          return pCursor->step_result != SQLITE_ROW;
+    if (source_arg == nullptr || queries_arg == nullptr || k_arg == nullptr) {
+        sqlite3_free(pTable->zErrMsg);
+        pTable->zErrMsg = sqlite3_mprintf("vss_knn() requires a source, queries and k");
+        return SQLITE_ERROR;
     }
-    return 1;
-}
 
-static int vssIndexColumn(sqlite3_vtab_cursor *cur,
-                          sqlite3_context *ctx,
-                          int i) {
+    if (sqlite3_value_type(k_arg) != SQLITE_INTEGER || sqlite3_value_int64(k_arg) <= 0) {
+        sqlite3_free(pTable->zErrMsg);
+        pTable->zErrMsg = sqlite3_mprintf("k of vss_knn() must be a positive integer");
+        return SQLITE_ERROR;
+    }
 
-    auto pCursor = static_cast<vss_index_cursor *>(cur);
+    TopkMetric metric = TopkMetric::l2;
+    if (metric_arg != nullptr && sqlite3_value_type(metric_arg) != SQLITE_NULL &&
+        (!parse_topk_metric((const char *)sqlite3_value_text(metric_arg), &metric) ||
+         metric == TopkMetric::l1 || metric == TopkMetric::linf)) {
+        sqlite3_free(pTable->zErrMsg);
+        pTable->zErrMsg = sqlite3_mprintf("metric of vss_knn() must be one of L2, INNER_PRODUCT or cosine");
+        return SQLITE_ERROR;
+    }
 
-    if (i == VSS_INDEX_COLUMN_DISTANCE) {
+    // One query vector, or a matrix blob of them, like vector_matrix()
+    // returns.
+    auto vector_api = pTable->vector_api;
+    vector<float> queries;
+    size_t d;
 
-        switch (pCursor->query_type) {
+    int64_t rows, dimensions;
+    const char *pzErrMsg = nullptr;
+    const void *matrix = nullptr;
+    vec_ptr query;
 
-          case QueryType::search:
-              sqlite3_result_double(ctx,
-                                    pCursor->search_distances.at(pCursor->iCurrent));
-              break;
+    if (sqlite3_value_type(queries_arg) == SQLITE_BLOB && vector_api->iVersion >= 1 &&
+        (matrix = vector_api->xValueAsMatrix(queries_arg, &rows, &dimensions, &pzErrMsg)) != nullptr) {
 
-          case QueryType::range_search:
-              sqlite3_result_double(ctx,
-                                    pCursor->range_search_result->distances[pCursor->iCurrent]);
-              break;
+        queries.resize(rows * dimensions);
+        if (!queries.empty())
+            memcpy(queries.data(), matrix, queries.size() * sizeof(float));
+        d = dimensions;
 
-          case QueryType::fullscan:
-              break;
-        }
+    } else if ((query = vector_api->xValueAsVector(queries_arg)) != nullptr) {
 
-    } else if (i >= VSS_INDEX_COLUMN_VECTORS) {
+        queries = move(*query);
+        d = queries.size();
 
-        auto index =
-            pCursor->table->indexes.at(i - VSS_INDEX_COLUMN_VECTORS)->index;
+    } else {
 
-        vector<float> vec(index->d);
-        sqlite3_int64 rowId;
-        vssIndexRowid(cur, &rowId);
+        sqlite3_free(pTable->zErrMsg);
+        pTable->zErrMsg = sqlite3_mprintf("queries of vss_knn() must be a vector or a matrix");
+        return SQLITE_ERROR;
+    }
 
-        try {
-            index->reconstruct(rowId, vec.data());
+    if (d == 0 || queries.empty())
+        return SQLITE_OK;
 
-        } catch (faiss::FaissException &e) {
+    int vector_column;
+    char *errmsg = nullptr;
+    auto stmt = vss_knn_source(pTable->db, "vss_knn", source_arg, column_arg, &vector_column, &errmsg);
+    if (stmt == nullptr) {
+        sqlite3_free(pTable->zErrMsg);
+        pTable->zErrMsg = errmsg;
+        return SQLITE_ERROR;
+    }
 
-            char *errmsg =
-                (char *)sqlite3_mprintf("Error reconstructing vector - Does "
-                                        "the column factory string end "
-                                        "with IDMap2? Full error: %s",
-                                        e.msg.c_str());
+    int rc;
+    try {
+        rc = vss_knn(pTable->db, vector_api, stmt, vector_column, queries, d,
+                     sqlite3_value_int64(k_arg), metric, pCur->results, &errmsg);
+    } catch (faiss::FaissException &e) {
+        errmsg = sqlite3_mprintf("vss_knn() failed: %s", e.what());
+        rc = SQLITE_ERROR;
+    }
+    sqlite3_finalize(stmt);
 
-            sqlite3_result_error(ctx, errmsg, -1);
-            sqlite3_free(errmsg);
-            return SQLITE_ERROR;
-        }
-        sqlite3_result_blob64(ctx, vec.data(), vec.size() * sizeof(float), SQLITE_TRANSIENT);
+    if (rc != SQLITE_OK) {
+        pCur->results.clear();
+        sqlite3_free(pTable->zErrMsg);
+        pTable->zErrMsg = errmsg;
+        return rc == SQLITE_NOMEM ? rc : SQLITE_ERROR;
     }
     return SQLITE_OK;
 }
 
-static int vssIndexBegin(sqlite3_vtab *tab) {
+static int vssKnnNext(sqlite3_vtab_cursor *cur) {
 
+    auto pCur = static_cast<vssKnn_cursor *>(cur);
+    pCur->iRowid++;
     return SQLITE_OK;
 }
 
-static int vssIndexSync(sqlite3_vtab *pVTab) {
+static int vssKnnEof(sqlite3_vtab_cursor *cur) {
 
-    auto pTable = static_cast<vss_index_vtab *>(pVTab);
+    auto pCur = static_cast<vssKnn_cursor *>(cur);
+    return pCur->iRowid >= (sqlite3_int64)pCur->results.size();
+}
 
-    try {
+static int vssKnnRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+
+    auto pCur = static_cast<vssKnn_cursor *>(cur);
+    *pRowid = pCur->iRowid;
+    return SQLITE_OK;
+}
 
-        bool needsWriting = false;
+static int vssKnnColumn(sqlite3_vtab_cursor *cur,
+                        sqlite3_context *context,
+                        int i) {
 
-        auto idxCol = 0;
-        for (auto iter = pTable->indexes.begin(); iter != pTable->indexes.end(); ++iter, idxCol++) {
+    auto pCur = static_cast<vssKnn_cursor *>(cur);
+    auto &result = pCur->results.at(pCur->iRowid);
 
-            // Checking if index needs training.
-            if (!(*iter)->trainings.empty()) {
+    switch (i) {
 
-                (*iter)->index->train(
-                    (*iter)->trainings.size() / (*iter)->index->d,
-                    (*iter)->trainings.data());
+        case VSS_KNN_QUERY_IDX:
+            sqlite3_result_int64(context, result.query_idx);
+            break;
 
-                (*iter)->trainings.clear();
-                (*iter)->trainings.shrink_to_fit();
+        case VSS_KNN_ROWID:
+            sqlite3_result_int64(context, result.rowid);
+            break;
 
-                needsWriting = true;
-            }
+        case VSS_KNN_DISTANCE:
+            sqlite3_result_double(context, result.distance);
+            break;
+
+        default:
+            sqlite3_result_null(context);
+            break;
+    }
+    return SQLITE_OK;
+}
+
+static sqlite3_module vssKnnModule = {
+    /* iVersion    */ 0,
+    /* xCreate     */ 0,
+    /* xConnect    */ vssKnnConnect,
+    /* xBestIndex  */ vssKnnBestIndex,
+    /* xDisconnect */ vssKnnDisconnect,
+    /* xDestroy    */ 0,
+    /* xOpen       */ vssKnnOpen,
+    /* xClose      */ vssKnnClose,
+    /* xFilter     */ vssKnnFilter,
+    /* xNext       */ vssKnnNext,
+    /* xEof        */ vssKnnEof,
+    /* xColumn     */ vssKnnColumn,
+    /* xRowid      */ vssKnnRowid,
+    /* xUpdate     */ 0,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ 0,
+    /* xRename     */ 0,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ 0};
 
-            // Checking if we're deleting records from the index.
-            if (!(*iter)->delete_ids.empty()) {
+#pragma endregion
 
-                faiss::IDSelectorBatch selector((*iter)->delete_ids.size(),
-                                                (*iter)->delete_ids.data());
+#pragma region vss_knn_join vtab
 
-                (*iter)->index->remove_ids(selector);
-                (*iter)->delete_ids.clear();
-                (*iter)->delete_ids.shrink_to_fit();
+// Left vectors are searched in batches of up to this many, one
+// index->search() call each, which faiss spreads across all cores.
+static const size_t VSS_KNN_JOIN_BATCH = 4096;
 
-                needsWriting = true;
-            }
+// Batches hold at most this many neighbours, so large k searches fewer left
+// vectors at once.
+static const size_t VSS_KNN_JOIN_RESULTS = 1024 * 1024;
 
-            // Checking if we're inserting records to the index.
-            if (!(*iter)->insert_data.empty()) {
+struct vssKnnJoin_vtab : public sqlite3_vtab {
 
-                (*iter)->index->add_with_ids(
-                    (*iter)->insert_ids.size(),
-                    (*iter)->insert_data.data(),
-                    (faiss::idx_t *)(*iter)->insert_ids.data());
+    vssKnnJoin_vtab(sqlite3 *db, vss_connection *connection) : db(db), connection(connection) {
 
-                (*iter)->insert_ids.clear();
-                (*iter)->insert_ids.shrink_to_fit();
+        pModule = nullptr;
+        nRef = 0;
+        zErrMsg = nullptr;
+    }
 
-                (*iter)->insert_data.clear();
-                (*iter)->insert_data.shrink_to_fit();
+    ~vssKnnJoin_vtab() {
 
-                needsWriting = true;
-            }
-        }
+        if (zErrMsg != nullptr)
+            sqlite3_free(zErrMsg);
+    }
 
-        if (needsWriting) {
+    sqlite3 *db;
+    vss_connection *connection;
+};
 
-            int i = 0;
-            for (auto iter = pTable->indexes.begin(); iter != pTable->indexes.end(); ++iter, i++) {
+// Results are produced one batch of left rows at a time, so only a batch of
+// left vectors and their k neighbours are ever held in memory.
+struct vssKnnJoin_cursor : public sqlite3_vtab_cursor {
 
-                int rc = write_index_insert((*iter)->index,
-                                            pTable->db,
-                                            pTable->schema,
-                                            pTable->name,
-                                            i,
-                                            (*iter)->name,
-                                            (*iter)->storage_type);
+    explicit vssKnnJoin_cursor(sqlite3_vtab *pVtab) : iRowid(0) {
 
-                if (rc != SQLITE_OK) {
+        this->pVtab = pVtab;
+    }
 
-                    sqlite3_free(pVTab->zErrMsg);
-                    pVTab->zErrMsg = sqlite3_mprintf("Error saving index (%d): %s",
-                                                    rc, sqlite3_errmsg(pTable->db));
-                    return rc;
-                }
-            }
-        }
+    ~vssKnnJoin_cursor() {
 
-        return SQLITE_OK;
+        sqlite3_finalize(left);
+    }
 
-    } catch (faiss::FaissException &e) {
+    sqlite3_int64 iRowid;
 
-        sqlite3_free(pVTab->zErrMsg);
-        pVTab->zErrMsg =
-            sqlite3_mprintf("Error during synchroning index. Full error: %s",
-                            e.msg.c_str());
+    sqlite3_stmt *left = nullptr;
+    int vector_column = 1;
+    bool left_done = true;
+
+    // The right column is looked up again for every batch, the table can be
+    // dropped or its index replaced between two xNext calls.
+    string right_schema;
+    string right_table_name;
+    string right_column_name;
+    vss_index_vtab *right_table = nullptr;
+    vss_index *right = nullptr;
+    faiss::idx_t k = 0;
+
+    // The current batch: n left rows with k neighbours each, some of which
+    // may be missing (-1) when the index has fewer vectors.
+    vector<sqlite3_int64> left_rowids;
+    vector<float> distances;
+    vector<faiss::idx_t> labels;
+    size_t position = 0;
+};
 
-        for (auto iter = pTable->indexes.begin(); iter != pTable->indexes.end(); ++iter) {
+static int vssKnnJoinConnect(sqlite3 *db,
+                             void *pAux,
+                             int argc,
+                             const char *const *argv,
+                             sqlite3_vtab **ppVtab,
+                             char **pzErr) {
+
+    int rc = sqlite3_declare_vtab(db,
+        "create table x(left_rowid, right_rowid, distance, "
+        "left_source hidden, left_column hidden, right_table hidden, right_column hidden, k hidden)");
+
+#define VSS_KNN_JOIN_LEFT_ROWID 0
+#define VSS_KNN_JOIN_RIGHT_ROWID 1
+#define VSS_KNN_JOIN_DISTANCE 2
+#define VSS_KNN_JOIN_LEFT_SOURCE 3
+#define VSS_KNN_JOIN_LEFT_COLUMN 4
+#define VSS_KNN_JOIN_RIGHT_TABLE 5
+#define VSS_KNN_JOIN_RIGHT_COLUMN 6
+#define VSS_KNN_JOIN_K 7
+
+    // The left side can be a query, so like vss_knn() it's never reachable
+    // from a schema.
+    if (rc == SQLITE_OK)
+        rc = sqlite3_vtab_config(db, SQLITE_VTAB_DIRECTONLY);
+
+    if (rc == SQLITE_OK) {
+
+        auto pNew = new vssKnnJoin_vtab(db, (vss_connection *)pAux);
+        if (pNew == nullptr)
+            return SQLITE_NOMEM;
+
+        *ppVtab = pNew;
+    }
+    return rc;
+}
 
-            (*iter)->insert_ids.clear();
-            (*iter)->insert_ids.shrink_to_fit();
+static int vssKnnJoinDisconnect(sqlite3_vtab *pVtab) {
 
-            (*iter)->insert_data.clear();
-            (*iter)->insert_data.shrink_to_fit();
+    auto pTable = static_cast<vssKnnJoin_vtab *>(pVtab);
+    delete pTable;
+    return SQLITE_OK;
+}
 
-            (*iter)->delete_ids.clear();
-            (*iter)->delete_ids.shrink_to_fit();
+static int vssKnnJoinOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
 
-            (*iter)->trainings.clear();
-            (*iter)->trainings.shrink_to_fit();
-        }
+    auto pCur = new vssKnnJoin_cursor(p);
+    if (pCur == nullptr)
+        return SQLITE_NOMEM;
+
+    *ppCursor = pCur;
+    return SQLITE_OK;
+}
+
+static int vssKnnJoinClose(sqlite3_vtab_cursor *cur) {
+
+    auto pCur = static_cast<vssKnnJoin_cursor *>(cur);
+    delete pCur;
+    return SQLITE_OK;
+}
+
+// Same argument handling as vssKnnBestIndex(): idxNum has a bit per argument
+// given, passed in column order.
+static int vssKnnJoinBestIndex(sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo) {
+
+    int positions[VSS_KNN_JOIN_K - VSS_KNN_JOIN_LEFT_SOURCE + 1] = {-1, -1, -1, -1, -1};
+
+    for (int i = 0; i < pIdxInfo->nConstraint; i++) {
+
+        auto pCons = pIdxInfo->aConstraint[i];
+
+        if (pCons.iColumn >= VSS_KNN_JOIN_LEFT_SOURCE &&
+            pCons.op == SQLITE_INDEX_CONSTRAINT_EQ) {
+
+            if (!pCons.usable)
+                return SQLITE_CONSTRAINT;
 
-        return SQLITE_ERROR;
+            positions[pCons.iColumn - VSS_KNN_JOIN_LEFT_SOURCE] = i;
+        }
     }
-}
 
-static int vssIndexCommit(sqlite3_vtab *pVTab) { return SQLITE_OK; }
+    int idxNum = 0;
+    int argvIndex = 0;
+    for (int column = 0; column <= VSS_KNN_JOIN_K - VSS_KNN_JOIN_LEFT_SOURCE; column++) {
 
-static int vssIndexRollback(sqlite3_vtab *pVTab) {
+        if (positions[column] < 0)
+            continue;
 
-    auto pTable = static_cast<vss_index_vtab *>(pVTab);
+        idxNum |= 1 << column;
+        pIdxInfo->aConstraintUsage[positions[column]].argvIndex = ++argvIndex;
+        pIdxInfo->aConstraintUsage[positions[column]].omit = 1;
+    }
 
-    for (auto iter = pTable->indexes.begin(); iter != pTable->indexes.end(); ++iter) {
+    pIdxInfo->idxNum = idxNum;
+    pIdxInfo->estimatedCost = (double)1000000;
+    pIdxInfo->estimatedRows = 10000;
+    return SQLITE_OK;
+}
 
-        (*iter)->trainings.clear();
-        (*iter)->trainings.shrink_to_fit();
+// Finds the right table and column of the cursor, errors when either is gone.
+static int vss_knn_join_right(vssKnnJoin_cursor *pCur, char **errmsg) {
 
-        (*iter)->insert_data.clear();
-        (*iter)->insert_data.shrink_to_fit();
+    auto pTable = static_cast<vssKnnJoin_vtab *>(pCur->pVtab);
 
-        (*iter)->insert_ids.clear();
-        (*iter)->insert_ids.shrink_to_fit();
+    pCur->right = nullptr;
+    pCur->right_table = vss_table_lookup(pTable->connection,
+                                         pTable->db,
+                                         pCur->right_schema.empty() ? nullptr : pCur->right_schema.c_str(),
+                                         pCur->right_table_name.c_str());
+    if (pCur->right_table == nullptr) {
+        *errmsg = sqlite3_mprintf("vss_knn_join() could not find vss0 table %s", pCur->right_table_name.c_str());
+        return SQLITE_ERROR;
+    }
 
-        (*iter)->delete_ids.clear();
-        (*iter)->delete_ids.shrink_to_fit();
+    for (auto column : pCur->right_table->indexes) {
+        if (sqlite3_stricmp(column->name.c_str(), pCur->right_column_name.c_str()) == 0)
+            pCur->right = column;
+    }
+
+    if (pCur->right == nullptr) {
+        *errmsg = sqlite3_mprintf("vss_knn_join() table %s has no column %s",
+                                  pCur->right_table_name.c_str(), pCur->right_column_name.c_str());
+        return SQLITE_ERROR;
     }
     return SQLITE_OK;
 }
 
-static int vssIndexUpdate(sqlite3_vtab *pVTab,
-                          int argc,
-                          sqlite3_value **argv,
-                          sqlite_int64 *pRowid) {
-
-    auto pTable = static_cast<vss_index_vtab *>(pVTab);
-
-    if (argc == 1 && sqlite3_value_type(argv[0]) != SQLITE_NULL) {
+// Reads the next batch of left vectors and searches them all in the right
+// index at once. Leaves an empty batch at the end of the left side.
+static int vss_knn_join_batch(vssKnnJoin_cursor *pCur, char **errmsg) {
 
-        // DELETE operation
-        sqlite3_int64 rowid_to_delete = sqlite3_value_int64(argv[0]);
+    auto rc = vss_knn_join_right(pCur, errmsg);
+    if (rc != SQLITE_OK)
+        return rc;
 
-        auto rc = shadow_data_delete(pTable->db,
-                                     pTable->schema,
-                                     pTable->name,
-                                     rowid_to_delete);
-        if (rc != SQLITE_OK)
-            return rc;
+    auto index = pCur->right->index;
+    auto d = (size_t)index->d;
+    auto batch_size = max((size_t)1, min(VSS_KNN_JOIN_BATCH, VSS_KNN_JOIN_RESULTS / (size_t)pCur->k));
 
-        for (auto iter = pTable->indexes.begin(); iter != pTable->indexes.end(); ++iter) {
-            (*iter)->delete_ids.push_back(rowid_to_delete);
-        }
+    pCur->left_rowids.clear();
+    pCur->position = 0;
 
-    } else if (argc > 1 && sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+    vector<float> batch;
+    batch.reserve(batch_size * d);
 
-        // INSERT operation
-        // if no operation, we add it to the index
-        bool noOperation =
-            sqlite3_value_type(argv[2 + VSS_INDEX_COLUMN_OPERATION]) ==
-            SQLITE_NULL;
+    rc = SQLITE_ROW;
+    while (pCur->left_rowids.size() < batch_size &&
+           (rc = sqlite3_step(pCur->left)) == SQLITE_ROW) {
 
-        if (noOperation) {
+        auto value = sqlite3_column_value(pCur->left, pCur->vector_column);
+        if (sqlite3_value_type(value) == SQLITE_NULL)
+            continue;
 
-            vec_ptr vec;
-            sqlite3_int64 rowid = sqlite3_value_int64(argv[1]);
-            bool inserted_rowid = false;
+        auto rowid = sqlite3_column_int64(pCur->left, 0);
+        auto vector = vss_value_as_vector(pCur->right_table, pCur->right, value);
 
-            auto i = 0;
-            for (auto iter = pTable->indexes.begin(); iter != pTable->indexes.end(); ++iter, i++) {
+        if (vector == nullptr) {
+            *errmsg = sqlite3_mprintf("vss_knn_join() value for left rowid %lld is not a vector", rowid);
+            return SQLITE_ERROR;
+        }
 
-                if ((vec = pTable->vector_api->xValueAsVector(
-                         argv[2 + VSS_INDEX_COLUMN_VECTORS + i])) != nullptr) {
+        if (vector->size() != d) {
+            *errmsg = sqlite3_mprintf("vss_knn_join() vector for left rowid %lld has %lld dimensions, expected %lld",
+                                      rowid, (sqlite3_int64)vector->size(), (sqlite3_int64)d);
+            return SQLITE_ERROR;
+        }
 
-                    // Make sure the index is already trained, if it's needed
-                    if (!(*iter)->index->is_trained) {
+        batch.insert(batch.end(), vector->begin(), vector->end());
+        pCur->left_rowids.push_back(rowid);
+    }
 
-                        sqlite3_free(pVTab->zErrMsg);
-                        pVTab->zErrMsg =
-                            sqlite3_mprintf("Index at i=%d requires training "
-                                            "before inserting data.",
-                                            i);
+    if (rc == SQLITE_DONE) {
+        pCur->left_done = true;
+    } else if (rc != SQLITE_ROW) {
+        *errmsg = sqlite3_mprintf("vss_knn_join() could not read left source: %s",
+                                  sqlite3_errmsg(sqlite3_db_handle(pCur->left)));
+        return rc;
+    }
 
-                        return SQLITE_ERROR;
-                    }
+    auto n = pCur->left_rowids.size();
+    if (n == 0)
+        return SQLITE_OK;
 
-                    if (!inserted_rowid) {
+    pCur->distances.resize(n * pCur->k);
+    pCur->labels.resize(n * pCur->k);
 
-                        sqlite_int64 retrowid;
-                        auto rc = shadow_data_insert(pTable->db, pTable->schema, pTable->name,
-                                                     &rowid, &retrowid);
-                        if (rc != SQLITE_OK)
-                            return rc;
+    try {
+        vss_faiss_threads threads(index);
+        index->search(n, batch.data(), pCur->k, pCur->distances.data(), pCur->labels.data());
+    } catch (faiss::FaissException &e) {
+        *errmsg = sqlite3_mprintf("vss_knn_join() search failed: %s", e.msg.c_str());
+        return SQLITE_ERROR;
+    }
 
-                        inserted_rowid = true;
-                    }
+    pCur->right->stats.searches += n;
+    return SQLITE_OK;
+}
 
-                    (*iter)->insert_data.reserve((*iter)->insert_data.size() + vec->size());
-                    (*iter)->insert_data.insert(
-                        (*iter)->insert_data.end(),
-                        vec->begin(),
-                        vec->end());
+// Moves to the next found neighbour from position, going through as many
+// batches as needed.
+static int vss_knn_join_seek(vssKnnJoin_cursor *pCur) {
 
-                    (*iter)->insert_ids.push_back(rowid);
+    while (true) {
 
-                    *pRowid = rowid;
-                }
-            }
+        auto total = pCur->left_rowids.size() * pCur->k;
+        while (pCur->position < total && pCur->labels[pCur->position] < 0)
+            pCur->position++;
 
-        } else {
+        if (pCur->position < total || pCur->left_done)
+            return SQLITE_OK;
 
-            string operation((char *)sqlite3_value_text(argv[2 + VSS_INDEX_COLUMN_OPERATION]));
+        char *errmsg = nullptr;
+        int rc = vss_knn_join_batch(pCur, &errmsg);
+        if (rc != SQLITE_OK) {
+            pCur->left_rowids.clear();
+            pCur->left_done = true;
+            sqlite3_free(pCur->pVtab->zErrMsg);
+            pCur->pVtab->zErrMsg = errmsg;
+            return rc == SQLITE_NOMEM ? rc : SQLITE_ERROR;
+        }
+    }
+}
 
-            if (operation.compare("training") == 0) {
+static int vssKnnJoinFilter(sqlite3_vtab_cursor *pVtabCursor,
+                            int idxNum,
+                            const char *idxStr,
+                            int argc,
+                            sqlite3_value **argv) {
 
-                auto i = 0;
-                for (auto iter = pTable->indexes.begin(); iter != pTable->indexes.end(); ++iter, i++) {
+    auto pCur = static_cast<vssKnnJoin_cursor *>(pVtabCursor);
+    auto pTable = static_cast<vssKnnJoin_vtab *>(pVtabCursor->pVtab);
 
-                    vec_ptr vec = pTable->vector_api->xValueAsVector(argv[2 + VSS_INDEX_COLUMN_VECTORS + i]);
-                    if (vec != nullptr) {
+    sqlite3_value *args[VSS_KNN_JOIN_K - VSS_KNN_JOIN_LEFT_SOURCE + 1] = {nullptr, nullptr, nullptr, nullptr, nullptr};
+    for (int column = 0, i = 0; column <= VSS_KNN_JOIN_K - VSS_KNN_JOIN_LEFT_SOURCE; column++) {
+        if (idxNum & (1 << column))
+            args[column] = argv[i++];
+    }
 
-                        (*iter)->trainings.reserve((*iter)->trainings.size() + vec->size());
-                        (*iter)->trainings.insert(
-                            (*iter)->trainings.end(),
-                            vec->begin(),
-                            vec->end());
-                    }
-                }
+    auto left_arg = args[VSS_KNN_JOIN_LEFT_SOURCE - VSS_KNN_JOIN_LEFT_SOURCE];
+    auto left_column_arg = args[VSS_KNN_JOIN_LEFT_COLUMN - VSS_KNN_JOIN_LEFT_SOURCE];
+    auto right_table_arg = args[VSS_KNN_JOIN_RIGHT_TABLE - VSS_KNN_JOIN_LEFT_SOURCE];
+    auto right_column_arg = args[VSS_KNN_JOIN_RIGHT_COLUMN - VSS_KNN_JOIN_LEFT_SOURCE];
+    auto k_arg = args[VSS_KNN_JOIN_K - VSS_KNN_JOIN_LEFT_SOURCE];
+
+    sqlite3_finalize(pCur->left);
+    pCur->left = nullptr;
+    pCur->left_done = true;
+    pCur->left_rowids.clear();
+    pCur->position = 0;
+    pCur->iRowid = 0;
+
+    auto right_table_name = right_table_arg != nullptr ? (const char *)sqlite3_value_text(right_table_arg) : nullptr;
+    auto right_column_name = right_column_arg != nullptr ? (const char *)sqlite3_value_text(right_column_arg) : nullptr;
+
+    if (left_arg == nullptr || right_table_name == nullptr || right_column_name == nullptr || k_arg == nullptr) {
+        sqlite3_free(pTable->zErrMsg);
+        pTable->zErrMsg = sqlite3_mprintf("vss_knn_join() requires a left source, a right table and column, and k");
+        return SQLITE_ERROR;
+    }
 
-            } else {
+    if (sqlite3_value_type(k_arg) != SQLITE_INTEGER || sqlite3_value_int64(k_arg) <= 0) {
+        sqlite3_free(pTable->zErrMsg);
+        pTable->zErrMsg = sqlite3_mprintf("k of vss_knn_join() must be a positive integer");
+        return SQLITE_ERROR;
+    }
 
-                return SQLITE_ERROR;
-            }
-        }
+    pCur->right_schema.clear();
+    pCur->right_table_name = right_table_name;
+    pCur->right_column_name = right_column_name;
 
-    } else {
+    char *errmsg = nullptr;
+    if (vss_knn_join_right(pCur, &errmsg) != SQLITE_OK) {
+        sqlite3_free(pTable->zErrMsg);
+        pTable->zErrMsg = errmsg;
+        return SQLITE_ERROR;
+    }
 
-        // TODO: Implement - UPDATE operation
-        sqlite3_free(pVTab->zErrMsg);
+    if (pCur->right_table->partitioned()) {
+        sqlite3_free(pTable->zErrMsg);
+        pTable->zErrMsg = sqlite3_mprintf("vss_knn_join() doesn't support partitioned tables like %s", right_table_name);
+        return SQLITE_ERROR;
+    }
 
-        pVTab->zErrMsg =
-            sqlite3_mprintf("UPDATE statements on vss0 virtual tables not supported yet.");
+    // Later batches look up the table found now, not another schema's.
+    pCur->right_schema = pCur->right_table->schema;
 
+    pCur->left = vss_knn_source(pTable->db, "vss_knn_join", left_arg, left_column_arg, &pCur->vector_column, &errmsg);
+    if (pCur->left == nullptr) {
+        sqlite3_free(pTable->zErrMsg);
+        pTable->zErrMsg = errmsg;
         return SQLITE_ERROR;
     }
 
-    return SQLITE_OK;
+    pCur->k = min((faiss::idx_t)sqlite3_value_int64(k_arg), pCur->right->index->ntotal);
+    pCur->left_done = pCur->k == 0;
+
+    return vss_knn_join_seek(pCur);
 }
 
-static void vssSearchFunc(sqlite3_context *context,
-                          int argc,
-                          sqlite3_value **argv) { }
+static int vssKnnJoinNext(sqlite3_vtab_cursor *cur) {
 
-static void faissMemoryUsageFunc(sqlite3_context *context,
-                                 int argc,
-                                 sqlite3_value **argv) {
+    auto pCur = static_cast<vssKnnJoin_cursor *>(cur);
+    pCur->iRowid++;
+    pCur->position++;
+    return vss_knn_join_seek(pCur);
+}
 
-    sqlite3_result_int64(context, faiss::get_mem_usage_kb());
+static int vssKnnJoinEof(sqlite3_vtab_cursor *cur) {
+
+    auto pCur = static_cast<vssKnnJoin_cursor *>(cur);
+    return pCur->position >= pCur->left_rowids.size() * pCur->k;
 }
 
-static void vssRangeSearchFunc(sqlite3_context *context,
-                               int argc,
-                               sqlite3_value **argv) { }
+static int vssKnnJoinRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
 
-static int vssIndexFindFunction(
-                    sqlite3_vtab *pVtab,
-                    int nArg,
-                    const char *zName,
-                    void (**pxFunc)(sqlite3_context *, int, sqlite3_value **),
-                    void **ppArg) {
+    auto pCur = static_cast<vssKnnJoin_cursor *>(cur);
+    *pRowid = pCur->iRowid;
+    return SQLITE_OK;
+}
 
-    if (sqlite3_stricmp(zName, "vss_search") == 0) {
-        *pxFunc = vssSearchFunc;
-        *ppArg = 0;
-        return VSS_SEARCH_FUNCTION;
-    }
+static int vssKnnJoinColumn(sqlite3_vtab_cursor *cur,
+                            sqlite3_context *context,
+                            int i) {
 
-    if (sqlite3_stricmp(zName, "vss_range_search") == 0) {
-        *pxFunc = vssRangeSearchFunc;
-        *ppArg = 0;
-        return VSS_RANGE_SEARCH_FUNCTION;
-    }
-    return 0;
-};
+    auto pCur = static_cast<vssKnnJoin_cursor *>(cur);
 
-static int vssIndexShadowName(const char *zName) {
+    switch (i) {
+
+        case VSS_KNN_JOIN_LEFT_ROWID:
+            sqlite3_result_int64(context, pCur->left_rowids.at(pCur->position / pCur->k));
+            break;
 
-    static const char *azName[] = {"index", "data"};
+        case VSS_KNN_JOIN_RIGHT_ROWID:
+            sqlite3_result_int64(context, pCur->labels.at(pCur->position));
+            break;
 
-    for (auto i = 0; i < sizeof(azName) / sizeof(azName[0]); i++) {
-        if (sqlite3_stricmp(zName, azName[i]) == 0)
-            return 1;
+        case VSS_KNN_JOIN_DISTANCE:
+            sqlite3_result_double(context, pCur->distances.at(pCur->position));
+            break;
+
+        default:
+            sqlite3_result_null(context);
+            break;
     }
-    return 0;
+    return SQLITE_OK;
 }
 
-static sqlite3_module vssIndexModule = {
-    /* iVersion    */ 3,
-    /* xCreate     */ vssIndexCreate,
-    /* xConnect    */ vssIndexConnect,
-    /* xBestIndex  */ vssIndexBestIndex,
-    /* xDisconnect */ vssIndexDisconnect,
-    /* xDestroy    */ vssIndexDestroy,
-    /* xOpen       */ vssIndexOpen,
-    /* xClose      */ vssIndexClose,
-    /* xFilter     */ vssIndexFilter,
-    /* xNext       */ vssIndexNext,
-    /* xEof        */ vssIndexEof,
-    /* xColumn     */ vssIndexColumn,
-    /* xRowid      */ vssIndexRowid,
-    /* xUpdate     */ vssIndexUpdate,
-    /* xBegin      */ vssIndexBegin,
-    /* xSync       */ vssIndexSync,
-    /* xCommit     */ vssIndexCommit,
-    /* xRollback   */ vssIndexRollback,
-    /* xFindMethod */ vssIndexFindFunction,
+static sqlite3_module vssKnnJoinModule = {
+    /* iVersion    */ 0,
+    /* xCreate     */ 0,
+    /* xConnect    */ vssKnnJoinConnect,
+    /* xBestIndex  */ vssKnnJoinBestIndex,
+    /* xDisconnect */ vssKnnJoinDisconnect,
+    /* xDestroy    */ 0,
+    /* xOpen       */ vssKnnJoinOpen,
+    /* xClose      */ vssKnnJoinClose,
+    /* xFilter     */ vssKnnJoinFilter,
+    /* xNext       */ vssKnnJoinNext,
+    /* xEof        */ vssKnnJoinEof,
+    /* xColumn     */ vssKnnJoinColumn,
+    /* xRowid      */ vssKnnJoinRowid,
+    /* xUpdate     */ 0,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ 0,
     /* xRename     */ 0,
     /* xSavepoint  */ 0,
     /* xRelease    */ 0,
     /* xRollbackTo */ 0,
-    /* xShadowName */ vssIndexShadowName};
+    /* xShadowName */ 0};
 
 #pragma endregion
 
@@ -1913,6 +9317,13 @@ __declspec(dllexport)
                                    vss_distance_linf,
                                    0, 0, 0);
 
+        sqlite3_create_function_v2(db, "vss_distance_hamming",
+                                   2,
+                                   SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS,
+                                   vector_api,
+                                   vss_distance_hamming,
+                                   0, 0, 0);
+
         sqlite3_create_function_v2(db, "vss_inner_product",
                                    2,
                                    SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS,
@@ -1941,21 +9352,48 @@ __declspec(dllexport)
                                    vss_fvec_sub,
                                    0, 0, 0);
 
-        sqlite3_create_function_v2(db, "vss_search",
+        for (int nArg = 4; nArg <= 5; nArg++) {
+            sqlite3_create_function_v2(db, "vss_topk",
+                                       nArg,
+                                       SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS,
+                                       vector_api,
+                                       0,
+                                       vssTopkStep, vssTopkFinal, 0);
+        }
+
+        for (int nArg = 2; nArg <= 3; nArg++) {
+            sqlite3_create_function_v2(db, "vss_kmeans",
+                                       nArg,
+                                       SQLITE_UTF8 | SQLITE_INNOCUOUS,
+                                       vector_api,
+                                       0,
+                                       vssKmeansStep, vssKmeansFinal, 0);
+        }
+
+        sqlite3_create_function_v2(db, "vss_assign",
                                    2,
                                    SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS,
                                    vector_api,
-                                   vssSearchFunc,
+                                   vss_assign,
                                    0, 0, 0);
 
-        sqlite3_create_function_v2(db,
-                                   "vss_search_params",
+        sqlite3_create_function_v2(db, "vss_search",
                                    2,
-                                   0,
+                                   SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS,
                                    vector_api,
-                                   vssSearchParamsFunc,
+                                   vssSearchFunc,
                                    0, 0, 0);
 
+        for (int nArg = 2; nArg <= 4; nArg++) {
+            sqlite3_create_function_v2(db,
+                                       "vss_search_params",
+                                       nArg,
+                                       0,
+                                       vector_api,
+                                       vssSearchParamsFunc,
+                                       0, 0, 0);
+        }
+
         sqlite3_create_function_v2(db,
                                    "vss_range_search",
                                    2,
@@ -1980,7 +9418,94 @@ __declspec(dllexport)
                                    faissMemoryUsageFunc,
                                    0, 0, 0);
 
-        auto rc = sqlite3_create_module_v2(db, "vss0", &vssIndexModule, vector_api, nullptr);
+        auto connection = new vss_connection(vector_api);
+
+        auto rc = sqlite3_create_module_v2(db, "vss0", &vssIndexModule, connection, delVssConnection);
+        if (rc != SQLITE_OK) {
+
+            *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+            return rc;
+        }
+
+        // Runs arbitrary SQL, so it must never be reachable from a schema
+        // (views, triggers) an attacker could have written.
+        sqlite3_create_function_v2(db,
+                                   "vss_explain",
+                                   -1,
+                                   SQLITE_UTF8 | SQLITE_DIRECTONLY,
+                                   connection,
+                                   vssExplainFunc,
+                                   0, 0, 0);
+
+        // Reads files and runs arbitrary SQL too.
+        sqlite3_create_function_v2(db,
+                                   "vss_bulk_load",
+                                   3,
+                                   SQLITE_UTF8 | SQLITE_DIRECTONLY,
+                                   connection,
+                                   vssBulkLoadFunc,
+                                   0, 0, 0);
+
+        // Reads index files.
+        sqlite3_create_function_v2(db,
+                                   "vss_import_index",
+                                   3,
+                                   SQLITE_UTF8 | SQLITE_DIRECTONLY,
+                                   connection,
+                                   vssImportIndexFunc,
+                                   0, 0, 0);
+
+        // Reads files and runs arbitrary SQL, like vss_bulk_load().
+        for (int nArg = 3; nArg <= 6; nArg++) {
+            sqlite3_create_function_v2(db, "vss_train",
+                                       nArg,
+                                       SQLITE_UTF8 | SQLITE_DIRECTONLY,
+                                       connection,
+                                       vssTrainFunc,
+                                       0, 0, 0);
+        }
+
+        // Rewrites the table definition.
+        for (int nArg = 3; nArg <= 4; nArg++) {
+            sqlite3_create_function_v2(db, "vss_rebuild",
+                                       nArg,
+                                       SQLITE_UTF8 | SQLITE_DIRECTONLY,
+                                       connection,
+                                       vssRebuildFunc,
+                                       0, 0, 0);
+        }
+
+        for (int nArg = 2; nArg <= 4; nArg++) {
+            sqlite3_create_function_v2(db, "vss_rebalance",
+                                       nArg,
+                                       SQLITE_UTF8 | SQLITE_DIRECTONLY,
+                                       connection,
+                                       vssRebalanceFunc,
+                                       0, 0, 0);
+        }
+
+        rc = sqlite3_create_module_v2(db, "vss_knn", &vssKnnModule, vector_api, nullptr);
+        if (rc != SQLITE_OK) {
+
+            *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+            return rc;
+        }
+
+        rc = sqlite3_create_module_v2(db, "vss_knn_join", &vssKnnJoinModule, connection, nullptr);
+        if (rc != SQLITE_OK) {
+
+            *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+            return rc;
+        }
+
+        rc = sqlite3_create_module_v2(db, "vss_stats", &vssStatsModule, connection, nullptr);
+        if (rc != SQLITE_OK) {
+
+            *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+            return rc;
+        }
+
+        rc = sqlite3_create_module_v2(db, "vss_indexes", &vssIndexesModule, connection, nullptr);
         if (rc != SQLITE_OK) {
 
             *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
@@ -0,0 +1,267 @@
+// Distance kernels between a vector stored in a 'v' blob of any element type
+// (see vector-encoding.h) and a float32 query. The stored side is converted
+// in registers as it's read, so no decoded copy of it is ever allocated. For
+// int8 vectors this is the asymmetric distance: the query keeps full
+// precision.
+//
+// The SIMD width is picked at compile time: AVX-512, AVX2 (with FMA and
+// F16C), NEON on aarch64, or plain loops otherwise.
+
+#ifndef _SQLITE_VECTOR_DISTANCE_H
+#define _SQLITE_VECTOR_DISTANCE_H
+
+#include "vector-encoding.h"
+
+#if defined(__AVX512F__)
+#include <immintrin.h>
+#define VECTOR_SIMD_AVX512
+#elif defined(__AVX2__) && defined(__FMA__) && defined(__F16C__)
+#include <immintrin.h>
+#define VECTOR_SIMD_AVX2
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define VECTOR_SIMD_NEON
+#endif
+
+#pragma region Element loads
+
+template <int Type>
+static inline float vectorViewElement(const VectorView &v, int64_t i);
+
+template <>
+inline float vectorViewElement<vector_blob_float32>(const VectorView &v, int64_t i) {
+    float x;
+    memcpy(&x, v.data + i * 4, sizeof(x));
+    return x;
+}
+
+template <>
+inline float vectorViewElement<vector_blob_float16>(const VectorView &v, int64_t i) {
+    uint16_t half;
+    memcpy(&half, v.data + i * 2, sizeof(half));
+    return vectorF16ToF32(half);
+}
+
+template <>
+inline float vectorViewElement<vector_blob_bfloat16>(const VectorView &v, int64_t i) {
+    uint16_t bf16;
+    memcpy(&bf16, v.data + i * 2, sizeof(bf16));
+    return vectorBF16ToF32(bf16);
+}
+
+template <>
+inline float vectorViewElement<vector_blob_int8>(const VectorView &v, int64_t i) {
+    return v.scale * (int8_t)v.data[i] + v.offset;
+}
+
+#if defined(VECTOR_SIMD_AVX512)
+
+typedef __m512 vector_simd;
+static const int64_t VECTOR_SIMD_WIDTH = 16;
+
+static inline vector_simd vectorSimdZero() { return _mm512_setzero_ps(); }
+static inline vector_simd vectorSimdLoadQuery(const float *q) { return _mm512_loadu_ps(q); }
+static inline vector_simd vectorSimdSub(vector_simd a, vector_simd b) { return _mm512_sub_ps(a, b); }
+static inline vector_simd vectorSimdFma(vector_simd a, vector_simd b, vector_simd c) { return _mm512_fmadd_ps(a, b, c); }
+static inline float vectorSimdSum(vector_simd a) { return _mm512_reduce_add_ps(a); }
+
+template <int Type>
+static inline vector_simd vectorViewLoad(const VectorView &v, int64_t i);
+
+template <>
+inline vector_simd vectorViewLoad<vector_blob_float32>(const VectorView &v, int64_t i) {
+    return _mm512_loadu_ps((const float *)(v.data + i * 4));
+}
+
+template <>
+inline vector_simd vectorViewLoad<vector_blob_float16>(const VectorView &v, int64_t i) {
+    return _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)(v.data + i * 2)));
+}
+
+template <>
+inline vector_simd vectorViewLoad<vector_blob_bfloat16>(const VectorView &v, int64_t i) {
+    __m512i wide = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)(v.data + i * 2)));
+    return _mm512_castsi512_ps(_mm512_slli_epi32(wide, 16));
+}
+
+template <>
+inline vector_simd vectorViewLoad<vector_blob_int8>(const VectorView &v, int64_t i) {
+    __m512i wide = _mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i *)(v.data + i)));
+    return _mm512_fmadd_ps(_mm512_cvtepi32_ps(wide), _mm512_set1_ps(v.scale), _mm512_set1_ps(v.offset));
+}
+
+#elif defined(VECTOR_SIMD_AVX2)
+
+typedef __m256 vector_simd;
+static const int64_t VECTOR_SIMD_WIDTH = 8;
+
+static inline vector_simd vectorSimdZero() { return _mm256_setzero_ps(); }
+static inline vector_simd vectorSimdLoadQuery(const float *q) { return _mm256_loadu_ps(q); }
+static inline vector_simd vectorSimdSub(vector_simd a, vector_simd b) { return _mm256_sub_ps(a, b); }
+static inline vector_simd vectorSimdFma(vector_simd a, vector_simd b, vector_simd c) { return _mm256_fmadd_ps(a, b, c); }
+
+static inline float vectorSimdSum(vector_simd a) {
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    return _mm_cvtss_f32(sum);
+}
+
+template <int Type>
+static inline vector_simd vectorViewLoad(const VectorView &v, int64_t i);
+
+template <>
+inline vector_simd vectorViewLoad<vector_blob_float32>(const VectorView &v, int64_t i) {
+    return _mm256_loadu_ps((const float *)(v.data + i * 4));
+}
+
+template <>
+inline vector_simd vectorViewLoad<vector_blob_float16>(const VectorView &v, int64_t i) {
+    return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(v.data + i * 2)));
+}
+
+template <>
+inline vector_simd vectorViewLoad<vector_blob_bfloat16>(const VectorView &v, int64_t i) {
+    __m256i wide = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(v.data + i * 2)));
+    return _mm256_castsi256_ps(_mm256_slli_epi32(wide, 16));
+}
+
+template <>
+inline vector_simd vectorViewLoad<vector_blob_int8>(const VectorView &v, int64_t i) {
+    __m256i wide = _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)(v.data + i)));
+    return _mm256_fmadd_ps(_mm256_cvtepi32_ps(wide), _mm256_set1_ps(v.scale), _mm256_set1_ps(v.offset));
+}
+
+#elif defined(VECTOR_SIMD_NEON)
+
+typedef float32x4_t vector_simd;
+static const int64_t VECTOR_SIMD_WIDTH = 4;
+
+static inline vector_simd vectorSimdZero() { return vdupq_n_f32(0); }
+static inline vector_simd vectorSimdLoadQuery(const float *q) { return vld1q_f32(q); }
+static inline vector_simd vectorSimdSub(vector_simd a, vector_simd b) { return vsubq_f32(a, b); }
+static inline vector_simd vectorSimdFma(vector_simd a, vector_simd b, vector_simd c) { return vfmaq_f32(c, a, b); }
+static inline float vectorSimdSum(vector_simd a) { return vaddvq_f32(a); }
+
+template <int Type>
+static inline vector_simd vectorViewLoad(const VectorView &v, int64_t i);
+
+template <>
+inline vector_simd vectorViewLoad<vector_blob_float32>(const VectorView &v, int64_t i) {
+    return vreinterpretq_f32_u8(vld1q_u8(v.data + i * 4));
+}
+
+template <>
+inline vector_simd vectorViewLoad<vector_blob_float16>(const VectorView &v, int64_t i) {
+    return vcvt_f32_f16(vreinterpret_f16_u8(vld1_u8(v.data + i * 2)));
+}
+
+template <>
+inline vector_simd vectorViewLoad<vector_blob_bfloat16>(const VectorView &v, int64_t i) {
+    return vreinterpretq_f32_u32(vshll_n_u16(vreinterpret_u16_u8(vld1_u8(v.data + i * 2)), 16));
+}
+
+template <>
+inline vector_simd vectorViewLoad<vector_blob_int8>(const VectorView &v, int64_t i) {
+    // Only 4 bytes may be read, the blob can end right after them.
+    uint32_t packed;
+    memcpy(&packed, v.data + i, sizeof(packed));
+    int8x8_t bytes = vreinterpret_s8_u32(vdup_n_u32(packed));
+    float32x4_t values = vcvtq_f32_s32(vmovl_s16(vget_low_s16(vmovl_s8(bytes))));
+    return vfmaq_f32(vdupq_n_f32(v.offset), values, vdupq_n_f32(v.scale));
+}
+
+#endif
+
+#pragma endregion
+
+#pragma region Kernels
+
+template <int Type>
+static inline float vectorViewL2sqr(const VectorView &v, const float *q) {
+
+    int64_t i = 0;
+    float sum = 0;
+
+#if defined(VECTOR_SIMD_AVX512) || defined(VECTOR_SIMD_AVX2) || defined(VECTOR_SIMD_NEON)
+    vector_simd acc = vectorSimdZero();
+    for (; i + VECTOR_SIMD_WIDTH <= v.size; i += VECTOR_SIMD_WIDTH) {
+        vector_simd diff = vectorSimdSub(vectorViewLoad<Type>(v, i), vectorSimdLoadQuery(q + i));
+        acc = vectorSimdFma(diff, diff, acc);
+    }
+    sum = vectorSimdSum(acc);
+#endif
+
+    for (; i < v.size; i++) {
+        float diff = vectorViewElement<Type>(v, i) - q[i];
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+template <int Type>
+static inline float vectorViewInnerProduct(const VectorView &v, const float *q) {
+
+    int64_t i = 0;
+    float sum = 0;
+
+#if defined(VECTOR_SIMD_AVX512) || defined(VECTOR_SIMD_AVX2) || defined(VECTOR_SIMD_NEON)
+    vector_simd acc = vectorSimdZero();
+    for (; i + VECTOR_SIMD_WIDTH <= v.size; i += VECTOR_SIMD_WIDTH)
+        acc = vectorSimdFma(vectorViewLoad<Type>(v, i), vectorSimdLoadQuery(q + i), acc);
+    sum = vectorSimdSum(acc);
+#endif
+
+    for (; i < v.size; i++)
+        sum += vectorViewElement<Type>(v, i) * q[i];
+    return sum;
+}
+
+template <int Type>
+static inline float vectorViewNormL2sqr(const VectorView &v) {
+
+    int64_t i = 0;
+    float sum = 0;
+
+#if defined(VECTOR_SIMD_AVX512) || defined(VECTOR_SIMD_AVX2) || defined(VECTOR_SIMD_NEON)
+    vector_simd acc = vectorSimdZero();
+    for (; i + VECTOR_SIMD_WIDTH <= v.size; i += VECTOR_SIMD_WIDTH) {
+        vector_simd x = vectorViewLoad<Type>(v, i);
+        acc = vectorSimdFma(x, x, acc);
+    }
+    sum = vectorSimdSum(acc);
+#endif
+
+    for (; i < v.size; i++) {
+        float x = vectorViewElement<Type>(v, i);
+        sum += x * x;
+    }
+    return sum;
+}
+
+#define VECTOR_VIEW_DISPATCH(kernel, v, ...)                                         \
+    switch ((v).type) {                                                              \
+        case vector_blob_float16: return kernel<vector_blob_float16>(__VA_ARGS__);   \
+        case vector_blob_bfloat16: return kernel<vector_blob_bfloat16>(__VA_ARGS__); \
+        case vector_blob_int8: return kernel<vector_blob_int8>(__VA_ARGS__);         \
+        default: return kernel<vector_blob_float32>(__VA_ARGS__);                    \
+    }
+
+// Squared L2 distance between v and the v.size floats of q.
+static inline float vectorViewDistanceL2sqr(const VectorView &v, const float *q) {
+    VECTOR_VIEW_DISPATCH(vectorViewL2sqr, v, v, q)
+}
+
+static inline float vectorViewDistanceInnerProduct(const VectorView &v, const float *q) {
+    VECTOR_VIEW_DISPATCH(vectorViewInnerProduct, v, v, q)
+}
+
+static inline float vectorViewDistanceNormL2sqr(const VectorView &v) {
+    VECTOR_VIEW_DISPATCH(vectorViewNormL2sqr, v, v)
+}
+
+#undef VECTOR_VIEW_DISPATCH
+
+#pragma endregion
+
+#endif /* ifndef _SQLITE_VECTOR_DISTANCE_H */
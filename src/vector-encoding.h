@@ -0,0 +1,398 @@
+// Compact element types for 'v' vector blobs, and conversions between them
+// and float32. Header only, so both vector0 and vss0 can decode the blobs
+// without going through the vector0 API.
+//
+// |Type | Elements  | Layout after the 2 byte header
+// |-|-|-
+// |1    | float32   | d * 4 bytes
+// |2    | float16   | d * 2 bytes, IEEE 754 half precision
+// |3    | bfloat16  | d * 2 bytes, the upper half of a float32
+// |4    | int8      | float32 scale, float32 offset, then d bytes. Element i
+// |     |           | is scale * q[i] + offset.
+//
+// All multi-byte values are in native byte order.
+
+#ifndef _SQLITE_VECTOR_ENCODING_H
+#define _SQLITE_VECTOR_ENCODING_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+// vss0 is built with -mf16c, vector0 for any x86-64 CPU: there the F16C
+// loops are compiled for their own target and only run when cpuid has F16C.
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define VECTOR_F16C 1
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+enum VectorBlobType {
+    vector_blob_float32 = 1,
+    vector_blob_float16 = 2,
+    vector_blob_bfloat16 = 3,
+    vector_blob_int8 = 4,
+};
+
+// Bytes between the 2 byte header and the elements.
+static inline int64_t vectorBlobTypeExtra(int type) {
+
+    return type == vector_blob_int8 ? 2 * sizeof(float) : 0;
+}
+
+static inline int64_t vectorBlobTypeElementSize(int type) {
+
+    switch (type) {
+        case vector_blob_float32: return 4;
+        case vector_blob_float16: return 2;
+        case vector_blob_bfloat16: return 2;
+        case vector_blob_int8: return 1;
+        default: return 0;
+    }
+}
+
+#pragma region Scalar conversions
+
+// Round to nearest even, overflow goes to infinity and NaNs stay NaNs.
+static inline uint16_t vectorF32ToF16(float value) {
+
+    const uint32_t f32_infinity = 255u << 23;
+    const uint32_t f16_max = (127u + 16u) << 23;
+    const uint32_t denormal_magic = ((127u - 15u) + (23u - 10u) + 1u) << 23;
+
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    uint16_t sign = (bits >> 16) & 0x8000;
+    bits &= 0x7fffffff;
+
+    uint16_t half;
+    if (bits >= f16_max) {
+
+        half = bits > f32_infinity ? 0x7e00 : 0x7c00;
+
+    } else if (bits < (113u << 23)) {
+
+        // Too small for a normal half: let the float addition round the
+        // mantissa into place.
+        float f, magic;
+        memcpy(&f, &bits, sizeof(f));
+        memcpy(&magic, &denormal_magic, sizeof(magic));
+        f += magic;
+        memcpy(&bits, &f, sizeof(bits));
+        half = bits - denormal_magic;
+
+    } else {
+
+        uint32_t odd = (bits >> 13) & 1;
+        bits += ((15u - 127u) << 23) + 0xfff + odd;
+        half = bits >> 13;
+    }
+
+    return half | sign;
+}
+
+static inline float vectorF16ToF32(uint16_t half) {
+
+    uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+    uint32_t exponent = (half >> 10) & 0x1f;
+    uint32_t mantissa = half & 0x3ff;
+    uint32_t bits;
+
+    if (exponent == 0) {
+
+        // Zero or subnormal, exactly representable as a float.
+        float f = mantissa * (1.0f / 16777216.0f);
+        memcpy(&bits, &f, sizeof(bits));
+        bits |= sign;
+
+    } else if (exponent == 31) {
+
+        bits = sign | 0x7f800000 | (mantissa << 13);
+
+    } else {
+
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static inline uint16_t vectorF32ToBF16(float value) {
+
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    // Keep NaNs quiet instead of letting the rounding turn them into
+    // infinities.
+    if ((bits & 0x7fffffff) > 0x7f800000)
+        return (bits >> 16) | 0x40;
+
+    bits += 0x7fff + ((bits >> 16) & 1);
+    return bits >> 16;
+}
+
+static inline float vectorBF16ToF32(uint16_t bf16) {
+
+    uint32_t bits = (uint32_t)bf16 << 16;
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+#pragma endregion
+
+#pragma region Batch conversions
+
+// The batch conversions work on unaligned byte pointers, since blobs read
+// from SQLite have no alignment guarantees.
+
+#if defined(VECTOR_F16C)
+
+static inline bool vectorHasF16C() {
+
+#if defined(__F16C__) && defined(__AVX__)
+    return true;
+#else
+    static const bool has_f16c = [] {
+        unsigned int eax, ebx, ecx, edx;
+        return __builtin_cpu_supports("avx") && __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_F16C) != 0;
+    }();
+    return has_f16c;
+#endif
+}
+
+// Convert the first multiple of 8 elements, returning how many were done.
+__attribute__((target("avx,f16c")))
+static inline int64_t vectorDecodeF16C(const uint8_t *in, float *out, int64_t n) {
+
+    int64_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i halves = _mm_loadu_si128((const __m128i *)(in + i * 2));
+        _mm256_storeu_ps(out + i, _mm256_cvtph_ps(halves));
+    }
+    return i;
+}
+
+__attribute__((target("avx,f16c")))
+static inline int64_t vectorEncodeF16C(const float *in, uint8_t *out, int64_t n) {
+
+    int64_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i halves = _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128((__m128i *)(out + i * 2), halves);
+    }
+    return i;
+}
+
+#endif
+
+static inline void vectorDecodeF16(const uint8_t *in, float *out, int64_t n) {
+
+    int64_t i = 0;
+
+#if defined(VECTOR_F16C)
+    if (vectorHasF16C())
+        i = vectorDecodeF16C(in, out, n);
+#elif defined(__aarch64__)
+    for (; i + 4 <= n; i += 4) {
+        uint16x4_t halves = vreinterpret_u16_u8(vld1_u8(in + i * 2));
+        vst1q_f32(out + i, vcvt_f32_f16(vreinterpret_f16_u16(halves)));
+    }
+#endif
+
+    for (; i < n; i++) {
+        uint16_t half;
+        memcpy(&half, in + i * 2, sizeof(half));
+        out[i] = vectorF16ToF32(half);
+    }
+}
+
+static inline void vectorEncodeF16(const float *in, uint8_t *out, int64_t n) {
+
+    int64_t i = 0;
+
+#if defined(VECTOR_F16C)
+    if (vectorHasF16C())
+        i = vectorEncodeF16C(in, out, n);
+#elif defined(__aarch64__)
+    for (; i + 4 <= n; i += 4) {
+        float16x4_t halves = vcvt_f16_f32(vld1q_f32(in + i));
+        vst1_u8(out + i * 2, vreinterpret_u8_f16(halves));
+    }
+#endif
+
+    for (; i < n; i++) {
+        uint16_t half = vectorF32ToF16(in[i]);
+        memcpy(out + i * 2, &half, sizeof(half));
+    }
+}
+
+// bfloat16 is a shift away from float32, the compiler vectorizes these.
+static inline void vectorDecodeBF16(const uint8_t *in, float *out, int64_t n) {
+
+    for (int64_t i = 0; i < n; i++) {
+        uint16_t bf16;
+        memcpy(&bf16, in + i * 2, sizeof(bf16));
+        out[i] = vectorBF16ToF32(bf16);
+    }
+}
+
+static inline void vectorEncodeBF16(const float *in, uint8_t *out, int64_t n) {
+
+    for (int64_t i = 0; i < n; i++) {
+        uint16_t bf16 = vectorF32ToBF16(in[i]);
+        memcpy(out + i * 2, &bf16, sizeof(bf16));
+    }
+}
+
+static inline void vectorDecodeI8(const uint8_t *in, float scale, float offset, float *out, int64_t n) {
+
+    for (int64_t i = 0; i < n; i++)
+        out[i] = scale * (int8_t)in[i] + offset;
+}
+
+// Maps [min, max] onto [-127, 127], clamping values outside of it. Returns
+// the scale and offset that decode the result.
+static inline void vectorEncodeI8(const float *in, float min, float max, uint8_t *out, int64_t n,
+                                  float *scale, float *offset) {
+
+    *offset = (min + max) / 2;
+    *scale = (max - min) / 254;
+
+    float inverse = *scale > 0 ? 1 / *scale : 0;
+    for (int64_t i = 0; i < n; i++) {
+        float q = std::nearbyint((in[i] - *offset) * inverse);
+        out[i] = (uint8_t)(int8_t)std::min(127.0f, std::max(-127.0f, q));
+    }
+}
+
+// A vector read in place from a 'v' blob, without decoding it. data points
+// at the first element.
+struct VectorView {
+
+    int type;
+    const uint8_t *data;
+    int64_t size;
+
+    // int8 blobs only.
+    float scale;
+    float offset;
+};
+
+// Fills view from a 'v' blob of any known type. Returns false for anything
+// else, including blobs whose size doesn't match their type.
+static inline bool vectorViewFromBlob(const void *blob, int64_t size, VectorView *view) {
+
+    auto bytes = (const uint8_t *)blob;
+    if (blob == nullptr || size < 2 || bytes[0] != 'v')
+        return false;
+
+    int type = bytes[1];
+    auto elementSize = vectorBlobTypeElementSize(type);
+    auto bodySize = size - 2 - vectorBlobTypeExtra(type);
+    if (elementSize == 0 || bodySize < 0 || bodySize % elementSize != 0)
+        return false;
+
+    view->type = type;
+    view->size = bodySize / elementSize;
+    view->data = bytes + 2 + vectorBlobTypeExtra(type);
+    view->scale = 1;
+    view->offset = 0;
+
+    if (type == vector_blob_int8) {
+        memcpy(&view->scale, bytes + 2, sizeof(float));
+        memcpy(&view->offset, bytes + 2 + sizeof(float), sizeof(float));
+    }
+    return true;
+}
+
+// Decodes the n elements of a vector blob of the given type, starting right
+// after the 2 byte header. Returns false for unknown types.
+static inline bool vectorDecodeBlob(int type, const uint8_t *body, int64_t n, float *out) {
+
+    switch (type) {
+
+        case vector_blob_float32:
+            memcpy(out, body, n * sizeof(float));
+            return true;
+
+        case vector_blob_float16:
+            vectorDecodeF16(body, out, n);
+            return true;
+
+        case vector_blob_bfloat16:
+            vectorDecodeBF16(body, out, n);
+            return true;
+
+        case vector_blob_int8: {
+            float scale, offset;
+            memcpy(&scale, body, sizeof(float));
+            memcpy(&offset, body + sizeof(float), sizeof(float));
+            vectorDecodeI8(body + 2 * sizeof(float), scale, offset, out, n);
+            return true;
+        }
+
+        default:
+            return false;
+    }
+}
+
+#pragma endregion
+
+#pragma region Binary vectors
+
+// Binary vectors pack one bit per dimension, set when the element is
+// strictly positive: zero maps to 0, as in faiss' real_to_binary() but unlike
+// its fvecs2bitvecs() (x >= 0). Bit i is bit i % 8 of byte i / 8, the layout
+// faiss binary indexes use for their codes.
+
+static inline int64_t vectorBinarySize(int64_t d) {
+
+    return (d + 7) / 8;
+}
+
+static inline void vectorBinarize(const float *in, uint8_t *out, int64_t n) {
+
+    memset(out, 0, vectorBinarySize(n));
+    for (int64_t i = 0; i < n; i++)
+        out[i / 8] |= (uint8_t)(in[i] > 0) << (i % 8);
+}
+
+// Inverse of vectorBinarize(), as 0 and 1 elements.
+static inline void vectorUnpackBits(const uint8_t *in, float *out, int64_t n) {
+
+    for (int64_t i = 0; i < n; i++)
+        out[i] = (in[i / 8] >> (i % 8)) & 1;
+}
+
+static inline int64_t vectorHamming(const uint8_t *a, const uint8_t *b, int64_t bytes) {
+
+    int64_t distance = 0;
+    int64_t i = 0;
+
+#if defined(__GNUC__) || defined(__clang__)
+    for (; i + 8 <= bytes; i += 8) {
+        uint64_t x, y;
+        memcpy(&x, a + i, sizeof(x));
+        memcpy(&y, b + i, sizeof(y));
+        distance += __builtin_popcountll(x ^ y);
+    }
+#endif
+
+    for (; i < bytes; i++) {
+        uint8_t x = a[i] ^ b[i];
+        for (; x; x &= x - 1)
+            distance++;
+    }
+    return distance;
+}
+
+#pragma endregion
+
+#endif /* ifndef _SQLITE_VECTOR_ENCODING_H */
@@ -3,6 +3,9 @@ import unittest
 import time
 import os
 import tempfile
+import json
+import math
+import struct
 
 EXT_VSS_PATH = "./dist/debug/vss0"
 EXT_VECTOR_PATH = "./dist/debug/vector0"
@@ -61,24 +64,38 @@ def execute_all(cursor, sql, args=None):
 
 
 VSS_FUNCTIONS = [
+    "vss_assign",
+    "vss_bulk_load",
     "vss_cosine_similarity",
     "vss_debug",
+    "vss_distance_hamming",
     "vss_distance_l1",
     "vss_distance_l2",
     "vss_distance_linf",
+    "vss_explain",
     "vss_fvec_add",
     "vss_fvec_sub",
+    "vss_import_index",
     "vss_inner_product",
+    "vss_kmeans",
     "vss_memory_usage",
     "vss_range_search",
     "vss_range_search_params",
+    "vss_rebalance",
+    "vss_rebuild",
     "vss_search",
     "vss_search_params",
+    "vss_topk",
+    "vss_train",
     "vss_version",
 ]
 
 VSS_MODULES = [
     "vss0",
+    "vss_indexes",
+    "vss_knn",
+    "vss_knn_join",
+    "vss_stats",
 ]
 
 
@@ -122,6 +139,30 @@ class TestVss(unittest.TestCase):
         self.assertEqual(vss_distance_l2("[0, 0]", "[0, 0]"), 0.0)
         self.assertEqual(vss_distance_l2("[0, 0]", "[0, 1]"), 1.0)
 
+    def test_vss_distance_hamming(self):
+        vss_distance_hamming = lambda a, b: db.execute(
+            "select vss_distance_hamming(?, ?)", [a, b]
+        ).fetchone()[0]
+        self.assertEqual(vss_distance_hamming(b"\x00\x00", b"\x00\x00"), 0)
+        self.assertEqual(vss_distance_hamming(b"\x0f\x01", b"\xf0\x00"), 9)
+        self.assertEqual(vss_distance_hamming(bytes(range(16)), bytes(16)), 32)
+
+        # other vectors are binarized first
+        self.assertEqual(vss_distance_hamming("[1, -1, 2]", "[-1, -1, 2]"), 1)
+        self.assertEqual(
+            db.execute(
+                "select vss_distance_hamming(vector_to_blob(vector_from_json(?)), vector_binarize(vector_from_json(?)))",
+                ["[1, -1, 0]", "[-1, -1, 0]"],
+            ).fetchone()[0],
+            1,
+        )
+
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError,
+            "LHS and RHS are not binary vectors of the same size",
+        ):
+            vss_distance_hamming(b"\x00", b"\x00\x00")
+
     def test_vss_distance_linf(self):
         vss_distance_linf = lambda a, b: db.execute(
             "select vss_distance_linf(json(?), json(?))", [a, b]
@@ -143,6 +184,85 @@ class TestVss(unittest.TestCase):
         self.assertAlmostEqual(vss_cosine_similarity("[2, 1]", "[1, 2]"), 0.8)
         self.assertEqual(vss_cosine_similarity("[1, 1]", "[-1, 1]"), 0.0)
 
+    def test_vss_distance_encoded(self):
+        # 19 dimensions, so both the SIMD loops and their tails run
+        stored = [(i - 9) / 4 for i in range(19)]
+        query = [((i * 7) % 19 - 9) / 5 for i in range(19)]
+
+        for encode in ["vector_to_f16", "vector_to_bf16", "vector_quantize_i8"]:
+            blob = db.execute(
+                f"select {encode}(vector_from_json(?))", [json.dumps(stored)]
+            ).fetchone()[0]
+            decoded = json.loads(
+                db.execute("select vector_to_json(?)", [blob]).fetchone()[0]
+            )
+            l2 = sum((a - b) ** 2 for a, b in zip(decoded, query))
+            ip = sum(a * b for a, b in zip(decoded, query))
+            cosine = ip / (
+                math.sqrt(sum(a * a for a in decoded))
+                * math.sqrt(sum(b * b for b in query))
+            )
+
+            for function, expected in [
+                ("vss_distance_l2", l2),
+                ("vss_inner_product", ip),
+                ("vss_cosine_similarity", cosine),
+            ]:
+                # the encoded side can be either argument
+                for sql in [
+                    f"select {function}(?1, vector_from_json(?2))",
+                    f"select {function}(vector_from_json(?2), ?1)",
+                ]:
+                    result = db.execute(sql, [blob, json.dumps(query)]).fetchone()[0]
+                    self.assertAlmostEqual(result, expected, delta=1e-5 * max(1, abs(expected)))
+
+            with self.assertRaisesRegex(
+                sqlite3.OperationalError, "LHS and RHS are not vectors of the same size"
+            ):
+                db.execute(
+                    "select vss_distance_l2(?, vector_from_json('[1, 2]'))", [blob]
+                ).fetchone()
+            with self.assertRaisesRegex(sqlite3.OperationalError, "RHS is not a vector"):
+                db.execute("select vss_inner_product(?, 'nope')", [blob]).fetchone()
+
+    def test_vss_distance_constant_operand(self):
+        # the bound query is decoded once per statement and reused on every
+        # row, every row must still see its own vector
+        rows = [[1, 0], [0, 2], [3, 4], [-1, 1]]
+        query = [1, 1]
+        for function, expected in [
+            ("vss_distance_l2", lambda a: sum((x - y) ** 2 for x, y in zip(a, query))),
+            ("vss_inner_product", lambda a: sum(x * y for x, y in zip(a, query))),
+            (
+                "vss_cosine_similarity",
+                lambda a: sum(x * y for x, y in zip(a, query))
+                / (math.sqrt(sum(x * x for x in a)) * math.sqrt(2)),
+            ),
+        ]:
+            for sql in [
+                f"select {function}(value, json(:q)) from json_each(:rows)",
+                f"select {function}(json(:q), value) from json_each(:rows)",
+            ]:
+                results = db.execute(
+                    sql, {"q": json.dumps(query), "rows": json.dumps(rows)}
+                ).fetchall()
+                for (result,), row in zip(results, rows):
+                    self.assertAlmostEqual(result, expected(row), places=5)
+
+        self.assertEqual(
+            db.execute(
+                "select vss_distance_hamming(value, :q) from json_each(:rows)",
+                {"q": "[1, 1]", "rows": json.dumps(rows)},
+            ).fetchall(),
+            [(1,), (1,), (0,), (1,)],
+        )
+
+        with self.assertRaisesRegex(sqlite3.OperationalError, "LHS is not a vector"):
+            db.execute(
+                "select vss_distance_l2(value, json(:q)) from json_each(:rows)",
+                {"q": "[1, 1]", "rows": '[[1, 0], "nope"]'},
+            ).fetchall()
+
     def test_vss_fvec_add(self):
         vss_fvec_add = lambda a, b: db.execute(
             "select vss_fvec_add(json(?), json(?))", [a, b]
@@ -173,11 +293,239 @@ class TestVss(unittest.TestCase):
         )
         self.skipTest("TODO")
 
+    def test_vss_topk(self):
+        db.execute(
+            "create temp table topk_items(category, embedding)"
+        )
+        db.executemany(
+            "insert into topk_items values (?, ?)",
+            [
+                ("a", "[0, 0]"),
+                ("a", "[1, 0]"),
+                ("b", "[2, 0]"),
+                ("a", "[3, 0]"),
+                ("b", "[4, 0]"),
+                ("b", None),
+            ],
+        )
+        topk = lambda sql, *args: [
+            (row["rowid"], row["distance"])
+            for row in json.loads(db.execute(sql, args).fetchone()[0])
+        ]
+
+        self.assertEqual(
+            topk(
+                "select vss_topk(rowid, embedding, json(?), 3) from topk_items",
+                "[2.5, 0]",
+            ),
+            [(3, 0.25), (4, 0.25), (2, 2.25)],
+        )
+        self.assertEqual(
+            topk(
+                "select vss_topk(rowid, embedding, json('[1, 0]'), 2, 'INNER_PRODUCT') "
+                "from topk_items where category = 'a'",
+            ),
+            [(4, 3.0), (2, 1.0)],
+        )
+        self.assertEqual(
+            topk(
+                "select vss_topk(rowid, embedding, json('[4, 0]'), 1, 'L1') from topk_items",
+            ),
+            [(5, 0.0)],
+        )
+        self.assertEqual(
+            db.execute(
+                "select category, vss_topk(rowid, embedding, json('[0, 0]'), 1) "
+                "from topk_items group by category order by category"
+            ).fetchall(),
+            [
+                ("a", '[{"rowid":1,"distance":0.0}]'),
+                ("b", '[{"rowid":3,"distance":4.0}]'),
+            ],
+        )
+        self.assertEqual(
+            db.execute(
+                "select vss_topk(rowid, embedding, json('[0, 0]'), 1) from topk_items where 0"
+            ).fetchone()[0],
+            "[]",
+        )
+
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "4th argument to vss_topk\\(\\) must be a positive integer"
+        ):
+            topk("select vss_topk(rowid, embedding, json('[0, 0]'), 0) from topk_items")
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "5th argument to vss_topk\\(\\) must be one of"
+        ):
+            topk("select vss_topk(rowid, embedding, json('[0, 0]'), 1, 'nope') from topk_items")
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "must have the size of the query"
+        ):
+            topk("select vss_topk(rowid, embedding, json('[0, 0, 0]'), 1) from topk_items")
+
+        db.execute("drop table topk_items")
+
+    def test_vss_kmeans(self):
+        points = json.dumps([[0, 0], [0, 1], [10, 10], [10, 11], [0, 0.5], [10, 10.5]])
+        centroids = db.execute(
+            "select vss_kmeans(value, 2, 10) from json_each(?)", [points]
+        ).fetchone()[0]
+        self.assertEqual(centroids[:16], b"m\x01\x00\x00" + struct.pack("<iq", 2, 2))
+        self.assertEqual(
+            sorted(struct.unpack("<4f", centroids[16:])[i : i + 2] for i in (0, 2)),
+            [(0, 0.5), (10, 10.5)],
+        )
+
+        labels = [
+            row[0]
+            for row in db.execute(
+                "select vss_assign(value, ?) from json_each(?)", [centroids, points]
+            ).fetchall()
+        ]
+        self.assertEqual(labels[0], labels[1])
+        self.assertEqual(labels[0], labels[4])
+        self.assertEqual(labels[2], labels[3])
+        self.assertNotEqual(labels[0], labels[2])
+
+        self.assertEqual(db.execute("select vss_kmeans(null, 2)").fetchone()[0], None)
+
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "needs at least 3 vectors for 3 centroids, got 2"
+        ):
+            db.execute("select vss_kmeans(value, 3) from json_each('[[1], [2]]')").fetchone()
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "vector has 3 dimensions, the centroids have 2"
+        ):
+            db.execute("select vss_assign('[1, 2, 3]', ?)", [centroids]).fetchone()
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "2nd argument to vss_assign\\(\\) must be a matrix"
+        ):
+            db.execute("select vss_assign('[1, 2]', '[1, 2]')").fetchone()
+
+    def test_vss_knn(self):
+        db.execute("create temp table knn_items(embedding)")
+        db.executemany(
+            "insert into knn_items values (?)",
+            [("[0, 0]",), ("[1, 0]",), ("[2, 0]",), ("[3, 0]",), (None,)],
+        )
+
+        results = db.execute(
+            "select query_idx, rowid, distance from vss_knn('knn_items', 'embedding', json('[2.2, 0]'), 2)"
+        ).fetchall()
+        self.assertEqual([row[:2] for row in results], [(0, 3), (0, 4)])
+        self.assertAlmostEqual(results[0][2], 0.04, places=5)
+        self.assertAlmostEqual(results[1][2], 0.64, places=5)
+
+        # several queries at once, as a matrix
+        self.assertEqual(
+            db.execute(
+                "select query_idx, rowid from vss_knn('knn_items', 'embedding', "
+                "(select vector_matrix(value) from json_each('[[0, 0], [3, 0]]')), 1)"
+            ).fetchall(),
+            [(0, 1), (1, 4)],
+        )
+
+        # a query source reads rowids from its first column
+        self.assertEqual(
+            db.execute(
+                "select rowid, distance from vss_knn("
+                "'select rowid * 10, embedding as e from knn_items where rowid > 1', 'e', "
+                "json('[1, 0]'), 2, 'INNER_PRODUCT')"
+            ).fetchall(),
+            [(40, 3.0), (30, 2.0)],
+        )
+
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "k of vss_knn\\(\\) must be a positive integer"
+        ):
+            db.execute(
+                "select * from vss_knn('knn_items', 'embedding', json('[0, 0]'), 0)"
+            ).fetchall()
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "has 2 dimensions, expected 3"
+        ):
+            db.execute(
+                "select * from vss_knn('knn_items', 'embedding', json('[0, 0, 0]'), 1)"
+            ).fetchall()
+
+        db.execute("drop table knn_items")
+
+    def test_vss_knn_join(self):
+        db = connect()
+        db.execute("create virtual table x using vss0(a(2))")
+        db.execute(
+            "insert into x(rowid, a) select key + 1, value from json_each(?)",
+            ["[[0, 0], [1, 0], [5, 5]]"],
+        )
+        db.execute("create table items(e)")
+        db.execute("insert into items(rowid, e) values (10, '[0.25, 0]'), (20, '[5, 4]'), (30, null)")
+        db.commit()
+
+        results = db.execute(
+            "select left_rowid, right_rowid, distance from vss_knn_join('items', 'e', 'x', 'a', 2)"
+        ).fetchall()
+        self.assertEqual([row[:2] for row in results], [(10, 1), (10, 2), (20, 3), (20, 2)])
+        self.assertEqual([row[2] for row in results], [0.0625, 0.5625, 1.0, 32.0])
+
+        # k is capped by the size of the index, and the left side can be a
+        # query, here the vss0 table itself
+        self.assertEqual(
+            db.execute(
+                "select count(*) from vss_knn_join('select rowid, a from x', null, 'x', 'a', 10) "
+                "where left_rowid != right_rowid"
+            ).fetchone()[0],
+            6,
+        )
+
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "could not find vss0 table nope"
+        ):
+            db.execute("select * from vss_knn_join('items', 'e', 'nope', 'a', 1)").fetchall()
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "has 3 dimensions, expected 2"
+        ):
+            db.execute(
+                "select * from vss_knn_join('select 1, json(''[1, 2, 3]'')', null, 'x', 'a', 1)"
+            ).fetchall()
+
     def test_vss_search(self):
         self.skipTest("TODO")
 
     def test_vss_search_params(self):
-        self.skipTest("TODO")
+        db = connect()
+        db.execute('create virtual table x using vss0(a(2) factory="IVF2,Flat,IDMap2")')
+        db.execute(
+            "insert into x(operation, a) select 'training', value from json_each(?)",
+            ["[[0, 0], [1, 1], [10, 10], [11, 11]]"],
+        )
+        db.execute(
+            "insert into x(rowid, a) values (1, '[0, 0]'), (2, '[1, 1]'), (3, '[10, 10]')"
+        )
+        db.commit()
+
+        search = "select rowid from x where vss_search(a, vss_search_params(?, 3, ?))"
+
+        def explain(nprobe):
+            report = json.loads(
+                db.execute("select vss_explain(?, ?, ?)", [search, "[5, 5]", nprobe]).fetchone()[0]
+            )
+            return report["rows"], report["scans"][0]["nprobe"]
+
+        # nprobe is set for the one search, and capped at the number of lists
+        self.assertEqual(explain(None), (2, 1))
+        self.assertEqual(explain(2), (3, 2))
+        self.assertEqual(explain(None), (2, 1))
+        self.assertEqual(explain(64), (3, 2))
+
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "nprobe must be a positive integer"
+        ):
+            db.execute(search, ["[5, 5]", 0])
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "ef_search must be a positive integer"
+        ):
+            db.execute("select vss_search_params('[5, 5]', 3, null, 'x')")
+        db.close()
 
     def test_vss_memory_usage(self):
         self.skipTest("TODO")
@@ -666,7 +1014,7 @@ class TestVss(unittest.TestCase):
             db.execute("create virtual table xx using vss0( a(2) metric_type=)")
         with self.assertRaisesRegex(
             sqlite3.OperationalError,
-            "Error parsing constructor: storage_type value must be one of faiss_shadow or faiss_ondisk",
+            "Error parsing constructor: storage_type value must be one of faiss_shadow, faiss_ondisk or faiss_ivflists",
         ):
             db.execute("create virtual table xx using vss0( a(2) storage_type=xxx)")
 
@@ -767,138 +1115,1262 @@ class TestVss(unittest.TestCase):
                 "create virtual table vss_on_disk using vss0(a(2) storage_type=faiss_ondisk)"
             )
 
-    def test_vss_training(self):
-        import random
-        import json
+    def test_vss0_storage_type_ivflists(self):
+        tf = tempfile.NamedTemporaryFile(delete=False)
+        tf.close()
+        self.addCleanup(os.remove, tf.name)
 
-        cur = db.cursor()
-        execute_all(
-            cur,
-            'create virtual table with_training using vss0(a(4) factory="IVF10,Flat,IDMap2", b(4) factory="IVF10,Flat,IDMap2")',
+        data = "[[0, 0], [1, 0], [10, 10], [11, 10], [0, 1], [10, 11]]"
+        db = connect(tf.name)
+        db.execute(
+            'create virtual table x using vss0(a(2) factory="IVF2,Flat,IDMap2" storage_type=faiss_ivflists)'
         )
-        data = list(
-            map(
-                lambda x: [
-                    random.uniform(0, 1),
-                    random.uniform(0, 1),
-                    random.uniform(0, 1),
-                    random.uniform(0, 1),
-                ],
-                range(0, 1000),
-            )
+        db.execute(
+            "insert into x(operation, a) select 'training', value from json_each(?)",
+            [data],
         )
-        execute_all(
-            cur,
-            """
-        insert into with_training(operation, a, b)
-          select
-            'training',
-            value,
-            value
-          from json_each(?)
-      """,
-            [json.dumps(data)],
+        db.commit()
+        db.execute(
+            "insert into x(rowid, a) select key + 1, value from json_each(?)", [data]
         )
         db.commit()
+
+        # one row per non-empty list, the _index header holds none of them
         self.assertEqual(
-            cur.execute("select count(*) from with_training").fetchone()[0], 0
+            execute_all(
+                db, "select col, length(ids) / 8 as n from x_ivflists order by n"
+            ),
+            [{"col": 0, "n": 3}, {"col": 0, "n": 3}],
         )
+        search = "select rowid from x where vss_search(a, vss_search_params(?, 2))"
+        self.assertEqual(execute_all(db, search, ["[10, 20]"]), [{"rowid": 6}, {"rowid": 3}])
 
-        execute_all(
-            cur,
-            """
-        insert into with_training(rowid, a, b)
-          select
-            key,
-            value,
-            value
-          from json_each(?)
-      """,
-            [json.dumps(data)],
+        # the IDMap2 is dropped, x_ivfrows says which list each rowid is in
+        self.assertEqual(
+            execute_all(
+                db,
+                "select count(*) as n, count(distinct list) as lists from x_ivfrows where col = 0",
+            ),
+            [{"n": 6, "lists": 2}],
         )
         self.assertEqual(
-            cur.execute("select count(*) from with_training").fetchone()[0], 1000
+            execute_all(db, "select vector_to_json(a) as a from x where rowid = 3"),
+            [{"a": "[10,10]"}],
         )
+
+        # only the list that held rowid 6 changes
+        db.execute("delete from x where rowid = 6")
         db.commit()
         self.assertEqual(
-            cur.execute("select count(*) from with_training").fetchone()[0], 1000
+            execute_all(
+                db, "select col, length(ids) / 8 as n from x_ivflists order by n"
+            ),
+            [{"col": 0, "n": 2}, {"col": 0, "n": 3}],
         )
-
-    def test_vss0_issue_29_upsert(self):
-        db = connect()
-        execute_all(db, "")
-        db.executescript(
-            """
-    create virtual table demo using vss0(a(2));
-
-    insert into demo(rowid, a)
-      values (1, '[1.0, 2.0]'), (2, '[2.0, 3.0]');
-    """
+        self.assertEqual(
+            execute_all(db, "select id from x_ivfrows where id >= 5 order by id"),
+            [{"id": 5}],
         )
+        self.assertEqual(execute_all(db, search, ["[10, 20]"]), [{"rowid": 3}, {"rowid": 4}])
+        db.close()
 
+        db = connect(tf.name)
+        self.assertEqual(execute_all(db, search, ["[10, 20]"]), [{"rowid": 3}, {"rowid": 4}])
         self.assertEqual(
-            execute_all(db, "select rowid, vector_debug(a) from demo;"),
-            [
-                {"rowid": 1, "vector_debug(a)": "size: 2 [1.000000, 2.000000]"},
-                {"rowid": 2, "vector_debug(a)": "size: 2 [2.000000, 3.000000]"},
-            ],
+            execute_all(
+                db,
+                "select storage_type, ntotal from vss_indexes where table_name = 'x'",
+            ),
+            [{"storage_type": "faiss_ivflists", "ntotal": 5}],
         )
 
-        db.executescript(
-            """
-    delete from demo where rowid = 1;
-    insert into demo(rowid, a) select 1, '[99.0, 99.0]';
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError,
+            "storage_type=faiss_ivflists on a needs a float IVF factory",
+        ):
+            db.execute("create virtual table y using vss0(a(2) storage_type=faiss_ivflists)")
+        db.close()
 
-    delete from demo where rowid = 2;
-    insert into demo(rowid, a) select 2, '[299.0, 299.0]';
-    """
+    def test_vss0_vamana(self):
+        tf = tempfile.NamedTemporaryFile(delete=False)
+        tf.close()
+        self.addCleanup(os.remove, tf.name)
+
+        db = connect(tf.name)
+        db.execute('create virtual table x using vss0(a(2) factory="Vamana4")')
+        db.execute(
+            "insert into x(rowid, a) select key + 1, value from json_each(?)",
+            ["[[0, 0], [1, 0], [10, 10], [11, 10], [0, 1], [10, 11]]"],
         )
+        db.commit()
 
-        # This is what used to fail, since we we're clearing deleted IDs properly
+        # one row per node, with its full vector and at most 4 neighbors
         self.assertEqual(
-            execute_all(db, "select rowid, vector_debug(a) from demo;"),
-            [
-                {"rowid": 1, "vector_debug(a)": "size: 2 [99.000000, 99.000000]"},
-                {"rowid": 2, "vector_debug(a)": "size: 2 [299.000000, 299.000000]"},
-            ],
+            execute_all(
+                db,
+                "select count(*) as nodes, max(length(vector)) as vector, max(length(neighbors)) <= 32 as degree from x_graph",
+            ),
+            [{"nodes": 6, "vector": 8, "degree": 1}],
+        )
+        search = "select rowid, vector_to_json(a) as a from x where vss_search(a, vss_search_params(?, 2))"
+        self.assertEqual(
+            execute_all(db, search, ["[10, 20]"]),
+            [{"rowid": 6, "a": "[10,11]"}, {"rowid": 3, "a": "[10,10]"}],
+        )
+
+        db.execute("delete from x where rowid = 6")
+        db.commit()
+        self.assertEqual(db.execute("select count(*) from x_graph").fetchone()[0], 5)
+        self.assertEqual(
+            execute_all(db, search, ["[10, 20]"]),
+            [{"rowid": 3, "a": "[10,10]"}, {"rowid": 4, "a": "[11,10]"}],
         )
         db.close()
 
-    # Make sure tha VACUUMing a database with vss0 tables still works as expected
-    def test_vss0_vacuum(self):
-        cur = db.cursor()
-        execute_all(cur, "create virtual table x using vss0(a(2));")
-        execute_all(
-            cur,
-            """
-      insert into x(rowid, a)
-        select
-          key + 1000,
+        db = connect(tf.name)
+        self.assertEqual(
+            execute_all(db, search, ["[10, 20]"]),
+            [{"rowid": 3, "a": "[10,10]"}, {"rowid": 4, "a": "[11,10]"}],
+        )
+        self.assertEqual(
+            execute_all(
+                db,
+                "select factory, ntotal, is_trained from vss_indexes where table_name = 'x'",
+            ),
+            [{"factory": "Vamana4", "ntotal": 5, "is_trained": 1}],
+        )
+
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "could not parse Vamana factory string Vamana4,PQ"
+        ):
+            db.execute('create virtual table y using vss0(a(2) factory="Vamana4,PQ")')
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "Vamana column a is stored in the _graph shadow table"
+        ):
+            db.execute(
+                'create virtual table y using vss0(a(2) factory="Vamana4" storage_type=faiss_ondisk)'
+            )
+
+        db.execute("update x_index set idx = substr(idx, 1, 8)")
+        db.commit()
+        db.close()
+        db = connect(tf.name)
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError,
+            "Could not read index at position 0: truncated Vamana index header",
+        ):
+            db.execute("select * from x").fetchall()
+        db.close()
+
+    def test_vss0_vamana_pq(self):
+        import random
+
+        random.seed(0)
+        data = [[random.uniform(-1, 1) for _ in range(4)] for _ in range(300)]
+
+        db = connect()
+        db.execute('create virtual table x using vss0(a(4) factory="Vamana8,PQ2")')
+        self.assertEqual(
+            db.execute("select is_trained from vss_indexes").fetchone()[0], 0
+        )
+        db.execute(
+            "insert into x(operation, a) select 'training', value from json_each(?)",
+            [json.dumps(data)],
+        )
+        db.commit()
+        db.execute(
+            "insert into x(rowid, a) select key + 1, value from json_each(?)",
+            [json.dumps(data[:50])],
+        )
+        db.commit()
+
+        # codes rank the candidates, full vectors the results
+        self.assertEqual(
+            execute_all(db, "select length(code) as code from x_graph group by 1"),
+            [{"code": 2}],
+        )
+        for rowid in [1, 17, 50]:
+            self.assertEqual(
+                db.execute(
+                    "select rowid from x where vss_search(a, vss_search_params(?, 1))",
+                    [json.dumps(data[rowid - 1])],
+                ).fetchone()[0],
+                rowid,
+            )
+
+    def test_vss0_partitions(self):
+        tf = tempfile.NamedTemporaryFile(delete=False)
+        tf.close()
+        self.addCleanup(os.remove, tf.name)
+
+        db = connect(tf.name)
+        db.execute(
+            'create virtual table x using vss0(tenant_id partition, a(2) factory="IVF2,Flat,IDMap2" flat_below=4)'
+        )
+        db.execute(
+            """
+            insert into x(rowid, tenant_id, a) values
+              (1, 1, '[0, 0]'), (2, 1, '[1, 0]'), (3, 1, '[10, 10]'), (4, 1, '[11, 10]'),
+              (5, 'b', '[10, 11]')
+            """
+        )
+        db.commit()
+
+        self.assertEqual(
+            execute_all(db, "select key, partition from x_partitions order by partition"),
+            [{"key": 1, "partition": 1}, {"key": "b", "partition": 2}],
+        )
+
+        search = "select rowid, tenant_id from x where vss_search(a, vss_search_params(?, 2)) and tenant_id = ?"
+        self.assertEqual(
+            execute_all(db, search, ["[10, 20]", 1]),
+            [{"rowid": 3, "tenant_id": 1}, {"rowid": 4, "tenant_id": 1}],
+        )
+        self.assertEqual(
+            execute_all(db, search, ["[10, 20]", "b"]),
+            [{"rowid": 5, "tenant_id": "b"}],
+        )
+        self.assertEqual(execute_all(db, search, ["[10, 20]", "c"]), [])
+
+        # searches of every partition add up in the column's stats
+        self.assertEqual(
+            execute_all(db, "select column_name, searches, latency_p50 is not null as has_latency from vss_stats('x')"),
+            [{"column_name": "a", "searches": 2, "has_latency": 1}],
+        )
+
+        # the partition of tenant 1 reached flat_below and switched to IVF
+        def explain(tenant_id):
+            report = json.loads(
+                db.execute("select vss_explain(?, ?, ?)", [search, "[10, 20]", tenant_id]).fetchone()[0]
+            )
+            return {key: report["scans"][0][key] for key in ["plan", "constraints", "nprobe"]}
+
+        self.assertEqual(
+            explain(1),
+            {"plan": "search", "constraints": ["partition", "vss_search_params"], "nprobe": 1},
+        )
+        self.assertEqual(
+            explain("b"),
+            {"plan": "search", "constraints": ["partition", "vss_search_params"], "nprobe": None},
+        )
+
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError,
+            "vss_search\\(\\) on partitioned table x needs a tenant_id = constraint",
+        ):
+            db.execute(
+                "select rowid from x where vss_search(a, vss_search_params('[0, 0]', 2))"
+            ).fetchall()
+
+        db.execute("delete from x where rowid = 4")
+        db.commit()
+        db.close()
+
+        db = connect(tf.name)
+        self.assertEqual(
+            execute_all(db, search, ["[0, 0]", 1]),
+            [{"rowid": 1, "tenant_id": 1}, {"rowid": 2, "tenant_id": 1}],
+        )
+        self.assertEqual(
+            execute_all(db, search, ["[10, 20]", 1]), [{"rowid": 3, "tenant_id": 1}]
+        )
+        self.assertEqual(
+            execute_all(db, "select rowid, tenant_id, vector_to_json(a) as a from x"),
+            [
+                {"rowid": 1, "tenant_id": 1, "a": "[0,0]"},
+                {"rowid": 2, "tenant_id": 1, "a": "[1,0]"},
+                {"rowid": 3, "tenant_id": 1, "a": "[10,10]"},
+                {"rowid": 5, "tenant_id": "b", "a": "[10,11]"},
+            ],
+        )
+        self.assertEqual(
+            execute_all(db, "select rowid from x where tenant_id = 'b'"), [{"rowid": 5}]
+        )
+
+        # partitions created in a rolled back transaction are forgotten
+        db.execute("insert into x(rowid, tenant_id, a) values (6, 'c', '[0, 0]')")
+        db.rollback()
+        self.assertEqual(execute_all(db, search, ["[0, 0]", "c"]), [])
+        self.assertEqual(db.execute("select count(*) from x_partitions").fetchone()[0], 2)
+
+        # more partitions than stay loaded, unwritten ones are kept until commit
+        db.execute(
+            "insert into x(rowid, tenant_id, a) select 100 + key, 100 + key, json_array(key, 0) from json_each(?)",
+            [json.dumps([0] * 100)],
+        )
+        for tenant_id in [100, 150, 199]:
+            self.assertEqual(
+                execute_all(db, search, ["[0, 0]", tenant_id]),
+                [{"rowid": tenant_id, "tenant_id": tenant_id}],
+            )
+        db.commit()
+        for tenant_id in range(100, 200):
+            self.assertEqual(
+                execute_all(db, search, ["[0, 0]", tenant_id]),
+                [{"rowid": tenant_id, "tenant_id": tenant_id}],
+            )
+        self.assertEqual(
+            execute_all(db, search, ["[10, 20]", 1]), [{"rowid": 3, "tenant_id": 1}]
+        )
+
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "tenant_id must be an integer or text partition key"
+        ):
+            db.execute("insert into x(rowid, a) values (7, '[0, 0]')")
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "vss_rebuild\\(\\) doesn't support partitioned tables like x"
+        ):
+            db.execute("select vss_rebuild('x', 'a', 'Flat,IDMap2')")
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "Only one partition column is allowed"
+        ):
+            db.execute("create virtual table y using vss0(t partition, u partition, a(2))")
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "flat_below=0 on a needs a factory that doesn't need training"
+        ):
+            db.execute(
+                'create virtual table y using vss0(t partition, a(2) factory="IVF2,Flat,IDMap2" flat_below=0)'
+            )
+        db.close()
+
+    def test_vss_training(self):
+        import random
+        import json
+
+        cur = db.cursor()
+        execute_all(
+            cur,
+            'create virtual table with_training using vss0(a(4) factory="IVF10,Flat,IDMap2", b(4) factory="IVF10,Flat,IDMap2")',
+        )
+        data = list(
+            map(
+                lambda x: [
+                    random.uniform(0, 1),
+                    random.uniform(0, 1),
+                    random.uniform(0, 1),
+                    random.uniform(0, 1),
+                ],
+                range(0, 1000),
+            )
+        )
+        execute_all(
+            cur,
+            """
+        insert into with_training(operation, a, b)
+          select
+            'training',
+            value,
+            value
+          from json_each(?)
+      """,
+            [json.dumps(data)],
+        )
+        db.commit()
+        self.assertEqual(
+            cur.execute("select count(*) from with_training").fetchone()[0], 0
+        )
+
+        execute_all(
+            cur,
+            """
+        insert into with_training(rowid, a, b)
+          select
+            key,
+            value,
+            value
+          from json_each(?)
+      """,
+            [json.dumps(data)],
+        )
+        self.assertEqual(
+            cur.execute("select count(*) from with_training").fetchone()[0], 1000
+        )
+        db.commit()
+        self.assertEqual(
+            cur.execute("select count(*) from with_training").fetchone()[0], 1000
+        )
+
+    def test_vss_train(self):
+        db = connect()
+        db.execute('create virtual table x using vss0(a(2) factory="IVF2,Flat,IDMap2")')
+        db.execute("create table source(v)")
+        db.executemany(
+            "insert into source(v) values (?)",
+            [(f"[{c + i * 0.1}, {c}]",) for c in [0, 10] for i in range(10)],
+        )
+        db.commit()
+
+        # a sample of the source, at most sample_size vectors
+        self.assertEqual(
+            db.execute(
+                "select vss_train('x', 'a', 8, 42, 'select rowid, v from source')"
+            ).fetchone()[0],
+            8,
+        )
+        self.assertEqual(
+            db.execute(
+                "select vss_train('x', 'a', 100, 42, 'select rowid, v from source', 1)"
+            ).fetchone()[0],
+            20,
+        )
+        db.execute(
+            "insert into x(rowid, a) values (1, '[0, 0]'), (2, '[1, 0]'), (3, '[10, 10]'), (4, '[11, 10]')"
+        )
+        db.commit()
+
+        # retraining on the stored vectors keeps them
+        self.assertEqual(db.execute("select vss_train('x', 'a', 3)").fetchone()[0], 3)
+        self.assertEqual(
+            execute_all(
+                db,
+                "select rowid, distance from x where vss_search(a, vss_search_params(?, 2))",
+                ["[10, 10]"],
+            ),
+            [{"rowid": 3, "distance": 0.0}, {"rowid": 4, "distance": 1.0}],
+        )
+        self.assertEqual(
+            db.execute(
+                "select ntotal, is_trained from vss_indexes where table_name = 'x'"
+            ).fetchone(),
+            (4, 1),
+        )
+
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "sample_size must be a positive integer"
+        ):
+            db.execute("select vss_train('x', 'a', 0)")
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "found no vectors to train column a on"
+        ):
+            db.execute('create virtual table y using vss0(a(2) factory="IVF2,Flat,IDMap2")')
+            db.execute("select vss_train('y', 'a', 10)")
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "has 3 dimensions, expected 2"
+        ):
+            db.execute(
+                "select vss_train('y', 'a', 10, 0, ?)", ["select 1, '[1, 2, 3]'"]
+            )
+
+        # SQ8 codes only decode to approximations of the stored vectors
+        db.execute('create virtual table z using vss0(a(2) factory="SQ8,IDMap2")')
+        db.execute(
+            "insert into z(operation, a) select 'training', value from json_each(?)",
+            ["[[0, 0], [10, 10]]"],
+        )
+        db.commit()
+        db.execute("insert into z(rowid, a) values (1, '[1, 1]')")
+        db.commit()
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError,
+            "vss_train\\(\\) can't move the vectors of column a, its index is lossy",
+        ):
+            db.execute("select vss_train('z', 'a', 10)")
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "can't run inside a transaction"
+        ):
+            db.execute("begin")
+            db.execute("select vss_train('x', 'a', 10)")
+        db.execute("rollback")
+        db.close()
+
+    def test_vss_rebalance(self):
+        db = connect()
+        db.execute('create virtual table x using vss0(a(2) factory="IVF2,Flat,IDMap2")')
+        db.execute(
+            "insert into x(operation, a) select 'training', value from json_each(?)",
+            ["[[0, 0], [1, 1], [10, 10], [11, 11]]"],
+        )
+        db.commit()
+
+        # the data drifted away from both centroids, into a single list
+        db.execute(
+            "insert into x(rowid, a) select key + 1, value from json_each(?)",
+            [
+                json.dumps(
+                    [[100 + i * 0.1, 100] for i in range(5)]
+                    + [[200 + i * 0.1, 200] for i in range(5)]
+                )
+            ],
+        )
+        db.commit()
+
+        report = json.loads(
+            db.execute("select vss_rebalance('x', 'a', 5.0)").fetchone()[0]
+        )
+        self.assertEqual(report["rebalanced"], False)
+        self.assertEqual(report["before"]["imbalance_factor"], 2.0)
+        self.assertNotIn("after", report)
+
+        report = json.loads(
+            db.execute("select vss_rebalance('x', 'a', 1.5)").fetchone()[0]
+        )
+        self.assertEqual(report["ntotal"], 10)
+        self.assertEqual(report["sample_size"], 9)
+        self.assertEqual(report["held_out"], 1)
+        self.assertEqual(report["rebalanced"], True)
+        self.assertEqual(report["after"]["imbalance_factor"], 1.0)
+        self.assertLess(
+            report["after"]["quantization_error"],
+            report["before"]["quantization_error"],
+        )
+
+        self.assertEqual(
+            execute_all(
+                db,
+                "select rowid, distance from x where vss_search(a, vss_search_params(?, 1))",
+                ["[200, 200]"],
+            ),
+            [{"rowid": 6, "distance": 0.0}],
+        )
+        self.assertEqual(
+            db.execute(
+                "select imbalance_factor from vss_indexes where table_name = 'x'"
+            ).fetchone()[0],
+            1.0,
+        )
+
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "column b isn't a trained IVF index"
+        ):
+            db.execute("create virtual table y using vss0(b(2))")
+            db.execute("select vss_rebalance('y', 'b')")
+        db.close()
+
+    def test_vss_rebuild(self):
+        tf = tempfile.NamedTemporaryFile(delete=False)
+        tf.close()
+        self.addCleanup(os.remove, tf.name)
+
+        db = connect(tf.name)
+        db.execute("create virtual table x using vss0(a(2), b(1) metric_type=L1)")
+        db.execute(
+            "insert into x(rowid, a, b) select key + 1, value, '[1]' from json_each(?)",
+            ["[[0, 0], [1, 0], [10, 10], [11, 10], [0, 1], [10, 11]]"],
+        )
+        db.commit()
+
+        self.assertEqual(
+            db.execute(
+                "select vss_rebuild('x', 'a', 'IVF2,Flat,IDMap2', 'INNER_PRODUCT')"
+            ).fetchone()[0],
+            6,
+        )
+        self.assertEqual(
+            execute_all(
+                db,
+                "select factory, metric_type, ntotal, is_trained from vss_indexes where table_name = 'x'",
+            ),
+            [
+                {
+                    "factory": "IVF2,Flat,IDMap2",
+                    "metric_type": "INNER_PRODUCT",
+                    "ntotal": 6,
+                    "is_trained": 1,
+                },
+                {"factory": "Flat,IDMap2", "metric_type": "L1", "ntotal": 6, "is_trained": 1},
+            ],
+        )
+        # the table definition is left alone, the new factory is a shadow row
+        self.assertEqual(
+            db.execute("select sql from sqlite_master where name = 'x'").fetchone()[0],
+            "CREATE VIRTUAL TABLE x using vss0(a(2), b(1) metric_type=L1)",
+        )
+        self.assertEqual(
+            execute_all(db, "select col, factory from x_factories"),
+            [{"col": 0, "factory": "IVF2,Flat,IDMap2"}],
+        )
+        db.close()
+
+        # new connections read back the new factory and index
+        db = connect(tf.name)
+        self.assertEqual(
+            execute_all(
+                db,
+                "select rowid, vector_to_json(a) as a from x where vss_search(a, vss_search_params(?, 2))",
+                ["[10, 20]"],
+            ),
+            [{"rowid": 6, "a": "[10,11]"}, {"rowid": 4, "a": "[11,10]"}],
+        )
+
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "unknown metric type Cosine"
+        ):
+            db.execute("select vss_rebuild('x', 'a', 'Flat,IDMap2', 'Cosine')")
+        with self.assertRaisesRegex(sqlite3.OperationalError, "vss_rebuild\\(\\) failed"):
+            db.execute("select vss_rebuild('x', 'a', 'NotAFactory')")
+        self.assertEqual(
+            db.execute("select factory from vss_indexes where column_name = 'a'").fetchone()[0],
+            "IVF2,Flat,IDMap2",
+        )
+
+        db.execute("create virtual table y using vss0(a(2) storage_type=faiss_ondisk)")
+        self.addCleanup(os.remove, tf.name + ".main.y.a.faissindex")
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError,
+            "doesn't support storage_type=faiss_ondisk columns like a",
+        ):
+            db.execute("select vss_rebuild('y', 'a', 'IVF2,Flat,IDMap2')")
+        db.close()
+
+    def test_vss_import_index(self):
+        db = connect()
+        matrix = lambda d, values: (
+            b"m\x01\x00\x00"
+            + struct.pack("<iq", d, len(values) // d)
+            + struct.pack(f"<{len(values)}f", *values)
+        )
+
+        db.execute('create virtual table x using vss0(a(2) factory="IVF2,Flat,IDMap2")')
+        self.assertIsNone(
+            db.execute(
+                "select vss_import_index('x', 'a', ?)", [matrix(2, [0, 0, 10, 10])]
+            ).fetchone()[0]
+        )
+        db.execute(
+            "insert into x(rowid, a) select key, value from json_each(?)",
+            ["[[1, 1], [9, 9], [0, 1]]"],
+        )
+        db.commit()
+        self.assertEqual(
+            execute_all(
+                db,
+                "select rowid from x where vss_search(a, vss_search_params(?, 2))",
+                ["[0, 0]"],
+            ),
+            [{"rowid": 2}, {"rowid": 0}],
+        )
+
+        # a serialized index, here the trained and still empty one of y
+        db.execute('create virtual table y using vss0(a(2) factory="IVF2,Flat,IDMap2")')
+        db.execute(
+            "insert into y(operation, a) select 'training', value from json_each(?)",
+            ["[[0, 0], [1, 1], [10, 10], [11, 11]]"],
+        )
+        db.commit()
+        db.execute('create virtual table z using vss0(a(2) factory="IVF2,Flat,IDMap2")')
+        db.execute(
+            "insert into z(operation, a) select 'load_trained', idx from y_index"
+        )
+        db.commit()
+        db.execute("insert into z(rowid, a) values (7, '[10, 11]')")
+        db.commit()
+        self.assertEqual(
+            execute_all(
+                db,
+                "select rowid, distance from z where vss_search(a, vss_search_params(?, 1))",
+                ["[10, 10]"],
+            ),
+            [{"rowid": 7, "distance": 1.0}],
+        )
+
+        # index files are read by vss_import_index(), not by inserts
+        f = tempfile.NamedTemporaryFile(suffix=".index", delete=False)
+        f.write(db.execute("select idx from y_index").fetchone()[0])
+        f.close()
+        self.addCleanup(os.remove, f.name)
+        db.execute('create virtual table t using vss0(a(2) factory="IVF2,Flat,IDMap2")')
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "use vss_import_index\\(\\) to load an index file"
+        ):
+            db.execute("insert into t(operation, a) values ('load_trained', ?)", [f.name])
+        self.assertIsNone(
+            db.execute("select vss_import_index('t', 'a', ?)", [f.name]).fetchone()[0]
+        )
+        db.commit()
+
+        # a plain IDMap is loaded as an IDMap2
+        db.execute('create virtual table s using vss0(a(2) factory="IVF2,Flat,IDMap")')
+        db.execute(
+            "insert into s(operation, a) select 'training', value from json_each(?)",
+            ["[[0, 0], [1, 1], [10, 10], [11, 11]]"],
+        )
+        db.commit()
+        db.execute("select vss_import_index('t', 'a', (select idx from s_index))")
+        db.execute("insert into t(rowid, a) values (3, '[1, 0]')")
+        db.commit()
+        self.assertEqual(
+            execute_all(
+                db,
+                "select rowid, distance from t where vss_search(a, vss_search_params(?, 1))",
+                ["[0, 0]"],
+            ),
+            [{"rowid": 3, "distance": 1.0}],
+        )
+
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError,
+            'the loaded index isn\'t built like the column\'s factory "IVF4,Flat,IDMap2"',
+        ):
+            db.execute('create virtual table r using vss0(a(2) factory="IVF4,Flat,IDMap2")')
+            db.execute("select vss_import_index('r', 'a', (select idx from y_index))")
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "Column a already has vectors"
+        ):
+            db.execute(
+                "select vss_import_index('x', 'a', ?)", [matrix(2, [0, 0, 10, 10])]
+            )
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "Column a has 2 IVF lists, got 3 centroids"
+        ):
+            db.execute('create virtual table w using vss0(a(2) factory="IVF2,Flat,IDMap2")')
+            db.execute("select vss_import_index('w', 'a', ?)", [matrix(2, [0] * 6)])
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "Column a has 2 dimensions, the centroids have 3"
+        ):
+            db.execute("select vss_import_index('w', 'a', ?)", [matrix(3, [0] * 6)])
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "Column a isn't an IVF index"
+        ):
+            db.execute("create virtual table v using vss0(a(2))")
+            db.execute("select vss_import_index('v', 'a', ?)", [matrix(2, [0] * 4)])
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "Column a uses the INNER_PRODUCT metric, the loaded index uses L2"
+        ):
+            db.execute(
+                'create virtual table u using vss0(a(2) factory="IVF2,Flat,IDMap2" metric_type=INNER_PRODUCT)'
+            )
+            db.execute("select vss_import_index('u', 'a', (select idx from y_index))")
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "table x has no column b"
+        ):
+            db.execute("select vss_import_index('x', 'b', ?)", [matrix(2, [0] * 4)])
+        db.close()
+
+    def test_vss0_issue_29_upsert(self):
+        db = connect()
+        execute_all(db, "")
+        db.executescript(
+            """
+    create virtual table demo using vss0(a(2));
+
+    insert into demo(rowid, a)
+      values (1, '[1.0, 2.0]'), (2, '[2.0, 3.0]');
+    """
+        )
+
+        self.assertEqual(
+            execute_all(db, "select rowid, vector_debug(a) from demo;"),
+            [
+                {"rowid": 1, "vector_debug(a)": "size: 2 [1.000000, 2.000000]"},
+                {"rowid": 2, "vector_debug(a)": "size: 2 [2.000000, 3.000000]"},
+            ],
+        )
+
+        db.executescript(
+            """
+    delete from demo where rowid = 1;
+    insert into demo(rowid, a) select 1, '[99.0, 99.0]';
+
+    delete from demo where rowid = 2;
+    insert into demo(rowid, a) select 2, '[299.0, 299.0]';
+    """
+        )
+
+        # This is what used to fail, since we we're clearing deleted IDs properly
+        self.assertEqual(
+            execute_all(db, "select rowid, vector_debug(a) from demo;"),
+            [
+                {"rowid": 1, "vector_debug(a)": "size: 2 [99.000000, 99.000000]"},
+                {"rowid": 2, "vector_debug(a)": "size: 2 [299.000000, 299.000000]"},
+            ],
+        )
+        db.close()
+
+    # Make sure tha VACUUMing a database with vss0 tables still works as expected
+    def test_vss0_vacuum(self):
+        cur = db.cursor()
+        execute_all(cur, "create virtual table x using vss0(a(2));")
+        execute_all(
+            cur,
+            """
+      insert into x(rowid, a)
+        select
+          key + 1000,
           value
         from json_each(?);
       """,
             [
                 """
-        [
-          [1, 1],
-          [2, 2],
-          [3, 3]
-        ]
-        """
+        [
+          [1, 1],
+          [2, 2],
+          [3, 3]
+        ]
+        """
+            ],
+        )
+        db.commit()
+
+        db.execute("VACUUM;")
+
+        self.assertEqual(
+            execute_all(
+                db,
+                "select rowid, distance from x where vss_search(a, vss_search_params(?, ?))",
+                ["[0, 0]", 1],
+            ),
+            [{"distance": 2.0, "rowid": 1000}],
+        )
+
+    def test_vss0_matrix_insert(self):
+        db = connect()
+        db.execute("create virtual table x using vss0(a(2), b(1))")
+
+        matrix = lambda d, values: (
+            b"m\x01\x00\x00"
+            + struct.pack("<iq", d, len(values) // d)
+            + struct.pack(f"<{len(values)}f", *values)
+        )
+        rowids = lambda *ids: struct.pack(f"<{len(ids)}q", *ids)
+
+        db.execute(
+            "insert into x(operation, rowids, a, b) values ('matrix', ?, ?, ?)",
+            [rowids(10, 20), matrix(2, [0, 1, 1, 0]), matrix(1, [5, 6])],
+        )
+        # without rowids, the next free ones are used
+        db.execute(
+            "insert into x(operation, a) values ('matrix', ?)", [matrix(2, [3, 3])]
+        )
+        db.commit()
+
+        self.assertEqual(
+            execute_all(db, "select rowid, vector_to_json(a) as a from x"),
+            [
+                {"rowid": 10, "a": "[0,1]"},
+                {"rowid": 20, "a": "[1,0]"},
+                {"rowid": 21, "a": "[3,3]"},
+            ],
+        )
+        self.assertEqual(
+            execute_all(
+                db,
+                "select rowid, distance from x where vss_search(b, vss_search_params(?, 1))",
+                ["[6]"],
+            ),
+            [{"rowid": 20, "distance": 0.0}],
+        )
+
+        # new rowids never reuse those of deleted rows
+        db.execute("delete from x where rowid = 21")
+        db.execute(
+            "insert into x(operation, a) values ('matrix', ?)", [matrix(2, [4, 4])]
+        )
+        db.commit()
+        self.assertEqual(
+            [row[0] for row in db.execute("select rowid from x_data").fetchall()],
+            [10, 20, 22],
+        )
+
+        # matrices made by vector_matrix() go straight back in
+        db.execute("create virtual table y using vss0(a(2))")
+        db.execute(
+            "insert into y(operation, rowids, a) select 'matrix', null, vector_matrix(a) from x"
+        )
+        db.commit()
+        self.assertEqual(db.execute("select count(*) from y").fetchone()[0], 3)
+
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "Column a has 2 dimensions, the matrix has 1"
+        ):
+            db.execute("insert into x(operation, a) values ('matrix', ?)", [matrix(1, [1])])
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "must have the same number of rows"
+        ):
+            db.execute(
+                "insert into x(operation, a, b) values ('matrix', ?, ?)",
+                [matrix(2, [1, 1]), matrix(1, [1, 2])],
+            )
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "rowids must be a blob of 1 int64 values"
+        ):
+            db.execute(
+                "insert into x(operation, rowids, a) values ('matrix', ?, ?)",
+                [rowids(1, 2), matrix(2, [1, 1])],
+            )
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "Could not insert rowid 10"
+        ):
+            db.execute(
+                "insert into x(operation, rowids, a) values ('matrix', ?, ?)",
+                [rowids(10), matrix(2, [1, 1])],
+            )
+        db.rollback()
+
+    def test_vss_bulk_load(self):
+        db = connect()
+        db.execute("create virtual table x using vss0(a(2), b(2))")
+        db.execute("insert into x(rowid, b) values (1, '[9, 9]')")
+        db.commit()
+
+        f = tempfile.NamedTemporaryFile(suffix=".fvecs", delete=False)
+        f.write(
+            b"".join(
+                struct.pack("<i2f", 2, *v) for v in [[0, 1], [1, 0], [1, 1]]
+            )
+        )
+        f.close()
+        self.addCleanup(os.remove, f.name)
+
+        # file rows take the next free rowids
+        self.assertEqual(
+            db.execute("select vss_bulk_load('x', 'a', ?)", [f.name]).fetchone()[0], 3
+        )
+        self.assertEqual(
+            execute_all(
+                db,
+                "select rowid, distance from x where vss_search(a, vss_search_params(?, 3))",
+                ["[0, 0]"],
+            ),
+            [
+                {"rowid": 2, "distance": 1.0},
+                {"rowid": 3, "distance": 1.0},
+                {"rowid": 4, "distance": 2.0},
+            ],
+        )
+
+        db.execute("create table source(v)")
+        db.executemany(
+            "insert into source(rowid, v) values (?, ?)",
+            [(10, "[5, 5]"), (11, "[6, 6]")],
+        )
+        db.commit()
+        self.assertEqual(
+            db.execute(
+                "select vss_bulk_load('x', 'a', 'select rowid, v from source')"
+            ).fetchone()[0],
+            2,
+        )
+
+        fvecs = struct.pack("<i2f", 2, 7, 7)
+        self.assertEqual(
+            db.execute("select vss_bulk_load('x', 'a', ?)", [fvecs]).fetchone()[0], 1
+        )
+        matrix = b"m\x01\x00\x00" + struct.pack("<iq4f", 2, 2, 8, 8, 9, 9)
+        self.assertEqual(
+            db.execute("select vss_bulk_load('x', 'a', ?)", [matrix]).fetchone()[0], 2
+        )
+        self.assertEqual(
+            [row[0] for row in db.execute("select rowid from x_data").fetchall()],
+            [1, 2, 3, 4, 10, 11, 12, 13, 14],
+        )
+
+        # new rowids never reuse those of deleted rows
+        db.execute("delete from x where rowid = 14")
+        db.commit()
+        self.assertEqual(
+            db.execute("select vss_bulk_load('x', 'a', ?)", [fvecs]).fetchone()[0], 1
+        )
+        self.assertEqual(
+            db.execute("select max(rowid) from x_data").fetchone()[0], 15
+        )
+
+        db.close()
+
+        # a failed load leaves neither rowids nor vectors behind
+        path = tempfile.mktemp(suffix=".db")
+        self.addCleanup(lambda: os.path.exists(path) and os.remove(path))
+        db = connect(path)
+        db.execute("create virtual table x using vss0(a(2))")
+        db.execute("create table source(v)")
+        db.executemany(
+            "insert into source(rowid, v) values (?, ?)",
+            [(1, "[0, 1]"), (2, "[0, 1, 2]")],
+        )
+        db.commit()
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError,
+            "vector for rowid 2 has 3 dimensions, expected 2",
+        ):
+            db.execute(
+                "select vss_bulk_load('x', 'a', 'select rowid, v from source')"
+            ).fetchone()
+        self.assertEqual(db.execute("select count(*) from x_data").fetchone()[0], 0)
+        self.assertEqual(db.execute("select count(*) from x").fetchone()[0], 0)
+
+        self.assertEqual(
+            db.execute(
+                "select vss_bulk_load('x', 'a', 'select rowid, v from source where rowid = 1')"
+            ).fetchone()[0],
+            1,
+        )
+        # the index was written, a new connection reads the loaded vectors back
+        db.close()
+        db = connect(path)
+        self.assertEqual(
+            execute_all(
+                db,
+                "select rowid, distance from x where vss_search(a, vss_search_params(?, 1))",
+                ["[0, 1]"],
+            ),
+            [{"rowid": 1, "distance": 0.0}],
+        )
+
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "rowid 1: UNIQUE constraint failed"
+        ):
+            db.execute(
+                "select vss_bulk_load('x', 'a', 'select 1, ''[1, 1]''')"
+            ).fetchone()
+
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "could not find vss0 table y"
+        ):
+            db.execute("select vss_bulk_load('y', 'a', 'select 1, 2')").fetchone()
+
+        with self.assertRaisesRegex(sqlite3.OperationalError, "table x has no column c"):
+            db.execute("select vss_bulk_load('x', 'c', 'select 1, 2')").fetchone()
+
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "query must return a rowid and a vector"
+        ):
+            db.execute("select vss_bulk_load('x', 'a', 'select 1')").fetchone()
+
+        db.execute("insert into source(v) values ('[1, 1]')")
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "can't run inside a transaction"
+        ):
+            db.execute("select vss_bulk_load('x', 'a', 'select 1, 2')").fetchone()
+        db.rollback()
+
+        db.execute("create virtual table y using vss0(a(2) factory=\"IVF2,Flat,IDMap2\")")
+        db.commit()
+        with self.assertRaisesRegex(sqlite3.OperationalError, "requires training"):
+            db.execute("select vss_bulk_load('y', 'a', 'select 1, ''[1, 1]''')").fetchone()
+        db.close()
+
+    def test_vss_explain(self):
+        db = connect()
+        db.execute("create virtual table x using vss0(a(2))")
+        db.execute(
+            "insert into x(rowid, a) values (1, '[0, 1]'), (2, '[1, 0]'), (3, '[1, 1]')"
+        )
+        db.commit()
+
+        report = json.loads(
+            db.execute(
+                "select vss_explain(?, ?)",
+                [
+                    "select rowid, distance from x where vss_search(a, vss_search_params(?1, 2))",
+                    "[0, 0.9]",
+                ],
+            ).fetchone()[0]
+        )
+        self.assertEqual(report["rows"], 2)
+        self.assertEqual(len(report["scans"]), 1)
+        scan = report["scans"][0]
+        for key in ["parse_ms", "search_ms", "materialize_ms"]:
+            self.assertGreaterEqual(scan.pop(key), 0)
+        self.assertEqual(
+            scan,
+            {
+                "table": "x",
+                "column": "a",
+                "plan": "search",
+                "constraints": ["vss_search_params"],
+                "limit_pushed_down": False,
+                "k": 2,
+                "nprobe": None,
+                "ef_search": None,
+                "lists_probed": 0,
+                "candidates_scanned": 3,
+                "rows": 2,
+            },
+        )
+
+        report = json.loads(
+            db.execute("select vss_explain('select rowid from x')").fetchone()[0]
+        )
+        self.assertEqual(report["rows"], 3)
+        self.assertEqual(
+            [(s["plan"], s["column"], s["k"], s["rows"]) for s in report["scans"]],
+            [("fullscan", None, None, 3)],
+        )
+
+        # statements without vss0 scans report no scans
+        report = json.loads(db.execute("select vss_explain('select 1')").fetchone()[0])
+        self.assertEqual((report["rows"], report["scans"]), (1, []))
+
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "vss_explain\\(\\) calls can't be nested"
+        ):
+            db.execute("select vss_explain('select vss_explain(''select 1'')')").fetchone()
+
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "vss_explain\\(\\) accepts a single statement"
+        ):
+            db.execute("select vss_explain('select 1; select 2')").fetchone()
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "vss_explain\\(\\) only runs read-only statements"
+        ):
+            db.execute("select vss_explain('delete from x')").fetchone()
+
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "could not prepare statement: no such table: y"
+        ):
+            db.execute("select vss_explain('select * from y')").fetchone()
+
+    def test_vss_stats(self):
+        db = connect()
+        db.execute("create virtual table x using vss0(a(2) recall_sample=1, b(1))")
+        db.execute(
+            "insert into x(rowid, a, b) values (1, '[0, 1]', '[1]'), (2, '[1, 0]', '[2]')"
+        )
+        db.commit()
+
+        def stats():
+            return execute_all(
+                db,
+                """
+                select
+                  table_name,
+                  column_name,
+                  searches,
+                  candidates_scanned,
+                  latency_p50 is not null as has_latency,
+                  faiss_p99 <= latency_p99 as faiss_within_total,
+                  recall_samples,
+                  recall,
+                  recall_exact
+                from vss_stats('x')
+                """,
+            )
+
+        self.assertEqual(
+            stats(),
+            [
+                {
+                    "table_name": "x",
+                    "column_name": "a",
+                    "searches": 0,
+                    "candidates_scanned": 0,
+                    "has_latency": 0,
+                    "faiss_within_total": None,
+                    "recall_samples": 0,
+                    "recall": None,
+                    "recall_exact": 1,
+                },
+                {
+                    "table_name": "x",
+                    "column_name": "b",
+                    "searches": 0,
+                    "candidates_scanned": 0,
+                    "has_latency": 0,
+                    "faiss_within_total": None,
+                    "recall_samples": 0,
+                    "recall": None,
+                    "recall_exact": 1,
+                },
             ],
         )
+
+        execute_all(
+            db,
+            "select rowid from x where vss_search(a, vss_search_params(?, 2))",
+            ["[0, 0.9]"],
+        )
+
+        self.assertEqual(
+            stats()[0],
+            {
+                "table_name": "x",
+                "column_name": "a",
+                "searches": 1,
+                "candidates_scanned": 2,
+                "has_latency": 1,
+                "faiss_within_total": 1,
+                "recall_samples": 1,
+                "recall": 1.0,
+                "recall_exact": 1,
+            },
+        )
+        self.assertEqual(execute_all(db, "select * from vss_stats('y')"), [])
+        self.assertEqual(
+            db.execute("select count(*) from vss_stats").fetchone()[0], 2
+        )
+        db.close()
+
+    def test_vss_indexes(self):
+        tf = tempfile.NamedTemporaryFile(delete=False)
+        tf.close()
+
+        db = connect(tf.name)
+        db.execute(
+            """create virtual table x using vss0(
+              a(2),
+              b(4) factory="IVF2,Flat,IDMap2" metric_type=INNER_PRODUCT
+            )"""
+        )
+        db.execute("insert into x(rowid, a) values (1, '[0, 1]'), (2, '[1, 0]')")
         db.commit()
 
-        db.execute("VACUUM;")
+        columns = """
+          table_name,
+          column_name,
+          factory,
+          metric_type,
+          storage_type,
+          dimensions,
+          ntotal,
+          is_trained,
+          serialized_size,
+          resident_bytes,
+          pending_inserts,
+          pending_deletes,
+          pending_trainings,
+          imbalance_factor,
+          last_sync_ms is not null as synced,
+          load_ms >= 0 as loaded
+        """
+        expected = {
+            "table_name": "x",
+            "column_name": "a",
+            "factory": "Flat,IDMap2",
+            "metric_type": "L2",
+            "storage_type": "faiss_shadow",
+            "dimensions": 2,
+            "ntotal": 2,
+            "is_trained": 1,
+            "pending_inserts": 0,
+            "pending_deletes": 0,
+            "pending_trainings": 0,
+            "imbalance_factor": None,
+            "synced": 1,
+            "loaded": 1,
+        }
+        rows = execute_all(db, f"select {columns} from vss_indexes")
+        serialized_size = rows[0].pop("serialized_size")
+        resident_bytes = rows[0].pop("resident_bytes")
+        self.assertEqual(rows[0], expected)
+        self.assertEqual(
+            serialized_size,
+            db.execute("select length(idx) from x_index where rowid = 0").fetchone()[0],
+        )
+        # two 2 dimensional vectors and their rowids, plus the IDMap2 hash map
+        self.assertGreaterEqual(resident_bytes, 2 * (2 * 4 + 8))
+        self.assertLess(resident_bytes, 1024)
+        self.assertEqual(rows[1]["factory"], "IVF2,Flat,IDMap2")
+        self.assertEqual(rows[1]["is_trained"], 0)
 
+        db.execute("insert into x(rowid, a) values (3, '[1, 1]')")
+        db.execute("delete from x where rowid = 1")
         self.assertEqual(
             execute_all(
-                db,
-                "select rowid, distance from x where vss_search(a, vss_search_params(?, ?))",
-                ["[0, 0]", 1],
-            ),
-            [{"distance": 2.0, "rowid": 1000}],
+                db, "select pending_inserts, pending_deletes from vss_indexes"
+            )[0],
+            {"pending_inserts": 1, "pending_deletes": 1},
         )
+        db.commit()
+        db.close()
+
+        # tables that weren't queried yet on a connection are still listed
+        db = connect(tf.name)
+        rows = execute_all(db, f"select {columns} from vss_indexes")
+        self.assertEqual(rows[0]["ntotal"], 2)
+        self.assertEqual(rows[0]["factory"], "Flat,IDMap2")
+        self.assertEqual(rows[0]["synced"], 0)
+        self.assertEqual(rows[0]["loaded"], 1)
+        db.close()
+        os.remove(tf.name)
 
     def test_vss0_metric_type(self):
         cur = db.cursor()
@@ -968,22 +2440,150 @@ class TestVss(unittest.TestCase):
 
         self.assertEqual(distance_of("ip", "[2,2]"), 10.0)
 
+    def test_vss0_binary(self):
+        cur = db.cursor()
+        execute_all(
+            cur,
+            """create virtual table vss_binary using vss0(
+              a(16) type=binary,
+              b(16) type=binary factory="BIVF1"
+            )""",
+        )
+
+        # binary IVF indexes are trained on binarized vectors like any other
+        db.execute(
+            "insert into vss_binary(operation, b) values ('training', ?1), ('training', ?2)",
+            [json.dumps([1] * 16), json.dumps([-1] * 16)],
+        )
+        db.commit()
+
+        # packed bits straight from vector_binarize(), or float vectors
+        # binarized on insert
+        db.execute(
+            "insert into vss_binary(rowid, a, b) values (1, vector_binarize(?1), ?1)",
+            [json.dumps([1] * 16)],
+        )
+        db.execute(
+            "insert into vss_binary(rowid, a, b) values (2, ?1, ?1)",
+            [b"\x0f\x00"],
+        )
+        db.execute(
+            "insert into vss_binary(rowid, a, b) values (3, ?1, ?1)",
+            [json.dumps([-1] * 16)],
+        )
+        db.commit()
+
+        self.assertEqual(
+            execute_all(cur, "select rowid, a from vss_binary order by rowid"),
+            [
+                {"rowid": 1, "a": b"\xff\xff"},
+                {"rowid": 2, "a": b"\x0f\x00"},
+                {"rowid": 3, "a": b"\x00\x00"},
+            ],
+        )
+
+        for column in ["a", "b"]:
+            self.assertEqual(
+                execute_all(
+                    cur,
+                    f"select rowid, distance from vss_binary where vss_search({column}, vss_search_params(?, 3))",
+                    [b"\x0f\x00"],
+                ),
+                [
+                    {"rowid": 2, "distance": 0.0},
+                    {"rowid": 3, "distance": 4.0},
+                    {"rowid": 1, "distance": 12.0},
+                ],
+            )
+
+        self.assertEqual(
+            execute_all(
+                cur,
+                "select rowid, distance from vss_binary where vss_search(a, ?) limit 1",
+                [json.dumps([1] * 15 + [-1])],
+            ),
+            [{"rowid": 1, "distance": 1.0}],
+        )
+        self.assertEqual(
+            execute_all(
+                cur,
+                "select rowid from vss_binary where vss_range_search(a, vss_range_search_params(?, 5))",
+                [b"\x00\x00"],
+            ),
+            [{"rowid": 2}, {"rowid": 3}],
+        )
+
+        self.assertEqual(
+            execute_all(
+                cur,
+                "select column_name, factory, metric_type, ntotal from vss_indexes where table_name = 'vss_binary'",
+            ),
+            [
+                {"column_name": "a", "factory": "BFlat", "metric_type": "Hamming", "ntotal": 3},
+                {"column_name": "b", "factory": "BIVF1", "metric_type": "Hamming", "ntotal": 3},
+            ],
+        )
+
+        # binary indexes are persisted, and read back as binary indexes
+        idx_types = [
+            row[0][0:4]
+            for row in db.execute("select idx from vss_binary_index").fetchall()
+        ]
+        self.assertEqual(idx_types, [b"IBM2", b"IBM2"])
+
+        db.execute("delete from vss_binary where rowid = 2")
+        db.commit()
+        self.assertEqual(
+            execute_all(
+                cur,
+                "select rowid from vss_binary where vss_search(a, vss_search_params(?, 1))",
+                [b"\x0f\x00"],
+            ),
+            [{"rowid": 3}],
+        )
+
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "metric_type can't be used on binary columns"
+        ):
+            db.execute(
+                "create virtual table vss_binary_ip using vss0(a(16) type=binary metric_type=L1)"
+            )
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "type value must be one of float or binary"
+        ):
+            db.execute("create virtual table vss_binary_bad using vss0(a(16) type=int8)")
+
+        db.execute("drop table vss_binary")
+
 
 VECTOR_FUNCTIONS = [
     "vector0",
+    "vector_avg",
+    "vector_binarize",
     "vector_debug",
     "vector_from_blob",
     "vector_from_json",
     "vector_from_raw",
     "vector_length",
+    "vector_matrix",
+    "vector_quantize_i8",
+    "vector_random",
+    "vector_sum",
+    "vector_to_bf16",
     "vector_to_blob",
+    "vector_to_f16",
     "vector_to_json",
     "vector_to_raw",
     "vector_value_at",
     "vector_version",
 ]
 
-VECTOR_MODULES = ["vector_fvecs_each"]
+VECTOR_MODULES = [
+    "vector_fvecs_each",
+    "vector_matrix_each",
+    "vector_random_each",
+    "vector_vecs_each",
+]
 
 
 class TestVector(unittest.TestCase):
@@ -1048,6 +2648,332 @@ class TestVector(unittest.TestCase):
                 "select vector_from_blob(?)", [b"v\x00\x00\x00\x00\x00"]
             ).fetchall()
 
+    def test_vector_random(self):
+        vector_random = lambda d, seed: db.execute(
+            "select vector_to_json(vector_random(?, ?))", [d, seed]
+        ).fetchone()[0]
+
+        v = json.loads(vector_random(8, 1))
+        self.assertEqual(len(v), 8)
+        self.assertTrue(all(0 <= x < 1 for x in v))
+        self.assertEqual(vector_random(8, 1), vector_random(8, 1))
+        self.assertNotEqual(vector_random(8, 1), vector_random(8, 2))
+
+        # same vector as the first row of vector_random_each()
+        self.assertEqual(
+            vector_random(8, 1),
+            db.execute(
+                "select vector_to_json(vector) from vector_random_each(1, 8, 1)"
+            ).fetchone()[0],
+        )
+
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "dimensions must be between 1 and 65536"
+        ):
+            vector_random(0, 1)
+
+    def test_vector_random_each(self):
+        rows = lambda sql, args=[]: execute_all(db, sql, args)
+
+        self.assertEqual(
+            rows(
+                "select rowid, vector_length(vector) as d, cluster from vector_random_each(3, 4)"
+            ),
+            [
+                {"rowid": 1, "d": 4, "cluster": None},
+                {"rowid": 2, "d": 4, "cluster": None},
+                {"rowid": 3, "d": 4, "cluster": None},
+            ],
+        )
+        self.assertEqual(
+            rows("select count(*) as n from vector_random_each(0, 4)"), [{"n": 0}]
+        )
+
+        def vectors(*args):
+            return [
+                json.loads(row["v"])
+                for row in rows(
+                    "select vector_to_json(vector) as v from vector_random_each(?, ?, ?, ?)",
+                    list(args),
+                )
+            ]
+
+        # deterministic for a given seed
+        self.assertEqual(vectors(5, 3, 7, "gaussian"), vectors(5, 3, 7, "gaussian"))
+        self.assertNotEqual(vectors(5, 3, 7, "gaussian"), vectors(5, 3, 8, "gaussian"))
+
+        gaussian = [x for v in vectors(1000, 4, 1, "gaussian") for x in v]
+        self.assertAlmostEqual(sum(gaussian) / len(gaussian), 0, delta=0.1)
+        self.assertTrue(any(x < 0 for x in gaussian))
+
+        clustered = rows(
+            "select cluster, vector_to_json(vector) as v from vector_random_each(200, 2, 1, 'clustered', 3)"
+        )
+        self.assertEqual(set(row["cluster"] for row in clustered), {0, 1, 2})
+        # points of a cluster stay close to each other
+        by_cluster = {}
+        for row in clustered:
+            by_cluster.setdefault(row["cluster"], []).append(json.loads(row["v"]))
+        for points in by_cluster.values():
+            self.assertLess(max(p[0] for p in points) - min(p[0] for p in points), 0.5)
+
+        with self.assertRaisesRegex(sqlite3.OperationalError, "Unknown distribution 'zipf'"):
+            rows("select * from vector_random_each(1, 2, 1, 'zipf')")
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError,
+            "vector_random_each\\(\\) requires n and dimensions arguments",
+        ):
+            rows("select * from vector_random_each(1)")
+
+    def test_vector_fvecs_each(self):
+        fvecs = b"".join(
+            struct.pack("<i", len(v)) + struct.pack(f"<{len(v)}f", *v)
+            for v in [[1, 2], [3, 4], [5, 6, 7]]
+        )
+        rows = lambda blob: execute_all(
+            db,
+            "select rowid, dimensions, vector_to_json(vector) as v from vector_fvecs_each(?)",
+            [blob],
+        )
+        self.assertEqual(
+            rows(fvecs),
+            [
+                {"rowid": 1, "dimensions": 2, "v": "[1,2]"},
+                {"rowid": 2, "dimensions": 2, "v": "[3,4]"},
+                {"rowid": 3, "dimensions": 3, "v": "[5,6,7]"},
+            ],
+        )
+        self.assertEqual(rows(b""), [])
+        # a truncated last record is not read
+        self.assertEqual(len(rows(fvecs[:-4])), 2)
+
+    def test_vector_vecs_each(self):
+        def write(suffix, records):
+            f = tempfile.NamedTemporaryFile(suffix=suffix, delete=False)
+            f.write(records)
+            f.close()
+            self.addCleanup(os.remove, f.name)
+            return f.name
+
+        rows = lambda *args: execute_all(
+            db,
+            f"select rowid, dimensions, vector_to_json(vector) as v from vector_vecs_each({', '.join('?' * len(args))})",
+            list(args),
+        )
+
+        fvecs = write(
+            ".fvecs",
+            b"".join(
+                struct.pack("<i", 2) + struct.pack("<2f", *v)
+                for v in [[0.5, 1], [2, 3]]
+            ),
+        )
+        self.assertEqual(
+            rows(fvecs),
+            [
+                {"rowid": 1, "dimensions": 2, "v": "[0.5,1]"},
+                {"rowid": 2, "dimensions": 2, "v": "[2,3]"},
+            ],
+        )
+
+        bvecs = write(".bvecs", struct.pack("<i", 3) + bytes([0, 128, 255]))
+        self.assertEqual(rows(bvecs), [{"rowid": 1, "dimensions": 3, "v": "[0,128,255]"}])
+
+        ivecs = write(".ivecs", struct.pack("<i3i", 3, 7, 0, 999999))
+        self.assertEqual(rows(ivecs), [{"rowid": 1, "dimensions": 3, "v": "[7,0,999999]"}])
+
+        # explicit format, regardless of the extension
+        self.assertEqual(
+            rows(write(".bin", struct.pack("<i2i", 2, 1, 2)), "ivecs"),
+            [{"rowid": 1, "dimensions": 2, "v": "[1,2]"}],
+        )
+        self.assertEqual(
+            rows(write(".fvecs", struct.pack("<i", 0)))[0]["dimensions"], 0
+        )
+        self.assertEqual(rows(write(".fvecs", b"")), [])
+
+        # vectors outlive the table function that read them
+        self.assertEqual(
+            db.execute(
+                "select vector_to_json((select vector from vector_vecs_each(?) where rowid = 2))",
+                [fvecs],
+            ).fetchone()[0],
+            "[2,3]",
+        )
+
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "is not a valid fvecs file: record 2 is truncated"
+        ):
+            rows(write(".fvecs", struct.pack("<i2f", 2, 1, 2) + struct.pack("<i", 2)))
+
+        with self.assertRaisesRegex(sqlite3.OperationalError, "Unknown format 'txt'"):
+            rows(write(".txt", b""))
+
+        with self.assertRaisesRegex(sqlite3.OperationalError, "Could not open"):
+            rows("/nonexistent/x.fvecs")
+
+    def test_vector_matrix(self):
+        matrix = db.execute(
+            "select vector_matrix(vector_from_json(value)) from json_each(?)",
+            ['["[1, 2]", "[3, 4]", "[5, 6]"]'],
+        ).fetchone()[0]
+        self.assertEqual(matrix[:16], b"m\x01\x00\x00" + struct.pack("<iq", 2, 3))
+        self.assertEqual(struct.unpack("<6f", matrix[16:]), (1, 2, 3, 4, 5, 6))
+
+        # no rows still make an empty matrix, NULLs are skipped
+        self.assertEqual(
+            db.execute("select vector_matrix(null) from json_each('[1, 2]')").fetchone()[0],
+            b"m\x01\x00\x00" + struct.pack("<iq", 0, 0),
+        )
+
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError,
+            "vector_matrix\\(\\) vectors must all have 2 dimensions, got one with 1",
+        ):
+            db.execute(
+                "select vector_matrix(vector_from_json(value)) from json_each(?)",
+                ['["[1, 2]", "[3]"]'],
+            ).fetchone()
+
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "vector_matrix\\(\\) value is not a vector"
+        ):
+            db.execute("select vector_matrix(1)").fetchone()
+
+    def test_vector_sum_avg(self):
+        aggregate = lambda function, vectors: db.execute(
+            f"select vector_to_json({function}(value)) from json_each(?)",
+            [vectors],
+        ).fetchone()[0]
+        self.assertEqual(aggregate("vector_sum", "[[1, 2], [3, 4], null, [5, 6]]"), "[9,12]")
+        self.assertEqual(aggregate("vector_avg", "[[1, 2], [3, 4], null, [5, 6]]"), "[3,4]")
+        self.assertEqual(aggregate("vector_avg", "[[0.5], [1]]"), "[0.75]")
+
+        # no rows, or only NULLs, are NULL
+        self.assertEqual(aggregate("vector_sum", "[]"), None)
+        self.assertEqual(aggregate("vector_avg", "[null]"), None)
+
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError,
+            "vector_avg\\(\\) vectors must all have 2 dimensions, got one with 1",
+        ):
+            aggregate("vector_avg", "[[1, 2], [3]]")
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "vector_sum\\(\\) value is not a vector"
+        ):
+            db.execute("select vector_sum(1)").fetchone()
+
+    def test_vector_matrix_each(self):
+        rows = lambda blob: execute_all(
+            db,
+            "select rowid, vector_to_json(vector) as v from vector_matrix_each(?)",
+            [blob],
+        )
+        matrix = b"m\x01\x00\x00" + struct.pack("<iq4f", 2, 2, 1, 2, 3, 4)
+        self.assertEqual(
+            rows(matrix),
+            [{"rowid": 1, "v": "[1,2]"}, {"rowid": 2, "v": "[3,4]"}],
+        )
+        self.assertEqual(rows(b"m\x01\x00\x00" + struct.pack("<iq", 0, 0)), [])
+
+        # round trip through vector_matrix()
+        self.assertEqual(
+            db.execute(
+                "select vector_matrix(vector) from vector_matrix_each(?)", [matrix]
+            ).fetchone()[0],
+            matrix,
+        )
+
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "Matrix blob size doesn't match its header"
+        ):
+            rows(matrix[:-4])
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "Blob not well-formatted matrix blob"
+        ):
+            rows(b"v" + matrix[1:])
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "Matrix blob size less than header length"
+        ):
+            rows(b"m\x01")
+
+    def test_vector_to_f16(self):
+        blob = db.execute(
+            "select vector_to_f16(vector_from_json('[0.5, -2, 65519, 1e-7]'))"
+        ).fetchone()[0]
+        self.assertEqual(blob[:2], b"v\x02")
+        self.assertEqual(struct.unpack("<4e", blob[2:]), (0.5, -2.0, 65504.0, 1.1920928955078125e-07))
+
+        # decoded transparently wherever a vector is expected
+        decoded = json.loads(db.execute("select vector_to_json(?)", [blob]).fetchone()[0])
+        self.assertEqual(decoded[:3], [0.5, -2, 65504])
+        self.assertAlmostEqual(decoded[3], 1.1920928955078125e-07)
+        self.assertEqual(
+            db.execute("select vector_length(vector_from_blob(?))", [blob]).fetchone()[0], 4
+        )
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "Vector blob size doesn't match its type"
+        ):
+            db.execute("select vector_from_blob(?)", [blob[:-1]]).fetchone()
+
+    def test_vector_to_bf16(self):
+        blob = db.execute(
+            "select vector_to_bf16(vector_from_json('[1, -0.5, 3.14159]'))"
+        ).fetchone()[0]
+        self.assertEqual(blob, b"v\x03" + struct.pack("<3H", 0x3F80, 0xBF00, 0x4049))
+        self.assertEqual(
+            db.execute("select vector_to_json(?)", [blob]).fetchone()[0],
+            "[1,-0.5,3.140625]",
+        )
+
+    def test_vector_quantize_i8(self):
+        quantize = lambda *args: db.execute(
+            f"select vector_quantize_i8(vector_from_json(?){', ?' * (len(args) - 1)})",
+            list(args),
+        ).fetchone()[0]
+
+        blob = quantize("[-1, 0, 1]")
+        self.assertEqual(blob[:2], b"v\x04")
+        scale, offset = struct.unpack("<2f", blob[2:10])
+        self.assertAlmostEqual(scale, 2 / 254)
+        self.assertEqual(offset, 0)
+        self.assertEqual(struct.unpack("<3b", blob[10:]), (-127, 0, 127))
+        self.assertEqual(
+            json.loads(db.execute("select vector_to_json(?)", [blob]).fetchone()[0]),
+            [-1, 0, 1],
+        )
+
+        # a shared range clamps values outside of it
+        decoded = json.loads(
+            db.execute(
+                "select vector_to_json(?)", [quantize("[0, 5, 20]", 0, 10)]
+            ).fetchone()[0]
+        )
+        self.assertAlmostEqual(decoded[0], 0, places=5)
+        self.assertAlmostEqual(decoded[1], 5, delta=10 / 254)
+        self.assertAlmostEqual(decoded[2], 10, places=5)
+
+        # constant vectors decode exactly
+        self.assertEqual(
+            db.execute("select vector_to_json(?)", [quantize("[3, 3]")]).fetchone()[0],
+            "[3,3]",
+        )
+
+        with self.assertRaisesRegex(sqlite3.OperationalError, "min <= max"):
+            quantize("[1]", 1, 0)
+        with self.assertRaisesRegex(
+            sqlite3.OperationalError, "takes a vector, and optionally a min and max"
+        ):
+            quantize("[1]", 1)
+
+    def test_vector_binarize(self):
+        vector_binarize = lambda v: db.execute(
+            "select vector_binarize(vector_from_json(?))", [v]
+        ).fetchone()[0]
+        self.assertEqual(vector_binarize("[1, -1, 0, 0.5]"), b"\x09")
+        self.assertEqual(vector_binarize("[1, 1, 1, 1, 1, 1, 1, 1, 1]"), b"\xff\x01")
+        self.assertEqual(vector_binarize("[]"), b"")
+
     def test_vector_to_blob(self):
         vector_to_blob = lambda x: db.execute(
             "select vector_to_blob(vector_from_json(json(?)))", [x]